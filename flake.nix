@@ -45,6 +45,7 @@
           buildInputs = attrValues {
             inherit (pkgs)
               foundationdb71
+              lmdb
             ;
           };
           LIBCLANG_PATH = "${llvm.libclang.lib}/lib";
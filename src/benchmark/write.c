@@ -14,11 +14,15 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
 #include "../constants.h"
 #include "../event.h"
+#include "../event_compress.h"
 #include "../fdb.h"
+#include "../fdb_internal.h"
+#include "../fdb_parallel.h"
 #include "../fdb_timer.h"
 
 //==============================================================================
@@ -30,6 +34,11 @@ typedef struct data_config_t {
   uint32_t event_size;
 } DataConfig;
 
+typedef struct batch_config_t {
+  uint32_t batch_size;  // Fragment cap per transaction (0 for none).
+  uint32_t batch_bytes; // Byte budget per transaction.
+} BatchConfig;
+
 //==============================================================================
 // Prototypes
 //==============================================================================
@@ -47,6 +56,37 @@ void run_write_benchmark(DataConfig config);
 /// @param[in] config   Configuration settings for the benchmark test.
 void run_write_benchmark_async(DataConfig config);
 
+/// Run the default parallel write benchmarks.
+///
+/// @param[in] config   Configuration settings for the benchmark test.
+void run_write_benchmark_parallel(DataConfig config);
+
+/// Run the compression benchmarks: the same redundant events, without
+/// compression and with each built-in compression codec.
+void run_compression_benchmarks(void);
+
+/// Compress, write and read back redundant events with one compression
+/// algorithm, then print the bytes written and the time each step took.
+///
+/// @param[in] config     Configuration settings for the benchmark test.
+/// @param[in] algorithm  The compression algorithm (COMPRESSION_*).
+void timed_compression_run(DataConfig config, uint8_t algorithm);
+
+/// Generate redundant, fake data for simulating events: words drawn at random
+/// from a small vocabulary, as in serialized application state.
+///
+/// @param[in] data  Pointer to the byte[] to fill.
+/// @param[in] size  Number of bytes to generate.
+void load_redundant_data(uint8_t *data, uint32_t size);
+
+/// Number of milliseconds between two times.
+///
+/// @param[in] start  The earlier time.
+/// @param[in] end    The later time.
+///
+/// @return  Elapsed time in milliseconds.
+double elapsed_ms(const struct timespec *start, const struct timespec *end);
+
 /// Write an array of events to a FoundationDB cluster and time the process.
 ///
 /// TODO: Implement for dynamic number of fragments per event.
@@ -54,9 +94,9 @@ void run_write_benchmark_async(DataConfig config);
 /// @param[in] events       Array of events to write.
 /// @param[in] num_events   Number of events in array.
 /// @param[in] num_frags    Number of fragments per event.
-/// @param[in] batch_size   Batch size of writes per FoundationDB transaction.
+/// @param[in] batch        Batch limits per FoundationDB transaction.
 void timed_array_write(const FragmentedEventSource *events, uint32_t num_events,
-                       uint32_t num_frags, uint32_t batch_size);
+                       uint32_t num_frags, BatchConfig batch);
 
 /// Write an array of events to a FoundationDB cluster and time the process.
 ///
@@ -65,9 +105,25 @@ void timed_array_write(const FragmentedEventSource *events, uint32_t num_events,
 /// @param[in] events       Array of events to write.
 /// @param[in] num_events   Number of events in array.
 /// @param[in] num_frags    Number of fragments per event.
-/// @param[in] batch_size   Batch size of writes per FoundationDB transaction.
+/// @param[in] batch        Batch limits per FoundationDB transaction.
 void timed_array_write_async(const FragmentedEventSource *events, uint32_t num_events,
-                             uint32_t num_frags, uint32_t batch_size);
+                             uint32_t num_frags, BatchConfig batch);
+
+/// Write an array of events to a FoundationDB cluster from a pool of worker
+/// threads and time the process.
+///
+/// @param[in] events       Array of events to write.
+/// @param[in] num_events   Number of events in array.
+/// @param[in] num_workers  Number of worker threads.
+void timed_array_write_parallel(const FragmentedEventSource *events,
+                                uint32_t num_events, uint32_t num_workers);
+
+/// Print the settings of a single benchmark run.
+///
+/// @param[in] config   Configuration settings for the benchmark test.
+/// @param[in] batch    Batch limits per FoundationDB transaction.
+/// @param[in] method   Name of the write method.
+void print_settings(DataConfig config, BatchConfig batch, const char *method);
 
 /// Generate an array of mock events and fragment them.
 ///
@@ -101,7 +157,8 @@ uint32_t parse_pos_int(char const *str);
 // Functions
 //==============================================================================
 
-/// Execute the Seguro write benchmark suite.
+/// Execute the Seguro write benchmark suite, or with the option
+/// "compression", the compression benchmarks.
 ///
 /// @param[in] argc  Number of command-line options provided.
 /// @param[in] argv  Array of command-line options provided.
@@ -114,7 +171,10 @@ int main(int argc, char **argv) {
   fdb_init_network_thread();
 
   // Run benchmarks
-  run_benchmarks();
+  if ((argc > 1) && !strcmp(argv[1], "compression"))
+    run_compression_benchmarks();
+  else
+    run_benchmarks();
 
   // Clean up FoundationDB database
   fdb_shutdown_network_thread();
@@ -141,6 +201,10 @@ void run_benchmarks(void) {
   for (uint8_t i = 0; i < num_configs; ++i) {
     run_write_benchmark_async(configs[i]);
   }
+
+  for (uint8_t i = 0; i < num_configs; ++i) {
+    run_write_benchmark_parallel(configs[i]);
+  }
 }
 
 void run_write_benchmark(DataConfig config) {
@@ -149,10 +213,17 @@ void run_write_benchmark(DataConfig config) {
 
   // Size of transaction cannot exceed 10,000,000 bytes (10MB) of "affected
   // data" (e.g. keys + values + ranges for write, keys + ranges for read).
-  // Therefore, batch size cannot exceed 1000 with OPTIMAL_VALUE_SIZE of 10,000
-  // bytes (10KB).
-  uint32_t batch_sizes[] = {1, 5, 10};
-  uint32_t num_bs = 3;
+  // Fragment caps only suit a single event size, so the same events are also
+  // written with byte budgets and no fragment cap.
+  BatchConfig batches[] = {
+      // batch size, batch bytes
+      {1, DEFAULT_BATCH_BYTES},
+      {5, DEFAULT_BATCH_BYTES},
+      {10, DEFAULT_BATCH_BYTES},
+      {0, 100000},
+      {0, DEFAULT_BATCH_BYTES},
+  };
+  uint32_t num_batches = 5;
   uint32_t num_events = config.num_events;
   uint32_t event_size = config.event_size;
   uint16_t num_fragments =
@@ -161,15 +232,10 @@ void run_write_benchmark(DataConfig config) {
   // Generate mock events
   load_mock_events(&raw_events, &events, num_events, event_size);
 
-  // Array batch writes for each batch size
-  for (uint8_t i = 0; i < num_bs; ++i) {
-    printf("\n");
-    printf("    events  %u\n", num_events);
-    printf("event size  %u bytes\n", event_size);
-    printf("batch size  %u\n", batch_sizes[i]);
-    printf(" fragments  %u\n", num_fragments);
-    printf("    method  synchronous\n");
-    timed_array_write(events, num_events, num_fragments, batch_sizes[i]);
+  // Array batch writes for each batch configuration
+  for (uint8_t i = 0; i < num_batches; ++i) {
+    print_settings(config, batches[i], "synchronous");
+    timed_array_write(events, num_events, num_fragments, batches[i]);
   }
 
   // Clean up heap
@@ -182,10 +248,17 @@ void run_write_benchmark_async(DataConfig config) {
 
   // Size of transaction cannot exceed 10,000,000 bytes (10MB) of "affected
   // data" (e.g. keys + values + ranges for write, keys + ranges for read).
-  // Therefore, batch size cannot exceed 1000 with OPTIMAL_VALUE_SIZE of 10,000
-  // bytes (10KB).
-  uint32_t batch_sizes[] = {1, 5, 10};
-  uint32_t num_bs = 3;
+  // Fragment caps only suit a single event size, so the same events are also
+  // written with byte budgets and no fragment cap.
+  BatchConfig batches[] = {
+      // batch size, batch bytes
+      {1, DEFAULT_BATCH_BYTES},
+      {5, DEFAULT_BATCH_BYTES},
+      {10, DEFAULT_BATCH_BYTES},
+      {0, 100000},
+      {0, DEFAULT_BATCH_BYTES},
+  };
+  uint32_t num_batches = 5;
   uint32_t num_events = config.num_events;
   uint32_t event_size = config.event_size;
   uint16_t num_fragments =
@@ -194,26 +267,182 @@ void run_write_benchmark_async(DataConfig config) {
   // Generate mock events
   load_mock_events(&raw_events, &events, num_events, event_size);
 
-  // Array batch writes for each batch size
-  for (uint8_t i = 0; i < num_bs; ++i) {
-    printf("\n");
-    printf("    events  %u\n", num_events);
-    printf("event size  %u bytes\n", event_size);
-    printf("batch size  %u\n", batch_sizes[i]);
-    printf(" fragments  %u\n", num_fragments);
-    printf("    method  asynchronous\n");
-    timed_array_write_async(events, num_events, num_fragments, batch_sizes[i]);
+  // Array batch writes for each batch configuration
+  for (uint8_t i = 0; i < num_batches; ++i) {
+    print_settings(config, batches[i], "asynchronous");
+    timed_array_write_async(events, num_events, num_fragments, batches[i]);
   }
 
   // Clean up heap
   release_events_memory(raw_events, events, num_events);
 }
 
+void run_write_benchmark_parallel(DataConfig config) {
+  Event *raw_events;
+  FragmentedEventSource *events;
+  BatchConfig batch = {0, DEFAULT_BATCH_BYTES};
+  uint32_t workers[] = {1, 2, 4, 8};
+  uint32_t num_runs = 4;
+  char method[32];
+
+  // Generate mock events
+  load_mock_events(&raw_events, &events, config.num_events, config.event_size);
+
+  // Array writes for each worker pool size
+  for (uint8_t i = 0; i < num_runs; ++i) {
+    snprintf(method, sizeof(method), "parallel (%u workers)", workers[i]);
+    print_settings(config, batch, method);
+
+    fdb_set_batch_size(batch.batch_size);
+    fdb_set_batch_bytes(batch.batch_bytes);
+    timed_array_write_parallel(events, config.num_events, workers[i]);
+  }
+
+  // Clean up heap
+  release_events_memory(raw_events, events, config.num_events);
+}
+
+void run_compression_benchmarks(void) {
+  int num_configs = 3;
+  DataConfig configs[] = {
+      // n     , size (bytes)
+      {1000, 1000},
+      {1000, 10000},
+      {100, 100000},
+  };
+  uint8_t algorithms[] = {COMPRESSION_NONE, COMPRESSION_LZ4, COMPRESSION_ZSTD};
+  const char *names[] = {"none", "lz4", "zstd"};
+
+  for (uint8_t i = 0; i < num_configs; ++i) {
+    for (uint8_t j = 0; j < 3; ++j) {
+      printf("\n");
+      printf("    events  %u\n", configs[i].num_events);
+      printf("event size  %u bytes\n", configs[i].event_size);
+      printf("     codec  %s\n", names[j]);
+
+      if ((algorithms[j] != COMPRESSION_NONE) &&
+          !compression_available(algorithms[j])) {
+        printf("            not built in\n");
+        continue;
+      }
+      timed_compression_run(configs[i], algorithms[j]);
+    }
+  }
+}
+
+void timed_compression_run(DataConfig config, uint8_t algorithm) {
+  FragmentedEventSource *f_events;
+  Event *events;
+  Event *read_events;
+  struct timespec t_start, t_compressed, t_written, t_read;
+  uint64_t data_bytes = (uint64_t)config.num_events * config.event_size;
+  uint64_t wire_bytes = 0;
+  uint32_t num_read;
+
+  // Generate mock events
+  events = (Event *)malloc(sizeof(Event) * config.num_events);
+  f_events = (FragmentedEventSource *)malloc(sizeof(FragmentedEventSource) *
+                                             config.num_events);
+  if (!events || !f_events)
+    fatal_error();
+  for (uint32_t i = 0; i < config.num_events; ++i) {
+    events[i].id = i;
+    events[i].data_length = config.event_size;
+    if (!(events[i].data = (uint8_t *)malloc(config.event_size)))
+      fatal_error();
+    load_redundant_data(events[i].data, config.event_size);
+  }
+
+  // Compress, write, then read back every event
+  timespec_get(&t_start, TIME_UTC);
+  for (uint32_t i = 0; i < config.num_events; ++i) {
+    if (init_compressed_event_source(&f_events[i], &events[i],
+                                     OPTIMAL_VALUE_SIZE, algorithm, 0))
+      fatal_error();
+  }
+  timespec_get(&t_compressed, TIME_UTC);
+
+  fdb_set_batch_size(0);
+  fdb_set_batch_bytes(DEFAULT_BATCH_BYTES);
+  if (fdb_write_fragmented_event_array(f_events, config.num_events))
+    fatal_error();
+  timespec_get(&t_written, TIME_UTC);
+
+  if (fdb_read_event_range(0, config.num_events, &read_events, &num_read) ||
+      (num_read != config.num_events))
+    fatal_error();
+  timespec_get(&t_read, TIME_UTC);
+
+  for (uint32_t i = 0; i < config.num_events; ++i)
+    wire_bytes += event_set_bytes(&f_events[i].src);
+
+  // Print results; keys and headers count towards the bytes on the wire
+  printf("data bytes  %lu\n", (unsigned long)data_bytes);
+  printf("wire bytes  %lu (%.1f%%)\n", (unsigned long)wire_bytes,
+         (100.0 * (double)wire_bytes) / (double)data_bytes);
+  printf("  compress  %12f ms\n", elapsed_ms(&t_start, &t_compressed));
+  printf("     write  %12f ms\n", elapsed_ms(&t_compressed, &t_written));
+  printf("      read  %12f ms\n", elapsed_ms(&t_written, &t_read));
+  printf("   latency  %12f ms/event (write and read)\n",
+         elapsed_ms(&t_compressed, &t_read) / config.num_events);
+
+  // Clean up heap
+  for (uint32_t i = 0; i < num_read; ++i)
+    free_event(&read_events[i]);
+  free((void *)read_events);
+  release_events_memory(events, f_events, config.num_events);
+
+  // Clean up the FoundationDB cluster
+  if (fdb_clear_database())
+    fatal_error();
+}
+
+void load_redundant_data(uint8_t *data, uint32_t size) {
+  static const char *words[] = {"event", "noun",  "cell",  "atom", "jet",
+                                "arvo",  "state", "agent", "poke", "gift",
+                                "move",  "wire",  "duct",  "card", "path",
+                                "mark"};
+  uint32_t filled = 0;
+
+  while (filled < size) {
+    const char *word = words[rand() % 16];
+    uint32_t length = (uint32_t)strlen(word);
+
+    if (length > (size - filled))
+      length = size - filled;
+    memcpy(data + filled, word, length);
+    filled += length;
+
+    if (filled < size)
+      data[filled++] = (uint8_t)(rand() % 4);
+  }
+}
+
+double elapsed_ms(const struct timespec *start, const struct timespec *end) {
+  return ((end->tv_sec - start->tv_sec) * 1000.0) +
+         ((end->tv_nsec - start->tv_nsec) / 1000000.0);
+}
+
+void print_settings(DataConfig config, BatchConfig batch, const char *method) {
+  printf("\n");
+  printf("    events  %u\n", config.num_events);
+  printf("event size  %u bytes\n", config.event_size);
+  if (batch.batch_size)
+    printf("batch size  %u\n", batch.batch_size);
+  else
+    printf("batch size  unlimited\n");
+  printf("  tx bytes  %u\n", batch.batch_bytes);
+  printf(" fragments  %u\n",
+         (uint32_t)ceil((double)config.event_size / (double)OPTIMAL_VALUE_SIZE));
+  printf("    method  %s\n", method);
+}
+
 void timed_array_write(const FragmentedEventSource *events, uint32_t num_events,
-                       uint32_t num_frags, uint32_t batch_size) {
+                       uint32_t num_frags, BatchConfig batch) {
   clock_t c_start, c_end;
 
-  fdb_set_batch_size(batch_size);
+  fdb_set_batch_size(batch.batch_size);
+  fdb_set_batch_bytes(batch.batch_bytes);
 
   // Write array of events in batches
   c_start = clock();
@@ -233,10 +462,11 @@ void timed_array_write(const FragmentedEventSource *events, uint32_t num_events,
 }
 
 void timed_array_write_async(const FragmentedEventSource *events, uint32_t num_events,
-                             uint32_t num_frags, uint32_t batch_size) {
+                             uint32_t num_frags, BatchConfig batch) {
   clock_t c_start, c_end;
 
-  fdb_set_batch_size(batch_size);
+  fdb_set_batch_size(batch.batch_size);
+  fdb_set_batch_bytes(batch.batch_bytes);
 
   // Write array of events in batches, and print a bar as a visual indicator of
   // progress
@@ -256,6 +486,33 @@ void timed_array_write_async(const FragmentedEventSource *events, uint32_t num_e
     fatal_error();
 }
 
+void timed_array_write_parallel(const FragmentedEventSource *events,
+                                uint32_t num_events, uint32_t num_workers) {
+  FDBWriteProgress progress;
+  struct timespec t_start, t_end;
+  double total_time;
+
+  // Write array of events from the worker pool
+  fdb_write_progress_init(&progress);
+  timespec_get(&t_start, TIME_UTC);
+  if (fdb_write_fragmented_event_array_parallel(events, num_events, num_workers,
+                                                &progress))
+    fatal_error();
+
+  timespec_get(&t_end, TIME_UTC);
+  total_time = ((t_end.tv_sec - t_start.tv_sec) * 1000.0) +
+               ((t_end.tv_nsec - t_start.tv_nsec) / 1000000.0);
+
+  // Print timing results
+  printf("   commits  %lu\n", (unsigned long)atomic_load(&progress.commits));
+  printf("total time  %12f ms\n", total_time);
+  printf("throughput  %12f events/s\n", num_events / (total_time / 1000.0));
+
+  // Clean up the FoundationDB cluster
+  if (fdb_clear_database())
+    fatal_error();
+}
+
 void load_mock_events(Event **events, FragmentedEventSource **f_events,
                       uint32_t num_events, uint32_t size) {
   // Seed the random number generator
@@ -285,20 +542,6 @@ void load_mock_events(Event **events, FragmentedEventSource **f_events,
   }
 }
 
-void load_lmdb_events(Event **events, FragmentedEventSource **f_events,
-                      uint32_t num_events, uint32_t size) {
-  // Allocate memory for events
-  *events = (Event *)malloc(sizeof(Event) * num_events);
-
-  // TODO
-
-  // Fragment events
-  *f_events = malloc(sizeof(FragmentedEventSource) * num_events);
-  for (uint32_t i = 0; i < num_events; ++i) {
-    init_fragmented_event_source(&(*f_events)[i], &(*events)[i], OPTIMAL_VALUE_SIZE);
-  }
-}
-
 void release_events_memory(Event *events, FragmentedEventSource *f_events,
                            uint32_t num_events) {
   // Release fragment pointers
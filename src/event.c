@@ -3,66 +3,256 @@
 /// Definitions for functions which manage events.
 
 #include <assert.h>
+#include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "constants.h"
 #include "event.h"
+#include "event_compress.h"
 
 //==============================================================================
 // Functions
 //==============================================================================
 
-uint8_t build_header(uint8_t *header, uint32_t num_fragments) {
-  // HEADER   MAX # FRAGS   MAX EVENT SIZE
-  // 1 byte   128                1280000 bytes (  1.28 MB)
-  // 2 byte   256                2560000 bytes (  2.56 MB)
-  // 3 byte   65536            655360000 bytes (655.36 MB)
-  // 4 byte   16777216      167772160000 bytes (~168 GB)
-  // ...
+uint8_t build_header(uint8_t *header, uint32_t num_fragments,
+                     uint64_t data_length, uint32_t fragment_length) {
+  uint8_t header_length = 1;
+
+  // A single fragment holds the whole event, so its length is the length of
+  // the event: the one byte header reads the same in every version
+  if (!num_fragments) {
+    header[0] = 0;
+    return 1;
+  }
+
+  // HEADER (v2)   CONTENTS
+  // 1 byte        HEADER_V2 marker
+  // 1-5 bytes     number of ADDITIONAL fragments
+  // 1-10 bytes    total length of the event data
+  // 1-5 bytes     length of every fragment after the first
   //
-  // Thus, the header size is determined by the number of fragments necessary to
-  // store the event (which is indirectly tied to the OPTIMAL_VALUE_SIZE macro
-  // [10,000 bytes for FDB]). We can also set an upper limit using the
-  // MAX_HEADER_SIZE macro for event sizes we expect to never be reached (e.g.
-  // maximum header size of 4 if we never expect to see an event larger than
-  // ~168GB).
+  // Each number is a little-endian base-128 varint, so the header grows with
+  // the event but has no upper limit short of the fragment key space. Readers
+  // learn the exact length of the event, and where each fragment goes, from
+  // the first fragment alone.
   //
-  if (num_fragments < 128) {
-    header[0] = ((uint8_t *)&num_fragments)[0];
-    return 1;
+  header[0] = HEADER_V2;
+  header_length += write_varint(header + header_length, num_fragments);
+  header_length += write_varint(header + header_length, data_length);
+  header_length += write_varint(header + header_length, fragment_length);
+
+  return header_length;
+}
+
+uint8_t build_packed_header(uint8_t *header, uint32_t num_events) {
+  // HEADER (packed)   CONTENTS
+  // 1 byte            HEADER_PACKED marker
+  // 1-2 bytes         number of events in the block
+  header[0] = HEADER_PACKED;
+  return (1 + write_varint(header + 1, num_events));
+}
+
+uint8_t build_compressed_header(uint8_t *header, uint32_t num_fragments,
+                                uint64_t data_length, uint32_t fragment_length,
+                                uint8_t algorithm, uint8_t level,
+                                uint64_t raw_length) {
+  uint8_t header_length = 3;
+
+  // HEADER (compressed)   CONTENTS
+  // 1 byte                HEADER_COMPRESSED marker
+  // 1 byte                compression algorithm
+  // 1 byte                compression level
+  // 1-5 bytes             number of ADDITIONAL fragments, which may be 0
+  // 1-10 bytes            total length of the compressed data
+  // 1-5 bytes             length of every fragment after the first
+  // 1-10 bytes            length of the event data once decompressed
+  header[0] = HEADER_COMPRESSED;
+  header[1] = algorithm;
+  header[2] = level;
+  header_length += write_varint(header + header_length, num_fragments);
+  header_length += write_varint(header + header_length, data_length);
+  header_length += write_varint(header + header_length, fragment_length);
+  header_length += write_varint(header + header_length, raw_length);
+
+  return header_length;
+}
+
+uint8_t read_header(const uint8_t *header, uint8_t header_length,
+                    EventHeader *out) {
+  uint8_t length = 1;
+  uint64_t value;
+  uint8_t n;
+
+  if (!header_length)
+    return 0;
+  out->num_events = 0;
+  out->compression = COMPRESSION_NONE;
+  out->compression_level = 0;
+  out->raw_length = 0;
+
+  // Packed block: only the number of events, each of which is whole
+  if (header[0] == HEADER_PACKED) {
+    if (!(n = read_varint(header + length, (header_length - length), &value)) ||
+        (value < 2) || (value > MAX_PACKED_EVENTS))
+      return 0;
+
+    out->num_fragments = 0;
+    out->data_length = 0;
+    out->fragment_length = 0;
+    out->num_events = (uint32_t)value;
+    return (length + n);
   }
 
-  for (uint8_t i = 1; i < (MAX_HEADER_SIZE - 1); ++i) {
-    if (num_fragments < ((uint32_t)(1 << (i * 8)))) {
-      header[0] = (EXTENDED_HEADER | i);
-      memcpy((header + 1), &num_fragments, i);
-      return (i + 1);
-    }
+  // v1: one byte for up to 127 additional fragments, or EXTENDED_HEADER and
+  // the number of little-endian bytes that follow. The fragments after the
+  // first are always OPTIMAL_VALUE_SIZE bytes long, and the length of the event
+  // follows from that of the first fragment.
+  // Compressed: the algorithm and level, then the layout of the compressed
+  // data as in v2
+  if (header[0] == HEADER_COMPRESSED) {
+    if ((header_length < 3) || (header[1] == COMPRESSION_NONE) ||
+        (header[1] > MAX_COMPRESSION))
+      return 0;
+
+    out->compression = header[1];
+    out->compression_level = header[2];
+    length = 3;
+  } else if (header[0] != HEADER_V2) {
+    out->num_fragments = header[0];
+    out->data_length = 0;
+    out->fragment_length = OPTIMAL_VALUE_SIZE;
+
+    if (!(header[0] & EXTENDED_HEADER))
+      return 1;
+
+    n = (header[0] ^ EXTENDED_HEADER);
+    if (!n || (n > 3) || (header_length < (n + 1)))
+      return 0;
+
+    out->num_fragments = 0;
+    for (uint8_t i = 0; i < n; ++i)
+      out->num_fragments |= ((uint32_t)header[i + 1] << (i * 8));
+
+    return (n + 1);
   }
 
-  // Technically this is wrong if num_fragments >= 2^24
-  header[0] = (EXTENDED_HEADER | (MAX_HEADER_SIZE - 1));
-  memcpy((header + 1), &num_fragments, (MAX_HEADER_SIZE - 1));
-  return MAX_HEADER_SIZE;
+  // v2: the number of additional fragments must leave room for the fragment
+  // key of the last one. Only a compressed event may have none.
+  if (!(n = read_varint(header + length, (header_length - length), &value)) ||
+      (!value && !out->compression) || (value >= UINT32_MAX))
+    return 0;
+  out->num_fragments = (uint32_t)value;
+  length += n;
+
+  if (!(n = read_varint(header + length, (header_length - length), &value)))
+    return 0;
+  out->data_length = value;
+  length += n;
+
+  if (!(n = read_varint(header + length, (header_length - length), &value)) ||
+      !value || (value > UINT32_MAX))
+    return 0;
+  out->fragment_length = (uint32_t)value;
+  length += n;
+
+  // The first fragment holds between one byte and a whole fragment
+  if ((out->data_length <=
+       ((uint64_t)out->num_fragments * out->fragment_length)) ||
+      ((out->data_length - ((uint64_t)out->num_fragments * out->fragment_length)) >
+       out->fragment_length))
+    return 0;
+
+  // Only events that shrink are compressed
+  if (out->compression) {
+    if (!(n = read_varint(header + length, (header_length - length), &value)) ||
+        (value <= out->data_length))
+      return 0;
+    out->raw_length = value;
+    length += n;
+  }
+
+  return length;
+}
+
+int unpack_event(const uint8_t *value, uint32_t value_length,
+                 uint32_t num_events, uint32_t index, const uint8_t **data,
+                 uint32_t *data_length) {
+  uint32_t directory_length = num_events * PACKED_OFFSET_SIZE;
+  uint32_t start = 0;
+  uint32_t end;
+
+  if ((index >= num_events) || (value_length < directory_length))
+    return -1;
+
+  // Each event starts where the one before it ends
+  end = value[index * PACKED_OFFSET_SIZE] |
+        ((uint32_t)value[(index * PACKED_OFFSET_SIZE) + 1] << 8);
+  if (index)
+    start = value[(index - 1) * PACKED_OFFSET_SIZE] |
+            ((uint32_t)value[((index - 1) * PACKED_OFFSET_SIZE) + 1] << 8);
+
+  if ((start > end) || (end > (value_length - directory_length)))
+    return -1;
+
+  *data = value + directory_length + start;
+  *data_length = end - start;
+  return 0;
 }
 
-uint8_t read_header(const uint8_t *header, uint32_t *num_fragments) {
-  if (header[0] & EXTENDED_HEADER) {
-    uint8_t header_bytes = (header[0] ^ EXTENDED_HEADER);
-    memcpy((uint8_t *)num_fragments, (header + 1), header_bytes);
+uint8_t write_varint(uint8_t *buf, uint64_t value) {
+  uint8_t length = 0;
 
-    return (header_bytes + 1);
+  while (value >= 0x80) {
+    buf[length++] = (uint8_t)(value | 0x80);
+    value >>= 7;
   }
+  buf[length++] = (uint8_t)value;
 
-  *num_fragments = header[0];
-  return 1;
+  return length;
+}
+
+uint8_t read_varint(const uint8_t *buf, uint8_t buf_length, uint64_t *value) {
+  *value = 0;
+
+  for (uint8_t i = 0; (i < buf_length) && (i < MAX_VARINT_SIZE); ++i) {
+    // The tenth byte only has room for the top bit of a 64-bit value
+    if ((i == (MAX_VARINT_SIZE - 1)) && (buf[i] > 1))
+      return 0;
+
+    *value |= ((uint64_t)(buf[i] & 0x7F) << (i * 7));
+    if (!(buf[i] & 0x80))
+      return (i + 1);
+  }
+
+  // Truncated, or too long
+  return 0;
 }
 
 void free_event(Event *event) { free((void *)event->data); }
 
+void init_event_arena(EventArena *arena, uint8_t *data, uint64_t capacity) {
+  arena->data = data;
+  arena->capacity = capacity;
+  arena->used = 0;
+}
+
+void reset_event_arena(EventArena *arena) { arena->used = 0; }
+
+uint8_t *event_arena_alloc(EventArena *arena, uint64_t length) {
+  uint8_t *data;
+
+  if (length > (arena->capacity - arena->used))
+    return NULL;
+
+  data = arena->data + arena->used;
+  arena->used += length;
+  return data;
+}
+
 void init_event_source(Source *es, Event *event, const struct source_ops_t *ops) {
   es->event = *event;
   // consume the event
@@ -114,6 +304,11 @@ void f_event__free(Source *src) {
   free_event(&src->event);
 }
 
+void f_event__free_borrowed(Source *src) {
+  // The data belongs to the caller
+  (void)src;
+}
+
 SourceOps f_event_ops = {
   .length = f_event__length,
   .num_fragments = f_event__num_fragments,
@@ -125,6 +320,17 @@ SourceOps f_event_ops = {
   .free = f_event__free
 };
 
+SourceOps f_event_borrowed_ops = {
+  .length = f_event__length,
+  .num_fragments = f_event__num_fragments,
+  .prefix_length = f_event__prefix_length,
+  .header_length = f_event__header_length,
+  .header = f_event__header,
+  .fragment_length = f_event__fragment_length,
+  .fragment_data = f_event__fragment_data,
+  .free = f_event__free_borrowed
+};
+
 void init_fragmented_event_source(FragmentedEventSource *es,
                                   Event *event,
                                   uint32_t fragment_length) {
@@ -132,5 +338,397 @@ void init_fragmented_event_source(FragmentedEventSource *es,
   es->fragment_length = fragment_length;
 
   // Header encodes number of ADDITIONAL fragments
-  es->header_length = build_header(es->header, f_event__num_fragments(&es->src) - 1);
+  es->header_length = build_header(es->header, f_event__num_fragments(&es->src) - 1,
+                                   es->src.event.data_length, fragment_length);
+}
+
+int init_compressed_event_source(FragmentedEventSource *es, Event *event,
+                                 uint32_t fragment_length, uint8_t algorithm,
+                                 uint8_t level) {
+  uint64_t raw_length = event->data_length;
+  uint64_t length;
+  uint8_t *data;
+
+  if ((algorithm != COMPRESSION_NONE) && !compression_available(algorithm))
+    return -1;
+
+  // Compress into a buffer a byte shorter than the event, which only takes
+  // data that shrinks; anything else is written as it is
+  if ((algorithm == COMPRESSION_NONE) || (raw_length < 2)) {
+    init_fragmented_event_source(es, event, fragment_length);
+    return 0;
+  }
+  if (!(data = malloc(sizeof(uint8_t) * (raw_length - 1))))
+    return -1;
+  if (compress_data(algorithm, level, event->data, raw_length, data,
+                    (raw_length - 1), &length)) {
+    free(data);
+    init_fragmented_event_source(es, event, fragment_length);
+    return 0;
+  }
+
+  // The compressed data takes the place of the event data
+  free(event->data);
+  event->data = data;
+  event->data_length = length;
+  init_fragmented_event_source(es, event, fragment_length);
+  es->header_length = build_compressed_header(
+      es->header, f_event__num_fragments(&es->src) - 1, length,
+      fragment_length, algorithm, level, raw_length);
+
+  return 0;
+}
+
+void init_borrowed_event_source(FragmentedEventSource *es,
+                                Event *event,
+                                uint32_t fragment_length) {
+  init_fragmented_event_source(es, event, fragment_length);
+  es->src.ops = &f_event_borrowed_ops;
+}
+
+uint32_t pack_events(uint8_t *value, const FragmentedEventSource f_events[],
+                     uint32_t num_events) {
+  uint32_t length = num_events * PACKED_OFFSET_SIZE;
+  uint32_t end = 0;
+
+  for (uint32_t i = 0; i < num_events; ++i) {
+    const Source *src = &f_events[i].src;
+
+    memcpy(value + length, es_fragment_data(src, 0), es_length(src));
+    length += es_length(src);
+    end += es_length(src);
+
+    value[i * PACKED_OFFSET_SIZE] = (uint8_t)end;
+    value[(i * PACKED_OFFSET_SIZE) + 1] = (uint8_t)(end >> 8);
+  }
+
+  return length;
+}
+
+uint32_t sg_event__length(const Source *src) {
+  return src->event.data_length;
+}
+
+uint32_t sg_event__num_fragments(const Source *src) {
+  ScatterGatherEventSource *es = container_of(src, ScatterGatherEventSource, src);
+  uint32_t rem = src->event.data_length % es->fragment_length;
+  uint32_t div = src->event.data_length / es->fragment_length;
+  return rem == 0 ? div : div + 1;
+}
+
+uint32_t sg_event__prefix_length(const Source *src) {
+  ScatterGatherEventSource *es = container_of(src, ScatterGatherEventSource, src);
+  uint32_t ret = src->event.data_length % es->fragment_length;
+  if (ret == 0)
+    ret = es->fragment_length;
+  return ret;
+}
+
+uint8_t sg_event__header_length(const Source *src) {
+  return container_of(src, ScatterGatherEventSource, src)->header_length;
+}
+
+const uint8_t *sg_event__header(const Source *src) {
+  return container_of(src, ScatterGatherEventSource, src)->header;
+}
+
+uint32_t sg_event__fragment_length(const Source *src, uint32_t fragment) {
+  ScatterGatherEventSource *es = container_of(src, ScatterGatherEventSource, src);
+  return fragment == 0 ? sg_event__prefix_length(src) : es->fragment_length;
+}
+
+uint64_t sg_event__fragment_offset(const Source *src, uint32_t fragment) {
+  ScatterGatherEventSource *es = container_of(src, ScatterGatherEventSource, src);
+  return fragment == 0 ? 0
+                       : sg_event__prefix_length(src) +
+                             ((uint64_t)(fragment - 1) * es->fragment_length);
+}
+
+uint32_t sg_event__segment_at(const ScatterGatherEventSource *es, uint64_t offset) {
+  // Last segment starting at or before the offset; empty segments share their
+  // offset with the next one, so they are never picked
+  uint32_t lo = 0;
+  uint32_t hi = es->num_segments;
+
+  while ((hi - lo) > 1) {
+    uint32_t mid = lo + ((hi - lo) / 2);
+    if (es->offsets[mid] <= offset)
+      lo = mid;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
+
+uint8_t *sg_event__fragment_data(const Source *src, uint32_t fragment) {
+  ScatterGatherEventSource *es = container_of(src, ScatterGatherEventSource, src);
+  uint64_t offset = sg_event__fragment_offset(src, fragment);
+  uint32_t segment = sg_event__segment_at(es, offset);
+  uint64_t skip = offset - es->offsets[segment];
+
+  // Zero-copy if the fragment lies within one segment
+  if ((skip + sg_event__fragment_length(src, fragment)) <= es->segments[segment].length)
+    return (uint8_t *)es->segments[segment].data + skip;
+
+  // Otherwise, use the copy made when the source was initialized
+  uint32_t lo = 0;
+  uint32_t hi = es->num_bounced;
+  while (lo < hi) {
+    uint32_t mid = lo + ((hi - lo) / 2);
+    if (es->bounced[mid] < fragment)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  assert((lo < es->num_bounced) && (es->bounced[lo] == fragment));
+  return es->bounce + ((uint64_t)lo * es->fragment_length);
+}
+
+void sg_event__free(Source *src) {
+  ScatterGatherEventSource *es = container_of(src, ScatterGatherEventSource, src);
+
+  // The segments belong to the caller
+  free(es->offsets);
+  free(es->bounced);
+  free(es->bounce);
+}
+
+SourceOps sg_event_ops = {
+  .length = sg_event__length,
+  .num_fragments = sg_event__num_fragments,
+  .prefix_length = sg_event__prefix_length,
+  .header_length = sg_event__header_length,
+  .header = sg_event__header,
+  .fragment_length = sg_event__fragment_length,
+  .fragment_data = sg_event__fragment_data,
+  .free = sg_event__free
+};
+
+int init_scatter_gather_event_source(ScatterGatherEventSource *es, uint64_t id,
+                                     const EventSegment *segments,
+                                     uint32_t num_segments,
+                                     uint32_t fragment_length) {
+  Event event = {id, 0, NULL};
+  uint32_t num_fragments;
+
+  es->segments = segments;
+  es->num_segments = num_segments;
+  es->fragment_length = fragment_length;
+  es->offsets = malloc(sizeof(uint64_t) * (num_segments ? num_segments : 1));
+  es->bounced = NULL;
+  es->bounce = NULL;
+  es->num_bounced = 0;
+  if (!es->offsets)
+    return -1;
+
+  // Place each segment in the event
+  for (uint32_t i = 0; i < num_segments; ++i) {
+    es->offsets[i] = event.data_length;
+    event.data_length += segments[i].length;
+  }
+
+  init_event_source(&es->src, &event, &sg_event_ops);
+  if (!event.data_length)
+    goto init_fail;
+
+  // Header encodes number of ADDITIONAL fragments
+  num_fragments = sg_event__num_fragments(&es->src);
+  es->header_length = build_header(es->header, num_fragments - 1,
+                                   event.data_length, fragment_length);
+
+  // A fragment can only straddle a segment boundary it contains, so there are
+  // fewer straddling fragments than segments
+  if (num_segments > 1) {
+    es->bounced = malloc(sizeof(uint32_t) * (num_segments - 1));
+    es->bounce = malloc((uint64_t)fragment_length * (num_segments - 1));
+    if (!es->bounced || !es->bounce)
+      goto init_fail;
+  }
+
+  // Copy each straddling fragment once, gathering it from its segments
+  for (uint32_t i = 1; i < num_segments; ++i) {
+    uint64_t boundary = es->offsets[i];
+    uint32_t fragment;
+    uint64_t start;
+    uint32_t length;
+    uint32_t segment;
+    uint32_t copied = 0;
+
+    // Skip boundaries at the very start or end, and between empty segments
+    if (!boundary || (boundary == event.data_length) ||
+        !segments[i].length)
+      continue;
+
+    // Find the fragment containing the first byte after the boundary
+    fragment = (boundary < sg_event__prefix_length(&es->src))
+                   ? 0
+                   : 1 + (uint32_t)((boundary - sg_event__prefix_length(&es->src)) /
+                                    fragment_length);
+    start = sg_event__fragment_offset(&es->src, fragment);
+    length = sg_event__fragment_length(&es->src, fragment);
+
+    // The boundary may fall exactly between two fragments, and a fragment
+    // spanning several boundaries is copied only once
+    if ((start == boundary) ||
+        (es->num_bounced && (es->bounced[es->num_bounced - 1] == fragment)))
+      continue;
+
+    segment = sg_event__segment_at(es, start);
+    while (copied < length) {
+      uint64_t skip = (start + copied) - es->offsets[segment];
+      uint64_t available = segments[segment].length - skip;
+      uint32_t chunk = (available < (length - copied)) ? (uint32_t)available
+                                                       : (length - copied);
+
+      memcpy(es->bounce + ((uint64_t)es->num_bounced * fragment_length) + copied,
+             segments[segment].data + skip, chunk);
+      copied += chunk;
+      ++segment;
+    }
+
+    es->bounced[es->num_bounced++] = fragment;
+  }
+
+  // Success
+  return 0;
+
+// Failure
+init_fail:
+  free(es->offsets);
+  free(es->bounced);
+  free(es->bounce);
+  es->offsets = NULL;
+  es->bounced = NULL;
+  es->bounce = NULL;
+  return -1;
+}
+
+uint32_t stream_event__length(const Source *src) {
+  return src->event.data_length;
+}
+
+uint32_t stream_event__num_fragments(const Source *src) {
+  StreamEventSource *es = container_of(src, StreamEventSource, src);
+  uint32_t rem = src->event.data_length % es->fragment_length;
+  uint32_t div = src->event.data_length / es->fragment_length;
+  return rem == 0 ? div : div + 1;
+}
+
+uint32_t stream_event__prefix_length(const Source *src) {
+  StreamEventSource *es = container_of(src, StreamEventSource, src);
+  uint32_t ret = src->event.data_length % es->fragment_length;
+  if (ret == 0)
+    ret = es->fragment_length;
+  return ret;
+}
+
+uint8_t stream_event__header_length(const Source *src) {
+  return container_of(src, StreamEventSource, src)->header_length;
+}
+
+const uint8_t *stream_event__header(const Source *src) {
+  return container_of(src, StreamEventSource, src)->header;
+}
+
+uint32_t stream_event__fragment_length(const Source *src, uint32_t fragment) {
+  StreamEventSource *es = container_of(src, StreamEventSource, src);
+  return fragment == 0 ? stream_event__prefix_length(src) : es->fragment_length;
+}
+
+uint8_t *stream_event__fragment_data(const Source *src, uint32_t fragment) {
+  StreamEventSource *es = container_of(src, StreamEventSource, src);
+  uint32_t pulled = atomic_load_explicit(&es->pulled, memory_order_acquire);
+
+  assert(es->ring);
+
+  // Pull every fragment up to the requested one, overwriting the oldest. Only
+  // the writing thread pulls; retries only revisit fragments still in the ring.
+  for (; pulled <= fragment; ++pulled) {
+    uint8_t *slot = es->ring + ((uint64_t)(pulled % es->ring_fragments) *
+                                es->fragment_length);
+
+    if (!es->error &&
+        es->pull(es->ctx, slot, stream_event__fragment_length(src, pulled)))
+      es->error = 1;
+    atomic_store_explicit(&es->pulled, pulled + 1, memory_order_release);
+  }
+
+  assert((pulled - fragment) <= es->ring_fragments);
+  return es->ring +
+         ((uint64_t)(fragment % es->ring_fragments) * es->fragment_length);
+}
+
+void stream_event__free(Source *src) {
+  StreamEventSource *es = container_of(src, StreamEventSource, src);
+
+  // The data stays with the callback or file descriptor
+  free(es->ring);
+  es->ring = NULL;
+}
+
+SourceOps stream_event_ops = {
+  .length = stream_event__length,
+  .num_fragments = stream_event__num_fragments,
+  .prefix_length = stream_event__prefix_length,
+  .header_length = stream_event__header_length,
+  .header = stream_event__header,
+  .fragment_length = stream_event__fragment_length,
+  .fragment_data = stream_event__fragment_data,
+  .free = stream_event__free
+};
+
+int stream_event__pull_fd(void *ctx, uint8_t *buf, uint32_t length) {
+  StreamEventSource *es = (StreamEventSource *)ctx;
+
+  // Pipes and sockets may return less than asked for
+  while (length) {
+    ssize_t num_read = read(es->fd, buf, length);
+
+    if (num_read < 0 && errno == EINTR)
+      continue;
+    if (num_read <= 0)
+      return -1;
+
+    buf += num_read;
+    length -= (uint32_t)num_read;
+  }
+
+  return 0;
+}
+
+int init_stream_event_source(StreamEventSource *es, uint64_t id,
+                             uint64_t length, EventPullFn pull, void *ctx,
+                             uint32_t fragment_length) {
+  Event event = {id, length, NULL};
+
+  if (!length)
+    return -1;
+
+  init_event_source(&es->src, &event, &stream_event_ops);
+  es->pull = pull;
+  es->ctx = ctx;
+  es->fd = -1;
+  es->fragment_length = fragment_length;
+  es->ring = NULL;
+  es->ring_fragments = 0;
+  atomic_init(&es->pulled, 0);
+  es->error = 0;
+
+  // Header encodes number of ADDITIONAL fragments
+  es->header_length = build_header(es->header, stream_event__num_fragments(&es->src) - 1,
+                                   length, fragment_length);
+
+  return 0;
+}
+
+int init_fd_event_source(StreamEventSource *es, uint64_t id, int fd,
+                         uint64_t length, uint32_t fragment_length) {
+  if (init_stream_event_source(es, id, length, stream_event__pull_fd, es,
+                               fragment_length))
+    return -1;
+
+  es->fd = fd;
+  return 0;
 }
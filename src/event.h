@@ -5,11 +5,18 @@
 #pragma once
 
 #include <foundationdb/fdb_c.h>
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdint.h>
 
 #define EXTENDED_HEADER 0x80
-#define MAX_HEADER_SIZE 4
+#define HEADER_V2 0xC0
+#define HEADER_PACKED 0xC1
+#define HEADER_COMPRESSED 0xC2
+#define MAX_PACKED_EVENTS 255
+#define PACKED_OFFSET_SIZE 2
+#define MAX_VARINT_SIZE 10
+#define MAX_HEADER_SIZE 33
 
 //==============================================================================
 // Types
@@ -21,32 +28,153 @@ typedef struct event_t {
   uint8_t *data;        // Pointer to event data array.
 } Event;
 
+/// Caller-owned memory that read events are reassembled into instead of the
+/// heap. Space is handed out front to back and given back all at once with
+/// reset_event_arena(), so a replay that resets the arena between batches
+/// makes no allocations at all. A single buffer is just an arena that holds
+/// one event at a time.
+typedef struct event_arena_t {
+  uint8_t *data;     // Memory owned by the caller.
+  uint64_t capacity; // Length of the memory in bytes.
+  uint64_t used;     // Bytes handed out since the last reset.
+} EventArena;
+
+/// Layout of an event, as read from the header of its first fragment.
+typedef struct event_header_t {
+  uint32_t num_fragments;   // Number of ADDITIONAL fragments.
+  uint64_t data_length;     // Length of the event data in bytes, or 0 if the
+                            // header does not record it (v1, or a single
+                            // fragment).
+  uint32_t fragment_length; // Length of every fragment after the first.
+  uint32_t num_events;      // Number of events packed into the value, or 0 for
+                            // a single event.
+  uint8_t compression;      // Algorithm the event data was compressed with
+                            // (COMPRESSION_*), or COMPRESSION_NONE.
+  uint8_t compression_level; // Level the event data was compressed at.
+  uint64_t raw_length;      // Length of the event data once decompressed, or 0
+                            // if it is not compressed.
+} EventHeader;
+
 //==============================================================================
 // Prototypes
 //==============================================================================
 
 /// Create the header for a fragmented event, which stores the number of
-/// fragments of which an event is composed.
+/// additional fragments of which an event is composed, its length, and the
+/// length of every fragment after the first. Events of a single fragment get
+/// the one byte header 0.
+///
+/// @param[in] header           Pointer to the byte[] to output the header
+///                             (at least MAX_HEADER_SIZE bytes).
+/// @param[in] num_fragments    Number of ADDITIONAL fragments.
+/// @param[in] data_length      Length of the event data in bytes.
+/// @param[in] fragment_length  Length of every fragment after the first.
+///
+/// @return   The length of the header in bytes.
+uint8_t build_header(uint8_t *header, uint32_t num_fragments,
+                     uint64_t data_length, uint32_t fragment_length);
+
+/// Create the header of a packed block: a single value holding a run of small
+/// events with consecutive ids, keyed by the first of them.
+///
+/// @param[in] header      Pointer to the byte[] to output the header (at least
+///                        MAX_HEADER_SIZE bytes).
+/// @param[in] num_events  Number of events in the block (between 2 and
+///                        MAX_PACKED_EVENTS).
 ///
-/// @param[in] header         Pointer to the byte[] to output the header.
-/// @param[in] num_fragments  Number of fragments to encode in the header.
+/// @return   The length of the header in bytes.
+uint8_t build_packed_header(uint8_t *header, uint32_t num_events);
+
+/// Create the header of a compressed event: a v2 header describing the
+/// compressed data as stored, along with the algorithm and level it was
+/// compressed with and its length once decompressed.
+///
+/// @param[in] header           Pointer to the byte[] to output the header
+///                             (at least MAX_HEADER_SIZE bytes).
+/// @param[in] num_fragments    Number of ADDITIONAL fragments.
+/// @param[in] data_length      Length of the compressed data in bytes.
+/// @param[in] fragment_length  Length of every fragment after the first.
+/// @param[in] algorithm        The compression algorithm (COMPRESSION_*).
+/// @param[in] level            The compression level.
+/// @param[in] raw_length       Length of the event data in bytes.
 ///
 /// @return   The length of the header in bytes.
-uint8_t build_header(uint8_t *header, uint32_t num_fragments);
+uint8_t build_compressed_header(uint8_t *header, uint32_t num_fragments,
+                                uint64_t data_length, uint32_t fragment_length,
+                                uint8_t algorithm, uint8_t level,
+                                uint64_t raw_length);
 
-/// Read the total number of fragments for an event from the header.
+/// Read the layout of an event from the header, in either the current (v2) or
+/// the original (v1) format, or the number of events of a packed block. The
+/// data length of a compressed event is that of its compressed data.
 ///
 /// @param[in] header         Handle for the header.
-/// @param[in] num_fragments  Address to write the number of fragments into.
+/// @param[in] header_length  Number of bytes available at the header.
+/// @param[in] out            Address to write the layout of the event into.
+///
+/// @return   The length of the header in bytes, or 0 if it is malformed.
+uint8_t read_header(const uint8_t *header, uint8_t header_length,
+                    EventHeader *out);
+
+/// Find one event in the value of a packed block.
+///
+/// @param[in]  value         Handle for the value.
+/// @param[in]  value_length  Length of the value in bytes.
+/// @param[in]  num_events    Number of events in the block, from its header.
+/// @param[in]  index         Position of the event in the block.
+/// @param[out] data          Address to write the start of the event data into.
+/// @param[out] data_length   Address to write the length of the event into.
+///
+/// @return  0  Success.
+/// @return -1  Failure (malformed block).
+int unpack_event(const uint8_t *value, uint32_t value_length,
+                 uint32_t num_events, uint32_t index, const uint8_t **data,
+                 uint32_t *data_length);
+
+/// Encode an unsigned integer as a little-endian base-128 varint.
+///
+/// @param[in] buf    Pointer to the byte[] to output the varint (at least
+///                   MAX_VARINT_SIZE bytes).
+/// @param[in] value  Integer to encode.
 ///
-/// @return   The length of the header in bytes
-uint8_t read_header(const uint8_t *header, uint32_t *num_fragments);
+/// @return   The length of the varint in bytes.
+uint8_t write_varint(uint8_t *buf, uint64_t value);
+
+/// Decode a little-endian base-128 varint.
+///
+/// @param[in] buf         Handle for the varint.
+/// @param[in] buf_length  Number of bytes available at the varint.
+/// @param[in] value       Address to write the integer into.
+///
+/// @return   The length of the varint in bytes, or 0 if it is malformed.
+uint8_t read_varint(const uint8_t *buf, uint8_t buf_length, uint64_t *value);
 
 /// Deallocate the heap memory used by an event.
 ///
 /// @param[in] event  The event to deallocate.
 void free_event(Event *event);
 
+/// Initialize an event arena over caller-owned memory.
+///
+/// @param[in] arena     Handle for the arena to initialize.
+/// @param[in] data      Memory events are reassembled into.
+/// @param[in] capacity  Length of the memory in bytes.
+void init_event_arena(EventArena *arena, uint8_t *data, uint64_t capacity);
+
+/// Give back every byte handed out by an event arena. The data of every event
+/// read into it since the last reset becomes invalid.
+///
+/// @param[in] arena  Handle for the arena.
+void reset_event_arena(EventArena *arena);
+
+/// Take space for event data from an event arena.
+///
+/// @param[in] arena   Handle for the arena.
+/// @param[in] length  Number of bytes needed.
+///
+/// @return  Pointer to the space, or NULL if the arena is too small.
+uint8_t *event_arena_alloc(EventArena *arena, uint64_t length);
+
 #ifndef container_of
 #define container_of(ptr, type, member) \
   ((type *)((char *)(ptr) - offsetof(type, member)))
@@ -98,7 +226,7 @@ static void __attribute__((used)) es_free(Source *src) {
 typedef struct {
   uint32_t fragment_length;
   uint8_t header[MAX_HEADER_SIZE]; // Header for first fragment which encodes
-                                   // the number of fragments.
+                                   // the layout of the event.
   uint8_t header_length;           // Length of header in bytes.
   Source src;
 } FragmentedEventSource;
@@ -106,3 +234,142 @@ typedef struct {
 void init_fragmented_event_source(FragmentedEventSource *es,
                                   Event *event,
                                   uint32_t fragment_length);
+
+/// Like init_fragmented_event_source(), but the event data is compressed first,
+/// and the compressed data is what gets fragmented and written. Events that
+/// do not shrink are left as they are, as if passed to
+/// init_fragmented_event_source(). Readers decompress events transparently.
+///
+/// @param[in] es               Handle for the source to initialize.
+/// @param[in] event            Handle for the event, whose data is consumed.
+/// @param[in] fragment_length  Maximum length of a fragment.
+/// @param[in] algorithm        The compression algorithm (COMPRESSION_*), which
+///                             must be built in.
+/// @param[in] level            Zstd compression level, or LZ4 acceleration (0
+///                             for the default of the algorithm).
+///
+/// @return  0  Success.
+/// @return -1  Failure (algorithm not built in, or out of memory); the event
+///             is left to the caller.
+int init_compressed_event_source(FragmentedEventSource *es, Event *event,
+                                 uint32_t fragment_length, uint8_t algorithm,
+                                 uint8_t level);
+
+/// Like init_fragmented_event_source(), but the event data is only borrowed:
+/// fragments point into the caller's buffer (e.g. a memory map), which must
+/// outlive the source, and es_free() leaves it alone.
+void init_borrowed_event_source(FragmentedEventSource *es,
+                                Event *event,
+                                uint32_t fragment_length);
+
+/// Pack a run of single-fragment events into the value of a packed block: the
+/// offset at which each event ends (PACKED_OFFSET_SIZE bytes, little-endian),
+/// then the data of the events back to back.
+///
+/// @param[in] value       Pointer to the byte[] to output the value.
+/// @param[in] f_events    Handle for the array of events to pack.
+/// @param[in] num_events  Number of events in the array.
+///
+/// @return   The length of the value in bytes.
+uint32_t pack_events(uint8_t *value, const FragmentedEventSource f_events[],
+                     uint32_t num_events);
+
+/// One contiguous piece of an event whose data is split across several
+/// buffers.
+typedef struct event_segment_t {
+  const uint8_t *data; // Start of the segment.
+  uint32_t length;     // Length of the segment in bytes.
+} EventSegment;
+
+typedef struct {
+  const EventSegment *segments;    // Segments in order, owned by the caller.
+  uint64_t *offsets;               // Offset of each segment in the event.
+  uint32_t num_segments;           // Number of segments.
+  uint32_t fragment_length;        // Length of every fragment but the first.
+  uint32_t *bounced;               // Fragments straddling segments, in order.
+  uint8_t *bounce;                 // Contiguous copies of those fragments.
+  uint32_t num_bounced;            // Number of straddling fragments.
+  uint8_t header[MAX_HEADER_SIZE]; // Header for first fragment which encodes
+                                   // the layout of the event.
+  uint8_t header_length;           // Length of header in bytes.
+  Source src;
+} ScatterGatherEventSource;
+
+/// Initialize a source for an event whose data is split across a list of
+/// segments, without concatenating them. Fragments that lie within one segment
+/// point straight into it; each fragment that straddles segments is copied
+/// once into a bounce buffer. The segments must outlive the source.
+///
+/// @param[in] es               Handle for the source to initialize.
+/// @param[in] id               Event id.
+/// @param[in] segments         Array of segments making up the event data.
+/// @param[in] num_segments     Number of segments in the array.
+/// @param[in] fragment_length  Maximum length of a fragment.
+///
+/// @return  0  Success.
+/// @return -1  Failure (empty event or out of memory).
+int init_scatter_gather_event_source(ScatterGatherEventSource *es, uint64_t id,
+                                     const EventSegment *segments,
+                                     uint32_t num_segments,
+                                     uint32_t fragment_length);
+
+/// Pull callback of a streaming event source: copy the next bytes of the event
+/// into a buffer.
+///
+/// @param[in] ctx     Caller data given to init_stream_event_source().
+/// @param[in] buf     Buffer to fill.
+/// @param[in] length  Exact number of bytes to copy.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+typedef int (*EventPullFn)(void *ctx, uint8_t *buf, uint32_t length);
+
+typedef struct {
+  EventPullFn pull;                // Pull callback feeding the event data.
+  void *ctx;                       // Caller data for the callback.
+  int fd;                          // File descriptor read by the default
+                                   // callback, or -1.
+  uint32_t fragment_length;        // Length of every fragment but the first.
+  uint8_t *ring;                   // Ring of the most recently pulled
+                                   // fragments, set up by the writer.
+  uint32_t ring_fragments;         // Capacity of the ring in fragments.
+  atomic_uint pulled;              // Number of fragments pulled so far.
+  int error;                       // Set once a pull has failed.
+  uint8_t header[MAX_HEADER_SIZE]; // Header for first fragment which encodes
+                                   // the layout of the event.
+  uint8_t header_length;           // Length of header in bytes.
+  Source src;
+} StreamEventSource;
+
+/// Initialize a source for an event whose data is pulled in order from a
+/// callback, so that it never has to be resident in memory at once. Only the
+/// most recent fragments are kept, in a ring sized by the writer, so a
+/// streaming source must be written with fdb_write_stream_event().
+///
+/// @param[in] es               Handle for the source to initialize.
+/// @param[in] id               Event id.
+/// @param[in] length           Total length of the event data in bytes.
+/// @param[in] pull             Callback producing the event data in order.
+/// @param[in] ctx              Caller data for the callback.
+/// @param[in] fragment_length  Maximum length of a fragment.
+///
+/// @return  0  Success.
+/// @return -1  Failure (empty event).
+int init_stream_event_source(StreamEventSource *es, uint64_t id,
+                             uint64_t length, EventPullFn pull, void *ctx,
+                             uint32_t fragment_length);
+
+/// Like init_stream_event_source(), but the event data is read from a file
+/// descriptor (a file, pipe or socket) from its current position. The
+/// descriptor stays open.
+///
+/// @param[in] es               Handle for the source to initialize.
+/// @param[in] id               Event id.
+/// @param[in] fd               File descriptor to read the event data from.
+/// @param[in] length           Total length of the event data in bytes.
+/// @param[in] fragment_length  Maximum length of a fragment.
+///
+/// @return  0  Success.
+/// @return -1  Failure (empty event).
+int init_fd_event_source(StreamEventSource *es, uint64_t id, int fd,
+                         uint64_t length, uint32_t fragment_length);
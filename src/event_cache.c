@@ -0,0 +1,419 @@
+/// @file event_cache.c
+///
+/// Definitions for the in-process cache of recently written and read events.
+///
+/// Each shard keeps its events in a chained hash table, for lookups by id, and
+/// on a circular doubly-linked list in order of use, for eviction. An event is
+/// stored in one allocation with its entry, and is copied in and out, so the
+/// cache never hands out memory that eviction could free.
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "constants.h"
+#include "event_cache.h"
+#include "fdb.h"
+
+// Number of hash buckets a shard starts with
+#define INITIAL_BUCKETS 256
+
+// Data of a cache entry, stored right after it
+#define ENTRY_DATA(entry) ((uint8_t *)((entry) + 1))
+
+//==============================================================================
+// Types
+//==============================================================================
+
+/// Cached event, stored together with its data, which directly follows it.
+typedef struct cache_entry_t {
+  uint64_t id;                     // Event id.
+  uint64_t data_length;            // Length of the event data in bytes.
+  struct cache_entry_t *hash_next; // Next entry in the same bucket.
+  struct cache_entry_t *lru_prev;  // Entry used more recently.
+  struct cache_entry_t *lru_next;  // Entry used less recently.
+} CacheEntry;
+
+/// Independently locked part of the cache, holding the ids that hash to it.
+typedef struct cache_shard_t {
+  pthread_mutex_t lock;
+  CacheEntry **buckets;  // Hash table of entries by id.
+  uint32_t num_buckets;  // Number of buckets, a power of two.
+  uint64_t num_entries;  // Number of entries.
+  CacheEntry lru;        // List head: next is the most recently used entry,
+                         // prev the least recently used one.
+  uint64_t bytes;        // Bytes used by the entries.
+  uint64_t capacity;     // Bytes the entries may use.
+  uint64_t hits;         // Lookups answered.
+  uint64_t misses;       // Lookups not answered.
+  uint64_t evictions;    // Entries evicted to make room.
+} CacheShard;
+
+//==============================================================================
+// Variables
+//==============================================================================
+
+CacheShard *event_cache_shards = NULL;
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Mix an event id into a hash, so that consecutive ids spread over shards and
+/// buckets.
+///
+/// @param[in] id  Event id.
+///
+/// @return  The hash of the id.
+uint64_t cache_hash(uint64_t id);
+
+/// Find the shard an event id belongs to.
+///
+/// @param[in] hash  Hash of the event id.
+///
+/// @return  Handle for the shard, or NULL if the cache is disabled.
+CacheShard *cache_shard(uint64_t hash);
+
+/// Find the link pointing to the entry for an event id in its bucket, or to
+/// the end of the bucket if there is none. The shard must be locked.
+///
+/// @param[in] shard  Handle for the shard.
+/// @param[in] hash   Hash of the event id.
+/// @param[in] id     Event id.
+///
+/// @return  Address of the link.
+CacheEntry **cache_find(CacheShard *shard, uint64_t hash, uint64_t id);
+
+/// Unlink an entry from its bucket and from the use order, and free it. The
+/// shard must be locked.
+///
+/// @param[in] shard  Handle for the shard.
+/// @param[in] link   Address of the bucket link pointing to the entry.
+void cache_unlink(CacheShard *shard, CacheEntry **link);
+
+/// Insert a new entry as the most recently used one, replacing any entry with
+/// the same id, then evict until the shard is within its capacity.
+///
+/// @param[in] entry  Handle for the entry, owned by the cache from here on.
+void cache_insert(CacheEntry *entry);
+
+/// Double the number of buckets of a shard, if memory allows. The shard must
+/// be locked.
+///
+/// @param[in] shard  Handle for the shard.
+void cache_grow(CacheShard *shard);
+
+/// Space an entry for an event of a given length takes in the cache.
+///
+/// @param[in] data_length  Length of the event data in bytes.
+///
+/// @return  The size of the entry in bytes.
+uint64_t cache_entry_size(uint64_t data_length);
+
+//==============================================================================
+// Functions
+//==============================================================================
+
+int event_cache_init(uint64_t capacity_bytes) {
+  CacheShard *shards;
+  uint32_t i;
+
+  if (!capacity_bytes)
+    return -1;
+
+  event_cache_destroy();
+
+  if (!(shards = calloc(EVENT_CACHE_SHARDS, sizeof(CacheShard))))
+    return -1;
+
+  for (i = 0; i < EVENT_CACHE_SHARDS; ++i) {
+    CacheShard *shard = &shards[i];
+
+    shard->buckets = calloc(INITIAL_BUCKETS, sizeof(CacheEntry *));
+    if (!shard->buckets || pthread_mutex_init(&shard->lock, NULL)) {
+      free(shard->buckets);
+      goto init_fail;
+    }
+
+    shard->num_buckets = INITIAL_BUCKETS;
+    shard->lru.lru_next = &shard->lru;
+    shard->lru.lru_prev = &shard->lru;
+    shard->capacity = capacity_bytes / EVENT_CACHE_SHARDS;
+  }
+
+  event_cache_shards = shards;
+
+  // Success
+  return 0;
+
+// Failure
+init_fail:
+  while (i--) {
+    pthread_mutex_destroy(&shards[i].lock);
+    free(shards[i].buckets);
+  }
+  free(shards);
+  return -1;
+}
+
+void event_cache_destroy(void) {
+  if (!event_cache_shards)
+    return;
+
+  event_cache_clear();
+  for (uint32_t i = 0; i < EVENT_CACHE_SHARDS; ++i) {
+    pthread_mutex_destroy(&event_cache_shards[i].lock);
+    free(event_cache_shards[i].buckets);
+  }
+
+  free(event_cache_shards);
+  event_cache_shards = NULL;
+}
+
+int event_cache_get(Event *event, EventArena *arena) {
+  uint64_t hash = cache_hash(event->id);
+  CacheShard *shard = cache_shard(hash);
+  CacheEntry *entry;
+  int result = 0;
+
+  if (!shard)
+    return 0;
+
+  pthread_mutex_lock(&shard->lock);
+
+  if (!(entry = *cache_find(shard, hash, event->id))) {
+    ++shard->misses;
+    pthread_mutex_unlock(&shard->lock);
+    return 0;
+  }
+
+  // Copy the data out while the entry cannot be evicted
+  event->data_length = entry->data_length;
+  event->data = arena ? event_arena_alloc(arena, entry->data_length)
+                      : malloc(entry->data_length);
+  if (event->data) {
+    memcpy(event->data, ENTRY_DATA(entry), entry->data_length);
+
+    // Move the entry to the front of the use order
+    entry->lru_prev->lru_next = entry->lru_next;
+    entry->lru_next->lru_prev = entry->lru_prev;
+    entry->lru_next = shard->lru.lru_next;
+    entry->lru_prev = &shard->lru;
+    shard->lru.lru_next->lru_prev = entry;
+    shard->lru.lru_next = entry;
+
+    ++shard->hits;
+    result = 1;
+  } else if (arena) {
+    result = FDB_READ_ARENA_FULL;
+  }
+
+  pthread_mutex_unlock(&shard->lock);
+  return result;
+}
+
+void event_cache_put_event(const Event *event) {
+  CacheEntry *entry;
+
+  if (!event_cache_shards ||
+      (cache_entry_size(event->data_length) >
+       cache_shard(cache_hash(event->id))->capacity))
+    return;
+
+  // Copy the data before taking the lock
+  if (!(entry = malloc(cache_entry_size(event->data_length))))
+    return;
+  entry->id = event->id;
+  entry->data_length = event->data_length;
+  memcpy(ENTRY_DATA(entry), event->data, event->data_length);
+
+  cache_insert(entry);
+}
+
+void event_cache_put_source(const Source *src) {
+  uint32_t num_fragments = es_num_fragments(src);
+  uint64_t data_length = 0;
+  CacheEntry *entry;
+  uint8_t *data;
+
+  // A compressed source holds the data as stored, not as read
+  if (!event_cache_shards || (es_header(src)[0] == HEADER_COMPRESSED))
+    return;
+
+  for (uint32_t i = 0; i < num_fragments; ++i)
+    data_length += es_fragment_length(src, i);
+  if (cache_entry_size(data_length) >
+      cache_shard(cache_hash(src->event.id))->capacity)
+    return;
+
+  // Gather the fragments before taking the lock
+  if (!(entry = malloc(cache_entry_size(data_length))))
+    return;
+  entry->id = src->event.id;
+  entry->data_length = data_length;
+
+  data = ENTRY_DATA(entry);
+  for (uint32_t i = 0; i < num_fragments; ++i) {
+    memcpy(data, es_fragment_data(src, i), es_fragment_length(src, i));
+    data += es_fragment_length(src, i);
+  }
+
+  cache_insert(entry);
+}
+
+void event_cache_remove(uint64_t id) {
+  uint64_t hash = cache_hash(id);
+  CacheShard *shard = cache_shard(hash);
+  CacheEntry **link;
+
+  if (!shard)
+    return;
+
+  pthread_mutex_lock(&shard->lock);
+  if (*(link = cache_find(shard, hash, id)))
+    cache_unlink(shard, link);
+  pthread_mutex_unlock(&shard->lock);
+}
+
+void event_cache_clear(void) {
+  if (!event_cache_shards)
+    return;
+
+  for (uint32_t i = 0; i < EVENT_CACHE_SHARDS; ++i) {
+    CacheShard *shard = &event_cache_shards[i];
+
+    pthread_mutex_lock(&shard->lock);
+    for (CacheEntry *entry = shard->lru.lru_next; entry != &shard->lru;) {
+      CacheEntry *next = entry->lru_next;
+
+      free(entry);
+      entry = next;
+    }
+
+    memset(shard->buckets, 0, sizeof(CacheEntry *) * shard->num_buckets);
+    shard->lru.lru_next = &shard->lru;
+    shard->lru.lru_prev = &shard->lru;
+    shard->num_entries = 0;
+    shard->bytes = 0;
+    pthread_mutex_unlock(&shard->lock);
+  }
+}
+
+void event_cache_stats(EventCacheStats *stats) {
+  memset(stats, 0, sizeof(*stats));
+  if (!event_cache_shards)
+    return;
+
+  for (uint32_t i = 0; i < EVENT_CACHE_SHARDS; ++i) {
+    CacheShard *shard = &event_cache_shards[i];
+
+    pthread_mutex_lock(&shard->lock);
+    stats->hits += shard->hits;
+    stats->misses += shard->misses;
+    stats->evictions += shard->evictions;
+    stats->events += shard->num_entries;
+    stats->bytes += shard->bytes;
+    pthread_mutex_unlock(&shard->lock);
+  }
+}
+
+uint64_t cache_hash(uint64_t id) {
+  // Fibonacci hashing; bits 32 and up pick the shard, the low bits the bucket
+  return id * 0x9E3779B97F4A7C15ull;
+}
+
+CacheShard *cache_shard(uint64_t hash) {
+  if (!event_cache_shards)
+    return NULL;
+
+  return &event_cache_shards[(hash >> 32) & (EVENT_CACHE_SHARDS - 1)];
+}
+
+CacheEntry **cache_find(CacheShard *shard, uint64_t hash, uint64_t id) {
+  CacheEntry **link = &shard->buckets[hash & (shard->num_buckets - 1)];
+
+  while (*link && ((*link)->id != id))
+    link = &(*link)->hash_next;
+
+  return link;
+}
+
+void cache_unlink(CacheShard *shard, CacheEntry **link) {
+  CacheEntry *entry = *link;
+
+  *link = entry->hash_next;
+  entry->lru_prev->lru_next = entry->lru_next;
+  entry->lru_next->lru_prev = entry->lru_prev;
+
+  --shard->num_entries;
+  shard->bytes -= cache_entry_size(entry->data_length);
+  free(entry);
+}
+
+void cache_insert(CacheEntry *entry) {
+  uint64_t hash = cache_hash(entry->id);
+  CacheShard *shard = cache_shard(hash);
+  CacheEntry **link;
+
+  pthread_mutex_lock(&shard->lock);
+
+  // Replace any older copy
+  if (*(link = cache_find(shard, hash, entry->id)))
+    cache_unlink(shard, link);
+
+  // Evict the least recently used entries until the new one fits
+  while ((shard->bytes + cache_entry_size(entry->data_length)) >
+         shard->capacity) {
+    CacheEntry *victim = shard->lru.lru_prev;
+
+    cache_unlink(shard, cache_find(shard, cache_hash(victim->id), victim->id));
+    ++shard->evictions;
+  }
+
+  if (shard->num_entries >= shard->num_buckets)
+    cache_grow(shard);
+
+  link = &shard->buckets[hash & (shard->num_buckets - 1)];
+  entry->hash_next = *link;
+  *link = entry;
+
+  entry->lru_next = shard->lru.lru_next;
+  entry->lru_prev = &shard->lru;
+  shard->lru.lru_next->lru_prev = entry;
+  shard->lru.lru_next = entry;
+
+  ++shard->num_entries;
+  shard->bytes += cache_entry_size(entry->data_length);
+
+  pthread_mutex_unlock(&shard->lock);
+}
+
+void cache_grow(CacheShard *shard) {
+  uint32_t num_buckets = shard->num_buckets * 2;
+  CacheEntry **buckets;
+
+  // A full table only makes chains longer, so failing here is harmless
+  if (!num_buckets || !(buckets = calloc(num_buckets, sizeof(CacheEntry *))))
+    return;
+
+  for (uint32_t i = 0; i < shard->num_buckets; ++i) {
+    for (CacheEntry *entry = shard->buckets[i]; entry;) {
+      CacheEntry *next = entry->hash_next;
+      CacheEntry **link = &buckets[cache_hash(entry->id) & (num_buckets - 1)];
+
+      entry->hash_next = *link;
+      *link = entry;
+      entry = next;
+    }
+  }
+
+  free(shard->buckets);
+  shard->buckets = buckets;
+  shard->num_buckets = num_buckets;
+}
+
+uint64_t cache_entry_size(uint64_t data_length) {
+  return sizeof(CacheEntry) + data_length;
+}
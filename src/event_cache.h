@@ -0,0 +1,84 @@
+/// @file event_cache.h
+///
+/// Declarations for the in-process cache of recently written and read events.
+///
+/// The cache is bounded in bytes and split into shards, each with its own lock
+/// and least-recently-used eviction order. Once enabled, the write functions
+/// of fdb.h fill it with every event they make durable, fdb_read_event() is
+/// served from it when it can be, and the clear functions remove what they
+/// clear.
+
+#pragma once
+
+#include <stdint.h>
+
+#include "event.h"
+
+//==============================================================================
+// Types
+//==============================================================================
+
+/// Counters of the event cache, summed over its shards.
+typedef struct event_cache_stats_t {
+  uint64_t hits;      // Lookups answered from the cache.
+  uint64_t misses;    // Lookups that went to the database.
+  uint64_t evictions; // Events evicted to make room.
+  uint64_t events;    // Events currently cached.
+  uint64_t bytes;     // Bytes currently used, including per-event overhead.
+} EventCacheStats;
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Enable the event cache, or resize it by dropping its contents. Must not run
+/// concurrently with reads or writes.
+///
+/// @param[in] capacity_bytes  Bytes the cache may use, split evenly across its
+///                            shards (must be greater than 0).
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int event_cache_init(uint64_t capacity_bytes);
+
+/// Disable the event cache and release its memory. Must not run concurrently
+/// with reads or writes.
+void event_cache_destroy(void);
+
+/// Look up an event in the cache by id, and copy its data out on a hit.
+///
+/// @param[in,out] event  Handle for the event; its id selects the event.
+/// @param[in]     arena  Arena to copy the data into, or NULL for the heap.
+///
+/// @return  1  Hit; the event data was copied.
+/// @return  0  Miss, or the cache is disabled.
+/// @return -2  FDB_READ_ARENA_FULL, a hit that does not fit in the arena;
+///             event->data_length holds the length needed.
+int event_cache_get(Event *event, EventArena *arena);
+
+/// Add an event to the cache, replacing any cached copy and evicting the least
+/// recently used events of its shard to make room. Events larger than a shard
+/// are not cached.
+///
+/// @param[in] event  Handle for the event, which is copied.
+void event_cache_put_event(const Event *event);
+
+/// Add the event of a source to the cache, like event_cache_put_event(), by
+/// copying its fragments. Not for stream sources, whose data is gone once
+/// written.
+///
+/// @param[in] src  Handle for the event source.
+void event_cache_put_source(const Source *src);
+
+/// Remove an event from the cache.
+///
+/// @param[in] id  Id of the event.
+void event_cache_remove(uint64_t id);
+
+/// Remove every event from the cache, keeping its counters.
+void event_cache_clear(void);
+
+/// Read the counters of the cache.
+///
+/// @param[out] stats  Address to write the counters into.
+void event_cache_stats(EventCacheStats *stats);
@@ -0,0 +1,118 @@
+/// @file event_compress.c
+///
+/// Definitions for the compression codecs of event data.
+///
+/// Both libraries take int or size_t lengths and plain buffers; everything
+/// here only adapts lengths and return conventions. LZ4 writes raw blocks,
+/// which do not record their decompressed length, so the length always comes
+/// from the event header.
+///
+/// Potentially helpful documentation:
+///   https://github.com/lz4/lz4/blob/dev/lib/lz4.h
+///   https://facebook.github.io/zstd/zstd_manual.html
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef WITH_LZ4
+#include <lz4.h>
+#endif
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
+
+#include "event_compress.h"
+
+//==============================================================================
+// Functions
+//==============================================================================
+
+bool compression_available(uint8_t algorithm) {
+  switch (algorithm) {
+#ifdef WITH_LZ4
+  case COMPRESSION_LZ4:
+    return true;
+#endif
+#ifdef WITH_ZSTD
+  case COMPRESSION_ZSTD:
+    return true;
+#endif
+  default:
+    return false;
+  }
+}
+
+int compress_data(uint8_t algorithm, uint8_t level, const uint8_t *src,
+                  uint64_t src_length, uint8_t *dst, uint64_t dst_capacity,
+                  uint64_t *dst_length) {
+  switch (algorithm) {
+#ifdef WITH_LZ4
+  case COMPRESSION_LZ4: {
+    int length;
+
+    if (src_length > LZ4_MAX_INPUT_SIZE)
+      return -1;
+    if (dst_capacity > INT32_MAX)
+      dst_capacity = INT32_MAX;
+
+    // Nothing is written if the data does not fit
+    if (!(length = LZ4_compress_fast((const char *)src, (char *)dst,
+                                     (int)src_length, (int)dst_capacity,
+                                     (level ? level : 1))))
+      return -1;
+
+    *dst_length = (uint64_t)length;
+    return 0;
+  }
+#endif
+#ifdef WITH_ZSTD
+  case COMPRESSION_ZSTD: {
+    size_t length = ZSTD_compress(dst, dst_capacity, src, src_length, level);
+
+    if (ZSTD_isError(length))
+      return -1;
+
+    *dst_length = length;
+    return 0;
+  }
+#endif
+  default:
+    (void)level;
+    (void)src;
+    (void)src_length;
+    (void)dst;
+    (void)dst_capacity;
+    (void)dst_length;
+    return -1;
+  }
+}
+
+int decompress_data(uint8_t algorithm, const uint8_t *src, uint64_t src_length,
+                    uint8_t *dst, uint64_t dst_length) {
+  switch (algorithm) {
+#ifdef WITH_LZ4
+  case COMPRESSION_LZ4:
+    if ((src_length > INT32_MAX) || (dst_length > LZ4_MAX_INPUT_SIZE))
+      return -1;
+
+    // The data must fill the event exactly
+    return (LZ4_decompress_safe((const char *)src, (char *)dst,
+                                (int)src_length, (int)dst_length) ==
+            (int)dst_length)
+               ? 0
+               : -1;
+#endif
+#ifdef WITH_ZSTD
+  case COMPRESSION_ZSTD:
+    return (ZSTD_decompress(dst, dst_length, src, src_length) == dst_length)
+               ? 0
+               : -1;
+#endif
+  default:
+    (void)src;
+    (void)src_length;
+    (void)dst;
+    (void)dst_length;
+    return -1;
+  }
+}
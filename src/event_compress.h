@@ -0,0 +1,63 @@
+/// @file event_compress.h
+///
+/// Declarations for the compression codecs of event data.
+///
+/// Each codec is only built in if its library is: LZ4 with `make LZ4=1`, Zstd
+/// with `make ZSTD=1`. Events compressed with a codec that is not built in
+/// cannot be read back, so every process sharing a log should be built with
+/// the codecs its writers use.
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define COMPRESSION_NONE 0
+#define COMPRESSION_LZ4 1
+#define COMPRESSION_ZSTD 2
+#define MAX_COMPRESSION COMPRESSION_ZSTD
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Check whether a compression algorithm is built in.
+///
+/// @param[in] algorithm  The algorithm (COMPRESSION_*).
+///
+/// @return  Whether data can be compressed and decompressed with it.
+bool compression_available(uint8_t algorithm);
+
+/// Compress data into a buffer, which fails if the compressed data does not
+/// fit. A buffer smaller than the data thus only takes data that shrinks.
+///
+/// @param[in]  algorithm     The algorithm (COMPRESSION_LZ4 or
+///                           COMPRESSION_ZSTD).
+/// @param[in]  level         Zstd compression level, or LZ4 acceleration (0
+///                           for the default of the algorithm).
+/// @param[in]  src           Handle for the data.
+/// @param[in]  src_length    Length of the data in bytes.
+/// @param[out] dst           Pointer to the buffer to output the compressed
+///                           data.
+/// @param[in]  dst_capacity  Length of the buffer in bytes.
+/// @param[out] dst_length    Address to write the length of the compressed
+///                           data into.
+///
+/// @return  0  Success.
+/// @return -1  Failure (algorithm not built in, or data did not fit).
+int compress_data(uint8_t algorithm, uint8_t level, const uint8_t *src,
+                  uint64_t src_length, uint8_t *dst, uint64_t dst_capacity,
+                  uint64_t *dst_length);
+
+/// Decompress data of a known decompressed length.
+///
+/// @param[in]  algorithm   The algorithm the data was compressed with.
+/// @param[in]  src         Handle for the compressed data.
+/// @param[in]  src_length  Length of the compressed data in bytes.
+/// @param[out] dst         Pointer to the buffer to output the data.
+/// @param[in]  dst_length  Length of the decompressed data in bytes.
+///
+/// @return  0  Success.
+/// @return -1  Failure (algorithm not built in, or malformed data).
+int decompress_data(uint8_t algorithm, const uint8_t *src, uint64_t src_length,
+                    uint8_t *dst, uint64_t dst_length);
@@ -8,28 +8,101 @@
 
 #include <assert.h>
 #include <foundationdb/fdb_c.h>
+#include <inttypes.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <threads.h>
+#include <time.h>
 
 #include "constants.h"
+#include "event_cache.h"
+#include "event_compress.h"
 #include "fdb.h"
+#include "fdb_internal.h"
 
 // Approximate maximum number of range clears that fit in a FoundationDB
 // transaction
 #define CLEAR_BATCH_SIZE 75000
 
+// Number of packed block lookups a clear of an event array keeps in flight
+#define CLEAR_LOOKUP_DEPTH 1000
+
+// First byte of idempotency marker keys, which live outside of the event
+// keyspace: 0x01 | nonce (8 bytes) | batch (4 bytes)
+#define MARKER_KEY_PREFIX 0x01
+
+// First byte of the event keys of bucket 0 in the bucketed key layout; bucket b
+// uses BUCKET_KEY_PREFIX + b. The unbucketed layout uses 0x00.
+#define BUCKET_KEY_PREFIX 0x40
+
+// First byte of the event keys in the compact key format, unbucketed and of
+// bucket 0
+#define COMPACT_KEY_PREFIX 0x02
+#define COMPACT_BUCKET_KEY_PREFIX 0x80
+
+// Largest values of the one, two and three byte ordered varints
+#define ORDERED_VARINT_MAX_1 240
+#define ORDERED_VARINT_MAX_2 2287
+#define ORDERED_VARINT_MAX_3 67823
+
+//==============================================================================
+// Types
+//==============================================================================
+
+/// Start of the batch committing in a slot of the pipelined array writer, kept
+/// so that the batch can be rebuilt for a retry.
+typedef struct event_array_batch_t {
+  const FragmentedEventSource *f_events; // Array of event sources.
+  uint32_t num_events;                   // Number of events in the array.
+  uint32_t event_pos;                    // First event in the batch.
+  uint32_t frag_pos;                     // First fragment in that event.
+  uint32_t num_fragments;                // Fragments in the batch.
+  uint32_t num_completed;                // Events whose last fragment is in
+                                         // the batch.
+} EventArrayBatch;
+
+/// Batch of fragments of a single event committing in a slot of the staged
+/// writer, kept so that the batch can be rebuilt for a retry.
+typedef struct source_batch_t {
+  const Source *src;      // Event source.
+  uint32_t frag_pos;      // First fragment in the batch.
+  uint32_t num_fragments; // Fragments in the batch.
+} SourceBatch;
+
+/// Recent read version handed to new read transactions, saving each of them
+/// the round trip to get one.
+typedef struct read_version_cache_t {
+  pthread_mutex_t lock;
+  int64_t version;            // Cached read version, 0 if none.
+  struct timespec at;         // Time at which the version was known current.
+  FDBTransaction *refresh_tx; // Transaction of the refresh in flight, or NULL.
+  struct timespec refresh_at; // Time at which the refresh was requested.
+} ReadVersionCache;
+
 //==============================================================================
 // Variables
 //==============================================================================
 
 FDBDatabase *fdb_database;
 pthread_t fdb_network_thread;
-uint32_t fdb_batch_size = 1;
+uint32_t fdb_batch_size = 0;
+uint32_t fdb_batch_bytes = DEFAULT_BATCH_BYTES;
+uint32_t fdb_fragment_size = OPTIMAL_VALUE_SIZE;
+uint32_t fdb_key_buckets = 1;
+uint8_t fdb_key_format = FDB_KEY_FORMAT_FIXED;
+uint32_t fdb_pack_bytes = 0;
+uint32_t fdb_window_size = DEFAULT_WINDOW_SIZE;
+uint32_t fdb_retry_limit = DEFAULT_RETRY_LIMIT;
+uint32_t fdb_retry_timeout_ms = DEFAULT_RETRY_TIMEOUT_MS;
+uint32_t fdb_read_version_max_age_ms = 0;
+ReadVersionCache read_version_cache = {PTHREAD_MUTEX_INITIALIZER, 0, {0, 0},
+                                       NULL, {0, 0}};
 
 //==============================================================================
 // Prototypes
@@ -39,25 +112,334 @@ uint32_t fdb_batch_size = 1;
 /// in a separate process.
 void *network_thread_func(void *arg);
 
-/// Add a limited number of write operations for the fragments of an event to a
-/// FoundationDB transaction.
+/// Add write operations for the next batch of fragments from an array of
+/// events to a FoundationDB transaction. The batch ends at the byte budget, at
+/// the fragment cap, or at the end of the array.
 ///
-/// @param[in] tx         FoundationDB transaction handle.
-/// @param[in] event      Fragmented event handle.
-/// @param[in] start_pos  Starting position in fragment array to write from.
-/// @param[in] limit      Absolute limit on the number of fragments to write.
+/// @param[in]     tx          FoundationDB transaction handle.
+/// @param[in]     f_events    Array of event sources.
+/// @param[in]     num_events  Number of events in the array.
+/// @param[in,out] event_pos   Position of the next event to write.
+/// @param[in,out] frag_pos    Position of the next fragment to write in that
+///                            event.
 ///
 /// @return   Number of event fragments added to transaction.
-uint32_t add_event_set_transactions(FDBTransaction *tx, const Source *event,
-                                    uint32_t start_pos, uint32_t limit);
+uint32_t add_event_array_set_transactions(FDBTransaction *tx,
+                                          const FragmentedEventSource f_events[],
+                                          uint32_t num_events,
+                                          uint32_t *event_pos,
+                                          uint32_t *frag_pos);
+
+/// Count the events at the front of an array that may share a packed block:
+/// single-fragment events with consecutive ids, up to MAX_PACKED_EVENTS of
+/// them and the block size (see fdb_set_pack_bytes()).
+///
+/// @param[in] f_events    Array of event sources.
+/// @param[in] num_events  Number of events in the array.
+///
+/// @return   Number of events to pack, or 0 if packing is off.
+uint32_t count_packable_events(const FragmentedEventSource f_events[],
+                               uint32_t num_events);
+
+/// Add a write operation for a packed block of events to a FoundationDB
+/// transaction, unless it would take the transaction over the byte budget.
+///
+/// @param[in]     tx           FoundationDB transaction handle.
+/// @param[in]     f_events     Array of the events to pack.
+/// @param[in]     num_events   Number of events in the array (between 2 and
+///                             MAX_PACKED_EVENTS).
+/// @param[in,out] batch_bytes  Key and value bytes already in the transaction.
+///
+/// @return   Number of key-value pairs added to transaction (0 or 1).
+uint32_t add_packed_event_set_transaction(FDBTransaction *tx,
+                                          const FragmentedEventSource f_events[],
+                                          uint32_t num_events,
+                                          uint32_t *batch_bytes);
+
+/// Offer a read version to the cache, which keeps the most recent one.
+///
+/// @param[in] version  Read version.
+/// @param[in] at       Time at which the version was known current.
+void cache_read_version(int64_t version, const struct timespec *at);
+
+/// Offer the version of a successful commit to the read version cache, so
+/// that reads from the cache see the writes of this process.
+///
+/// @param[in] tx  Handle for the committed transaction.
+void cache_committed_version(FDBTransaction *tx);
+
+/// Start getting a new read version for the cache in the background, unless a
+/// refresh is already in flight.
+void refresh_read_version(void);
+
+/// Callback function for when the read version of a cache refresh arrives.
+///
+/// @param[in] future  Handle for the FoundationDB future.
+/// @param[in] param   Unused.
+void read_version_callback(FDBFuture *future, void *param);
+
+/// Callback function for when a pipelined commit completes. Retries the commit
+/// if possible, otherwise completes the slot.
+///
+/// @param[in] future  Handle for the FoundationDB future.
+/// @param[in] param   Handle for the FDBPipelineSlot object.
+void pipeline_commit_callback(FDBFuture *future, void *param);
+
+/// Callback function for when FoundationDB is ready for a pipelined commit to
+/// be retried. Rebuilds the writes of the slot and commits them again.
+///
+/// @param[in] future  Handle for the FoundationDB future.
+/// @param[in] param   Handle for the FDBPipelineSlot object.
+void pipeline_retry_callback(FDBFuture *future, void *param);
+
+/// Run the commit hook of a pipeline slot, then return the slot to the window
+/// and wake the producer.
+///
+/// @param[in] slot  Handle for the slot.
+/// @param[in] err   FoundationDB error code of the commit.
+void pipeline_complete(FDBPipelineSlot *slot, fdb_error_t err);
+
+/// Generate a nonce identifying the markers of one multi-transaction write.
+///
+/// @return  A nonce unique among concurrent writes.
+uint64_t new_write_nonce(void);
+
+/// Build the key of the idempotency marker for one batch of a write.
+///
+/// @param[out] key    Buffer of FDB_KEY_TOTAL_LENGTH bytes for the key, which
+///                    is always in the fixed key format.
+/// @param[in]  nonce  Nonce of the write.
+/// @param[in]  batch  Position of the batch in the write.
+void build_marker_key(uint8_t *key, uint64_t nonce, uint32_t batch);
+
+/// Add the idempotency marker operation for one batch of a write to a
+/// FoundationDB transaction. Every batch but the last sets its own marker; the
+/// last batch clears the markers of all batches before it, leaving nothing
+/// behind once the write completes.
+///
+/// @param[in] tx       FoundationDB transaction handle.
+/// @param[in] nonce    Nonce of the write.
+/// @param[in] batch    Position of the batch in the write.
+/// @param[in] last_id  Id of the last event in the batch.
+/// @param[in] final    Whether this is the last batch of the write.
+void add_marker_transaction(FDBTransaction *tx, uint64_t nonce, uint32_t batch,
+                            uint64_t last_id, bool final);
+
+/// Clear the idempotency markers of a failed write, up to the batch that
+/// failed, in a single commit attempt. Nothing else knows the nonce, so
+/// markers this misses are only removed by fdb_clear_write_markers().
+///
+/// @param[in] tx     FoundationDB transaction handle.
+/// @param[in] nonce  Nonce of the write.
+/// @param[in] batch  Position of the batch that failed.
+void clear_write_markers(FDBTransaction *tx, uint64_t nonce, uint32_t batch);
+
+/// Check with a point read whether a batch whose commit result is unknown was
+/// applied. The read stays in the transaction, so resending the batch
+/// conflicts with a late commit of the original.
+///
+/// @param[in] tx     FoundationDB transaction handle, reset for a retry.
+/// @param[in] nonce  Nonce of the write.
+/// @param[in] batch  Position of the batch in the write.
+/// @param[in] final  Whether this is the last batch of the write.
+///
+/// @return  true if the batch is known to be durable.
+bool batch_committed(FDBTransaction *tx, uint64_t nonce, uint32_t batch,
+                     bool final);
+
+/// Pipeline commit hook of the pipelined array writer: add a committed batch
+/// to the progress counters.
+///
+/// @param[in] slot  Handle for the slot whose commit completed.
+/// @param[in] err   FoundationDB error code of the commit.
+void count_event_array_batch(FDBPipelineSlot *slot, fdb_error_t err);
+
+/// Pipeline refill hook of the pipelined array writer: add the writes of the
+/// batch starting at the position recorded in the slot.
+///
+/// @param[in] slot  Handle for the slot.
+void refill_event_array_batch(FDBPipelineSlot *slot);
+
+/// Wait for a particular slot of a pipeline to be free and prepare its
+/// transaction for writes. Taking slots in turn keeps commits in flight to the
+/// last window size of batches, even when they complete out of order.
+///
+/// @param[in] pipeline  Handle for the pipeline.
+/// @param[in] slot      Handle for the slot to take.
+///
+/// @return  Handle for the slot, or NULL if an earlier commit failed.
+FDBPipelineSlot *pipeline_acquire_slot(FDBPipeline *pipeline,
+                                       FDBPipelineSlot *slot);
+
+/// Write an event in two steps: stage every fragment but the first through a
+/// pipeline, then commit the first fragment, whose key carries the header, in
+/// one small transaction. The event only becomes visible to readers with that
+/// last commit, so a write that fails midway never exposes a partial event.
+///
+/// @param[in] src         Handle for the event source.
+/// @param[in] head        Data of the first fragment.
+/// @param[in] pull_error  Handle for the pull error flag of a streaming
+///                        source, or NULL.
+///
+/// @return  0  Success
+/// @return -1  Failure
+int write_event_staged(const Source *src, const uint8_t *head,
+                       const int *pull_error);
+
+/// Maximum number of fragments of an event staged in one transaction: at most
+/// one short prefix plus whole fragments up to the byte budget, and no more
+/// than the fragment cap.
+///
+/// @param[in] src  Handle for the event source.
+///
+/// @return  Number of fragments.
+uint32_t staged_batch_fragments(const Source *src);
+
+/// Pipeline refill hook of the staged writer: add the writes of the batch
+/// recorded in the slot again.
+///
+/// @param[in] slot  Handle for the slot.
+void refill_source_batch(FDBPipelineSlot *slot);
+
+/// Read every event with an id in [first_id, last_id) with range reads,
+/// splitting the key-value pairs into events as they arrive.
+///
+/// @param[in]  first_id  Id of the first event in the range.
+/// @param[in]  last_id   Id after the last event in the range.
+/// @param[in]  borrow    Whether single-fragment events may point into the
+///                       futures holding them, rather than be copied.
+/// @param[out] batch     Handle for the batch to read into. Without borrowing,
+///                       only its events are set, and every event owns its
+///                       data.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int read_event_batch(uint64_t first_id, uint64_t last_id, bool borrow,
+                     FDBEventBatch *batch);
+
+/// Make room for one more element at the end of a heap array whose capacity
+/// follows from its length: 64 elements, doubling at every power of two.
+///
+/// @param[in] array         Address of the array, which may be NULL.
+/// @param[in] length        Number of elements in the array.
+/// @param[in] element_size  Size of one element in bytes.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int reserve_array(void **array, uint32_t length, size_t element_size);
+
+/// Build a key in the fixed key format: the prefix byte, then the id and the
+/// fragment number big-endian.
+///
+/// @param[in] fdb_key   Pointer to the write location for the FoundationDB key.
+/// @param[in] prefix    The prefix byte.
+/// @param[in] id        The event id.
+/// @param[in] fragment  The fragment number.
+void build_fixed_key(uint8_t *fdb_key, uint8_t prefix, uint64_t id,
+                     uint32_t fragment);
+
+/// Write an integer as an ordered varint: 1 to 9 bytes that compare like the
+/// integers they encode. Up to 240 takes one byte, up to 2287 two, up to 67823
+/// three; beyond that, a byte of 250 to 255 gives the number of big-endian
+/// bytes (3 to 8) that follow.
+///
+/// @param[in] out    Pointer to the write location, of at least 9 bytes.
+/// @param[in] value  The integer.
+///
+/// @return  Number of bytes written.
+uint8_t write_ordered_varint(uint8_t *out, uint64_t value);
+
+/// Read an ordered varint written by write_ordered_varint().
+///
+/// @param[in]  in      Pointer to the varint.
+/// @param[in]  length  Number of bytes available.
+/// @param[out] value   Address to write the integer into.
+///
+/// @return  Number of bytes read, or 0 if the varint is truncated or not in
+///          its shortest form.
+uint8_t read_ordered_varint(const uint8_t *in, int length, uint64_t *value);
+
+/// First byte of the event keys of a key bucket.
+///
+/// @param[in] bucket  The key bucket.
+///
+/// @return  The key prefix of the bucket.
+uint8_t bucket_key_prefix(uint32_t bucket);
+
+/// Compare two events by id, for qsort().
+///
+/// @param[in] a  Handle for the first event.
+/// @param[in] b  Handle for the second event.
+///
+/// @return  Negative, zero or positive as the first id is lower, equal or
+///          higher.
+int compare_event_ids(const void *a, const void *b);
+
+/// Start reading the last key up to the first fragment of an event: either
+/// that fragment, or the key of a packed block that may hold the event.
+///
+/// @param[in] tx  FoundationDB transaction handle.
+/// @param[in] id  Event id.
+///
+/// @return  Handle for the future of the read.
+FDBFuture *get_event_head(FDBTransaction *tx, uint64_t id);
+
+/// Wait for a read started by get_event_head(), and find the packed block
+/// holding the event, if any.
+///
+/// @param[in]  future   Handle for the future of the read.
+/// @param[in]  id       Event id.
+/// @param[out] head_id  Address to write the id of the first event of the
+///                      block into, or the event id if it is not packed.
+/// @param[out] num_ids  Address to write the number of events in the block
+///                      into, or 1 if the event is not packed.
+///
+/// @return  FoundationDB error code (0 on success).
+fdb_error_t read_event_head(FDBFuture *future, uint64_t id, uint64_t *head_id,
+                            uint32_t *num_ids);
+
+/// Add clear operations for an array of events to a FoundationDB transaction,
+/// after looking up the packed block of each one. An event at the head of a
+/// block is cleared with its block, and the rest of the block goes with it; an
+/// event packed into the block of an event not cleared before it is refused.
+///
+/// @param[in]  tx           FoundationDB transaction handle.
+/// @param[in]  events       Array of events to clear.
+/// @param[in]  num_events   Number of events in the array.
+/// @param[out] num_cleared  Array to write the number of ids cleared from the
+///                          id of each event on into.
+/// @param[out] refused      Address to write the position of the first event
+///                          refused into, or num_events if there is none.
+///
+/// @return  FoundationDB error code (0 on success).
+fdb_error_t add_event_array_clear_transactions(
+    FDBTransaction *tx, const FragmentedEventSource events[],
+    uint32_t num_events, uint32_t *num_cleared, uint32_t *refused);
 
-/// Add a clear operation for all fragments of an event to a FoundationDB
-/// transaction.
+/// Decompress the event gathered by an assembler and hand it over, as
+/// assemble_fragment() does with a complete event.
+///
+/// @param[in]  as     Handle for the assembler, holding the compressed data.
+/// @param[in]  arena  Arena to take the data of the event from, or NULL for
+///                    the heap.
+/// @param[out] event  Address to move the event into.
+///
+/// @return  1  The event was moved out of the assembler.
+/// @return -1  Failure (malformed data, or out of memory).
+int inflate_event(EventAssembler *as, EventArena *arena, Event *event);
+
+/// Hand over the next event of the packed block being read, as
+/// assemble_fragment() does.
+///
+/// @param[in]  as     Handle for the assembler.
+/// @param[in]  kv     Key-value pair of the packed block.
+/// @param[in]  arena  Arena to take the data of the event from, or NULL for
+///                    the heap.
+/// @param[out] event  Address to move the event into.
 ///
-/// @param[in] tx                FoundationDB transaction handle.
-/// @param[in] id                Event id.
-/// @param[in] num_fragments
-void add_event_clear_transaction(FDBTransaction *tx, uint64_t id, uint32_t num_fragments);
+/// @return  Result as for assemble_fragment().
+int unpack_next_event(EventAssembler *as, const FDBKeyValue *kv,
+                      EventArena *arena, Event *event);
 
 /// Check if a FoundationDB API command returned an error. If so, print the
 /// error description and exit.
@@ -125,11 +507,127 @@ int fdb_shutdown_network_thread(void) {
 }
 
 int fdb_set_batch_size(uint32_t batch_size) {
-  if (!batch_size)
+  fdb_batch_size = batch_size;
+  return 0;
+}
+
+int fdb_set_batch_bytes(uint32_t batch_bytes) {
+  if (!batch_bytes || (batch_bytes > MAX_BATCH_BYTES))
     return -1;
 
-  fdb_batch_size = batch_size;
+  fdb_batch_bytes = batch_bytes;
+  return 0;
+}
+
+int fdb_set_fragment_size(uint32_t fragment_size) {
+  if (!fragment_size || (fragment_size > MAX_VALUE_SIZE))
+    return -1;
+
+  fdb_fragment_size = fragment_size;
+  return 0;
+}
+
+int fdb_set_key_buckets(uint32_t num_buckets) {
+  if (!num_buckets || (num_buckets > MAX_KEY_BUCKETS))
+    return -1;
+
+  fdb_key_buckets = num_buckets;
+  return 0;
+}
+
+int fdb_set_key_format(uint8_t key_format) {
+  if ((key_format != FDB_KEY_FORMAT_FIXED) &&
+      (key_format != FDB_KEY_FORMAT_COMPACT))
+    return -1;
+
+  fdb_key_format = key_format;
+  return 0;
+}
+
+int fdb_set_pack_bytes(uint32_t pack_bytes) {
+  if (pack_bytes > OPTIMAL_VALUE_SIZE)
+    return -1;
+
+  fdb_pack_bytes = pack_bytes;
+  return 0;
+}
+
+int fdb_set_window_size(uint32_t window_size) {
+  if (!window_size)
+    return -1;
+
+  fdb_window_size = window_size;
+  return 0;
+}
+
+int fdb_set_retry_limit(uint32_t retry_limit) {
+  fdb_retry_limit = retry_limit;
+  return 0;
+}
+
+int fdb_set_retry_timeout(uint32_t timeout_ms) {
+  if (!timeout_ms)
+    return -1;
+
+  fdb_retry_timeout_ms = timeout_ms;
+  return 0;
+}
+
+int fdb_set_read_version_cache(uint32_t max_age_ms) {
+  // A cached version must leave the read most of its lifetime
+  if (max_age_ms >= READ_TX_MAX_AGE_MS)
+    return -1;
+
+  pthread_mutex_lock(&read_version_cache.lock);
+  fdb_read_version_max_age_ms = max_age_ms;
+  if (!max_age_ms)
+    read_version_cache.version = 0;
+  pthread_mutex_unlock(&read_version_cache.lock);
+
+  return 0;
+}
+
+void fdb_retry_init(FDBRetry *retry) {
+  retry->attempts = 0;
+  retry->backoff_us = RETRY_BACKOFF_MIN_US;
+  timespec_get(&retry->start, TIME_UTC);
+
+  // Each retry state draws its own delays, so that concurrent transactions
+  // neither share nor race on a generator. Xorshift needs a non-zero seed.
+  retry->jitter = (uint32_t)retry->start.tv_nsec ^ (uint32_t)(uintptr_t)retry;
+  if (!retry->jitter)
+    retry->jitter = 1;
+}
+
+int fdb_retry_on_error(FDBTransaction *tx, fdb_error_t err, FDBRetry *retry) {
+  FDBFuture *future;
+  uint32_t delay_us;
+
+  // Give up on errors that a retry cannot fix, and once out of budget
+  if (!retry_allowed(retry, err))
+    goto retry_fail;
+
+  // Let FoundationDB reset the transaction and apply its own backoff
+  future = fdb_transaction_on_error(tx, err);
+  if (!(err = fdb_future_block_until_ready(future)))
+    err = fdb_future_get_error(future);
+  fdb_future_destroy(future);
+  if (err)
+    goto retry_fail;
+
+  // Spread out clients that failed at the same time
+  delay_us = retry_next_delay(retry);
+  thrd_sleep(&(struct timespec){.tv_sec = delay_us / 1000000,
+                                .tv_nsec = (delay_us % 1000000) * 1000},
+             NULL);
+
+  // Success
   return 0;
+
+// Failure
+retry_fail:
+  fdb_check_error(err);
+  return -1;
 }
 
 int fdb_setup_transaction(FDBTransaction **tx) {
@@ -145,20 +643,10 @@ int fdb_setup_transaction(FDBTransaction **tx) {
 }
 
 int fdb_send_transaction(FDBTransaction *tx) {
-  // Commit event batch transaction
-  FDBFuture *future = fdb_transaction_commit(tx);
-
-  // Wait for the future to be ready
-  if (fdb_check_error(fdb_future_block_until_ready(future)))
-    goto tx_fail;
-
-  // Check that the future did not return any errors
-  if (fdb_check_error(fdb_future_get_error(future)))
+  // Commit event batch transaction and wait for the result
+  if (fdb_check_error(commit_transaction(tx)))
     goto tx_fail;
 
-  // Destroy the future
-  fdb_future_destroy(future);
-
   // Delete existing transaction object and create a new one
   fdb_transaction_reset(tx);
 
@@ -172,17 +660,26 @@ tx_fail:
 
 int fdb_write_batch(const Source *event, uint32_t *pos) {
   FDBTransaction *tx;
+  FDBRetry retry;
+  fdb_error_t err;
   uint32_t num_out;
 
   // Initialize transaction
   if (fdb_check_error(fdb_setup_transaction(&tx)))
-    goto tx_fail;
+    return -1;
+
+  // Add write events to transaction and attempt to apply it, adding them
+  // again for every retry
+  fdb_retry_init(&retry);
+  do {
+    uint32_t batch_bytes = 0;
 
-  // Add write events to transaction
-  num_out = add_event_set_transactions(tx, event, *pos, fdb_batch_size);
+    num_out = add_event_set_transactions(tx, event, *pos,
+                                         batch_fragment_limit(), &batch_bytes);
+  } while ((err = commit_transaction(tx)) &&
+           !fdb_retry_on_error(tx, err, &retry));
 
-  // Attempt to apply the transaction
-  if (fdb_check_error(fdb_send_transaction(tx)))
+  if (err)
     goto tx_fail;
 
   // Clean up the transaction
@@ -194,40 +691,52 @@ int fdb_write_batch(const Source *event, uint32_t *pos) {
 
 // Failure
 tx_fail:
+  fdb_transaction_destroy(tx);
   return -1;
 }
 
 int fdb_write_event(const Source *event) {
   FDBTransaction *tx;
-  uint32_t i = 0;
+  FDBRetry retry;
+  fdb_error_t err;
+
+  // An event larger than one transaction is staged, then made visible at once
+  if ((event_set_bytes(event) > fdb_batch_bytes) ||
+      (es_num_fragments(event) > batch_fragment_limit())) {
+    if (write_event_staged(event, es_fragment_data(event, 0), NULL))
+      return -1;
+
+    event_cache_put_source(event);
+    return 0;
+  }
 
   // Initialize transaction
   if (fdb_check_error(fdb_setup_transaction(&tx)))
-    goto tx_fail;
+    return -1;
 
-  // Write event fragments in maximal batches
-  while (i < es_num_fragments(event)) {
-    i += add_event_set_transactions(tx, event, i, fdb_batch_size);
+  // Write every fragment in a single transaction
+  fdb_retry_init(&retry);
+  do {
+    uint32_t batch_bytes = 0;
 
-    if (fdb_check_error(fdb_send_transaction(tx)))
-      goto tx_fail;
-  }
+    add_event_set_transactions(tx, event, 0, UINT32_MAX, &batch_bytes);
+  } while ((err = commit_transaction(tx)) &&
+           !fdb_retry_on_error(tx, err, &retry));
 
   // Clean up the transaction
   fdb_transaction_destroy(tx);
 
-  // Success
-  return 0;
+  if (err)
+    return -1;
 
-// Failure
-tx_fail:
-  return -1;
+  event_cache_put_source(event);
+  return 0;
 }
 
 int fdb_write_event_array(Event events[], uint32_t num_events) {
   FragmentedEventSource *f_events = malloc(sizeof(FragmentedEventSource) * num_events);
   for (uint32_t i = 0; i < num_events; i++)
-    init_fragmented_event_source(&f_events[i], &events[i], OPTIMAL_VALUE_SIZE);
+    init_fragmented_event_source(&f_events[i], &events[i], fdb_fragment_size);
 
   int err = fdb_write_fragmented_event_array(f_events, num_events);
   for (uint32_t i = 0; i < num_events; i++)
@@ -241,256 +750,778 @@ int fdb_write_event_array(Event events[], uint32_t num_events) {
 int fdb_write_fragmented_event_array(const FragmentedEventSource f_events[],
                                      uint32_t num_events) {
   FDBTransaction *tx;
-  uint32_t batch_filled = 0;
+  FDBRetry retry;
+  fdb_error_t err;
+  uint64_t nonce = new_write_nonce();
   uint32_t frag_pos = 0;
+  uint32_t batch = 0;
   uint32_t i = 0;
 
   // Initialize transaction
   if (fdb_check_error(fdb_setup_transaction(&tx)))
-    goto tx_fail;
+    return -1;
 
-  // For each event
-  while (i < num_events) {
-    // Add as many unwritten fragments from the current event as possible
-    // (method differs slightly depending on whether there are already other
-    // fragments in the batch)
-    if (!batch_filled) {
-      batch_filled = add_event_set_transactions(tx, &f_events[i].src, frag_pos,
-                                                fdb_batch_size);
-      frag_pos += batch_filled;
-    } else {
-      uint32_t num_kvp = add_event_set_transactions(
-          tx, &f_events[i].src, frag_pos, (fdb_batch_size - batch_filled));
-      batch_filled += num_kvp;
-      frag_pos += num_kvp;
-    }
+  // Fill and apply one batch at a time until every event is written
+  for (; i < num_events; ++batch) {
+    uint32_t batch_event_pos = i;
+    uint32_t batch_frag_pos = frag_pos;
 
-    // Increment event counter when all fragments from an event have been
-    // written
-    if (frag_pos == es_num_fragments(&f_events[i].src)) {
-      i += 1;
-      frag_pos = 0;
-    }
+    // A retry rebuilds the same batch from its starting position
+    fdb_retry_init(&retry);
+    for (;;) {
+      bool final;
+
+      i = batch_event_pos;
+      frag_pos = batch_frag_pos;
+      add_event_array_set_transactions(tx, f_events, num_events, &i, &frag_pos);
+
+      final = (i == num_events);
+      add_marker_transaction(tx, nonce, batch,
+                             f_events[frag_pos ? i : (i - 1)].src.event.id,
+                             final);
 
-    // Attempt to apply transaction when batch is filled
-    if (batch_filled == fdb_batch_size) {
-      if (fdb_check_error(fdb_send_transaction(tx)))
+      if (!(err = commit_transaction(tx)))
+        break;
+      if (fdb_retry_on_error(tx, err, &retry))
         goto tx_fail;
 
-      batch_filled = 0;
+      // Skip the resend if the marker shows the batch landed after all
+      if (fdb_error_predicate(FDB_ERROR_PREDICATE_MAYBE_COMMITTED, err) &&
+          batch_committed(tx, nonce, batch, final))
+        break;
     }
-  }
 
-  // Catch the final, non-full batch
-  if (fdb_check_error(fdb_send_transaction(tx)))
-    goto tx_fail;
+    fdb_transaction_reset(tx);
+  }
 
   // Clean up the transaction
   fdb_transaction_destroy(tx);
 
+  for (i = 0; i < num_events; ++i)
+    event_cache_put_source(&f_events[i].src);
+
   // Success
   return 0;
 
 // Failure
 tx_fail:
+  clear_write_markers(tx, nonce, batch);
+  fdb_transaction_destroy(tx);
   return -1;
 }
 
-// With range reads, it's possible to remove headers completely from stored
-// event fragments. If the layout of a typical Urbit event log is many, many
-// very small events, then this could be a good way to save storage space.
-// Alternatively, the larger events are, the more inefficient and meaningless
-// this idea becomes.
-//
-// Potential pros:
-//  - Save 13 bytes per event
-//
-// Potential cons:
-//  - Uses up to twice as much memory when reading back events
-//  - Might actually be more complicated, several concurrent processes fetching
-//  additional data from FDB and writing
-//    the data already available to the correct memory location
-//
-int fdb_read_event(Event *event) {
-  FDBFuture *future;
-  FDBTransaction *tx;
-  const FDBKeyValue *out_kv;
-  fdb_bool_t out_more;
-  int32_t out_count;
-  uint32_t out_counted = 0;
-  uint32_t num_fragments = 0;
-  uint16_t prefix_length = 0;
-  uint8_t range_start_key[FDB_KEY_TOTAL_LENGTH];
-  uint8_t range_end_key[FDB_KEY_TOTAL_LENGTH];
+int fdb_write_fragmented_event_array_pipelined(
+    const FragmentedEventSource f_events[], uint32_t num_events) {
+  return write_event_array_pipelined(f_events, num_events, NULL);
+}
 
-  // Setup keys for range read
-  fdb_build_event_key(range_start_key, event->id, 0);
-  fdb_build_event_key(range_end_key, (event->id + 1), 0);
+int write_event_array_pipelined(const FragmentedEventSource f_events[],
+                                uint32_t num_events,
+                                FDBWriteProgress *progress) {
+  FDBPipeline pipeline;
+  FDBPipelineSlot *slot;
+  EventArrayBatch *batches;
+  uint32_t frag_pos = 0;
+  uint32_t i = 0;
 
-  // Setup transaction
-  if (fdb_check_error(fdb_setup_transaction(&tx))) {
+  if (fdb_pipeline_init(&pipeline, fdb_window_size))
+    return -1;
+
+  // Each slot remembers where its batch starts, so that a failed commit can
+  // rebuild the batch and retry
+  batches = malloc(sizeof(EventArrayBatch) * pipeline.window_size);
+  if (!batches) {
+    fdb_pipeline_destroy(&pipeline);
     return -1;
   }
+  pipeline.refill = &refill_event_array_batch;
+  if (progress) {
+    pipeline.on_commit = &count_event_array_batch;
+    pipeline.hook_param = progress;
+  }
 
-  // Loop until FoundationDB says there is no more data
-  do {
-    out_more = 0;
-
-    // Read data range
-    future = fdb_transaction_get_range(
-        tx, range_start_key, FDB_KEY_TOTAL_LENGTH, 0, (out_counted + 1),
-        range_end_key, FDB_KEY_TOTAL_LENGTH, 0, 1, 0, 0,
-        FDB_STREAMING_MODE_WANT_ALL, 0, 0, 0);
-    if (fdb_check_error(fdb_future_block_until_ready(future)))
-      goto tx_fail;
-    if (fdb_check_error(fdb_future_get_error(future)))
-      goto tx_fail;
-    if (fdb_check_error(fdb_future_get_keyvalue_array(future, &out_kv,
-                                                      &out_count, &out_more)))
-      goto tx_fail;
+  // Fill one batch at a time and start committing it, waiting for room in the
+  // window before filling the next one
+  while (i < num_events) {
+    EventArrayBatch *batch;
 
-    // Read header from very first batch
-    if (!num_fragments) {
-      // Get number of fragments
-      assert(out_kv[0].key_length > FDB_KEY_TOTAL_LENGTH);
-      (void)read_header((const uint8_t *)out_kv[0].key + FDB_KEY_TOTAL_LENGTH, &num_fragments);
+    if (!(slot = fdb_pipeline_acquire(&pipeline)))
+      goto tx_fail;
 
-      // Allocate memory for the event and copy the prefix
-      event->data_length =
-          ((num_fragments * OPTIMAL_VALUE_SIZE) + out_kv[0].value_length);
-      event->data = malloc(sizeof(uint8_t) * event->data_length);
+    batch = &batches[slot - pipeline.slots];
+    batch->f_events = f_events;
+    batch->num_events = num_events;
+    batch->event_pos = i;
+    batch->frag_pos = frag_pos;
+    slot->param = batch;
 
-      memcpy(event->data, out_kv[0].value, out_kv[0].value_length);
-      prefix_length = out_kv[0].value_length;
+    batch->num_fragments = add_event_array_set_transactions(
+        slot->tx, f_events, num_events, &i, &frag_pos);
+    batch->num_completed = i - batch->event_pos;
 
-      // Header stores number of ADDITIONAL fragments
-      ++num_fragments;
-    }
+    if (fdb_pipeline_commit(slot))
+      goto tx_fail;
+  }
 
-    // Copy each fragment to final event memory (skipping the first fragment)
-    for (uint8_t i = (out_counted == 0); i < out_count; ++i) {
-      assert(out_kv[i].key_length == FDB_KEY_TOTAL_LENGTH);
-      // Every fragment after the first should be EXACTLY the preset size
-      if (out_kv[i].value_length != OPTIMAL_VALUE_SIZE)
-        goto tx_fail;
+  // Wait for every batch to be applied
+  if (fdb_pipeline_drain(&pipeline))
+    goto tx_fail;
 
-      memcpy((event->data + prefix_length + (OPTIMAL_VALUE_SIZE * (i - 1))),
-             out_kv[i].value, OPTIMAL_VALUE_SIZE);
-    }
+  fdb_pipeline_destroy(&pipeline);
+  free(batches);
 
-    out_counted += out_count;
+  for (i = 0; i < num_events; ++i)
+    event_cache_put_source(&f_events[i].src);
 
-    fdb_future_destroy(future);
-    continue;
+  // Success
+  return 0;
 
-  tx_fail:
-    fdb_future_destroy(future);
-    fdb_transaction_destroy(tx);
-    free((void *)event->data);
-    return -1;
+// Failure
+tx_fail:
+  fdb_pipeline_destroy(&pipeline);
+  free(batches);
+  return -1;
+}
 
-  } while (out_more);
+int fdb_write_stream_event(StreamEventSource *es) {
+  const Source *src = &es->src;
+  uint32_t num_fragments = es_num_fragments(src);
+  uint64_t ring_fragments;
+  uint8_t *head;
+  int err;
 
-  fdb_transaction_destroy(tx);
+  // Only the fragments of the batches in flight are kept
+  ring_fragments = (uint64_t)staged_batch_fragments(src) * fdb_window_size;
+  if (ring_fragments > num_fragments)
+    ring_fragments = num_fragments;
 
-  // Fail on mismatch between found keys and number of fragments recorded in
-  // header
-  if (num_fragments != out_counted) {
-    free((void *)event->data);
+  if (atomic_load(&es->pulled) || es->ring)
     return -1;
+  es->ring = malloc(ring_fragments * es->fragment_length);
+  head = malloc(es_prefix_length(src));
+  if (!es->ring || !head)
+    goto stream_fail;
+  es->ring_fragments = (uint32_t)ring_fragments;
+
+  // The first fragment is pulled first but written last, so set it aside
+  memcpy(head, es_fragment_data(src, 0), es_prefix_length(src));
+  if (es->error) {
+    fprintf(stderr, "could not pull data for event %" PRIu64 "\n",
+            src->event.id);
+    goto stream_fail;
   }
 
-  // Success
-  return 0;
-}
+  err = write_event_staged(src, head, &es->error);
 
-int fdb_read_event_array(Event *events, uint32_t num_events) {
-  for (uint32_t i = 0; i < num_events; ++i) {
-    if (fdb_read_event(events + i)) {
-      for (uint32_t j = 0; j < i; ++j) {
-        free((void *)(events + j));
-      }
+  free(head);
+  free(es->ring);
+  es->ring = NULL;
 
-      return -1;
-    }
-  }
+  return err;
 
-  // Success
-  return 0;
+// Failure
+stream_fail:
+  free(head);
+  free(es->ring);
+  es->ring = NULL;
+  return -1;
+}
+
+int write_event_staged(const Source *src, const uint8_t *head,
+                       const int *pull_error) {
+  uint32_t num_fragments = es_num_fragments(src);
+  uint32_t batch_fragments = staged_batch_fragments(src);
+  uint8_t key[FDB_KEY_MAX_LENGTH + MAX_HEADER_SIZE];
+  uint8_t key_length;
+  FDBPipeline pipeline;
+  FDBPipelineSlot *slot;
+  SourceBatch *batches;
+  FDBTransaction *tx;
+  FDBRetry retry;
+  fdb_error_t err;
+  uint32_t i = 1;
+
+  if (fdb_pipeline_init(&pipeline, fdb_window_size))
+    return -1;
+
+  batches = malloc(sizeof(SourceBatch) * pipeline.window_size);
+  if (!batches) {
+    fdb_pipeline_destroy(&pipeline);
+    return -1;
+  }
+  pipeline.refill = &refill_source_batch;
+
+  // Stage every fragment but the first, one batch at a time. Reusing the slot
+  // of the batch one window back waits for it to be durable, which also frees
+  // its fragments in the ring of a streaming source.
+  for (uint32_t b = 0; i < num_fragments; ++b) {
+    SourceBatch *batch;
+    uint32_t batch_bytes = 0;
+
+    slot = &pipeline.slots[b % pipeline.window_size];
+    if (!pipeline_acquire_slot(&pipeline, slot))
+      goto stage_fail;
+
+    batch = &batches[slot - pipeline.slots];
+    batch->src = src;
+    batch->frag_pos = i;
+    batch->num_fragments = add_event_set_transactions(
+        slot->tx, src, i, batch_fragments, &batch_bytes);
+    slot->param = batch;
+    i += batch->num_fragments;
+
+    // Do not commit data from a failed pull
+    if (pull_error && *pull_error) {
+      fprintf(stderr, "could not pull data for event %" PRIu64 "\n",
+              src->event.id);
+      goto stage_fail;
+    }
+
+    if (fdb_pipeline_commit(slot))
+      goto stage_fail;
+  }
+
+  // Wait for every staged batch to be applied
+  if (fdb_pipeline_drain(&pipeline))
+    goto stage_fail;
+
+  fdb_pipeline_destroy(&pipeline);
+  free(batches);
+
+  // Readers start at the first fragment, so writing it publishes the event
+  if (fdb_check_error(fdb_setup_transaction(&tx)))
+    return -1;
+
+  key_length = fdb_build_event_key(key, src->event.id, 0);
+  memcpy(key + key_length, es_header(src), es_header_length(src));
+
+  fdb_retry_init(&retry);
+  do {
+    // Replace an older first fragment, whose key holds another header, and
+    // drop fragments an earlier failed write staged past this event
+    add_event_clear_transaction(tx, src->event.id, 0, 1);
+    add_event_clear_transaction(tx, src->event.id, num_fragments, UINT32_MAX);
+    fdb_transaction_set(tx, key, key_length + es_header_length(src), head,
+                        es_prefix_length(src));
+  } while ((err = commit_transaction(tx)) &&
+           !fdb_retry_on_error(tx, err, &retry));
+
+  fdb_transaction_destroy(tx);
+
+  return err ? -1 : 0;
+
+// Failure
+stage_fail:
+  fdb_pipeline_destroy(&pipeline);
+  free(batches);
+  return -1;
+}
+
+int fdb_pipeline_init(FDBPipeline *pipeline, uint32_t window_size) {
+  if (!window_size)
+    return -1;
+
+  pipeline->slots = calloc(window_size, sizeof(FDBPipelineSlot));
+  if (!pipeline->slots)
+    return -1;
+
+  pipeline->free_slots = NULL;
+  pipeline->window_size = window_size;
+  pipeline->in_flight = 0;
+  pipeline->error = 0;
+  pipeline->on_commit = NULL;
+  pipeline->refill = NULL;
+  pipeline->hook_param = NULL;
+
+  // Each slot keeps its own transaction for the lifetime of the pipeline, so
+  // no more than window_size transactions are ever created
+  for (uint32_t i = 0; i < window_size; ++i) {
+    FDBPipelineSlot *slot = &pipeline->slots[i];
+
+    if (fdb_setup_transaction(&slot->tx)) {
+      for (uint32_t j = 0; j < i; ++j)
+        fdb_transaction_destroy(pipeline->slots[j].tx);
+      free(pipeline->slots);
+      return -1;
+    }
+
+    slot->pipeline = pipeline;
+    slot->next = pipeline->free_slots;
+    pipeline->free_slots = slot;
+  }
+
+  pthread_mutex_init(&pipeline->lock, NULL);
+  pthread_cond_init(&pipeline->cond, NULL);
+
+  // Success
+  return 0;
+}
+
+FDBPipelineSlot *fdb_pipeline_acquire(FDBPipeline *pipeline) {
+  FDBPipelineSlot *slot = NULL;
+
+  pthread_mutex_lock(&pipeline->lock);
+
+  // Sleep until a commit completes and frees its slot
+  while (!pipeline->free_slots && !pipeline->error)
+    pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+
+  // Stop handing out slots once any commit has failed
+  if (!pipeline->error) {
+    slot = pipeline->free_slots;
+    pipeline->free_slots = slot->next;
+  }
+
+  pthread_mutex_unlock(&pipeline->lock);
+
+  // Discard the writes of the previous commit in this slot
+  if (slot) {
+    fdb_transaction_reset(slot->tx);
+    fdb_retry_init(&slot->retry);
+  }
+
+  return slot;
+}
+
+int fdb_pipeline_commit(FDBPipelineSlot *slot) {
+  FDBPipeline *pipeline = slot->pipeline;
+
+  // The callback may run before fdb_future_set_callback() returns, so the
+  // commit must be counted first
+  pthread_mutex_lock(&pipeline->lock);
+  ++pipeline->in_flight;
+  pthread_mutex_unlock(&pipeline->lock);
+
+  slot->future = fdb_transaction_commit(slot->tx);
+  if (fdb_check_error(fdb_future_set_callback(
+          slot->future, &pipeline_commit_callback, (void *)slot))) {
+    fdb_future_destroy(slot->future);
+    slot->future = NULL;
+
+    pthread_mutex_lock(&pipeline->lock);
+    --pipeline->in_flight;
+    slot->next = pipeline->free_slots;
+    pipeline->free_slots = slot;
+    pthread_mutex_unlock(&pipeline->lock);
+
+    return -1;
+  }
+
+  // Success
+  return 0;
+}
+
+int fdb_pipeline_drain(FDBPipeline *pipeline) {
+  int err;
+
+  pthread_mutex_lock(&pipeline->lock);
+  while (pipeline->in_flight)
+    pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+  err = pipeline->error;
+  pthread_mutex_unlock(&pipeline->lock);
+
+  return err ? -1 : 0;
+}
+
+void fdb_pipeline_destroy(FDBPipeline *pipeline) {
+  // Callbacks still reference the slots, so wait for them first
+  (void)fdb_pipeline_drain(pipeline);
+
+  for (uint32_t i = 0; i < pipeline->window_size; ++i)
+    fdb_transaction_destroy(pipeline->slots[i].tx);
+  free(pipeline->slots);
+
+  pthread_cond_destroy(&pipeline->cond);
+  pthread_mutex_destroy(&pipeline->lock);
+}
+
+// With range reads, it's possible to remove headers completely from stored
+// event fragments. If the layout of a typical Urbit event log is many, many
+// very small events, then this could be a good way to save storage space.
+// Alternatively, the larger events are, the more inefficient and meaningless
+// this idea becomes.
+//
+// Potential pros:
+//  - Save 13 bytes per event
+//
+// Potential cons:
+//  - Uses up to twice as much memory when reading back events
+//  - Might actually be more complicated, several concurrent processes fetching
+//  additional data from FDB and writing
+//    the data already available to the correct memory location
+//
+int fdb_read_event(Event *event) { return fdb_read_event_into(event, NULL); }
+
+int fdb_read_event_into(Event *event, EventArena *arena) {
+  EventAssembler as;
+  FDBFuture *future;
+  FDBTransaction *tx;
+  FDBRetry retry;
+  struct timespec tx_start;
+  const FDBKeyValue *out_kv;
+  fdb_bool_t out_more = 1;
+  fdb_error_t err;
+  int out_count;
+  int complete = 0;
+  uint8_t range_start_key[FDB_KEY_MAX_LENGTH + MAX_HEADER_SIZE];
+  uint8_t range_end_key[FDB_KEY_MAX_LENGTH];
+  int range_start_length;
+  int range_end_length;
+  bool resumed = false;
+
+  init_assembler(&as, event->id, event->id + 1);
+  event->data = NULL;
+
+  // Recently written or read events come from the event cache
+  if ((complete = event_cache_get(event, arena)))
+    return (complete > 0) ? 0 : complete;
+
+  // Setup transaction
+  if (setup_read_transaction(&tx, &tx_start))
+    return -1;
+
+  // Loop until FoundationDB says there is no more data
+  fdb_retry_init(&retry);
+  while (out_more) {
+    read_renew_transaction(tx, &tx_start);
+
+    // The first read takes the last key up to the first fragment: either the
+    // first fragment itself, or the packed block holding the event. Without
+    // either, the event was never published, and staged fragments behind it
+    // are not worth fetching. Later reads start after the last key received.
+    if (!resumed)
+      future = get_event_head(tx, event->id);
+    else
+      future = fdb_transaction_get_range(
+          tx, FDB_KEYSEL_FIRST_GREATER_THAN(range_start_key, range_start_length),
+          FDB_KEYSEL_FIRST_GREATER_OR_EQUAL(range_end_key, range_end_length),
+          0, 0, FDB_STREAMING_MODE_WANT_ALL, 1, 0, 0);
+    if (!(err = fdb_future_block_until_ready(future)))
+      err = fdb_future_get_error(future);
+    if (!err)
+      err = fdb_future_get_keyvalue_array(future, &out_kv, &out_count,
+                                          &out_more);
+
+    // On a retryable error, including an expired read version, the read
+    // resumes from the last key received in a new transaction
+    if (err) {
+      fdb_future_destroy(future);
+      if (read_retry_on_error(tx, err, &retry, &tx_start))
+        goto tx_fail;
+
+      out_more = 1;
+      continue;
+    }
+
+    // Copy each fragment to final event memory; nothing may follow the last
+    for (int i = 0; i < out_count; ++i) {
+      if (complete)
+        goto range_fail;
+      if ((complete = assemble_fragment(&as, &out_kv[i], arena, event)) ==
+          FDB_READ_ARENA_FULL)
+        goto arena_full;
+      if (complete < 0)
+        goto range_fail;
+    }
+
+    // The first key must have started the event; the rest of its fragments
+    // follow, in its key bucket
+    if (!resumed) {
+      if (!complete && !as.event.data)
+        goto range_fail;
+      range_end_length =
+          fdb_build_event_key(range_end_key, event->id, UINT32_MAX);
+      out_more = !complete;
+      resumed = true;
+    }
+
+    // Remember the last key received
+    if (out_count) {
+      const FDBKeyValue *last = &out_kv[out_count - 1];
+
+      if (last->key_length > (int)sizeof(range_start_key))
+        goto range_fail;
+      memcpy(range_start_key, last->key, last->key_length);
+      range_start_length = last->key_length;
+    }
+
+    // The read made progress, so its retry budget starts over
+    fdb_retry_init(&retry);
+    fdb_future_destroy(future);
+  }
+
+  fdb_transaction_destroy(tx);
+
+  // Fail on mismatch between found keys and number of fragments recorded in
+  // header
+  if (!complete) {
+    release_event_data(arena, &as.event);
+    return -1;
+  }
+
+  event_cache_put_event(event);
+
+  // Success
+  return 0;
+
+// The arena has no room; event->data_length holds the length needed
+arena_full:
+  fdb_future_destroy(future);
+  fdb_transaction_destroy(tx);
+  return FDB_READ_ARENA_FULL;
+
+// Failure
+range_fail:
+  fdb_future_destroy(future);
+tx_fail:
+  fdb_transaction_destroy(tx);
+  release_event_data(arena, &as.event);
+  if (complete)
+    release_event_data(arena, event);
+  event->data = NULL;
+  return -1;
+}
+
+int fdb_read_event_array(Event *events, uint32_t num_events) {
+  bool consecutive = (num_events > 1);
+  Event *range_events;
+  uint32_t num_found;
+
+  for (uint32_t i = 1; consecutive && (i < num_events); ++i)
+    consecutive = (events[i].id == (events[0].id + i));
+
+  // Consecutive events are read together, in a single transaction
+  if (consecutive) {
+    if (fdb_read_event_range(events[0].id, events[0].id + num_events,
+                             &range_events, &num_found))
+      return -1;
+
+    // Every requested event must exist
+    if (num_found != num_events) {
+      for (uint32_t i = 0; i < num_found; ++i)
+        free_event(&range_events[i]);
+      free(range_events);
+      return -1;
+    }
+
+    memcpy(events, range_events, sizeof(Event) * num_events);
+    free(range_events);
+
+    // Success
+    return 0;
+  }
+
+  for (uint32_t i = 0; i < num_events; ++i) {
+    if (fdb_read_event(events + i)) {
+      for (uint32_t j = 0; j < i; ++j) {
+        free((void *)events[j].data);
+      }
+
+      return -1;
+    }
+  }
+
+  // Success
+  return 0;
+}
+
+int fdb_read_event_range(uint64_t first_id, uint64_t last_id, Event **events,
+                         uint32_t *num_events) {
+  FDBEventBatch batch;
+
+  // Without borrowing, every event owns its data and nothing else is held
+  if (read_event_batch(first_id, last_id, false, &batch))
+    return -1;
+
+  *events = batch.events;
+  *num_events = batch.num_events;
+
+  // Success
+  return 0;
+}
+
+int fdb_read_event_batch(uint64_t first_id, uint64_t last_id,
+                         FDBEventBatch *batch) {
+  return read_event_batch(first_id, last_id, true, batch);
+}
+
+void fdb_release_event_batch(FDBEventBatch *batch) {
+  for (uint32_t i = 0; i < batch->num_futures; ++i)
+    fdb_future_destroy(batch->futures[i]);
+  for (uint32_t i = 0; i < batch->num_copies; ++i)
+    free(batch->copies[i]);
+
+  free(batch->futures);
+  free(batch->copies);
+  free(batch->events);
+  memset(batch, 0, sizeof(*batch));
 }
 
 int fdb_clear_event(const FragmentedEventSource *event) {
+  uint64_t id = event->src.event.id;
+  uint64_t head_id = id;
+  uint32_t num_ids = 1;
+  FDBFuture *future;
   FDBTransaction *tx;
+  FDBRetry retry;
+  fdb_error_t err;
 
   // Initialize transaction
   if (fdb_check_error(fdb_setup_transaction(&tx)))
-    goto tx_fail;
+    return -1;
+
+  // Look up the packed block of the event, then add a clear operation for
+  // the event, or its block, and attempt to apply the transaction
+  fdb_retry_init(&retry);
+  do {
+    future = get_event_head(tx, id);
+    err = read_event_head(future, id, &head_id, &num_ids);
+    fdb_future_destroy(future);
+
+    if (!err && (head_id == id)) {
+      add_event_clear_transaction(tx, id, 0, UINT32_MAX);
+      err = commit_transaction(tx);
+    }
+  } while (err && !fdb_retry_on_error(tx, err, &retry));
 
-  // Add a clear operation for the event
-  add_event_clear_transaction(tx, event->src.event.id, es_num_fragments(&event->src));
+  // Even a failed clear may have been applied, so drop any cached copy, along
+  // with those of the rest of a packed block
+  if (head_id == id)
+    for (uint32_t i = 0; i < num_ids; ++i)
+      event_cache_remove(id + i);
 
-  // Attempt to apply the transaction
-  if (fdb_send_transaction(tx))
+  if (err)
     goto tx_fail;
 
   // Clean up the transaction
   fdb_transaction_destroy(tx);
 
+  // Only whole packed blocks are cleared
+  if (head_id != id) {
+    fprintf(stderr, "event %" PRIu64 " is packed with event %" PRIu64 "\n",
+            id, head_id);
+    return -1;
+  }
+
   // Success
   return 0;
 
 // Failure
 tx_fail:
+  fdb_transaction_destroy(tx);
   return -1;
 }
 
 int fdb_clear_event_array(const FragmentedEventSource events[], uint32_t num_events) {
+  uint32_t *num_cleared;
+  uint32_t refused;
   FDBTransaction *tx;
+  FDBRetry retry;
+  fdb_error_t err;
 
-  // Initialize transaction
-  if (fdb_check_error(fdb_setup_transaction(&tx)))
-    goto tx_fail;
+  num_cleared = malloc(sizeof(uint32_t) * ((num_events < CLEAR_BATCH_SIZE)
+                                               ? num_events
+                                               : CLEAR_BATCH_SIZE));
+  if (!num_cleared)
+    return -1;
 
-  // Add a clear operation for the each event, attempt to apply full batches
-  for (uint32_t i = 0; i < num_events; ++i) {
+  // Initialize transaction
+  if (fdb_check_error(fdb_setup_transaction(&tx))) {
+    free(num_cleared);
+    return -1;
+  }
 
-    add_event_clear_transaction(tx, events[i].src.event.id, es_num_fragments(&events[i].src));
+  // Add a clear operation for each event, applying full batches at a time
+  for (uint32_t i = 0; i < num_events; i += CLEAR_BATCH_SIZE) {
+    uint32_t end = ((num_events - i) > CLEAR_BATCH_SIZE) ? (i + CLEAR_BATCH_SIZE)
+                                                         : num_events;
+
+    fdb_retry_init(&retry);
+    do {
+      if (!(err = add_event_array_clear_transactions(
+                tx, &events[i], end - i, num_cleared, &refused)) &&
+          (refused == (end - i)))
+        err = commit_transaction(tx);
+    } while (err && !fdb_retry_on_error(tx, err, &retry));
+
+    // Even a failed clear may have been applied, so drop any cached copies,
+    // along with those of the rest of packed blocks
+    for (uint32_t j = i; j < end; ++j)
+      for (uint32_t k = 0; k < num_cleared[j - i]; ++k)
+        event_cache_remove(events[j].src.event.id + k);
+
+    if (err)
+      goto tx_fail;
 
-    if (!(i % CLEAR_BATCH_SIZE)) {
-      if (fdb_send_transaction(tx))
-        goto tx_fail;
+    // Only whole packed blocks are cleared
+    if (refused < (end - i)) {
+      fprintf(stderr, "event %" PRIu64 " is packed with an event not cleared\n",
+              events[i + refused].src.event.id);
+      goto tx_fail;
     }
-  }
 
-  // Catch the final, non-full batch
-  if (fdb_send_transaction(tx))
-    goto tx_fail;
+    fdb_transaction_reset(tx);
+  }
 
   // Clean up the transaction
   fdb_transaction_destroy(tx);
+  free(num_cleared);
 
   // Success
   return 0;
 
 // Failure
 tx_fail:
+  fdb_transaction_destroy(tx);
+  free(num_cleared);
   return -1;
 }
 
+int fdb_clear_write_markers(void) {
+  FDBTransaction *tx;
+  uint8_t start_key[1] = {MARKER_KEY_PREFIX};
+  uint8_t end_key[1] = {MARKER_KEY_PREFIX + 1};
+  FDBRetry retry;
+  fdb_error_t err;
+
+  // Initialize transaction
+  if (fdb_check_error(fdb_setup_transaction(&tx)))
+    return -1;
+
+  // Add clear operation to transaction and attempt to apply it
+  fdb_retry_init(&retry);
+  do {
+    fdb_transaction_clear_range(tx, start_key, 1, end_key, 1);
+  } while ((err = commit_transaction(tx)) &&
+           !fdb_retry_on_error(tx, err, &retry));
+
+  fdb_transaction_destroy(tx);
+
+  return err ? -1 : 0;
+}
+
 int fdb_clear_database(void) {
   FDBTransaction *tx;
   uint8_t start_key[1] = {0};
   uint8_t end_key[1] = {0xFF};
+  FDBRetry retry;
+  fdb_error_t err;
 
   // Initialize transaction
   if (fdb_check_error(fdb_setup_transaction(&tx)))
-    goto tx_fail;
+    return -1;
 
-  // Add clear operation to transaction
-  fdb_transaction_clear_range(tx, start_key, 1, end_key, 1);
+  // Add clear operation to transaction and attempt to apply it
+  fdb_retry_init(&retry);
+  do {
+    fdb_transaction_clear_range(tx, start_key, 1, end_key, 1);
+  } while ((err = commit_transaction(tx)) &&
+           !fdb_retry_on_error(tx, err, &retry));
 
-  // Catch the final, non-full batch
-  if (fdb_send_transaction(tx))
+  // Even a failed clear may have been applied, so drop every cached event
+  event_cache_clear();
+
+  if (err)
     goto tx_fail;
 
   // Clean up the transaction
@@ -501,20 +1532,13 @@ int fdb_clear_database(void) {
 
 // Failure
 tx_fail:
+  fdb_transaction_destroy(tx);
   return -1;
 }
 
-void fdb_build_event_key(uint8_t *fdb_key, uint64_t key, uint32_t fragment) {
-  // FoundationDB has a rule that keys beginning with 0xff access a special
-  // key-space, so need to prepend a null byte
-  fdb_key[0] = 0;
-
-  for (uint8_t i = 0; i < FDB_KEY_EVENT_LENGTH; ++i) {
-    fdb_key[(FDB_KEY_EVENT_LENGTH - i)] = ((uint8_t *)(&key))[i];
-  }
-  for (uint8_t i = 0; i < FDB_KEY_FRAGMENT_LENGTH; ++i) {
-    fdb_key[(FDB_KEY_TOTAL_LENGTH - (i + 1))] = ((uint8_t *)(&fragment))[i];
-  }
+uint8_t fdb_build_event_key(uint8_t *fdb_key, uint64_t key, uint32_t fragment) {
+  return build_bucket_key(fdb_key, (uint32_t)(key % fdb_key_buckets), key,
+                          fragment);
 }
 
 fdb_error_t fdb_check_error(fdb_error_t err) {
@@ -531,52 +1555,1225 @@ void *network_thread_func(void *arg) {
   return NULL;
 }
 
-uint32_t add_event_set_transactions(FDBTransaction *tx, const Source *event,
-                                    uint32_t start_pos, uint32_t limit) {
-  // Determine the number of fragments that are going to be written
-  uint32_t max_pos = (start_pos + limit);
-  uint32_t end_pos =
-      (max_pos < es_num_fragments(event)) ? max_pos : es_num_fragments(event);
-  uint32_t num_kvp = end_pos - start_pos;
-  uint8_t key[FDB_KEY_TOTAL_LENGTH + MAX_HEADER_SIZE] = {0};
+fdb_error_t commit_transaction(FDBTransaction *tx) {
+  FDBFuture *future = fdb_transaction_commit(tx);
+  fdb_error_t err;
 
-  // Special rules for first fragment
-  if (!start_pos) {
-    fdb_build_event_key(key, event->event.id, 0);
-    // First fragment's key also contains the header
-    memcpy(key + FDB_KEY_TOTAL_LENGTH, es_header(event), es_header_length(event));
+  // Wait for the future to be ready, then check it for errors
+  if (!(err = fdb_future_block_until_ready(future)))
+    err = fdb_future_get_error(future);
 
-    fdb_transaction_set(tx, key, FDB_KEY_TOTAL_LENGTH + es_header_length(event),
-                        es_fragment_data(event, 0), es_prefix_length(event));
+  fdb_future_destroy(future);
+  if (!err)
+    cache_committed_version(tx);
+  return err;
+}
+
+bool retry_allowed(const FDBRetry *retry, fdb_error_t err) {
+  struct timespec now;
+  uint64_t elapsed_ms;
+
+  if (!fdb_error_predicate(FDB_ERROR_PREDICATE_RETRYABLE, err))
+    return false;
+  if (retry->attempts >= fdb_retry_limit)
+    return false;
+
+  timespec_get(&now, TIME_UTC);
+  elapsed_ms = ((uint64_t)(now.tv_sec - retry->start.tv_sec) * 1000) +
+               ((now.tv_nsec - retry->start.tv_nsec) / 1000000);
+
+  return (elapsed_ms < fdb_retry_timeout_ms);
+}
+
+uint32_t retry_next_delay(FDBRetry *retry) {
+  uint32_t delay_us;
+
+  retry->jitter ^= retry->jitter << 13;
+  retry->jitter ^= retry->jitter >> 17;
+  retry->jitter ^= retry->jitter << 5;
+  delay_us = retry->jitter % retry->backoff_us;
+
+  ++retry->attempts;
+  if (retry->backoff_us < RETRY_BACKOFF_MAX_US)
+    retry->backoff_us *= 2;
+
+  return delay_us;
+}
+
+int setup_read_transaction(FDBTransaction **tx, struct timespec *tx_start) {
+  uint32_t max_age_ms = fdb_read_version_max_age_ms;
+  struct timespec at;
+  int64_t version;
+  uint64_t age_ms;
+
+  if (fdb_setup_transaction(tx))
+    return -1;
+  timespec_get(tx_start, TIME_UTC);
 
-    ++start_pos;
+  if (!max_age_ms)
+    return 0;
+
+  pthread_mutex_lock(&read_version_cache.lock);
+  version = read_version_cache.version;
+  at = read_version_cache.at;
+  pthread_mutex_unlock(&read_version_cache.lock);
+
+  age_ms = ((uint64_t)(tx_start->tv_sec - at.tv_sec) * 1000) +
+           ((tx_start->tv_nsec - at.tv_nsec) / 1000000);
+
+  // Use the cached version while it is within the bound, and refresh it once
+  // it is halfway there, so hot reads keep finding a usable one
+  if (version && (age_ms < max_age_ms)) {
+    fdb_transaction_set_read_version(*tx, version);
+    *tx_start = at;
   }
+  if (!version || (age_ms >= (max_age_ms / 2)))
+    refresh_read_version();
+
+  return 0;
+}
 
-  for (uint32_t i = start_pos; i < end_pos; ++i) {
-    // Setup key for event fragment
-    fdb_build_event_key(key, event->event.id, i);
+void cache_read_version(int64_t version, const struct timespec *at) {
+  pthread_mutex_lock(&read_version_cache.lock);
 
-    // Add write operation to transaction
-    fdb_transaction_set(tx, key, FDB_KEY_TOTAL_LENGTH, es_fragment_data(event, i),
-                        es_fragment_length(event, i));
+  // A higher version was current at least as late as the one it replaces
+  if (fdb_read_version_max_age_ms && (version > read_version_cache.version)) {
+    read_version_cache.version = version;
+    if ((at->tv_sec > read_version_cache.at.tv_sec) ||
+        ((at->tv_sec == read_version_cache.at.tv_sec) &&
+         (at->tv_nsec > read_version_cache.at.tv_nsec)))
+      read_version_cache.at = *at;
   }
 
-  return num_kvp;
+  pthread_mutex_unlock(&read_version_cache.lock);
+}
+
+void cache_committed_version(FDBTransaction *tx) {
+  struct timespec now;
+  int64_t version;
+
+  if (!fdb_read_version_max_age_ms)
+    return;
+
+  // Read-only transactions have no commit version
+  if (fdb_transaction_get_committed_version(tx, &version) || (version <= 0))
+    return;
+
+  timespec_get(&now, TIME_UTC);
+  cache_read_version(version, &now);
+}
+
+void refresh_read_version(void) {
+  FDBTransaction *tx;
+  FDBFuture *future;
+
+  pthread_mutex_lock(&read_version_cache.lock);
+  if (read_version_cache.refresh_tx ||
+      fdb_database_create_transaction(fdb_database, &tx)) {
+    pthread_mutex_unlock(&read_version_cache.lock);
+    return;
+  }
+  read_version_cache.refresh_tx = tx;
+  timespec_get(&read_version_cache.refresh_at, TIME_UTC);
+  pthread_mutex_unlock(&read_version_cache.lock);
+
+  // The callback may run right away, so it takes the lock itself
+  future = fdb_transaction_get_read_version(tx);
+  if (fdb_future_set_callback(future, &read_version_callback, NULL)) {
+    fdb_future_destroy(future);
+
+    pthread_mutex_lock(&read_version_cache.lock);
+    read_version_cache.refresh_tx = NULL;
+    pthread_mutex_unlock(&read_version_cache.lock);
+    fdb_transaction_destroy(tx);
+  }
+}
+
+void read_version_callback(FDBFuture *future, void *param) {
+  FDBTransaction *tx;
+  struct timespec at;
+  int64_t version;
+
+  pthread_mutex_lock(&read_version_cache.lock);
+  tx = read_version_cache.refresh_tx;
+  at = read_version_cache.refresh_at;
+  pthread_mutex_unlock(&read_version_cache.lock);
+
+  // The version was current no earlier than when it was requested
+  if (!fdb_future_get_error(future) && !fdb_future_get_int64(future, &version))
+    cache_read_version(version, &at);
+
+  fdb_future_destroy(future);
+
+  pthread_mutex_lock(&read_version_cache.lock);
+  read_version_cache.refresh_tx = NULL;
+  pthread_mutex_unlock(&read_version_cache.lock);
+  fdb_transaction_destroy(tx);
+}
+
+void read_renew_transaction(FDBTransaction *tx, struct timespec *tx_start) {
+  struct timespec now;
+  uint64_t age_ms;
+
+  timespec_get(&now, TIME_UTC);
+  age_ms = ((uint64_t)(now.tv_sec - tx_start->tv_sec) * 1000) +
+           ((now.tv_nsec - tx_start->tv_nsec) / 1000000);
+
+  if (age_ms >= READ_TX_MAX_AGE_MS) {
+    fdb_transaction_reset(tx);
+    *tx_start = now;
+  }
+}
+
+int read_retry_on_error(FDBTransaction *tx, fdb_error_t err, FDBRetry *retry,
+                        struct timespec *tx_start) {
+  if ((err == FDB_ERROR_TRANSACTION_TOO_OLD) &&
+      (!retry->attempts || retry_allowed(retry, err))) {
+    ++retry->attempts;
+    fdb_transaction_reset(tx);
+  } else if (fdb_retry_on_error(tx, err, retry)) {
+    return -1;
+  }
+
+  timespec_get(tx_start, TIME_UTC);
+  return 0;
+}
+
+void pipeline_commit_callback(FDBFuture *future, void *param) {
+  FDBPipelineSlot *slot = (FDBPipelineSlot *)param;
+  FDBPipeline *pipeline = slot->pipeline;
+  fdb_error_t err = fdb_future_get_error(future);
+
+  fdb_future_destroy(future);
+  slot->future = NULL;
+
+  // Retry if the writes can be rebuilt. This runs on the network thread, so
+  // only FoundationDB's own backoff applies.
+  if (err && pipeline->refill && retry_allowed(&slot->retry, err)) {
+    (void)retry_next_delay(&slot->retry);
+
+    slot->future = fdb_transaction_on_error(slot->tx, err);
+    if (!fdb_future_set_callback(slot->future, &pipeline_retry_callback,
+                                 (void *)slot))
+      return;
+
+    fdb_future_destroy(slot->future);
+    slot->future = NULL;
+  }
+
+  pipeline_complete(slot, err);
+}
+
+void pipeline_retry_callback(FDBFuture *future, void *param) {
+  FDBPipelineSlot *slot = (FDBPipelineSlot *)param;
+  FDBPipeline *pipeline = slot->pipeline;
+  fdb_error_t err = fdb_future_get_error(future);
+
+  fdb_future_destroy(future);
+  slot->future = NULL;
+
+  // FoundationDB reset the transaction, so add the writes again and commit
+  if (!err) {
+    pipeline->refill(slot);
+
+    slot->future = fdb_transaction_commit(slot->tx);
+    if (!(err = fdb_future_set_callback(slot->future, &pipeline_commit_callback,
+                                        (void *)slot)))
+      return;
+
+    fdb_future_destroy(slot->future);
+    slot->future = NULL;
+  }
+
+  pipeline_complete(slot, err);
+}
+
+void pipeline_complete(FDBPipelineSlot *slot, fdb_error_t err) {
+  FDBPipeline *pipeline = slot->pipeline;
+
+  if (!fdb_check_error(err))
+    cache_committed_version(slot->tx);
+  if (pipeline->on_commit)
+    pipeline->on_commit(slot, err);
+
+  // Return the slot to the window and wake the producer
+  pthread_mutex_lock(&pipeline->lock);
+  if (err && !pipeline->error)
+    pipeline->error = err;
+  slot->next = pipeline->free_slots;
+  pipeline->free_slots = slot;
+  --pipeline->in_flight;
+  pthread_cond_broadcast(&pipeline->cond);
+  pthread_mutex_unlock(&pipeline->lock);
+}
+
+uint32_t add_event_set_transactions(FDBTransaction *tx, const Source *event,
+                                    uint32_t start_pos, uint32_t limit,
+                                    uint32_t *batch_bytes) {
+  // Determine the last fragment that may be written
+  uint32_t max_pos = (limit < (es_num_fragments(event) - start_pos))
+                         ? (start_pos + limit)
+                         : es_num_fragments(event);
+  uint8_t key[FDB_KEY_MAX_LENGTH + MAX_HEADER_SIZE] = {0};
+  uint32_t i;
+
+  for (i = start_pos; i < max_pos; ++i) {
+    // Setup key for event fragment; the first fragment's key also contains
+    // the header
+    uint8_t key_length = fdb_build_event_key(key, event->event.id, i);
+    uint32_t kvp_bytes;
+
+    if (!i) {
+      memcpy(key + key_length, es_header(event), es_header_length(event));
+      key_length += es_header_length(event);
+    }
+    kvp_bytes = key_length + es_fragment_length(event, i);
+
+    // Close the batch at the byte budget, but always make progress
+    if (*batch_bytes && ((*batch_bytes + kvp_bytes) > fdb_batch_bytes))
+      break;
+
+    // Neither an older first fragment, whose key holds another header, nor
+    // fragments left past the event may outlive it. The fragments in between
+    // are overwritten, possibly by a batch committing ahead of this one.
+    if (!i) {
+      add_event_clear_transaction(tx, event->event.id, 0, 1);
+      add_event_clear_transaction(tx, event->event.id,
+                                  es_num_fragments(event), UINT32_MAX);
+    }
+
+    // Add write operation to transaction
+    fdb_transaction_set(tx, key, key_length, es_fragment_data(event, i),
+                        es_fragment_length(event, i));
+    *batch_bytes += kvp_bytes;
+  }
+
+  return (i - start_pos);
+}
+
+uint32_t add_event_array_set_transactions(FDBTransaction *tx,
+                                          const FragmentedEventSource f_events[],
+                                          uint32_t num_events,
+                                          uint32_t *event_pos,
+                                          uint32_t *frag_pos) {
+  uint32_t limit = batch_fragment_limit();
+  uint32_t batch_filled = 0;
+  uint32_t batch_bytes = 0;
+
+  while ((*event_pos < num_events) && (batch_filled < limit)) {
+    const Source *event = &f_events[*event_pos].src;
+    uint32_t num_packed;
+
+    // Write a run of small events as one packed block
+    if (!*frag_pos &&
+        ((num_packed = count_packable_events(&f_events[*event_pos],
+                                             (num_events - *event_pos))) > 1)) {
+      if (!add_packed_event_set_transaction(tx, &f_events[*event_pos],
+                                            num_packed, &batch_bytes))
+        break;
+      ++batch_filled;
+      *event_pos += num_packed;
+      continue;
+    }
+
+    // Add as many unwritten fragments from the current event as fit
+    uint32_t num_kvp = add_event_set_transactions(
+        tx, event, *frag_pos, (limit - batch_filled), &batch_bytes);
+    batch_filled += num_kvp;
+    *frag_pos += num_kvp;
+
+    // The batch is full if the rest of the event did not fit
+    if (*frag_pos < es_num_fragments(event))
+      break;
+
+    // Move on to the next event when all fragments from an event have been
+    // written
+    ++*event_pos;
+    *frag_pos = 0;
+  }
+
+  return batch_filled;
+}
+
+uint32_t count_packable_events(const FragmentedEventSource f_events[],
+                               uint32_t num_events) {
+  uint32_t value_length = 0;
+  uint32_t i;
+
+  if (!fdb_pack_bytes || (fdb_key_buckets > 1))
+    return 0;
+
+  for (i = 0; (i < num_events) && (i < MAX_PACKED_EVENTS); ++i) {
+    const Source *event = &f_events[i].src;
+
+    // Only events written as they are fit, so not compressed ones
+    value_length += PACKED_OFFSET_SIZE + es_length(event);
+    if ((es_num_fragments(event) != 1) || es_header(event)[0] ||
+        !es_length(event) ||
+        (event->event.id != (f_events[0].src.event.id + i)) ||
+        (value_length > fdb_pack_bytes))
+      break;
+  }
+
+  return i;
+}
+
+uint32_t add_packed_event_set_transaction(FDBTransaction *tx,
+                                          const FragmentedEventSource f_events[],
+                                          uint32_t num_events,
+                                          uint32_t *batch_bytes) {
+  uint8_t key[FDB_KEY_MAX_LENGTH + MAX_HEADER_SIZE];
+  uint8_t end_key[FDB_KEY_MAX_LENGTH];
+  uint8_t value[OPTIMAL_VALUE_SIZE];
+  uint32_t value_length;
+  uint8_t key_length, end_key_length, event_key_length;
+
+  // The block is keyed by the first fragment key of its first event, with the
+  // packed header in place of the event header
+  event_key_length = fdb_build_event_key(key, f_events[0].src.event.id, 0);
+  key_length = event_key_length +
+               build_packed_header(key + event_key_length, num_events);
+  value_length = pack_events(value, f_events, num_events);
+
+  // Close the batch at the byte budget, but always make progress
+  if (*batch_bytes &&
+      ((*batch_bytes + key_length + value_length) > fdb_batch_bytes))
+    return 0;
+
+  // Keys the events were written under before, whose headers differ, must
+  // not outlive the block; packed ids share one key bucket, so one range
+  // covers them all
+  end_key_length = fdb_build_event_key(
+      end_key, f_events[num_events - 1].src.event.id, UINT32_MAX);
+  fdb_transaction_clear_range(tx, key, event_key_length, end_key,
+                              end_key_length);
+
+  fdb_transaction_set(tx, key, key_length, value, value_length);
+  *batch_bytes += key_length + value_length;
+  return 1;
+}
+
+uint64_t new_write_nonce(void) {
+  static atomic_uint_fast32_t counter;
+  struct timespec now;
+
+  // Wall-clock nanoseconds tell processes apart, the counter tells apart
+  // writes started within the same tick
+  timespec_get(&now, TIME_UTC);
+  return ((uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec) ^
+         ((uint64_t)atomic_fetch_add(&counter, 1) << 48);
+}
+
+void build_marker_key(uint8_t *key, uint64_t nonce, uint32_t batch) {
+  build_fixed_key(key, MARKER_KEY_PREFIX, nonce, batch);
+}
+
+void add_marker_transaction(FDBTransaction *tx, uint64_t nonce, uint32_t batch,
+                            uint64_t last_id, bool final) {
+  uint8_t key[FDB_KEY_TOTAL_LENGTH];
+  uint8_t end_key[FDB_KEY_TOTAL_LENGTH];
+
+  build_marker_key(key, nonce, (final ? 0 : batch));
+
+  if (!final) {
+    fdb_transaction_set(tx, key, FDB_KEY_TOTAL_LENGTH, (const uint8_t *)&last_id,
+                        sizeof(last_id));
+  } else if (batch) {
+    build_marker_key(end_key, nonce, batch);
+    fdb_transaction_clear_range(tx, key, FDB_KEY_TOTAL_LENGTH, end_key,
+                                FDB_KEY_TOTAL_LENGTH);
+  }
+}
+
+void clear_write_markers(FDBTransaction *tx, uint64_t nonce, uint32_t batch) {
+  uint8_t key[FDB_KEY_TOTAL_LENGTH];
+  uint8_t end_key[FDB_KEY_TOTAL_LENGTH];
+
+  // The failed batch may have landed after all, so its marker goes too
+  build_marker_key(key, nonce, 0);
+  build_marker_key(end_key, nonce, batch + 1);
+
+  fdb_transaction_reset(tx);
+  fdb_transaction_clear_range(tx, key, FDB_KEY_TOTAL_LENGTH, end_key,
+                              FDB_KEY_TOTAL_LENGTH);
+  fdb_check_error(commit_transaction(tx));
+}
+
+bool batch_committed(FDBTransaction *tx, uint64_t nonce, uint32_t batch,
+                     bool final) {
+  uint8_t key[FDB_KEY_TOTAL_LENGTH];
+  const uint8_t *value;
+  fdb_bool_t present;
+  FDBFuture *future;
+  fdb_error_t err;
+  int value_length;
+
+  // A write that fits in one transaction has no markers to check
+  if (final && !batch)
+    return false;
+
+  // The last batch clears every marker, so the first marker is gone once it
+  // lands; any other batch leaves its own marker behind
+  build_marker_key(key, nonce, (final ? 0 : batch));
+  future = fdb_transaction_get(tx, key, FDB_KEY_TOTAL_LENGTH, 0);
+  if (!(err = fdb_future_block_until_ready(future)))
+    err = fdb_future_get_error(future);
+  if (!err)
+    err = fdb_future_get_value(future, &present, &value, &value_length);
+  fdb_future_destroy(future);
+
+  // When in doubt, resend: the writes themselves are idempotent
+  if (err)
+    return false;
+
+  return final ? !present : (bool)present;
+}
+
+void count_event_array_batch(FDBPipelineSlot *slot, fdb_error_t err) {
+  FDBWriteProgress *progress = (FDBWriteProgress *)slot->pipeline->hook_param;
+  EventArrayBatch *batch = (EventArrayBatch *)slot->param;
+
+  if (err)
+    return;
+
+  atomic_fetch_add(&progress->events, batch->num_completed);
+  atomic_fetch_add(&progress->fragments, batch->num_fragments);
+  atomic_fetch_add(&progress->commits, 1);
+}
+
+void refill_event_array_batch(FDBPipelineSlot *slot) {
+  EventArrayBatch *batch = (EventArrayBatch *)slot->param;
+  uint32_t event_pos = batch->event_pos;
+  uint32_t frag_pos = batch->frag_pos;
+
+  add_event_array_set_transactions(slot->tx, batch->f_events,
+                                   batch->num_events, &event_pos, &frag_pos);
+}
+
+FDBPipelineSlot *pipeline_acquire_slot(FDBPipeline *pipeline,
+                                       FDBPipelineSlot *slot) {
+  FDBPipelineSlot **link = NULL;
+
+  pthread_mutex_lock(&pipeline->lock);
+
+  // Sleep until the commit in the slot completes
+  while (!pipeline->error) {
+    for (link = &pipeline->free_slots; *link && (*link != slot);
+         link = &(*link)->next)
+      ;
+    if (*link)
+      break;
+    pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+  }
+
+  // Stop handing out slots once any commit has failed
+  if (pipeline->error)
+    slot = NULL;
+  else
+    *link = slot->next;
+
+  pthread_mutex_unlock(&pipeline->lock);
+
+  // Discard the writes of the previous commit in this slot
+  if (slot) {
+    fdb_transaction_reset(slot->tx);
+    fdb_retry_init(&slot->retry);
+  }
+
+  return slot;
+}
+
+uint32_t staged_batch_fragments(const Source *src) {
+  uint32_t fragment_length = es_fragment_length(src, es_num_fragments(src) - 1);
+  uint32_t limit = batch_fragment_limit();
+  uint32_t ret = (fdb_batch_bytes / (FDB_KEY_TOTAL_LENGTH + fragment_length)) + 1;
+
+  return (ret < limit) ? ret : limit;
+}
+
+uint64_t event_set_bytes(const Source *src) {
+  return (uint64_t)es_num_fragments(src) * FDB_KEY_TOTAL_LENGTH +
+         es_header_length(src) + es_length(src);
+}
+
+void refill_source_batch(FDBPipelineSlot *slot) {
+  SourceBatch *batch = (SourceBatch *)slot->param;
+  uint32_t batch_bytes = 0;
+
+  add_event_set_transactions(slot->tx, batch->src, batch->frag_pos,
+                             batch->num_fragments, &batch_bytes);
+}
+
+uint32_t batch_fragment_limit(void) {
+  return fdb_batch_size ? fdb_batch_size : UINT32_MAX;
+}
+
+int read_event_batch(uint64_t first_id, uint64_t last_id, bool borrow,
+                     FDBEventBatch *batch) {
+  EventAssembler as;
+  FDBFuture *future;
+  FDBTransaction *tx;
+  FDBRetry retry;
+  struct timespec tx_start;
+  const FDBKeyValue *out_kv;
+  fdb_bool_t out_more;
+  fdb_error_t err;
+  int out_count;
+  uint8_t range_start_key[FDB_KEY_MAX_LENGTH + MAX_HEADER_SIZE];
+  uint8_t range_end_key[FDB_KEY_MAX_LENGTH];
+  int range_start_length;
+  int range_end_length;
+  bool resumed;
+
+  memset(batch, 0, sizeof(*batch));
+  if (first_id >= last_id)
+    return 0;
+
+  // Setup transaction
+  if (setup_read_transaction(&tx, &tx_start))
+    return -1;
+
+  // Read the whole range of every key bucket in turn, splitting it into events
+  // as the key-value pairs arrive. Events are immutable once published, so a
+  // long read may move on to a new transaction without the caller noticing.
+  for (uint32_t bucket = 0; bucket < fdb_key_buckets; ++bucket) {
+    // Setup keys for range read
+    range_start_length = build_bucket_key(range_start_key, bucket, first_id, 0);
+    range_end_length = build_bucket_key(range_end_key, bucket, last_id, 0);
+    init_assembler(&as, first_id, last_id);
+    as.leading = (fdb_key_buckets == 1);
+    resumed = false;
+    out_more = 1;
+
+    fdb_retry_init(&retry);
+    while (out_more) {
+      bool borrowed = false;
+
+      read_renew_transaction(tx, &tx_start);
+
+      // Read data range, starting after the last key received. Without key
+      // buckets, the first read starts at the key before the range, which
+      // may be a packed block holding the first events of the range.
+      future = fdb_transaction_get_range(
+          tx, range_start_key, range_start_length, resumed,
+          (resumed || !as.leading),
+          FDB_KEYSEL_FIRST_GREATER_OR_EQUAL(range_end_key, range_end_length),
+          0, 0, FDB_STREAMING_MODE_WANT_ALL, 0, 0, 0);
+      if (!(err = fdb_future_block_until_ready(future)))
+        err = fdb_future_get_error(future);
+      if (!err)
+        err = fdb_future_get_keyvalue_array(future, &out_kv, &out_count,
+                                            &out_more);
+
+      // On a retryable error, including an expired read version, the read
+      // resumes from the last key received in a new transaction
+      if (err) {
+        fdb_future_destroy(future);
+        if (read_retry_on_error(tx, err, &retry, &tx_start))
+          goto tx_fail;
+
+        out_more = 1;
+        continue;
+      }
+
+      for (int i = 0; i < out_count; ++i) {
+        Event *event;
+        EventHeader header;
+
+        if (reserve_array((void **)&batch->events, batch->num_events,
+                          sizeof(Event)))
+          goto range_fail;
+        event = &batch->events[batch->num_events];
+
+        // A published single-fragment event is the value itself: point at it
+        // and keep the future alive
+        if (borrow && !as.event.data) {
+          uint32_t fragment;
+          uint8_t key_length = read_event_key(
+              out_kv[i].key, out_kv[i].key_length, &event->id, &fragment);
+
+          if (key_length && !fragment && (event->id >= first_id) &&
+              (out_kv[i].key_length > key_length) &&
+              (out_kv[i].key_length <= (key_length + MAX_HEADER_SIZE)) &&
+              (read_header(out_kv[i].key + key_length,
+                           (uint8_t)(out_kv[i].key_length - key_length),
+                           &header) ==
+               (uint8_t)(out_kv[i].key_length - key_length)) &&
+              !header.num_fragments && !header.num_events &&
+              !header.compression) {
+            event->data_length = out_kv[i].value_length;
+            event->data = (uint8_t *)out_kv[i].value;
+            ++batch->num_events;
+            as.leading = false;
+            borrowed = true;
+            continue;
+          }
+        }
+
+        switch (assemble_fragment(&as, &out_kv[i], NULL, event)) {
+        case 2:
+          // The next event of a packed block comes from the same key-value
+          // pair
+          --i;
+          // Fall through
+        case 1:
+          // Keep track of the copies the batch owns
+          if (borrow) {
+            if (reserve_array((void **)&batch->copies, batch->num_copies,
+                              sizeof(uint8_t *))) {
+              free(event->data);
+              goto range_fail;
+            }
+            batch->copies[batch->num_copies++] = event->data;
+          }
+          ++batch->num_events;
+          break;
+        case 0:
+          break;
+        default:
+          goto range_fail;
+        }
+      }
+
+      // Remember the last key received
+      if (out_count) {
+        const FDBKeyValue *last = &out_kv[out_count - 1];
+
+        if (last->key_length > (int)sizeof(range_start_key))
+          goto range_fail;
+        memcpy(range_start_key, last->key, last->key_length);
+        range_start_length = last->key_length;
+        resumed = true;
+      }
+
+      // The read made progress, so its retry budget starts over
+      fdb_retry_init(&retry);
+
+      // Hold on to the future for as long as events point into it
+      if (borrowed) {
+        if (reserve_array((void **)&batch->futures, batch->num_futures,
+                          sizeof(FDBFuture *)))
+          goto range_fail;
+        batch->futures[batch->num_futures++] = future;
+      } else {
+        fdb_future_destroy(future);
+      }
+    }
+
+    // The range ended in the middle of an event
+    if (as.event.data) {
+      fdb_transaction_destroy(tx);
+      free((void *)as.event.data);
+      goto read_fail;
+    }
+  }
+
+  fdb_transaction_destroy(tx);
+
+  // Merge the buckets back into id order
+  if (fdb_key_buckets > 1)
+    qsort(batch->events, batch->num_events, sizeof(Event), compare_event_ids);
+
+  // Success
+  return 0;
+
+// Failure
+range_fail:
+  fdb_future_destroy(future);
+tx_fail:
+  fdb_transaction_destroy(tx);
+  free((void *)as.event.data);
+read_fail:
+  if (!borrow) {
+    for (uint32_t i = 0; i < batch->num_events; ++i)
+      free_event(&batch->events[i]);
+  }
+  fdb_release_event_batch(batch);
+  return -1;
+}
+
+int reserve_array(void **array, uint32_t length, size_t element_size) {
+  void *grown;
+
+  // The capacity is 64 elements, then doubles whenever the length reaches a
+  // power of two
+  if (length && ((length < 64) || (length & (length - 1))))
+    return 0;
+
+  if (!(grown = realloc(*array, element_size * (length ? (length * 2) : 64))))
+    return -1;
+
+  *array = grown;
+  return 0;
+}
+
+uint8_t build_bucket_key(uint8_t *fdb_key, uint32_t bucket, uint64_t id,
+                         uint32_t fragment) {
+  uint8_t length = 1;
+
+  // FoundationDB has a rule that keys beginning with 0xff access a special
+  // key-space, so need to prepend a prefix byte: a null byte, or the bucket of
+  // the event, which spreads consecutive ids over as many key ranges (and so
+  // storage servers)
+  if (fdb_key_format == FDB_KEY_FORMAT_FIXED) {
+    build_fixed_key(fdb_key, bucket_key_prefix(bucket), id, fragment);
+    return FDB_KEY_TOTAL_LENGTH;
+  }
+
+  // Ordered varints keep the keys of the compact format in id, then fragment
+  // order
+  fdb_key[0] = bucket_key_prefix(bucket);
+  length += write_ordered_varint(fdb_key + length, id);
+  length += write_ordered_varint(fdb_key + length, fragment);
+  return length;
+}
+
+void build_fixed_key(uint8_t *fdb_key, uint8_t prefix, uint64_t id,
+                     uint32_t fragment) {
+  fdb_key[0] = prefix;
+
+  for (uint8_t i = 0; i < FDB_KEY_EVENT_LENGTH; ++i) {
+    fdb_key[(FDB_KEY_EVENT_LENGTH - i)] = ((uint8_t *)(&id))[i];
+  }
+  for (uint8_t i = 0; i < FDB_KEY_FRAGMENT_LENGTH; ++i) {
+    fdb_key[(FDB_KEY_TOTAL_LENGTH - (i + 1))] = ((uint8_t *)(&fragment))[i];
+  }
+}
+
+uint8_t write_ordered_varint(uint8_t *out, uint64_t value) {
+  uint8_t length = 3;
+
+  if (value <= ORDERED_VARINT_MAX_1) {
+    out[0] = (uint8_t)value;
+    return 1;
+  }
+  if (value <= ORDERED_VARINT_MAX_2) {
+    value -= (ORDERED_VARINT_MAX_1 + 1);
+    out[0] = (uint8_t)((value >> 8) + 241);
+    out[1] = (uint8_t)value;
+    return 2;
+  }
+  if (value <= ORDERED_VARINT_MAX_3) {
+    value -= (ORDERED_VARINT_MAX_2 + 1);
+    out[0] = 249;
+    out[1] = (uint8_t)(value >> 8);
+    out[2] = (uint8_t)value;
+    return 3;
+  }
+
+  while ((length < 8) && (value >> (8 * length)))
+    ++length;
+
+  out[0] = (uint8_t)(247 + length);
+  for (uint8_t i = 0; i < length; ++i)
+    out[length - i] = (uint8_t)(value >> (8 * i));
+
+  return (length + 1);
+}
+
+uint8_t read_ordered_varint(const uint8_t *in, int length, uint64_t *value) {
+  uint8_t num_bytes;
+
+  if (length < 1)
+    return 0;
+
+  if (in[0] <= ORDERED_VARINT_MAX_1) {
+    *value = in[0];
+    return 1;
+  }
+  if (in[0] <= 248) {
+    if (length < 2)
+      return 0;
+    *value = (ORDERED_VARINT_MAX_1 + 1) + ((uint64_t)(in[0] - 241) << 8) + in[1];
+    // The last lead byte only reaches ORDERED_VARINT_MAX_2 at 0xFE
+    return (*value <= ORDERED_VARINT_MAX_2) ? 2 : 0;
+  }
+  if (in[0] == 249) {
+    if (length < 3)
+      return 0;
+    *value = (ORDERED_VARINT_MAX_2 + 1) + ((uint64_t)in[1] << 8) + in[2];
+    return 3;
+  }
+
+  num_bytes = (uint8_t)(in[0] - 247);
+  if (length < (num_bytes + 1))
+    return 0;
+
+  *value = 0;
+  for (uint8_t i = 1; i <= num_bytes; ++i)
+    *value = (*value << 8) | in[i];
+
+  // Only the shortest form is valid, so every value has exactly one key
+  if ((*value <= ORDERED_VARINT_MAX_3) ||
+      ((num_bytes > 3) && !(*value >> (8 * (num_bytes - 1)))))
+    return 0;
+
+  return (num_bytes + 1);
+}
+
+uint8_t bucket_key_prefix(uint32_t bucket) {
+  if (fdb_key_format == FDB_KEY_FORMAT_COMPACT)
+    return (fdb_key_buckets > 1) ? (uint8_t)(COMPACT_BUCKET_KEY_PREFIX + bucket)
+                                 : COMPACT_KEY_PREFIX;
+
+  return (fdb_key_buckets > 1) ? (uint8_t)(BUCKET_KEY_PREFIX + bucket) : 0;
+}
+
+int compare_event_ids(const void *a, const void *b) {
+  uint64_t id_a = ((const Event *)a)->id;
+  uint64_t id_b = ((const Event *)b)->id;
+
+  return (id_a > id_b) - (id_a < id_b);
+}
+
+uint8_t read_event_key(const uint8_t *fdb_key, int key_length, uint64_t *id,
+                       uint32_t *fragment) {
+  uint64_t value;
+  uint8_t length = 1;
+  uint8_t n;
+
+  if (fdb_key_format == FDB_KEY_FORMAT_FIXED) {
+    if (key_length < FDB_KEY_TOTAL_LENGTH)
+      return 0;
+
+    for (uint8_t i = 0; i < FDB_KEY_EVENT_LENGTH; ++i) {
+      ((uint8_t *)id)[i] = fdb_key[(FDB_KEY_EVENT_LENGTH - i)];
+    }
+    for (uint8_t i = 0; i < FDB_KEY_FRAGMENT_LENGTH; ++i) {
+      ((uint8_t *)fragment)[i] = fdb_key[(FDB_KEY_TOTAL_LENGTH - (i + 1))];
+    }
+    length = FDB_KEY_TOTAL_LENGTH;
+  } else {
+    if ((key_length < 1) ||
+        !(n = read_ordered_varint(fdb_key + length, key_length - length, id)))
+      return 0;
+    length += n;
+
+    if (!(n = read_ordered_varint(fdb_key + length, key_length - length,
+                                  &value)) ||
+        (value > UINT32_MAX))
+      return 0;
+    *fragment = (uint32_t)value;
+    length += n;
+  }
+
+  // The key must sit in the key bucket of its event
+  if (fdb_key[0] != bucket_key_prefix((uint32_t)(*id % fdb_key_buckets)))
+    return 0;
+
+  return length;
+}
+
+FDBFuture *get_event_head(FDBTransaction *tx, uint64_t id) {
+  uint8_t range_start_key[FDB_KEY_MAX_LENGTH];
+  uint8_t range_end_key[FDB_KEY_MAX_LENGTH];
+  uint8_t range_start_length, range_end_length;
+
+  // Look back from the first fragment to the start of the key bucket
+  range_start_length = build_bucket_key(
+      range_start_key, (uint32_t)(id % fdb_key_buckets), 0, 0);
+  range_end_length = fdb_build_event_key(range_end_key, id, 1);
+
+  return fdb_transaction_get_range(
+      tx, FDB_KEYSEL_FIRST_GREATER_OR_EQUAL(range_start_key, range_start_length),
+      FDB_KEYSEL_FIRST_GREATER_OR_EQUAL(range_end_key, range_end_length), 1, 0,
+      FDB_STREAMING_MODE_EXACT, 1, 0, 1);
+}
+
+fdb_error_t read_event_head(FDBFuture *future, uint64_t id, uint64_t *head_id,
+                            uint32_t *num_ids) {
+  const FDBKeyValue *out_kv;
+  fdb_bool_t out_more;
+  fdb_error_t err;
+  EventHeader header;
+  uint64_t key_id;
+  uint32_t fragment;
+  uint8_t key_length;
+  uint8_t header_length;
+  int out_count;
+
+  *head_id = id;
+  *num_ids = 1;
+
+  if (!(err = fdb_future_block_until_ready(future)))
+    err = fdb_future_get_error(future);
+  if (!err)
+    err = fdb_future_get_keyvalue_array(future, &out_kv, &out_count,
+                                        &out_more);
+  if (err || !out_count)
+    return err;
+
+  // Only the first fragment key of a packed block has more to say
+  if (!(key_length = read_event_key(out_kv->key, out_kv->key_length, &key_id,
+                                    &fragment)) ||
+      fragment || (key_id > id) || (out_kv->key_length <= key_length) ||
+      (out_kv->key_length > (key_length + MAX_HEADER_SIZE)))
+    return 0;
+
+  header_length = (uint8_t)(out_kv->key_length - key_length);
+  if ((read_header(out_kv->key + key_length, header_length, &header) !=
+       header_length) ||
+      !header.num_events || ((id - key_id) >= header.num_events))
+    return 0;
+
+  *head_id = key_id;
+  *num_ids = header.num_events;
+  return 0;
+}
+
+fdb_error_t add_event_array_clear_transactions(
+    FDBTransaction *tx, const FragmentedEventSource events[],
+    uint32_t num_events, uint32_t *num_cleared, uint32_t *refused) {
+  FDBFuture *futures[CLEAR_LOOKUP_DEPTH];
+  uint64_t block_id = 0;
+  uint64_t block_end = 0;
+  fdb_error_t err = 0;
+
+  for (uint32_t i = 0; i < num_events; ++i)
+    num_cleared[i] = 1;
+  *refused = num_events;
+
+  // Keep a window of lookups in flight, clearing in array order
+  for (uint32_t i = 0; i < num_events; i += CLEAR_LOOKUP_DEPTH) {
+    uint32_t end = ((num_events - i) > CLEAR_LOOKUP_DEPTH)
+                       ? (i + CLEAR_LOOKUP_DEPTH)
+                       : num_events;
+
+    for (uint32_t j = i; j < end; ++j)
+      futures[j - i] = get_event_head(tx, events[j].src.event.id);
+
+    for (uint32_t j = i; j < end; ++j) {
+      uint64_t id = events[j].src.event.id;
+      uint64_t head_id;
+      uint32_t num_ids;
+
+      if (!err && (*refused == num_events) &&
+          !(err = read_event_head(futures[j - i], id, &head_id, &num_ids))) {
+        if (head_id == id) {
+          add_event_clear_transaction(tx, id, 0, UINT32_MAX);
+          num_cleared[j] = num_ids;
+          block_id = id;
+          block_end = id + num_ids;
+        } else if ((head_id != block_id) || (id >= block_end)) {
+          // A packed event only goes with a head cleared before it
+          *refused = j;
+        }
+      }
+      fdb_future_destroy(futures[j - i]);
+    }
+
+    if (err || (*refused < num_events))
+      break;
+  }
+
+  return err;
+}
+
+void init_assembler(EventAssembler *as, uint64_t first_id, uint64_t last_id) {
+  memset(as, 0, sizeof(*as));
+  as->first_id = first_id;
+  as->last_id = last_id;
+}
+
+int assemble_fragment(EventAssembler *as, const FDBKeyValue *kv,
+                      EventArena *arena, Event *event) {
+  EventHeader header;
+  uint64_t id;
+  uint64_t rest_length;
+  uint32_t fragment;
+  uint8_t key_length;
+  uint8_t header_length;
+  bool leading = as->leading;
+
+  // Go on with the packed block of the last call
+  if (as->next_packed < as->num_packed)
+    return unpack_next_event(as, kv, arena, event);
+  as->num_packed = 0;
+  as->leading = false;
+
+  // A read looking back from the start of its range may land on anything
+  if (!(key_length = read_event_key(kv->key, kv->key_length, &id, &fragment)))
+    return leading ? 0 : -1;
+
+  if (!as->event.data) {
+    // Skip fragments of an event that was staged but never published
+    if (fragment || (kv->key_length == key_length))
+      return 0;
+
+    // Get the layout of the event; the header stores the number of
+    // ADDITIONAL fragments
+    header_length = (uint8_t)(kv->key_length - key_length);
+    if ((kv->key_length > (key_length + MAX_HEADER_SIZE)) ||
+        (read_header(kv->key + key_length, header_length, &header) !=
+         header_length))
+      return -1;
+
+    // A packed block holds whole events, handed over one at a time
+    if (header.num_events) {
+      as->packed_id = id;
+      as->num_packed = header.num_events;
+      as->next_packed = 0;
+      return unpack_next_event(as, kv, arena, event);
+    }
+
+    // Skip an event in front of the range
+    if (id < as->first_id)
+      return 0;
+
+    as->num_fragments = header.num_fragments + 1;
+    as->fragment_length = header.fragment_length;
+
+    // The first fragment holds whatever the others do not, so without a
+    // recorded length (v1) the event ends where the first fragment says
+    rest_length = ((uint64_t)header.num_fragments * header.fragment_length);
+    if (header.data_length &&
+        ((uint64_t)kv->value_length != (header.data_length - rest_length)))
+      return -1;
+
+    // Allocate exactly the memory for the event and copy the prefix. A
+    // compressed event is gathered on the heap, and only decompressed into the
+    // arena, which must have room for it from the start.
+    as->event.id = id;
+    as->event.data_length = rest_length + kv->value_length;
+    as->compression = header.compression;
+    as->raw_length = header.raw_length;
+    if (arena &&
+        ((as->compression ? as->raw_length : as->event.data_length) >
+         (arena->capacity - arena->used))) {
+      event->id = id;
+      event->data_length =
+          as->compression ? as->raw_length : as->event.data_length;
+      event->data = NULL;
+      return FDB_READ_ARENA_FULL;
+    }
+    if (arena && !as->compression)
+      as->event.data = event_arena_alloc(arena, as->event.data_length);
+    else if (!(as->event.data = malloc(sizeof(uint8_t) * as->event.data_length)))
+      return -1;
+    as->arena = as->compression ? NULL : arena;
+
+    memcpy(as->event.data, kv->value, kv->value_length);
+    as->prefix_length = kv->value_length;
+    as->num_received = 1;
+  } else {
+    // Every fragment after the first should be EXACTLY the size recorded in
+    // the header, and arrive in order
+    if ((id != as->event.id) || (fragment != as->num_received) ||
+        (kv->key_length != key_length) ||
+        ((uint32_t)kv->value_length != as->fragment_length))
+      return -1;
+
+    memcpy((as->event.data + as->prefix_length +
+            ((uint64_t)as->fragment_length * (fragment - 1))),
+           kv->value, as->fragment_length);
+    ++as->num_received;
+  }
+
+  if (as->num_received < as->num_fragments)
+    return 0;
+
+  // Hand the complete event over, decompressed if it was compressed
+  if (as->compression)
+    return inflate_event(as, arena, event);
+
+  *event = as->event;
+  as->event.data = NULL;
+  return 1;
+}
+
+int inflate_event(EventAssembler *as, EventArena *arena, Event *event) {
+  Event inflated = {as->event.id, as->raw_length, NULL};
+
+  inflated.data = arena ? event_arena_alloc(arena, as->raw_length)
+                        : malloc(sizeof(uint8_t) * as->raw_length);
+  if (inflated.data &&
+      decompress_data(as->compression, as->event.data, as->event.data_length,
+                      inflated.data, as->raw_length))
+    release_event_data(arena, &inflated);
+
+  // The compressed data has served its purpose either way
+  free((void *)as->event.data);
+  as->event.data = NULL;
+  if (!inflated.data)
+    return -1;
+
+  *event = inflated;
+  return 1;
+}
+
+int unpack_next_event(EventAssembler *as, const FDBKeyValue *kv,
+                      EventArena *arena, Event *event) {
+  const uint8_t *data;
+  uint8_t *copy;
+  uint32_t data_length;
+  uint64_t id;
+
+  // Skip the events of the block in front of the range
+  while ((as->next_packed < as->num_packed) &&
+         ((as->packed_id + as->next_packed) < as->first_id))
+    ++as->next_packed;
+
+  // Stop at the end of the block, or of the range
+  id = as->packed_id + as->next_packed;
+  if ((as->next_packed == as->num_packed) ||
+      (as->last_id && (id >= as->last_id))) {
+    as->next_packed = as->num_packed;
+    return 0;
+  }
+
+  if (unpack_event(kv->value, (uint32_t)kv->value_length, as->num_packed,
+                   as->next_packed, &data, &data_length))
+    return -1;
+
+  // Copy the event out, as its key-value pair does not outlive the read
+  if (arena) {
+    if (!(copy = event_arena_alloc(arena, data_length))) {
+      event->id = id;
+      event->data_length = data_length;
+      event->data = NULL;
+      return FDB_READ_ARENA_FULL;
+    }
+  } else if (!(copy = malloc(sizeof(uint8_t) * data_length))) {
+    return -1;
+  }
+  memcpy(copy, data, data_length);
+
+  event->id = id;
+  event->data_length = data_length;
+  event->data = copy;
+
+  // The block is done once its last event in range is handed over
+  ++as->next_packed;
+  if (as->last_id && ((id + 1) >= as->last_id))
+    as->next_packed = as->num_packed;
+
+  return (as->next_packed < as->num_packed) ? 2 : 1;
+}
+
+void release_event_data(EventArena *arena, Event *event) {
+  if (!arena)
+    free((void *)event->data);
+  else if ((event->data + event->data_length) == (arena->data + arena->used))
+    arena->used -= event->data_length;
+
+  event->data = NULL;
 }
 
-void add_event_clear_transaction(FDBTransaction *tx, uint64_t id, uint32_t num_fragments) {
-  uint8_t range_start_key[FDB_KEY_TOTAL_LENGTH] = {0};
-  uint8_t range_end_key[FDB_KEY_TOTAL_LENGTH] = {0};
+void add_event_clear_transaction(FDBTransaction *tx, uint64_t id,
+                                 uint32_t start_pos, uint32_t end_pos) {
+  uint8_t range_start_key[FDB_KEY_MAX_LENGTH] = {0};
+  uint8_t range_end_key[FDB_KEY_MAX_LENGTH] = {0};
+  uint8_t range_start_length, range_end_length;
 
   // Setup start key for range
-  fdb_build_event_key(range_start_key, id, 0);
+  range_start_length = fdb_build_event_key(range_start_key, id, start_pos);
 
   // Setup end key for range
-  fdb_build_event_key(range_end_key, id, num_fragments);
+  range_end_length = fdb_build_event_key(range_end_key, id, end_pos);
 
   // Add clear operation to transaction
-  fdb_transaction_clear_range(tx, range_start_key, FDB_KEY_TOTAL_LENGTH,
-                              range_end_key, FDB_KEY_TOTAL_LENGTH);
+  fdb_transaction_clear_range(tx, range_start_key, range_start_length,
+                              range_end_key, range_end_length);
 }
 
 void check_error_bail(fdb_error_t err) {
@@ -15,7 +15,10 @@
 
 #include <foundationdb/fdb_c.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include <time.h>
 
 #include "event.h"
 
@@ -24,6 +27,104 @@
 #define FDB_KEY_EVENT_LENGTH 8
 #define FDB_KEY_FRAGMENT_LENGTH 4
 
+// Longest event fragment key in any key format, without the header
+#define FDB_KEY_MAX_LENGTH 15
+
+// Key formats: fixed-width big-endian ids and fragment numbers, or compact
+// order-preserving variable-length integers
+#define FDB_KEY_FORMAT_FIXED 0
+#define FDB_KEY_FORMAT_COMPACT 1
+
+// Returned by the readers into an event arena when the arena is too small for
+// the next event
+#define FDB_READ_ARENA_FULL -2
+
+//==============================================================================
+// Types
+//==============================================================================
+
+/// Retry state of a single transaction: how often and for how long it has
+/// been retried, and the bound of the next jittered delay.
+typedef struct fdb_retry_t {
+  uint32_t attempts;     // Number of retries so far.
+  uint32_t backoff_us;   // Upper bound of the next jittered delay.
+  uint32_t jitter;       // State of the xorshift generator of the delays.
+  struct timespec start; // Time at which the first attempt started.
+} FDBRetry;
+
+/// Aggregate progress of a write, updated as batches commit. Safe to read from
+/// any thread while the write is running.
+typedef struct fdb_write_progress_t {
+  atomic_uint_fast64_t events;    // Events whose last fragment is durable.
+  atomic_uint_fast64_t fragments; // Fragments durable so far.
+  atomic_uint_fast64_t commits;   // Transactions committed so far.
+} FDBWriteProgress;
+
+/// Reassembly state of the event whose fragments are being read, shared by the
+/// single-event, range and cursor readers.
+typedef struct event_assembler_t {
+  Event event;            // Event being assembled; data is NULL between events.
+  uint32_t num_fragments; // Fragments in the event, including the first.
+  uint32_t num_received;  // Fragments received so far.
+  uint32_t prefix_length; // Length of the first fragment.
+  uint32_t fragment_length; // Length of every fragment after the first.
+  EventArena *arena;      // Arena holding the event data, or NULL for the heap.
+  uint64_t first_id;      // Id of the first event to hand over.
+  uint64_t last_id;       // Id after the last event to hand over from packed
+                          // blocks, or 0 for no limit.
+  uint64_t packed_id;     // Id of the first event of the packed block.
+  uint32_t num_packed;    // Events in the packed block the last event came
+                          // from, or 0 if it was not packed.
+  uint32_t next_packed;   // Next event of the packed block to hand over.
+  bool leading;           // Set while the next key-value pair may precede the
+                          // range being read.
+  uint8_t compression;    // Algorithm the event was compressed with, or
+                          // COMPRESSION_NONE.
+  uint64_t raw_length;    // Length of the event once decompressed.
+} EventAssembler;
+
+/// Events read from a range, where each single-fragment event borrows its data
+/// straight from the FoundationDB future that returned it rather than a copy.
+/// The futures stay alive, and the data valid, until the batch is released.
+typedef struct fdb_event_batch_t {
+  Event *events;        // Events read, in id order.
+  uint32_t num_events;  // Number of events read.
+  FDBFuture **futures;  // Futures holding borrowed event data.
+  uint32_t num_futures; // Number of futures held.
+  uint8_t **copies;     // Data of the multi-fragment events, on the heap.
+  uint32_t num_copies;  // Number of copies.
+} FDBEventBatch;
+
+typedef struct fdb_pipeline_t FDBPipeline;
+
+/// A window slot of a pipelined writer: one reusable transaction and, while a
+/// commit is in flight, its future.
+typedef struct fdb_pipeline_slot_t {
+  FDBPipeline *pipeline;            // Pipeline owning the slot.
+  FDBTransaction *tx;               // Transaction reused by every commit.
+  FDBFuture *future;                // Commit future, while in flight.
+  void *param;                      // Caller data for the commit in flight.
+  FDBRetry retry;                   // Retry state of the commit in flight.
+  struct fdb_pipeline_slot_t *next; // Next free slot.
+} FDBPipelineSlot;
+
+/// Bounded window of concurrently committing transactions. A single producer
+/// thread fills slots and commits them; commit callbacks return slots to the
+/// window and wake the producer through a condition variable.
+struct fdb_pipeline_t {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  FDBPipelineSlot *slots;      // All slots in the window.
+  FDBPipelineSlot *free_slots; // Slots available for the producer.
+  uint32_t window_size;        // Maximum number of commits in flight.
+  uint32_t in_flight;          // Current number of commits in flight.
+  fdb_error_t error;           // First commit error, if any.
+  void (*on_commit)(FDBPipelineSlot *slot, fdb_error_t err); // Optional hook.
+  void (*refill)(FDBPipelineSlot *slot); // Optional hook re-adding the writes
+                                         // of a slot; enables retries.
+  void *hook_param;            // Optional data for the hooks.
+};
+
 //==============================================================================
 // Variables
 //==============================================================================
@@ -50,13 +151,143 @@ void fdb_shutdown_database(void);
 int fdb_shutdown_network_thread(void);
 
 /// Set the maximum batch size of event fragments in a single write transaction.
+/// Transactions are otherwise only limited by the byte budget.
 ///
-/// @param[in] batch_size  The new maximum batch size (must be greater than 0).
+/// @param[in] batch_size  The new maximum batch size (0 for no limit).
 ///
 /// @return  0  Success.
 /// @return -1  Failure.
 int fdb_set_batch_size(uint32_t batch_size);
 
+/// Set the byte budget of a single write transaction: a transaction is closed
+/// before the key and value bytes of its writes exceed the budget.
+///
+/// @param[in] batch_bytes  The new budget (between 1 and MAX_BATCH_BYTES).
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int fdb_set_batch_bytes(uint32_t batch_bytes);
+
+/// Set the length of every fragment but the first of the events that
+/// fdb_write_event_array() fragments itself. Each event records its own
+/// fragment length, so events written before a change stay readable.
+///
+/// @param[in] fragment_size  The new fragment length in bytes (between 1 and
+///                           MAX_VALUE_SIZE).
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int fdb_set_fragment_size(uint32_t fragment_size);
+
+/// Set the number of key buckets event keys are spread over. With one bucket
+/// (the default), keys follow the event ids, so every append lands at the end
+/// of the same key range and on the same storage servers. With more, each
+/// event goes to bucket (id % num_buckets) under a key prefix of its own,
+/// spreading appends over as many key ranges; the range readers and cursors
+/// read every bucket and merge the events back into id order. Every client of
+/// a database must use the same number of buckets, and the number cannot
+/// change once events are written.
+///
+/// @param[in] num_buckets  The new number of buckets (between 1 and
+///                         MAX_KEY_BUCKETS).
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int fdb_set_key_buckets(uint32_t num_buckets);
+
+/// Set the format of event keys. FDB_KEY_FORMAT_FIXED (the default) spends 8
+/// bytes on the id and 4 on the fragment number of every key.
+/// FDB_KEY_FORMAT_COMPACT encodes both as variable-length integers that sort
+/// in numeric order, so keys keep their order but a small fragment number
+/// takes one byte, and an id of up to 16M four. The formats live under
+/// different key prefixes: events written in one format are not seen in the
+/// other, so every client of a database must use the same format.
+///
+/// @param[in] key_format  The new key format.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int fdb_set_key_format(uint8_t key_format);
+
+/// Set the size of the packed blocks written by the event array writers. With
+/// a size of 0 (the default), every event has keys of its own. Otherwise, each
+/// run of single-fragment events with consecutive ids is packed into blocks of
+/// up to MAX_PACKED_EVENTS events and pack_bytes bytes, each stored as one
+/// key-value pair under the key of its first event, which cuts the number of
+/// keys written and stored for small events. Every reader finds events inside
+/// packed blocks. Packing is skipped with several key buckets.
+///
+/// Packed events are cleared a whole block at a time: clearing the first event
+/// of a block clears every event in it, and clearing any other fails, unless
+/// it comes after the first one in the same fdb_clear_event_array() call.
+///
+/// @param[in] pack_bytes  The new block size in bytes (at most
+///                        OPTIMAL_VALUE_SIZE), or 0 to turn packing off.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int fdb_set_pack_bytes(uint32_t pack_bytes);
+
+/// Set the maximum number of write transactions kept in flight by the
+/// pipelined writer.
+///
+/// @param[in] window_size  The new window size (must be greater than 0).
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int fdb_set_window_size(uint32_t window_size);
+
+/// Set the maximum number of times a single transaction is retried after a
+/// retryable error.
+///
+/// @param[in] retry_limit  The new retry limit (0 disables retries).
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int fdb_set_retry_limit(uint32_t retry_limit);
+
+/// Set the time budget for retrying a single transaction, counted from its
+/// first attempt.
+///
+/// @param[in] timeout_ms  The new time budget in milliseconds (must be greater
+///                        than 0).
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int fdb_set_retry_timeout(uint32_t timeout_ms);
+
+/// Enable or disable the read version cache. When enabled, new read
+/// transactions skip the round trip for a read version by taking a recent one,
+/// at most max_age_ms old, so they may miss writes of other processes made
+/// within that time. The cache refreshes in the background and takes the
+/// version of every commit of this process, so reads always see its own
+/// writes.
+///
+/// @param[in] max_age_ms  The staleness bound in milliseconds, below
+///                        READ_TX_MAX_AGE_MS, or 0 to disable the cache.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int fdb_set_read_version_cache(uint32_t max_age_ms);
+
+/// Start tracking the retries of a transaction.
+///
+/// @param[in] retry  Handle for the retry state to initialize.
+void fdb_retry_init(FDBRetry *retry);
+
+/// Handle an error from a transaction. If the error is retryable and the
+/// retry budgets allow it, let FoundationDB reset the transaction and back
+/// off, then add a jittered delay; the caller must add its operations to the
+/// transaction again. Otherwise, print the error and give up.
+///
+/// @param[in] tx     Handle for the transaction that failed.
+/// @param[in] err    FoundationDB error code of the failure.
+/// @param[in] retry  Handle for the retry state of the transaction.
+///
+/// @return  0  The transaction should be retried.
+/// @return -1  Failure.
+int fdb_retry_on_error(FDBTransaction *tx, fdb_error_t err, FDBRetry *retry);
+
 /// Setup a handle for a new FoundationDB transaction.
 ///
 /// @param[in] tx  Memory address to write the new transaction handle into.
@@ -65,7 +296,8 @@ int fdb_set_batch_size(uint32_t batch_size);
 /// @return -1  Failure.
 int fdb_setup_transaction(FDBTransaction **tx);
 
-/// Attempt to synchronously apply a FoundationDB write transaction.
+/// Attempt to synchronously apply a FoundationDB write transaction. The
+/// transaction is not retried on failure (see fdb_retry_on_error()).
 ///
 /// @param[in] tx  Handle for the transaction containing writes/clears.
 ///
@@ -84,7 +316,11 @@ int fdb_send_transaction(FDBTransaction *tx);
 /// @return -1  Failure.
 int fdb_write_batch(const Source *src, uint32_t *pos);
 
-/// Write a single event source.
+/// Write a single event source. An event larger than one transaction is
+/// written atomically: every fragment but the first is staged in pipelined
+/// transactions, then the first fragment publishes the event in one small
+/// commit. A write that fails midway leaves staged fragments that readers
+/// ignore, and that a later fdb_write_event() or clear of the event removes.
 ///
 /// @param[in] src   Handle for the event source to write.
 ///
@@ -92,7 +328,11 @@ int fdb_write_batch(const Source *src, uint32_t *pos);
 /// @return -1  Failure.
 int fdb_write_event(const Source *src);
 
-/// Write an array of fragmented events.
+/// Write an array of fragmented events. When the write spans several
+/// transactions, each one carries an idempotency marker, so that a commit with
+/// an unknown result is only resent if it did not land. A write that fails
+/// tries once to clear the markers it set; markers left behind by that or by a
+/// process dying midway are removed by fdb_clear_write_markers().
 ///
 /// @param[in] events      Handle for the array of event sources to write.
 /// @param[in] num_events  Number of events in the array.
@@ -102,7 +342,71 @@ int fdb_write_event(const Source *src);
 int fdb_write_fragmented_event_array(const FragmentedEventSource f_events[],
                                      uint32_t num_events);
 
-/// Write an array of events.
+/// Write an array of fragmented events, keeping up to the configured window
+/// size of batches committing concurrently.
+///
+/// @param[in] f_events    Handle for the array of event sources to write.
+/// @param[in] num_events  Number of events in the array.
+///
+/// @return  0  Success
+/// @return -1  Failure
+int fdb_write_fragmented_event_array_pipelined(
+    const FragmentedEventSource f_events[], uint32_t num_events);
+
+/// Write an event from a streaming source, keeping up to the configured window
+/// size of batches committing concurrently. Fragments are pulled in order, and
+/// only those of the batches in flight are kept, so peak memory stays at about
+/// the window size times the byte budget of a transaction, however large the
+/// event is. Like fdb_write_event(), the event only becomes visible once all
+/// of it is durable.
+///
+/// @param[in] es  Handle for the streaming event source to write; must not
+///                have been written before.
+///
+/// @return  0  Success
+/// @return -1  Failure
+int fdb_write_stream_event(StreamEventSource *es);
+
+/// Initialize a pipelined writer.
+///
+/// @param[in] pipeline     Handle for the pipeline to initialize.
+/// @param[in] window_size  Maximum number of commits in flight.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int fdb_pipeline_init(FDBPipeline *pipeline, uint32_t window_size);
+
+/// Wait for a free slot in the window and prepare its transaction for writes.
+///
+/// @param[in] pipeline  Handle for the pipeline.
+///
+/// @return  Handle for the slot, or NULL if an earlier commit failed.
+FDBPipelineSlot *fdb_pipeline_acquire(FDBPipeline *pipeline);
+
+/// Start committing the transaction of an acquired slot without waiting for
+/// the result. The slot returns to the window once the commit completes.
+///
+/// @param[in] slot  Handle for the slot.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int fdb_pipeline_commit(FDBPipelineSlot *slot);
+
+/// Wait until every commit in flight has completed.
+///
+/// @param[in] pipeline  Handle for the pipeline.
+///
+/// @return  0  Success, every commit was applied.
+/// @return -1  Failure, at least one commit failed.
+int fdb_pipeline_drain(FDBPipeline *pipeline);
+
+/// Wait for commits in flight, then release the resources of a pipeline.
+///
+/// @param[in] pipeline  Handle for the pipeline.
+void fdb_pipeline_destroy(FDBPipeline *pipeline);
+
+/// Write an array of events, fragmented to the length set with
+/// fdb_set_fragment_size().
 ///
 /// @param[in] events      Handle for the array of events to write.
 /// @param[in] num_events  Number of events in the array.
@@ -112,6 +416,11 @@ int fdb_write_fragmented_event_array(const FragmentedEventSource f_events[],
 int fdb_write_event_array(Event events[], uint32_t num_events);
 
 /// Read event fragments from the database and combine them into one event.
+/// Fails without reading further if the first fragment, which publishes the
+/// event, is missing. Like every reader, it moves on to a new transaction
+/// before its read version expires, resuming after the last key received.
+/// When the event cache is enabled, cached events are copied from it, and
+/// events read from the database are added to it.
 ///
 /// @param[in] event  Handle for the event to write to.
 ///
@@ -119,7 +428,21 @@ int fdb_write_event_array(Event events[], uint32_t num_events);
 /// @return -1  Failure.
 int fdb_read_event(Event *event);
 
-/// Read an array of events from the database.
+/// Read an event like fdb_read_event(), reassembling it into an event arena
+/// instead of the heap. If the arena is too small, nothing is taken from it,
+/// and the length of the event is written to event->data_length so that the
+/// caller can make room and read again.
+///
+/// @param[in] event  Handle for the event to write to.
+/// @param[in] arena  Handle for the arena, or NULL to allocate from the heap.
+///
+/// @return  0  Success.
+/// @return -2  FDB_READ_ARENA_FULL, the arena is too small for the event.
+/// @return -1  Failure.
+int fdb_read_event_into(Event *event, EventArena *arena);
+
+/// Read an array of events from the database. Events with consecutive ids are
+/// read with fdb_read_event_range().
 ///
 /// @param[in] events       Handle for the event array.
 /// @param[in] num_events   Number of events in array.
@@ -128,7 +451,45 @@ int fdb_read_event(Event *event);
 /// @return -1  Failure.
 int fdb_read_event_array(Event *events, uint32_t num_events);
 
-/// Remove a single fragmented event from the database.
+/// Read every event with an id in [first_id, last_id) from the database with
+/// range reads, splitting the key-value pairs into events as they arrive. Ids
+/// missing from the range are skipped.
+///
+/// @param[in]  first_id    Id of the first event in the range.
+/// @param[in]  last_id     Id after the last event in the range.
+/// @param[out] events      Address to write the array of events read into;
+///                         the caller frees it and the data of every event.
+/// @param[out] num_events  Address to write the number of events read into.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int fdb_read_event_range(uint64_t first_id, uint64_t last_id, Event **events,
+                         uint32_t *num_events);
+
+/// Read every event with an id in [first_id, last_id) like
+/// fdb_read_event_range(), without copying single-fragment events: their data
+/// points into the key-value arrays of the range reads. Only events of several
+/// fragments are reassembled on the heap.
+///
+/// @param[in]  first_id  Id of the first event in the range.
+/// @param[in]  last_id   Id after the last event in the range.
+/// @param[out] batch     Handle for the batch to read into; the caller
+///                       releases it with fdb_release_event_batch().
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int fdb_read_event_batch(uint64_t first_id, uint64_t last_id,
+                         FDBEventBatch *batch);
+
+/// Release a batch of events, along with the futures and copies holding their
+/// data. No event of the batch may be used afterwards.
+///
+/// @param[in] batch  Handle for the batch.
+void fdb_release_event_batch(FDBEventBatch *batch);
+
+/// Remove a single fragmented event from the database. The first event of a
+/// packed block is cleared along with its block, and any other packed event is
+/// refused (see fdb_set_pack_bytes()).
 ///
 /// @param[in] event  Handle for the event to remove.
 ///
@@ -136,7 +497,9 @@ int fdb_read_event_array(Event *events, uint32_t num_events);
 /// @return -1  Failure.
 int fdb_clear_event(const FragmentedEventSource *event);
 
-/// Remove an array of fragmented events from the database.
+/// Remove an array of fragmented events from the database. Packed events are
+/// cleared as by fdb_clear_event(), except that the events of a block may all
+/// be cleared at once, first one first.
 ///
 /// @param[in] events       Handle for the array of events to remove.
 /// @param[in] num_events   Number of events in the array.
@@ -145,18 +508,32 @@ int fdb_clear_event(const FragmentedEventSource *event);
 /// @return -1  Failure.
 int fdb_clear_event_array(const FragmentedEventSource events[], uint32_t num_events);
 
+/// Remove the idempotency markers left behind by array writes that failed or
+/// never finished (see fdb_write_fragmented_event_array()). Markers are kept
+/// outside of the event keys, so events are left alone. Must not run
+/// alongside an array write, whose markers it would remove too.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int fdb_clear_write_markers(void);
+
 /// Remove all key-value pairs from the database.
 ///
 /// @return  0  Success.
 /// @return -1  Failure.
 int fdb_clear_database(void);
 
-/// Build the FoundationDB key for an event fragment.
+/// Build the FoundationDB key for an event fragment, in the key bucket of the
+/// event (see fdb_set_key_buckets()) and the current key format (see
+/// fdb_set_key_format()).
 ///
-/// @param[in] fdb_key   Pointer to the write location for the FoundationDB key.
+/// @param[in] fdb_key   Pointer to the write location for the FoundationDB key,
+///                      of at least FDB_KEY_MAX_LENGTH bytes.
 /// @param[in] key       The unique event identifier.
 /// @param[in] fragment  The fragment number.
-void fdb_build_event_key(uint8_t *fdb_key, uint64_t key, uint32_t fragment);
+///
+/// @return  Length of the key in bytes.
+uint8_t fdb_build_event_key(uint8_t *fdb_key, uint64_t key, uint32_t fragment);
 
 /// Check if a FoundationDB API command returned an error. If so, print the
 /// error description.
@@ -0,0 +1,340 @@
+/// @file fdb_async.c
+///
+/// Definitions for the non-blocking readers of the FoundationDB event log.
+///
+/// Nothing here waits on a future: every range read gets a callback, which
+/// hands the complete events to the caller, then issues the next range read
+/// from the last key received. Retries are chained the same way, through the
+/// future of fdb_transaction_on_error(), so a read only ever holds its own
+/// state and never a thread.
+///
+/// Potentially helpful documentation:
+///   https://apple.github.io/foundationdb/api-c.html#c.fdb_future_set_callback
+
+#include <foundationdb/fdb_c.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "constants.h"
+#include "fdb.h"
+#include "fdb_async.h"
+#include "fdb_internal.h"
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Set up an asynchronous read of the events with ids in [first_id, last_id)
+/// and issue its first range read.
+///
+/// @param[in] read      Handle for the read state.
+/// @param[in] first_id  Id of the first event in the range.
+/// @param[in] last_id   Id after the last event in the range.
+/// @param[in] single    Whether this reads one event, which must exist.
+/// @param[in] on_event  Callback receiving each event.
+/// @param[in] on_done   Callback receiving the result of the read.
+/// @param[in] param     Caller data for the callbacks.
+///
+/// @return  0  The read was started; the done callback will run.
+/// @return -1  Failure; no callback will run.
+int async_read_start(FDBAsyncRead *read, uint64_t first_id, uint64_t last_id,
+                     bool single, FDBAsyncEventCallback on_event,
+                     FDBAsyncDoneCallback on_done, void *param);
+
+/// Point an asynchronous range read at the start of a key bucket.
+///
+/// @param[in] read    Handle for the read state.
+/// @param[in] bucket  The key bucket.
+void async_read_set_bucket(FDBAsyncRead *read, uint32_t bucket);
+
+/// Issue the next range read of an asynchronous read, after the last key read
+/// so far. Once the callback is set, the read may already be done.
+///
+/// @param[in] read  Handle for the read state.
+///
+/// @return  FoundationDB error code, 0 if the range read is in flight.
+fdb_error_t async_read_issue(FDBAsyncRead *read);
+
+/// Callback function for when a range read of an asynchronous read completes.
+/// Delivers the complete events, then issues the next range read or finishes.
+///
+/// @param[in] future  Handle for the FoundationDB future.
+/// @param[in] param   Handle for the FDBAsyncRead object.
+void async_read_callback(FDBFuture *future, void *param);
+
+/// Retry a failed range read of an asynchronous read if possible, otherwise
+/// finish the read.
+///
+/// @param[in] read  Handle for the read state.
+/// @param[in] err   FoundationDB error code of the range read.
+void async_read_retry(FDBAsyncRead *read, fdb_error_t err);
+
+/// Callback function for when FoundationDB is ready for a range read of an
+/// asynchronous read to be retried.
+///
+/// @param[in] future  Handle for the FoundationDB future.
+/// @param[in] param   Handle for the FDBAsyncRead object.
+void async_retry_callback(FDBFuture *future, void *param);
+
+/// Release the resources of an asynchronous read and report its result.
+///
+/// @param[in] read    Handle for the read state.
+/// @param[in] result  0 on success, -1 on failure.
+void async_read_finish(FDBAsyncRead *read, int result);
+
+//==============================================================================
+// Functions
+//==============================================================================
+
+int fdb_read_event_async(FDBAsyncRead *read, uint64_t id,
+                         FDBAsyncEventCallback on_event,
+                         FDBAsyncDoneCallback on_done, void *param) {
+  return async_read_start(read, id, (id + 1), true, on_event, on_done, param);
+}
+
+int fdb_read_event_range_async(FDBAsyncRead *read, uint64_t first_id,
+                               uint64_t last_id,
+                               FDBAsyncEventCallback on_event,
+                               FDBAsyncDoneCallback on_done, void *param) {
+  return async_read_start(read, first_id, last_id, false, on_event, on_done,
+                          param);
+}
+
+int async_read_start(FDBAsyncRead *read, uint64_t first_id, uint64_t last_id,
+                     bool single, FDBAsyncEventCallback on_event,
+                     FDBAsyncDoneCallback on_done, void *param) {
+  read->future = NULL;
+  read->resumed = false;
+  read->single = single;
+  read->num_events = 0;
+  init_assembler(&read->as, first_id, last_id);
+  read->on_event = on_event;
+  read->on_done = on_done;
+  read->param = param;
+  read->first_id = first_id;
+  read->last_id = last_id;
+
+  // Setup keys for range read; a single event is looked for from its first
+  // fragment back to the start of its own bucket
+  if (single) {
+    read->begin_length = build_bucket_key(
+        read->begin_key, (uint32_t)(first_id % fdb_key_buckets), 0, 0);
+    read->end_length = fdb_build_event_key(read->end_key, first_id, 1);
+  } else {
+    async_read_set_bucket(read, 0);
+  }
+
+  if (setup_read_transaction(&read->tx, &read->tx_start))
+    return -1;
+  fdb_retry_init(&read->retry);
+
+  // An empty range needs no reads
+  if (first_id >= last_id) {
+    async_read_finish(read, 0);
+    return 0;
+  }
+
+  if (fdb_check_error(async_read_issue(read))) {
+    fdb_transaction_destroy(read->tx);
+    return -1;
+  }
+
+  // Success
+  return 0;
+}
+
+void async_read_set_bucket(FDBAsyncRead *read, uint32_t bucket) {
+  read->bucket = bucket;
+  read->resumed = false;
+  read->as.leading = (fdb_key_buckets == 1);
+  read->begin_length =
+      build_bucket_key(read->begin_key, bucket, read->first_id, 0);
+  read->end_length = build_bucket_key(read->end_key, bucket, read->last_id, 0);
+}
+
+fdb_error_t async_read_issue(FDBAsyncRead *read) {
+  fdb_error_t err;
+
+  read_renew_transaction(read->tx, &read->tx_start);
+
+  // As with fdb_read_event(), the first range of a single event is the one
+  // key that starts it: its first fragment, or the packed block holding it.
+  // Without key buckets, the first range of a range read starts at the key
+  // before the range, which may be a packed block too.
+  if (read->single && !read->resumed)
+    read->future = fdb_transaction_get_range(
+        read->tx,
+        FDB_KEYSEL_FIRST_GREATER_OR_EQUAL(read->begin_key, read->begin_length),
+        FDB_KEYSEL_FIRST_GREATER_OR_EQUAL(read->end_key, read->end_length), 1,
+        0, FDB_STREAMING_MODE_EXACT, 1, 0, 1);
+  else
+    read->future = fdb_transaction_get_range(
+        read->tx, read->begin_key, read->begin_length, read->resumed,
+        (read->resumed || !read->as.leading),
+        FDB_KEYSEL_FIRST_GREATER_OR_EQUAL(read->end_key, read->end_length),
+        0, 0, FDB_STREAMING_MODE_WANT_ALL, 1, 0, 0);
+
+  if ((err = fdb_future_set_callback(read->future, &async_read_callback,
+                                     (void *)read))) {
+    fdb_future_destroy(read->future);
+    read->future = NULL;
+  }
+
+  return err;
+}
+
+void async_read_callback(FDBFuture *future, void *param) {
+  FDBAsyncRead *read = (FDBAsyncRead *)param;
+  const FDBKeyValue *out_kv;
+  fdb_bool_t out_more;
+  fdb_error_t err;
+  int out_count;
+
+  if (!(err = fdb_future_get_error(future)))
+    err = fdb_future_get_keyvalue_array(future, &out_kv, &out_count, &out_more);
+
+  if (err) {
+    fdb_future_destroy(future);
+    read->future = NULL;
+    async_read_retry(read, err);
+    return;
+  }
+
+  // Hand each complete event over; nothing may follow a single event
+  for (int i = 0; i < out_count; ++i) {
+    Event event;
+
+    if (read->single && read->num_events)
+      goto read_fail;
+
+    switch (assemble_fragment(&read->as, &out_kv[i], NULL, &event)) {
+    case 2:
+      // The next event of a packed block comes from the same key-value pair
+      --i;
+      // Fall through
+    case 1:
+      ++read->num_events;
+      if (read->on_event(read->param, &event))
+        goto read_fail;
+      break;
+    case 0:
+      break;
+    default:
+      goto read_fail;
+    }
+  }
+
+  // The first key of a single event must have started it; the rest of its
+  // fragments follow, in its key bucket
+  if (read->single && !read->resumed) {
+    if (!read->num_events && !read->as.event.data)
+      goto read_fail;
+    read->end_length =
+        fdb_build_event_key(read->end_key, read->first_id, UINT32_MAX);
+    out_more = !read->num_events;
+  }
+
+  // Remember the last key received
+  if (out_count) {
+    const FDBKeyValue *last = &out_kv[out_count - 1];
+
+    if (last->key_length > (int)sizeof(read->begin_key))
+      goto read_fail;
+    memcpy(read->begin_key, last->key, last->key_length);
+    read->begin_length = last->key_length;
+    read->resumed = true;
+  }
+
+  fdb_future_destroy(future);
+  read->future = NULL;
+
+  // Move on to the next key bucket, unless the bucket ended in the middle of an
+  // event
+  if (!out_more && !read->single && !read->as.event.data &&
+      ((read->bucket + 1) < fdb_key_buckets)) {
+    async_read_set_bucket(read, (read->bucket + 1));
+    out_more = 1;
+  }
+
+  // Chain the next range read; the read made progress, so its retry budget
+  // starts over
+  if (out_more) {
+    fdb_retry_init(&read->retry);
+    if (fdb_check_error(async_read_issue(read)))
+      async_read_finish(read, -1);
+    return;
+  }
+
+  // Fail if the range ended in the middle of an event, or a single event was
+  // not found
+  async_read_finish(read, (read->as.event.data ||
+                           (read->single && !read->num_events))
+                              ? -1
+                              : 0);
+  return;
+
+// Failure
+read_fail:
+  fdb_future_destroy(future);
+  read->future = NULL;
+  async_read_finish(read, -1);
+}
+
+void async_read_retry(FDBAsyncRead *read, fdb_error_t err) {
+  // An expired read version only needs a new transaction, and the first one
+  // since the read last made progress is free
+  if ((err == FDB_ERROR_TRANSACTION_TOO_OLD) &&
+      (!read->retry.attempts || retry_allowed(&read->retry, err))) {
+    ++read->retry.attempts;
+    fdb_transaction_reset(read->tx);
+    timespec_get(&read->tx_start, TIME_UTC);
+    if (!(err = async_read_issue(read)))
+      return;
+  } else if (retry_allowed(&read->retry, err)) {
+    // This runs on the network thread, so only FoundationDB's own backoff
+    // applies
+    (void)retry_next_delay(&read->retry);
+
+    read->future = fdb_transaction_on_error(read->tx, err);
+    if (!fdb_future_set_callback(read->future, &async_retry_callback,
+                                 (void *)read))
+      return;
+
+    fdb_future_destroy(read->future);
+    read->future = NULL;
+  }
+
+  fdb_check_error(err);
+  async_read_finish(read, -1);
+}
+
+void async_retry_callback(FDBFuture *future, void *param) {
+  FDBAsyncRead *read = (FDBAsyncRead *)param;
+  fdb_error_t err = fdb_future_get_error(future);
+
+  fdb_future_destroy(future);
+  read->future = NULL;
+
+  // FoundationDB reset the transaction, so resume from the last key received
+  if (!err) {
+    timespec_get(&read->tx_start, TIME_UTC);
+    if (!(err = async_read_issue(read)))
+      return;
+  }
+
+  fdb_check_error(err);
+  async_read_finish(read, -1);
+}
+
+void async_read_finish(FDBAsyncRead *read, int result) {
+  free((void *)read->as.event.data);
+  read->as.event.data = NULL;
+  fdb_transaction_destroy(read->tx);
+  read->tx = NULL;
+
+  // The caller may reuse the read from here on
+  read->on_done(read->param, result);
+}
@@ -0,0 +1,106 @@
+/// @file fdb_async.h
+///
+/// Declarations for reading the FoundationDB event log without blocking: each
+/// read chains its range reads from FoundationDB callbacks and hands events to
+/// the caller as they complete, so one thread can keep many reads in flight.
+
+#pragma once
+
+#include <foundationdb/fdb_c.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "event.h"
+#include "fdb.h"
+
+//==============================================================================
+// Types
+//==============================================================================
+
+/// Callback receiving each event of an asynchronous read.
+///
+/// @param[in] param  Caller data given to the read.
+/// @param[in] event  Handle for the event; the callback owns its data.
+///
+/// @return  0  Continue the read.
+/// @return -1  Stop the read, which then fails.
+typedef int (*FDBAsyncEventCallback)(void *param, Event *event);
+
+/// Callback receiving the result of an asynchronous read, once no more events
+/// will be delivered. The read may be reused or released from this callback.
+///
+/// @param[in] param   Caller data given to the read.
+/// @param[in] result  0 on success, -1 on failure.
+typedef void (*FDBAsyncDoneCallback)(void *param, int result);
+
+/// State of one asynchronous read, owned by the caller until the read is
+/// done. At most one range read of it is in flight at a time.
+typedef struct fdb_async_read_t {
+  FDBTransaction *tx;       // Transaction used for the range reads.
+  struct timespec tx_start; // Time at which the transaction was started.
+  FDBFuture *future;        // Range read or retry in flight.
+  uint8_t begin_key[FDB_KEY_MAX_LENGTH + MAX_HEADER_SIZE]; // Key after which
+                                                           // the next read
+                                                           // starts.
+  int begin_length;         // Length of the begin key.
+  bool resumed;             // Set once the begin key is a key already read.
+  uint8_t end_key[FDB_KEY_MAX_LENGTH]; // Key the range ends before.
+  int end_length;           // Length of the end key.
+  uint64_t first_id;        // Id of the first event in the range.
+  uint64_t last_id;         // Id after the last event in the range.
+  uint32_t bucket;          // Key bucket being read.
+  bool single;              // Whether this reads one event, which must exist.
+  uint32_t num_events;      // Number of events delivered so far.
+  EventAssembler as;        // Event being reassembled.
+  FDBRetry retry;           // Retry state of the range read in flight.
+  FDBAsyncEventCallback on_event; // Callback receiving each event.
+  FDBAsyncDoneCallback on_done;   // Callback receiving the result.
+  void *param;              // Caller data for the callbacks.
+} FDBAsyncRead;
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Start reading one event without blocking. Like fdb_read_event(), the read
+/// fails if the first fragment of the event is missing.
+///
+/// The callbacks run on the FoundationDB network thread (or on the calling
+/// thread, if a range read completes before its callback is set), so they must
+/// not block.
+///
+/// @param[in] read      Handle for the read state, untouched by the caller
+///                      until the done callback runs.
+/// @param[in] id        Id of the event to read.
+/// @param[in] on_event  Callback receiving the event.
+/// @param[in] on_done   Callback receiving the result of the read.
+/// @param[in] param     Caller data for the callbacks.
+///
+/// @return  0  The read was started; the done callback will run.
+/// @return -1  Failure; no callback will run.
+int fdb_read_event_async(FDBAsyncRead *read, uint64_t id,
+                         FDBAsyncEventCallback on_event,
+                         FDBAsyncDoneCallback on_done, void *param);
+
+/// Start reading every event with an id in [first_id, last_id) without
+/// blocking. Events are delivered in id order as they are reassembled, and
+/// ids missing from the range are skipped. With several key buckets (see
+/// fdb_set_key_buckets()), the buckets are read one after the other, so events
+/// are in id order within each bucket only. The callbacks run as for
+/// fdb_read_event_async().
+///
+/// @param[in] read      Handle for the read state, untouched by the caller
+///                      until the done callback runs.
+/// @param[in] first_id  Id of the first event in the range.
+/// @param[in] last_id   Id after the last event in the range.
+/// @param[in] on_event  Callback receiving each event.
+/// @param[in] on_done   Callback receiving the result of the read.
+/// @param[in] param     Caller data for the callbacks.
+///
+/// @return  0  The read was started; the done callback will run.
+/// @return -1  Failure; no callback will run.
+int fdb_read_event_range_async(FDBAsyncRead *read, uint64_t first_id,
+                               uint64_t last_id,
+                               FDBAsyncEventCallback on_event,
+                               FDBAsyncDoneCallback on_done, void *param);
@@ -2,5 +2,55 @@
 ///
 /// Macro constants for FoundationDB backend implementation.
 
-// Optimal size of a value in bytes
+// Optimal size of a value in bytes, and the default length of every fragment
+// after the first
 #define OPTIMAL_VALUE_SIZE 10000
+
+// Largest value FoundationDB accepts, in bytes
+#define MAX_VALUE_SIZE 100000
+
+// Default byte budget (keys + values) of a single write transaction. Small
+// enough to keep commits fast, large enough to amortize a commit over many
+// small events.
+#define DEFAULT_BATCH_BYTES 1000000
+
+// Largest accepted byte budget of a write transaction, leaving headroom below
+// the 10,000,000 byte FoundationDB transaction limit for conflict ranges and
+// other per-mutation overhead
+#define MAX_BATCH_BYTES 9000000
+
+// Default number of write transactions a pipelined write keeps in flight
+#define DEFAULT_WINDOW_SIZE 16
+
+// Default number of times a single transaction is retried before giving up
+#define DEFAULT_RETRY_LIMIT 100
+
+// Default time budget for retrying a single transaction, in milliseconds
+#define DEFAULT_RETRY_TIMEOUT_MS 30000
+
+// Bounds of the jittered delay added between retries, in microseconds. The
+// bound doubles with every retry of the same transaction.
+#define RETRY_BACKOFF_MIN_US 1000
+#define RETRY_BACKOFF_MAX_US 100000
+
+// Age at which a long read moves on to a new transaction, in milliseconds.
+// FoundationDB rejects reads at a read version more than 5 seconds old.
+#define READ_TX_MAX_AGE_MS 4000
+
+// FoundationDB error code of a read at an expired read version
+#define FDB_ERROR_TRANSACTION_TOO_OLD 1007
+
+// Default number of key and value bytes per partition of a parallel scan, as
+// estimated by FoundationDB split points
+#define DEFAULT_SCAN_PARTITION_BYTES 16000000
+
+// Number of events a worker of an ordered parallel scan may read ahead of the
+// caller in its partition
+#define SCAN_REORDER_DEPTH 64
+
+// Largest number of key buckets event keys may be spread over
+#define MAX_KEY_BUCKETS 64
+
+// Number of independently locked shards of the event cache. Must be a power
+// of two.
+#define EVENT_CACHE_SHARDS 16
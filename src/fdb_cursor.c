@@ -0,0 +1,336 @@
+/// @file fdb_cursor.c
+///
+/// Definitions for the replay cursor over the FoundationDB event log.
+///
+/// The cursor keeps exactly one range read in flight: as soon as a read
+/// arrives, the next one is started from its last key, and the caller consumes
+/// the arrived key-value pairs while it travels. Reads use the iterator
+/// streaming mode, so they start small (the first event arrives quickly) and
+/// grow as the replay goes on. A replay outliving its read version moves on to
+/// a new transaction, resuming after the last key read. With several key
+/// buckets, each bucket gets a cursor of its own, and the events they read are
+/// merged by id.
+///
+/// Potentially helpful documentation:
+///   https://apple.github.io/foundationdb/api-c.html#c.FDBStreamingMode
+
+#include <foundationdb/fdb_c.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fdb.h"
+#include "fdb_cursor.h"
+#include "fdb_internal.h"
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Open a cursor over the events with ids in [first_id, last_id) of one key
+/// bucket, and start reading the first range.
+///
+/// @param[in] cursor    Handle for the cursor to open.
+/// @param[in] bucket    The key bucket.
+/// @param[in] first_id  Id of the first event in the range.
+/// @param[in] last_id   Id after the last event in the range.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int cursor_open_bucket(FDBCursor *cursor, uint32_t bucket, uint64_t first_id,
+                       uint64_t last_id);
+
+/// Move a merging cursor to the next event: the lowest id among the next
+/// events of its key buckets.
+///
+/// @param[in]  cursor  Handle for the cursor.
+/// @param[out] event   Address to write the next event into.
+/// @param[in]  arena   Handle for the arena, or NULL to allocate from the heap.
+///
+/// @return  1  An event was read.
+/// @return  0  There are no more events in the range.
+/// @return -2  FDB_READ_ARENA_FULL, the arena is too small for the event.
+/// @return -1  Failure.
+int cursor_next_merged(FDBCursor *cursor, Event *event, EventArena *arena);
+
+/// Start the next range read of a cursor, after the last key read so far.
+///
+/// @param[in] cursor  Handle for the cursor.
+void cursor_prefetch(FDBCursor *cursor);
+
+/// Wait for the range read in flight and make it the current one, retrying it
+/// on retryable errors, then start the read after it.
+///
+/// @param[in] cursor  Handle for the cursor.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int cursor_advance(FDBCursor *cursor);
+
+//==============================================================================
+// Functions
+//==============================================================================
+
+int fdb_cursor_open(FDBCursor *cursor, uint64_t first_id, uint64_t last_id) {
+  // A single key bucket is read directly
+  if ((fdb_key_buckets == 1) || (first_id >= last_id))
+    return cursor_open_bucket(cursor, 0, first_id, last_id);
+
+  cursor->tx = NULL;
+  cursor->current = NULL;
+  cursor->prefetch = NULL;
+  init_assembler(&cursor->as, first_id, last_id);
+  cursor->failed = false;
+  cursor->num_lanes = 0;
+  if (!(cursor->lanes = malloc(sizeof(FDBCursorLane) * fdb_key_buckets)))
+    return -1;
+
+  // Every bucket has a range read in flight from the start
+  for (; cursor->num_lanes < fdb_key_buckets; ++cursor->num_lanes) {
+    FDBCursorLane *lane = &cursor->lanes[cursor->num_lanes];
+
+    if (cursor_open_bucket(&lane->cursor, cursor->num_lanes, first_id,
+                           last_id)) {
+      fdb_cursor_close(cursor);
+      return -1;
+    }
+    lane->ready = false;
+    lane->done = false;
+  }
+
+  // Success
+  return 0;
+}
+
+int cursor_open_bucket(FDBCursor *cursor, uint32_t bucket, uint64_t first_id,
+                       uint64_t last_id) {
+  cursor->current = NULL;
+  cursor->prefetch = NULL;
+  cursor->kv = NULL;
+  cursor->num_kv = 0;
+  cursor->pos = 0;
+  cursor->iteration = 1;
+  cursor->resumed = false;
+  init_assembler(&cursor->as, first_id, last_id);
+  cursor->failed = false;
+  cursor->lanes = NULL;
+  cursor->num_lanes = 0;
+
+  // Setup keys for range read. Without key buckets, the first read starts at
+  // the key before the range, which may be a packed block holding the first
+  // events of the range.
+  cursor->as.leading = (fdb_key_buckets == 1);
+  cursor->begin_length = build_bucket_key(cursor->begin_key, bucket, first_id, 0);
+  cursor->end_length = build_bucket_key(cursor->end_key, bucket, last_id, 0);
+
+  if (setup_read_transaction(&cursor->tx, &cursor->tx_start))
+    return -1;
+
+  // An empty range needs no reads
+  if (first_id < last_id) {
+    fdb_retry_init(&cursor->retry);
+    cursor_prefetch(cursor);
+  }
+
+  // Success
+  return 0;
+}
+
+int fdb_cursor_next(FDBCursor *cursor, Event *event) {
+  return fdb_cursor_next_into(cursor, event, NULL);
+}
+
+int fdb_cursor_next_into(FDBCursor *cursor, Event *event, EventArena *arena) {
+  if (cursor->failed)
+    return -1;
+  if (cursor->lanes)
+    return cursor_next_merged(cursor, event, arena);
+
+  for (;;) {
+    // Consume what has arrived until an event is complete. A fragment the
+    // arena has no room for stays where it is, for the next call, as does a
+    // packed block with events left in it.
+    while (cursor->pos < cursor->num_kv) {
+      switch (assemble_fragment(&cursor->as, &cursor->kv[cursor->pos], arena,
+                                event)) {
+      case 2:
+        return 1;
+      case 1:
+        ++cursor->pos;
+        return 1;
+      case 0:
+        ++cursor->pos;
+        break;
+      case FDB_READ_ARENA_FULL:
+        return FDB_READ_ARENA_FULL;
+      default:
+        goto cursor_fail;
+      }
+    }
+
+    // Out of key-value pairs: release them and move to the read in flight
+    if (cursor->current) {
+      fdb_future_destroy(cursor->current);
+      cursor->current = NULL;
+      cursor->num_kv = 0;
+      cursor->pos = 0;
+    }
+
+    if (!cursor->prefetch) {
+      // The range ended in the middle of an event
+      if (cursor->as.event.data)
+        goto cursor_fail;
+
+      return 0;
+    }
+
+    if (cursor_advance(cursor))
+      goto cursor_fail;
+  }
+
+// Failure
+cursor_fail:
+  cursor->failed = true;
+  return -1;
+}
+
+void fdb_cursor_close(FDBCursor *cursor) {
+  if (cursor->lanes) {
+    for (uint32_t i = 0; i < cursor->num_lanes; ++i) {
+      fdb_cursor_close(&cursor->lanes[i].cursor);
+      if (cursor->lanes[i].ready)
+        free_event(&cursor->lanes[i].head);
+    }
+
+    free(cursor->lanes);
+    cursor->lanes = NULL;
+    cursor->num_lanes = 0;
+    return;
+  }
+
+  if (cursor->prefetch) {
+    fdb_future_cancel(cursor->prefetch);
+    fdb_future_destroy(cursor->prefetch);
+  }
+  if (cursor->current)
+    fdb_future_destroy(cursor->current);
+
+  release_event_data(cursor->as.arena, &cursor->as.event);
+  fdb_transaction_destroy(cursor->tx);
+
+  cursor->prefetch = NULL;
+  cursor->current = NULL;
+  cursor->as.event.data = NULL;
+}
+
+void cursor_prefetch(FDBCursor *cursor) {
+  read_renew_transaction(cursor->tx, &cursor->tx_start);
+
+  cursor->prefetch = fdb_transaction_get_range(
+      cursor->tx, cursor->begin_key, cursor->begin_length, cursor->resumed,
+      (cursor->resumed || !cursor->as.leading),
+      FDB_KEYSEL_FIRST_GREATER_OR_EQUAL(cursor->end_key, cursor->end_length),
+      0, 0, FDB_STREAMING_MODE_ITERATOR, cursor->iteration++, 0, 0);
+}
+
+int cursor_advance(FDBCursor *cursor) {
+  fdb_bool_t out_more;
+  fdb_error_t err;
+
+  for (;;) {
+    if (!(err = fdb_future_block_until_ready(cursor->prefetch)))
+      err = fdb_future_get_error(cursor->prefetch);
+    if (!err)
+      err = fdb_future_get_keyvalue_array(cursor->prefetch, &cursor->kv,
+                                          &cursor->num_kv, &out_more);
+    if (!err)
+      break;
+
+    // On a retryable error, including an expired read version, the read
+    // starts over from the same key in a new transaction
+    fdb_future_destroy(cursor->prefetch);
+    cursor->prefetch = NULL;
+    if (read_retry_on_error(cursor->tx, err, &cursor->retry, &cursor->tx_start))
+      return -1;
+
+    cursor_prefetch(cursor);
+  }
+
+  cursor->current = cursor->prefetch;
+  cursor->prefetch = NULL;
+  cursor->pos = 0;
+
+  // Start the next read right away, from the last key of this one
+  if (out_more) {
+    if (cursor->num_kv) {
+      const FDBKeyValue *last = &cursor->kv[cursor->num_kv - 1];
+
+      if (last->key_length > (int)sizeof(cursor->begin_key))
+        return -1;
+      memcpy(cursor->begin_key, last->key, last->key_length);
+      cursor->begin_length = last->key_length;
+      cursor->resumed = true;
+    }
+
+    fdb_retry_init(&cursor->retry);
+    cursor_prefetch(cursor);
+  }
+
+  // Success
+  return 0;
+}
+
+int cursor_next_merged(FDBCursor *cursor, Event *event, EventArena *arena) {
+  FDBCursorLane *next = NULL;
+  uint8_t *data;
+
+  // Every bucket that is not done must have its next event ready, since any
+  // of them may hold the lowest id
+  for (uint32_t i = 0; i < cursor->num_lanes; ++i) {
+    FDBCursorLane *lane = &cursor->lanes[i];
+
+    if (!lane->ready && !lane->done) {
+      switch (fdb_cursor_next(&lane->cursor, &lane->head)) {
+      case 1:
+        lane->ready = true;
+        break;
+      case 0:
+        lane->done = true;
+        break;
+      default:
+        goto cursor_fail;
+      }
+    }
+
+    if (lane->ready && (!next || (lane->head.id < next->head.id)))
+      next = lane;
+  }
+
+  if (!next)
+    return 0;
+
+  // The lanes read into the heap, so an arena gets a copy
+  if (arena) {
+    if (!(data = event_arena_alloc(arena, next->head.data_length))) {
+      event->id = next->head.id;
+      event->data_length = next->head.data_length;
+      event->data = NULL;
+      return FDB_READ_ARENA_FULL;
+    }
+
+    memcpy(data, next->head.data, next->head.data_length);
+    free_event(&next->head);
+    next->head.data = data;
+  }
+
+  *event = next->head;
+  next->ready = false;
+  return 1;
+
+// Failure
+cursor_fail:
+  cursor->failed = true;
+  return -1;
+}
@@ -0,0 +1,104 @@
+/// @file fdb_cursor.h
+///
+/// Declarations for a cursor replaying a range of the FoundationDB event log
+/// one event at a time, with the next range read always in flight.
+
+#pragma once
+
+#include <foundationdb/fdb_c.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "event.h"
+#include "fdb.h"
+
+//==============================================================================
+// Types
+//==============================================================================
+
+/// Cursor over the events with ids in a range. While the caller consumes the
+/// key-value pairs of one range read, the next one is already in flight. With
+/// several key buckets, the cursor merges one cursor per bucket instead.
+typedef struct fdb_cursor_t {
+  FDBTransaction *tx;      // Transaction used for the range reads.
+  struct timespec tx_start; // Time at which the transaction was started.
+  FDBFuture *current;      // Range read being consumed, or NULL.
+  FDBFuture *prefetch;     // Next range read, in flight, or NULL at the end.
+  const FDBKeyValue *kv;   // Key-value pairs of the current range read.
+  int num_kv;              // Number of key-value pairs in the current read.
+  int pos;                 // Next key-value pair to consume.
+  int iteration;           // Iteration of the next range read, which lets
+                           // FoundationDB grow the reads as the replay goes.
+  uint8_t begin_key[FDB_KEY_MAX_LENGTH + MAX_HEADER_SIZE]; // Key after which
+                                                           // the next read
+                                                           // starts.
+  int begin_length;        // Length of the begin key.
+  bool resumed;            // Set once the begin key is a key already read.
+  uint8_t end_key[FDB_KEY_MAX_LENGTH]; // Key the range ends before.
+  int end_length;          // Length of the end key.
+  EventAssembler as;       // Event being reassembled.
+  FDBRetry retry;          // Retry state of the range read in flight.
+  bool failed;             // Set once the cursor hit an error.
+  struct fdb_cursor_lane_t *lanes; // Cursor of each key bucket, or NULL.
+  uint32_t num_lanes;      // Number of key buckets merged.
+} FDBCursor;
+
+/// Cursor over one key bucket of a merging cursor, and the next event it read.
+typedef struct fdb_cursor_lane_t {
+  FDBCursor cursor; // Cursor over the bucket.
+  Event head;       // Next event of the bucket, while ready is set.
+  bool ready;       // Set while head holds an event.
+  bool done;        // Set once the bucket has no more events.
+} FDBCursorLane;
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Open a cursor over the events with ids in [first_id, last_id), and start
+/// reading the first range.
+///
+/// @param[in] cursor    Handle for the cursor to open.
+/// @param[in] first_id  Id of the first event in the range.
+/// @param[in] last_id   Id after the last event in the range.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int fdb_cursor_open(FDBCursor *cursor, uint64_t first_id, uint64_t last_id);
+
+/// Move a cursor to the next event. Once the key-value pairs of a range read
+/// are used up, the cursor waits for the read in flight and immediately starts
+/// the one after it, so the network round trip overlaps with the caller's
+/// work on the events.
+///
+/// @param[in]  cursor  Handle for the cursor.
+/// @param[out] event   Address to write the next event into; the caller frees
+///                     its data.
+///
+/// @return  1  An event was read.
+/// @return  0  There are no more events in the range.
+/// @return -1  Failure.
+int fdb_cursor_next(FDBCursor *cursor, Event *event);
+
+/// Move a cursor to the next event like fdb_cursor_next(), reassembling it
+/// into an event arena instead of the heap. If the arena is too small, the
+/// cursor stays where it is and the length of the event is written to
+/// event->data_length; the caller resets or replaces the arena and calls
+/// again.
+///
+/// @param[in]  cursor  Handle for the cursor.
+/// @param[out] event   Address to write the next event into; its data lives in
+///                     the arena.
+/// @param[in]  arena   Handle for the arena, or NULL to allocate from the heap.
+///
+/// @return  1  An event was read.
+/// @return  0  There are no more events in the range.
+/// @return -2  FDB_READ_ARENA_FULL, the arena is too small for the event.
+/// @return -1  Failure.
+int fdb_cursor_next_into(FDBCursor *cursor, Event *event, EventArena *arena);
+
+/// Close a cursor, cancelling any range read in flight.
+///
+/// @param[in] cursor  Handle for the cursor.
+void fdb_cursor_close(FDBCursor *cursor);
@@ -0,0 +1,339 @@
+/// @file fdb_group_commit.c
+///
+/// Definitions for the group-commit front end to the FoundationDB write path.
+///
+/// The submission queue is an intrusive multi-producer, single-consumer queue
+/// (after Dmitry Vyukov's design): producers only swap the queue head, so
+/// submitting never takes a lock. The committer sleeps on a condition variable
+/// only while the queue is empty.
+///
+/// Potentially helpful documentation:
+///   https://www.1024cores.net/home/lock-free-algorithms/queues/intrusive-mpsc-node-based-queue
+
+#include <foundationdb/fdb_c.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "event_cache.h"
+#include "fdb.h"
+#include "fdb_group_commit.h"
+#include "fdb_internal.h"
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Committer loop: take queued writes, merge them into shared transactions and
+/// complete their futures once each commit is durable.
+///
+/// @param[in] arg  Handle for the FDBGroupCommit object.
+void *group_commit_thread_func(void *arg);
+
+/// Push a write onto the submission queue.
+///
+/// @param[in] gc      Handle for the group committer.
+/// @param[in] future  Handle for the write to push.
+void group_commit_push(FDBGroupCommit *gc, FDBWriteFuture *future);
+
+/// Pop the oldest write from the submission queue.
+///
+/// @param[in] gc  Handle for the group committer.
+///
+/// @return  Handle for the write, or NULL if the queue is empty.
+FDBWriteFuture *group_commit_pop(FDBGroupCommit *gc);
+
+/// Wait for the next queued write.
+///
+/// @param[in] gc        Handle for the group committer.
+/// @param[in] deadline  Absolute time to give up at, or NULL to wait until a
+///                      write arrives or shutdown is requested.
+///
+/// @return  Handle for the write, or NULL on timeout or shutdown.
+FDBWriteFuture *group_commit_next(FDBGroupCommit *gc,
+                                  const struct timespec *deadline);
+
+/// Complete every write in a batch with the same result.
+///
+/// @param[in] gc      Handle for the group committer.
+/// @param[in] batch   First write in the batch.
+/// @param[in] result  0 if the batch is durable, -1 on failure.
+void group_commit_complete(FDBGroupCommit *gc, FDBWriteFuture *batch,
+                           int result);
+
+//==============================================================================
+// Functions
+//==============================================================================
+
+int fdb_group_commit_init(FDBGroupCommit *gc, uint32_t max_delay_us) {
+  atomic_init(&gc->stub.next, NULL);
+  atomic_init(&gc->head, &gc->stub);
+  gc->tail = &gc->stub;
+  atomic_init(&gc->pending, 0);
+  atomic_init(&gc->sleeping, false);
+  atomic_init(&gc->stopping, false);
+  gc->max_delay_us = max_delay_us;
+  gc->num_commits = 0;
+  gc->num_events = 0;
+
+  if (pthread_mutex_init(&gc->lock, NULL))
+    goto lock_fail;
+  if (pthread_cond_init(&gc->submitted, NULL))
+    goto submitted_fail;
+  if (pthread_cond_init(&gc->completed, NULL))
+    goto completed_fail;
+  if (pthread_create(&gc->thread, NULL, group_commit_thread_func, gc))
+    goto thread_fail;
+
+  // Success
+  return 0;
+
+// Failure
+thread_fail:
+  pthread_cond_destroy(&gc->completed);
+completed_fail:
+  pthread_cond_destroy(&gc->submitted);
+submitted_fail:
+  pthread_mutex_destroy(&gc->lock);
+lock_fail:
+  return -1;
+}
+
+int fdb_group_commit_shutdown(FDBGroupCommit *gc) {
+  // Wake the committer so it can drain the queue and exit
+  pthread_mutex_lock(&gc->lock);
+  atomic_store(&gc->stopping, true);
+  pthread_cond_signal(&gc->submitted);
+  pthread_mutex_unlock(&gc->lock);
+
+  if (pthread_join(gc->thread, NULL))
+    return -1;
+
+  pthread_cond_destroy(&gc->completed);
+  pthread_cond_destroy(&gc->submitted);
+  pthread_mutex_destroy(&gc->lock);
+  return 0;
+}
+
+void fdb_group_commit_submit(FDBGroupCommit *gc, const Source *src,
+                             FDBWriteFuture *future) {
+  future->src = src;
+  future->batch_next = NULL;
+  future->result = -1;
+  atomic_init(&future->done, 0);
+
+  // Only take the lock if the committer may be asleep. Both flags are
+  // sequentially consistent, so either the committer sees the new write
+  // before sleeping or the producer sees it sleeping and wakes it.
+  atomic_fetch_add(&gc->pending, 1);
+  group_commit_push(gc, future);
+  if (atomic_load(&gc->sleeping)) {
+    pthread_mutex_lock(&gc->lock);
+    pthread_cond_signal(&gc->submitted);
+    pthread_mutex_unlock(&gc->lock);
+  }
+}
+
+int fdb_group_commit_wait(FDBGroupCommit *gc, FDBWriteFuture *future) {
+  if (!atomic_load_explicit(&future->done, memory_order_acquire)) {
+    pthread_mutex_lock(&gc->lock);
+    while (!atomic_load_explicit(&future->done, memory_order_acquire))
+      pthread_cond_wait(&gc->completed, &gc->lock);
+    pthread_mutex_unlock(&gc->lock);
+  }
+
+  return future->result;
+}
+
+int fdb_group_commit_write(FDBGroupCommit *gc, const Source *src) {
+  FDBWriteFuture future;
+
+  fdb_group_commit_submit(gc, src, &future);
+  return fdb_group_commit_wait(gc, &future);
+}
+
+void *group_commit_thread_func(void *arg) {
+  FDBGroupCommit *gc = (FDBGroupCommit *)arg;
+  FDBWriteFuture *next;
+  FDBTransaction *tx;
+
+  if (fdb_setup_transaction(&tx))
+    tx = NULL;
+
+  next = group_commit_next(gc, NULL);
+  while (next) {
+    FDBWriteFuture *batch = NULL;
+    FDBWriteFuture **batch_end = &batch;
+    uint32_t batch_filled = 0;
+    uint32_t batch_bytes = 0;
+    struct timespec deadline;
+
+    // Writes arriving within the delay of the first one share its commit
+    timespec_get(&deadline, TIME_UTC);
+    deadline.tv_nsec += (long)gc->max_delay_us * 1000;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000;
+    deadline.tv_nsec %= 1000000000;
+
+    while (next) {
+      const Source *src = next->src;
+      uint32_t num_fragments = es_num_fragments(src);
+
+      // An event too large for one transaction is written on its own
+      if (!batch && (event_set_bytes(src) > fdb_batch_bytes ||
+                     num_fragments > batch_fragment_limit())) {
+        next->batch_next = NULL;
+        group_commit_complete(gc, next, tx ? fdb_write_event(src) : -1);
+        ++gc->num_events;
+        next = group_commit_pop(gc);
+        continue;
+      }
+
+      // Close the batch before an event that would take it over budget
+      if (batch && (batch_bytes + event_set_bytes(src) > fdb_batch_bytes ||
+                    num_fragments > batch_fragment_limit() - batch_filled))
+        break;
+
+      if (tx)
+        batch_filled += add_event_set_transactions(tx, src, 0, num_fragments,
+                                                   &batch_bytes);
+      *batch_end = next;
+      batch_end = &next->batch_next;
+      *batch_end = NULL;
+
+      // Gather whatever else is queued, waiting up to the delay for more
+      next = group_commit_pop(gc);
+      if (!next && gc->max_delay_us)
+        next = group_commit_next(gc, &deadline);
+    }
+
+    if (batch) {
+      int result = -1;
+
+      if (tx) {
+        FDBRetry retry;
+        fdb_error_t err;
+
+        // A retry starts from a reset transaction, so add the batch again
+        fdb_retry_init(&retry);
+        while ((err = commit_transaction(tx)) &&
+               !fdb_retry_on_error(tx, err, &retry)) {
+          batch_bytes = 0;
+          for (FDBWriteFuture *f = batch; f; f = f->batch_next)
+            add_event_set_transactions(tx, f->src, 0, UINT32_MAX, &batch_bytes);
+        }
+
+        fdb_transaction_reset(tx);
+        result = err ? -1 : 0;
+        ++gc->num_commits;
+      }
+
+      for (FDBWriteFuture *f = batch; f; f = f->batch_next) {
+        if (!result)
+          event_cache_put_source(f->src);
+        ++gc->num_events;
+      }
+      group_commit_complete(gc, batch, result);
+    }
+
+    if (!next)
+      next = group_commit_next(gc, NULL);
+  }
+
+  if (tx)
+    fdb_transaction_destroy(tx);
+
+  return NULL;
+}
+
+void group_commit_push(FDBGroupCommit *gc, FDBWriteFuture *future) {
+  atomic_store_explicit(&future->next, NULL, memory_order_relaxed);
+  FDBWriteFuture *prev = atomic_exchange(&gc->head, future);
+  atomic_store_explicit(&prev->next, future, memory_order_release);
+}
+
+FDBWriteFuture *group_commit_pop(FDBGroupCommit *gc) {
+  FDBWriteFuture *tail = gc->tail;
+  FDBWriteFuture *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+  // Step over the stub
+  if (tail == &gc->stub) {
+    if (!next)
+      return NULL;
+    gc->tail = next;
+    tail = next;
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+  }
+
+  if (next) {
+    gc->tail = next;
+    atomic_fetch_sub(&gc->pending, 1);
+    return tail;
+  }
+
+  // A producer is between swapping the head and linking its write
+  if (tail != atomic_load(&gc->head))
+    return NULL;
+
+  // The tail is the last write: put the stub back behind it
+  group_commit_push(gc, &gc->stub);
+  next = atomic_load_explicit(&tail->next, memory_order_acquire);
+  if (next) {
+    gc->tail = next;
+    atomic_fetch_sub(&gc->pending, 1);
+    return tail;
+  }
+
+  return NULL;
+}
+
+FDBWriteFuture *group_commit_next(FDBGroupCommit *gc,
+                                  const struct timespec *deadline) {
+  for (;;) {
+    FDBWriteFuture *future = group_commit_pop(gc);
+    bool timed_out = false;
+
+    if (future)
+      return future;
+
+    pthread_mutex_lock(&gc->lock);
+    atomic_store(&gc->sleeping, true);
+
+    // Nothing submitted, or a producer has not finished linking its write
+    if (!atomic_load(&gc->pending)) {
+      if (atomic_load(&gc->stopping)) {
+        atomic_store(&gc->sleeping, false);
+        pthread_mutex_unlock(&gc->lock);
+        return NULL;
+      }
+
+      if (deadline)
+        timed_out = pthread_cond_timedwait(&gc->submitted, &gc->lock, deadline);
+      else
+        pthread_cond_wait(&gc->submitted, &gc->lock);
+    }
+
+    atomic_store(&gc->sleeping, false);
+    pthread_mutex_unlock(&gc->lock);
+
+    if (timed_out)
+      return group_commit_pop(gc);
+  }
+}
+
+void group_commit_complete(FDBGroupCommit *gc, FDBWriteFuture *batch,
+                           int result) {
+  // Read the links first: a completed future may be reused immediately
+  while (batch) {
+    FDBWriteFuture *next = batch->batch_next;
+
+    batch->result = result;
+    atomic_store_explicit(&batch->done, 1, memory_order_release);
+    batch = next;
+  }
+
+  pthread_mutex_lock(&gc->lock);
+  pthread_cond_broadcast(&gc->completed);
+  pthread_mutex_unlock(&gc->lock);
+}
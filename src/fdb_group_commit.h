@@ -0,0 +1,98 @@
+/// @file fdb_group_commit.h
+///
+/// Declarations for a group-commit front end to the FoundationDB write path:
+/// many producer threads enqueue event sources, and a single committer thread
+/// merges everything queued into shared transactions.
+
+#pragma once
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "event.h"
+
+//==============================================================================
+// Types
+//==============================================================================
+
+/// Pending write of a single event source through a group committer. Owned by
+/// the producer, and must stay valid until the write completes.
+typedef struct fdb_write_future_t {
+  struct fdb_write_future_t *_Atomic next; // Link in the submission queue.
+  struct fdb_write_future_t *batch_next;   // Link in the committer's batch.
+  const Source *src;                       // Event source to write.
+  atomic_int done;                         // Set once the write completed.
+  int result;                              // 0 if durable, -1 on failure.
+} FDBWriteFuture;
+
+/// Group committer: a lock-free multi-producer, single-consumer queue of
+/// pending writes, drained by a dedicated committer thread.
+typedef struct fdb_group_commit_t {
+  FDBWriteFuture *_Atomic head; // Most recently submitted write.
+  FDBWriteFuture *tail;         // Oldest write not yet taken by the committer.
+  FDBWriteFuture stub;          // Placeholder node keeping the queue non-empty.
+  atomic_uint pending;          // Writes submitted but not yet taken.
+  atomic_bool sleeping;         // Set while the committer waits for writes.
+  atomic_bool stopping;         // Set when shutdown was requested.
+  uint32_t max_delay_us;        // Longest a batch waits for more writes.
+  pthread_t thread;             // Committer thread.
+  pthread_mutex_t lock;         // Guards sleeping/completion waits.
+  pthread_cond_t submitted;     // Signalled when the committer has work.
+  pthread_cond_t completed;     // Broadcast when writes complete.
+  uint64_t num_commits;         // Transactions committed so far.
+  uint64_t num_events;          // Events written so far.
+} FDBGroupCommit;
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Initialize a group committer and start its committer thread. Batches are
+/// bounded by the write byte budget and fragment cap (see fdb.h).
+///
+/// @param[in] gc            Handle for the group committer.
+/// @param[in] max_delay_us  Longest time a batch waits for more writes once
+///                          the queue runs dry, in microseconds (0 commits as
+///                          soon as the queue is empty).
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int fdb_group_commit_init(FDBGroupCommit *gc, uint32_t max_delay_us);
+
+/// Write every queued event, then stop the committer thread.
+///
+/// @param[in] gc  Handle for the group committer.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int fdb_group_commit_shutdown(FDBGroupCommit *gc);
+
+/// Queue an event source for writing without waiting for the commit. Safe to
+/// call from any number of threads concurrently.
+///
+/// @param[in] gc      Handle for the group committer.
+/// @param[in] src     Handle for the event source to write.
+/// @param[in] future  Handle for the future completed once the write is
+///                    durable.
+void fdb_group_commit_submit(FDBGroupCommit *gc, const Source *src,
+                             FDBWriteFuture *future);
+
+/// Wait until a queued write has completed.
+///
+/// @param[in] gc      Handle for the group committer.
+/// @param[in] future  Handle for the future of the write.
+///
+/// @return  0  Success, the event is durable.
+/// @return -1  Failure.
+int fdb_group_commit_wait(FDBGroupCommit *gc, FDBWriteFuture *future);
+
+/// Write a single event source through a group committer, waiting until the
+/// shared commit that contains it is durable.
+///
+/// @param[in] gc   Handle for the group committer.
+/// @param[in] src  Handle for the event source to write.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int fdb_group_commit_write(FDBGroupCommit *gc, const Source *src);
@@ -0,0 +1,211 @@
+/// @file fdb_internal.h
+///
+/// Declarations for the settings and helpers of fdb.c that the other
+/// FoundationDB modules, the benchmarks and the tests build on. They are not
+/// part of the public interface in fdb.h.
+
+#pragma once
+
+#include <foundationdb/fdb_c.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "event.h"
+#include "fdb.h"
+
+//==============================================================================
+// Variables
+//==============================================================================
+
+extern uint32_t fdb_batch_bytes; // Byte budget of a write transaction.
+extern uint32_t fdb_batch_size;  // Fragments of a write transaction.
+extern uint32_t fdb_key_buckets; // Number of key buckets of event keys.
+extern uint32_t fdb_window_size; // Commits a pipelined write keeps in flight.
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Add a limited number of write operations for the fragments of an event to a
+/// FoundationDB transaction. Stops before the first fragment that would take
+/// the transaction over the byte budget, unless the transaction is empty. The
+/// first fragment comes with clears of the keys of the event that its other
+/// fragments do not overwrite: an older first fragment, whose key holds
+/// another header, and anything past the new last fragment.
+///
+/// @param[in]     tx           FoundationDB transaction handle.
+/// @param[in]     event        Fragmented event handle.
+/// @param[in]     start_pos    Starting position in fragment array to write
+///                             from.
+/// @param[in]     limit        Absolute limit on the number of fragments to
+///                             write.
+/// @param[in,out] batch_bytes  Key and value bytes already in the transaction.
+///
+/// @return   Number of event fragments added to transaction.
+uint32_t add_event_set_transactions(FDBTransaction *tx, const Source *event,
+                                    uint32_t start_pos, uint32_t limit,
+                                    uint32_t *batch_bytes);
+
+/// Maximum number of fragments in a write transaction.
+///
+/// @return  The fragment cap, or UINT32_MAX if there is none.
+uint32_t batch_fragment_limit(void);
+
+/// Commit a FoundationDB transaction and wait for the result, without
+/// printing errors or resetting the transaction.
+///
+/// @param[in] tx  Handle for the transaction containing writes/clears.
+///
+/// @return  FoundationDB error code of the commit.
+fdb_error_t commit_transaction(FDBTransaction *tx);
+
+/// Check whether a failed transaction may be retried: the error must be
+/// retryable and the retry budgets not yet spent.
+///
+/// @param[in] retry  Handle for the retry state of the transaction.
+/// @param[in] err    FoundationDB error code of the failure.
+///
+/// @return  true if the transaction may be retried.
+bool retry_allowed(const FDBRetry *retry, fdb_error_t err);
+
+/// Count a retry and return the jittered delay to wait before it, doubling the
+/// bound of the next delay.
+///
+/// @param[in] retry  Handle for the retry state of the transaction.
+///
+/// @return  Delay in microseconds.
+uint32_t retry_next_delay(FDBRetry *retry);
+
+/// Create the transaction of a read. When the read version cache is enabled,
+/// the transaction takes the cached version if it is recent enough, and its
+/// start time is that of the version.
+///
+/// @param[out] tx        Address to write the transaction handle into.
+/// @param[out] tx_start  Address to write the start time of the transaction
+///                       into.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int setup_read_transaction(FDBTransaction **tx, struct timespec *tx_start);
+
+/// Move a long read to a new transaction, with a fresh read version, if the
+/// current one is close to expiring. The read must resume after the last key
+/// it received.
+///
+/// @param[in]     tx        Handle for the read transaction.
+/// @param[in,out] tx_start  Time at which the transaction was started.
+void read_renew_transaction(FDBTransaction *tx, struct timespec *tx_start);
+
+/// Handle an error from a read that resumes after the last key it received.
+/// An expired read version only needs a new transaction, without backoff, and
+/// the first one since the read last made progress is free; other errors go
+/// through fdb_retry_on_error(). Every attempt counts against the retry budget,
+/// which the caller resets whenever the read makes progress.
+///
+/// @param[in]     tx        Handle for the read transaction.
+/// @param[in]     err       FoundationDB error code of the failure.
+/// @param[in]     retry     Handle for the retry state of the read.
+/// @param[in,out] tx_start  Time at which the transaction was started.
+///
+/// @return  0  The read should be resumed.
+/// @return -1  Failure.
+int read_retry_on_error(FDBTransaction *tx, fdb_error_t err, FDBRetry *retry,
+                        struct timespec *tx_start);
+
+/// Write an array of fragmented events through a pipeline, optionally
+/// reporting progress as batches commit.
+///
+/// @param[in] f_events    Handle for the array of event sources to write.
+/// @param[in] num_events  Number of events in the array.
+/// @param[in] progress    Handle for the progress counters, or NULL.
+///
+/// @return  0  Success
+/// @return -1  Failure
+int write_event_array_pipelined(const FragmentedEventSource f_events[],
+                                uint32_t num_events,
+                                FDBWriteProgress *progress);
+
+/// Number of key and value bytes an event adds to a write transaction.
+///
+/// @param[in] src  Handle for the event source.
+///
+/// @return  Key and value bytes for all fragments of the event.
+uint64_t event_set_bytes(const Source *src);
+
+/// Build the FoundationDB key for an event fragment in a given key bucket,
+/// whether or not the event belongs there. Range reads use it to stay within
+/// one bucket.
+///
+/// @param[in] fdb_key   Pointer to the write location for the FoundationDB key.
+/// @param[in] bucket    The key bucket.
+/// @param[in] id        The event id.
+/// @param[in] fragment  The fragment number.
+///
+/// @return  Length of the key in bytes.
+uint8_t build_bucket_key(uint8_t *fdb_key, uint32_t bucket, uint64_t id,
+                         uint32_t fragment);
+
+/// Parse the event id and fragment number out of an event fragment key in the
+/// current key format, which must be in the key bucket of its event. Anything
+/// after the event key, like the header of a first fragment, is left alone.
+///
+/// @param[in]  fdb_key     The FoundationDB key.
+/// @param[in]  key_length  Length of the key in bytes.
+/// @param[out] id          Address to write the event id into.
+/// @param[out] fragment    Address to write the fragment number into.
+///
+/// @return  Length of the event key in bytes, or 0 if the key does not belong
+///          to an event.
+uint8_t read_event_key(const uint8_t *fdb_key, int key_length, uint64_t *id,
+                       uint32_t *fragment);
+
+/// Set up an assembler to hand over the events with ids in a range.
+///
+/// @param[in] as        Handle for the assembler.
+/// @param[in] first_id  Id of the first event to hand over.
+/// @param[in] last_id   Id after the last event to hand over, or 0 for no
+///                      limit. Only events of packed blocks are checked
+///                      against it; the range read ends at it otherwise.
+void init_assembler(EventAssembler *as, uint64_t first_id, uint64_t last_id);
+
+/// Add a fragment read from the database to the event being reassembled.
+/// Fragments in front of the first fragment of an event were staged by a write
+/// that never published them, and are skipped, as are events before the first
+/// id of the assembler. The events of a packed block are handed over one per
+/// call, with the same key-value pair passed again for each.
+///
+/// @param[in]  as     Handle for the assembler.
+/// @param[in]  kv     Key-value pair of the fragment.
+/// @param[in]  arena  Arena to take the data of a new event from, or NULL for
+///                    the heap.
+/// @param[out] event  Address to move the event into once it is complete, or
+///                    to write the id and length of an event the arena has no
+///                    room for.
+///
+/// @return  2  An event of a packed block was moved out of the assembler; pass
+///             the same key-value pair again for the next one.
+/// @return  1  The event is complete and was moved out of the assembler.
+/// @return  0  The fragment was added or skipped.
+/// @return -2  The arena is too small; the fragment was not consumed.
+/// @return -1  Failure, the fragment does not belong where it was read.
+int assemble_fragment(EventAssembler *as, const FDBKeyValue *kv,
+                      EventArena *arena, Event *event);
+
+/// Give back the data of an event, to the heap or to the arena it came from.
+/// Arena space is only reclaimed if nothing was taken from the arena after it.
+///
+/// @param[in] arena  Arena holding the data, or NULL for the heap.
+/// @param[in] event  Handle for the event.
+void release_event_data(EventArena *arena, Event *event);
+
+/// Add a clear operation for a range of fragment positions of an event to a
+/// FoundationDB transaction. Clearing to UINT32_MAX, not only to the end of the
+/// event as it is now, also removes fragments left by a failed staged write.
+///
+/// @param[in] tx         FoundationDB transaction handle.
+/// @param[in] id         Event id.
+/// @param[in] start_pos  Position of the first fragment to clear.
+/// @param[in] end_pos    Position after the last fragment to clear.
+void add_event_clear_transaction(FDBTransaction *tx, uint64_t id,
+                                 uint32_t start_pos, uint32_t end_pos);
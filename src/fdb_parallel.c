@@ -0,0 +1,466 @@
+/// @file fdb_parallel.c
+///
+/// Definitions for functions that spread work on the FoundationDB event log
+/// over several worker threads.
+
+#include <foundationdb/fdb_c.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "constants.h"
+#include "fdb.h"
+#include "fdb_cursor.h"
+#include "fdb_internal.h"
+#include "fdb_parallel.h"
+
+//==============================================================================
+// Types
+//==============================================================================
+
+/// Shard of an event array written by one worker thread.
+typedef struct write_shard_t {
+  const FragmentedEventSource *f_events; // First event of the shard.
+  uint32_t num_events;                   // Number of events in the shard.
+  FDBWriteProgress *progress;            // Shared progress counters, or NULL.
+  pthread_t thread;                      // Worker writing the shard.
+  int result;                            // Result of the worker.
+} WriteShard;
+
+/// Partition of a parallel scan: a range of event ids, and the events read
+/// from it but not yet delivered in an ordered scan.
+typedef struct scan_partition_t {
+  uint64_t first_id;                  // Id of the first event.
+  uint64_t last_id;                   // Id after the last event.
+  Event events[SCAN_REORDER_DEPTH];   // Ring of events read ahead.
+  uint32_t head;                      // Oldest event in the ring.
+  uint32_t count;                     // Number of events in the ring.
+  bool done;                          // Set once the worker finished.
+  int result;                         // Result of the worker.
+} ScanPartition;
+
+/// State of a parallel scan shared by its workers and the calling thread.
+typedef struct scan_t {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;           // Broadcast whenever a ring or state changes.
+  ScanPartition *partitions;     // Partitions in id order.
+  uint32_t num_partitions;       // Number of partitions.
+  uint32_t next_partition;       // Next partition for a worker to take.
+  bool ordered;                  // Whether workers hand events to the caller.
+  bool stopping;                 // Set once the scan failed or was stopped.
+  FDBScanCallback callback;      // Callback receiving each event.
+  void *param;                   // Caller data for the callback.
+} Scan;
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Worker thread: write one shard of an event array through a pipeline.
+///
+/// @param[in] arg  Handle for the WriteShard object.
+void *write_shard_thread_func(void *arg);
+
+/// Cut a range of event ids into partitions of about the scan partition size,
+/// at split points snapped back to the start of an event.
+///
+/// @param[in]  first_id        Id of the first event in the range.
+/// @param[in]  last_id         Id after the last event in the range.
+/// @param[out] partitions      Address to write the array of partitions into.
+/// @param[out] num_partitions  Address to write the number of partitions into.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int partition_event_range(uint64_t first_id, uint64_t last_id,
+                          ScanPartition **partitions, uint32_t *num_partitions);
+
+/// Worker thread: take partitions in order and read them with a cursor.
+///
+/// @param[in] arg  Handle for the Scan object.
+void *scan_thread_func(void *arg);
+
+/// Read every event of a partition, handing each to the callback or, in an
+/// ordered scan, to the ring of the partition.
+///
+/// @param[in] scan  Handle for the scan.
+/// @param[in] p     Position of the partition.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int scan_partition(Scan *scan, uint32_t p);
+
+/// Deliver the events of an ordered scan to the callback in id order, on the
+/// calling thread.
+///
+/// @param[in] scan  Handle for the scan.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int deliver_ordered(Scan *scan);
+
+//==============================================================================
+// Variables
+//==============================================================================
+
+uint32_t fdb_scan_partition_bytes = DEFAULT_SCAN_PARTITION_BYTES;
+
+//==============================================================================
+// Functions
+//==============================================================================
+
+void fdb_write_progress_init(FDBWriteProgress *progress) {
+  atomic_init(&progress->events, 0);
+  atomic_init(&progress->fragments, 0);
+  atomic_init(&progress->commits, 0);
+}
+
+int fdb_write_fragmented_event_array_parallel(
+    const FragmentedEventSource f_events[], uint32_t num_events,
+    uint32_t num_workers, FDBWriteProgress *progress) {
+  WriteShard *shards;
+  uint64_t total_bytes = 0;
+  uint64_t shard_bytes = 0;
+  uint32_t num_shards = 0;
+  uint32_t start = 0;
+  int result = 0;
+
+  if (!num_workers)
+    return -1;
+
+  shards = malloc(sizeof(WriteShard) * num_workers);
+  if (!shards)
+    return -1;
+
+  for (uint32_t i = 0; i < num_events; ++i)
+    total_bytes += es_length(&f_events[i].src);
+
+  // Cut a shard whenever it reaches its share of the bytes; the last shard
+  // takes whatever is left
+  for (uint32_t i = 0; i < num_events; ++i) {
+    shard_bytes += es_length(&f_events[i].src);
+
+    if ((i + 1 == num_events) ||
+        ((num_shards + 1 < num_workers) &&
+         (shard_bytes * num_workers >= total_bytes))) {
+      WriteShard *shard = &shards[num_shards];
+
+      shard->f_events = f_events + start;
+      shard->num_events = (i + 1) - start;
+      shard->progress = progress;
+      shard->result = 0;
+
+      // Fall back to writing the shard on this thread
+      if (pthread_create(&shard->thread, NULL, write_shard_thread_func, shard)) {
+        if (write_event_array_pipelined(shard->f_events, shard->num_events,
+                                        progress))
+          result = -1;
+      } else {
+        ++num_shards;
+      }
+
+      start = i + 1;
+      shard_bytes = 0;
+    }
+  }
+
+  // Wait for every worker, even after a failure
+  for (uint32_t i = 0; i < num_shards; ++i) {
+    pthread_join(shards[i].thread, NULL);
+    if (shards[i].result)
+      result = -1;
+  }
+
+  free(shards);
+  return result;
+}
+
+void *write_shard_thread_func(void *arg) {
+  WriteShard *shard = (WriteShard *)arg;
+
+  shard->result = write_event_array_pipelined(shard->f_events,
+                                              shard->num_events,
+                                              shard->progress);
+  return NULL;
+}
+
+int fdb_set_scan_partition_bytes(uint32_t partition_bytes) {
+  if (!partition_bytes)
+    return -1;
+
+  fdb_scan_partition_bytes = partition_bytes;
+  return 0;
+}
+
+int fdb_scan_event_range_parallel(uint64_t first_id, uint64_t last_id,
+                                  uint32_t num_workers, bool ordered,
+                                  FDBScanCallback callback, void *param) {
+  Scan scan;
+  pthread_t *threads;
+  uint32_t num_threads = 0;
+  int result = 0;
+
+  if (!num_workers)
+    return -1;
+  if (first_id >= last_id)
+    return 0;
+
+  if (partition_event_range(first_id, last_id, &scan.partitions,
+                            &scan.num_partitions))
+    return -1;
+
+  threads = malloc(sizeof(pthread_t) * num_workers);
+  if (!threads) {
+    free(scan.partitions);
+    return -1;
+  }
+
+  pthread_mutex_init(&scan.lock, NULL);
+  pthread_cond_init(&scan.cond, NULL);
+  scan.next_partition = 0;
+  scan.ordered = ordered;
+  scan.stopping = false;
+  scan.callback = callback;
+  scan.param = param;
+
+  for (uint32_t i = 0; i < num_workers; ++i) {
+    if (pthread_create(&threads[num_threads], NULL, scan_thread_func, &scan))
+      break;
+    ++num_threads;
+  }
+
+  if (!num_threads) {
+    // Scanning the partitions in turn on this thread keeps them in order
+    scan.ordered = false;
+    (void)scan_thread_func(&scan);
+  } else if (ordered) {
+    result = deliver_ordered(&scan);
+  }
+
+  // Wait for every worker, even after a failure
+  for (uint32_t i = 0; i < num_threads; ++i)
+    pthread_join(threads[i], NULL);
+
+  for (uint32_t p = 0; p < scan.num_partitions; ++p) {
+    ScanPartition *partition = &scan.partitions[p];
+
+    if (partition->result)
+      result = -1;
+
+    // Release whatever a stopped scan left undelivered
+    for (; partition->count; --partition->count) {
+      free_event(&partition->events[partition->head]);
+      partition->head = (partition->head + 1) % SCAN_REORDER_DEPTH;
+    }
+  }
+  if (scan.stopping)
+    result = -1;
+
+  pthread_cond_destroy(&scan.cond);
+  pthread_mutex_destroy(&scan.lock);
+  free(threads);
+  free(scan.partitions);
+  return result;
+}
+
+int partition_event_range(uint64_t first_id, uint64_t last_id,
+                          ScanPartition **partitions, uint32_t *num_partitions) {
+  uint8_t begin_key[FDB_KEY_MAX_LENGTH];
+  uint8_t end_key[FDB_KEY_MAX_LENGTH];
+  int begin_length, end_length;
+  const FDBKey *out_keys;
+  FDBFuture *future;
+  FDBTransaction *tx;
+  FDBRetry retry;
+  fdb_error_t err;
+  int out_count;
+  uint64_t start = first_id;
+  int64_t chunk_bytes = fdb_scan_partition_bytes / fdb_key_buckets;
+
+  // Events are spread evenly over the key buckets, so the split points of the
+  // first bucket, at its share of the target size, stand for all of them
+  begin_length = build_bucket_key(begin_key, 0, first_id, 0);
+  end_length = build_bucket_key(end_key, 0, last_id, 0);
+  if (!chunk_bytes)
+    chunk_bytes = 1;
+
+  if (fdb_setup_transaction(&tx))
+    return -1;
+
+  // Ask FoundationDB where to cut the range into chunks of the target size
+  fdb_retry_init(&retry);
+  for (;;) {
+    future = fdb_transaction_get_range_split_points(
+        tx, begin_key, begin_length, end_key, end_length,
+        chunk_bytes);
+    if (!(err = fdb_future_block_until_ready(future)))
+      err = fdb_future_get_error(future);
+    if (!err)
+      err = fdb_future_get_key_array(future, &out_keys, &out_count);
+    if (!err)
+      break;
+
+    fdb_future_destroy(future);
+    if (fdb_retry_on_error(tx, err, &retry)) {
+      fdb_transaction_destroy(tx);
+      return -1;
+    }
+  }
+
+  // The split points include both ends of the range
+  *partitions = malloc(sizeof(ScanPartition) * (out_count + 1));
+  *num_partitions = 0;
+  if (!*partitions)
+    goto split_fail;
+
+  for (int i = 0; i <= out_count; ++i) {
+    uint64_t id = last_id;
+    uint32_t fragment;
+
+    // Snap each split point back to the start of the event it falls in
+    if (i < out_count) {
+      if (!out_keys[i].key_length || (out_keys[i].key[0] != begin_key[0]) ||
+          !read_event_key(out_keys[i].key, out_keys[i].key_length, &id,
+                          &fragment))
+        continue;
+    }
+
+    if ((id <= start) || (id > last_id))
+      continue;
+
+    (*partitions)[*num_partitions].first_id = start;
+    (*partitions)[*num_partitions].last_id = id;
+    ++*num_partitions;
+    start = id;
+  }
+
+  for (uint32_t p = 0; p < *num_partitions; ++p) {
+    (*partitions)[p].head = 0;
+    (*partitions)[p].count = 0;
+    (*partitions)[p].done = false;
+    (*partitions)[p].result = 0;
+  }
+
+  fdb_future_destroy(future);
+  fdb_transaction_destroy(tx);
+
+  // Success
+  return 0;
+
+// Failure
+split_fail:
+  fdb_future_destroy(future);
+  fdb_transaction_destroy(tx);
+  return -1;
+}
+
+void *scan_thread_func(void *arg) {
+  Scan *scan = (Scan *)arg;
+
+  for (;;) {
+    uint32_t p;
+    int result;
+
+    // Take the next partition in order, so the oldest undelivered partition
+    // always has a worker
+    pthread_mutex_lock(&scan->lock);
+    if (scan->stopping || (scan->next_partition == scan->num_partitions)) {
+      pthread_mutex_unlock(&scan->lock);
+      return NULL;
+    }
+    p = scan->next_partition++;
+    pthread_mutex_unlock(&scan->lock);
+
+    result = scan_partition(scan, p);
+
+    pthread_mutex_lock(&scan->lock);
+    scan->partitions[p].result = result;
+    scan->partitions[p].done = true;
+    if (result)
+      scan->stopping = true;
+    pthread_cond_broadcast(&scan->cond);
+    pthread_mutex_unlock(&scan->lock);
+  }
+}
+
+int scan_partition(Scan *scan, uint32_t p) {
+  ScanPartition *partition = &scan->partitions[p];
+  FDBCursor cursor;
+  Event event;
+  int rc;
+
+  if (fdb_cursor_open(&cursor, partition->first_id, partition->last_id))
+    return -1;
+
+  while ((rc = fdb_cursor_next(&cursor, &event)) == 1) {
+    if (!scan->ordered) {
+      if (scan->callback(scan->param, p, &event)) {
+        rc = -1;
+        break;
+      }
+      continue;
+    }
+
+    // Wait for room in the ring of the partition
+    pthread_mutex_lock(&scan->lock);
+    while ((partition->count == SCAN_REORDER_DEPTH) && !scan->stopping)
+      pthread_cond_wait(&scan->cond, &scan->lock);
+
+    if (scan->stopping) {
+      pthread_mutex_unlock(&scan->lock);
+      free_event(&event);
+      break;
+    }
+
+    partition->events[(partition->head + partition->count) % SCAN_REORDER_DEPTH] =
+        event;
+    ++partition->count;
+    pthread_cond_broadcast(&scan->cond);
+    pthread_mutex_unlock(&scan->lock);
+  }
+
+  fdb_cursor_close(&cursor);
+  return (rc < 0) ? -1 : 0;
+}
+
+int deliver_ordered(Scan *scan) {
+  for (uint32_t p = 0; p < scan->num_partitions; ++p) {
+    ScanPartition *partition = &scan->partitions[p];
+
+    for (;;) {
+      Event event;
+
+      // Wait for the next event of the partition, or for its end
+      pthread_mutex_lock(&scan->lock);
+      while (!partition->count && !partition->done && !scan->stopping)
+        pthread_cond_wait(&scan->cond, &scan->lock);
+
+      if (scan->stopping || !partition->count) {
+        bool failed = scan->stopping || partition->result;
+
+        pthread_mutex_unlock(&scan->lock);
+        if (failed)
+          return -1;
+        break;
+      }
+
+      event = partition->events[partition->head];
+      partition->head = (partition->head + 1) % SCAN_REORDER_DEPTH;
+      --partition->count;
+      pthread_cond_broadcast(&scan->cond);
+      pthread_mutex_unlock(&scan->lock);
+
+      if (scan->callback(scan->param, p, &event)) {
+        pthread_mutex_lock(&scan->lock);
+        scan->stopping = true;
+        pthread_cond_broadcast(&scan->cond);
+        pthread_mutex_unlock(&scan->lock);
+        return -1;
+      }
+    }
+  }
+
+  // Success
+  return 0;
+}
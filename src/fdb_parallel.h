@@ -0,0 +1,85 @@
+/// @file fdb_parallel.h
+///
+/// Declarations for functions that spread work on the FoundationDB event log
+/// over several worker threads.
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "event.h"
+#include "fdb.h"
+
+//==============================================================================
+// Types
+//==============================================================================
+
+/// Callback receiving the events of a parallel scan.
+///
+/// @param[in] param      Caller data given to the scan.
+/// @param[in] partition  Partition of the scan the event was read from.
+/// @param[in] event      Handle for the event; the callback owns its data.
+///
+/// @return  0  Continue the scan.
+/// @return -1  Stop the scan, which then fails.
+typedef int (*FDBScanCallback)(void *param, uint32_t partition, Event *event);
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Initialize the progress counters of a write.
+///
+/// @param[in] progress  Handle for the progress counters.
+void fdb_write_progress_init(FDBWriteProgress *progress);
+
+/// Write an array of fragmented events from a pool of worker threads. The
+/// array is split into contiguous shards of roughly equal size in bytes (so an
+/// array sorted by id gives each worker a disjoint id range), and each worker
+/// writes its shard with its own pipeline of transactions.
+///
+/// @param[in] f_events     Handle for the array of event sources to write.
+/// @param[in] num_events   Number of events in the array.
+/// @param[in] num_workers  Number of worker threads (must be greater than 0).
+/// @param[in] progress     Handle for progress counters updated as batches
+///                         commit, or NULL.
+///
+/// @return  0  Success
+/// @return -1  Failure
+int fdb_write_fragmented_event_array_parallel(
+    const FragmentedEventSource f_events[], uint32_t num_events,
+    uint32_t num_workers, FDBWriteProgress *progress);
+
+/// Set the target size of a partition of a parallel scan.
+///
+/// @param[in] partition_bytes  The new target size in key and value bytes
+///                             (must be greater than 0).
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int fdb_set_scan_partition_bytes(uint32_t partition_bytes);
+
+/// Read every event with an id in [first_id, last_id) from a pool of worker
+/// threads. The range is cut into partitions at the split points FoundationDB
+/// reports for it, moved back to the start of the event they fall in, so no
+/// event spans two partitions. Each worker scans whole partitions with its own
+/// cursor and transaction.
+///
+/// In ordered mode, the callback runs on the calling thread and sees events in
+/// id order: workers read at most SCAN_REORDER_DEPTH events ahead in their
+/// partition. Otherwise, workers run the callback themselves, concurrently and
+/// in no particular order across partitions.
+///
+/// @param[in] first_id     Id of the first event in the range.
+/// @param[in] last_id      Id after the last event in the range.
+/// @param[in] num_workers  Number of worker threads (must be greater than 0).
+/// @param[in] ordered      Whether events must be delivered in id order.
+/// @param[in] callback     Callback receiving each event.
+/// @param[in] param        Caller data for the callback.
+///
+/// @return  0  Success
+/// @return -1  Failure
+int fdb_scan_event_range_parallel(uint64_t first_id, uint64_t last_id,
+                                  uint32_t num_workers, bool ordered,
+                                  FDBScanCallback callback, void *param);
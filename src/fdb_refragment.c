@@ -0,0 +1,396 @@
+/// @file fdb_refragment.c
+///
+/// Definitions for rewriting events of the FoundationDB event log to a new
+/// fragment length.
+///
+/// Each chunk of the range is one transaction: its events are read, and those
+/// not already at the new fragment length are cleared and written again. The
+/// range read puts the whole chunk in the read conflict set of the
+/// transaction, so the rewrite never clobbers a write made since the read. The
+/// rate limit paces the chunks, sleeping between commits whenever the bytes
+/// rewritten so far get ahead of it. With several key buckets, the range is
+/// rewritten one bucket after the other.
+
+#include <foundationdb/fdb_c.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <threads.h>
+#include <time.h>
+
+#include "constants.h"
+#include "fdb.h"
+#include "fdb_internal.h"
+#include "fdb_refragment.h"
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Set up a re-fragmenter for a range of events.
+///
+/// @param[in] rf                 Handle for the re-fragmenter.
+/// @param[in] first_id           Id of the first event in the range.
+/// @param[in] last_id            Id after the last event in the range.
+/// @param[in] fragment_length    Fragment length to rewrite events to.
+/// @param[in] max_bytes_per_sec  Rate limit on rewritten event data.
+///
+/// @return  0  Success.
+/// @return -1  Failure (invalid fragment length).
+int refragment_init(FDBRefragmenter *rf, uint64_t first_id, uint64_t last_id,
+                    uint32_t fragment_length, uint64_t max_bytes_per_sec);
+
+/// Rewrite the events of a re-fragmenter chunk by chunk, until the end of its
+/// range or until it is stopped.
+///
+/// @param[in] rf  Handle for the re-fragmenter.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int refragment_run(FDBRefragmenter *rf);
+
+/// Add the rewrites of the next chunk of events to a transaction.
+///
+/// @param[in]  tx       FoundationDB transaction handle.
+/// @param[in]  rf       Handle for the re-fragmenter.
+/// @param[out] next_id  Id to resume from once the transaction commits.
+/// @param[out] chunk    Counters of the chunk.
+/// @param[out] err      FoundationDB error code of the range read.
+///
+/// @return  0  Success, or a FoundationDB error in err.
+/// @return -1  Failure (malformed event or out of memory).
+int refragment_chunk(FDBTransaction *tx, const FDBRefragmenter *rf,
+                     uint64_t *next_id, FDBRefragmentStats *chunk,
+                     fdb_error_t *err);
+
+/// Check whether an event is laid out other than it would be if written now.
+///
+/// @param[in] as               Handle for the assembler that read the event,
+///                             which keeps the layout of the last event.
+/// @param[in] event            Handle for the event.
+/// @param[in] fragment_length  Fragment length to rewrite events to.
+///
+/// @return  Whether the event needs rewriting.
+bool refragment_needed(const EventAssembler *as, const Event *event,
+                       uint32_t fragment_length);
+
+/// Sleep until the bytes rewritten so far are within the rate limit, or until
+/// the re-fragmenter is stopped.
+///
+/// @param[in] rf     Handle for the re-fragmenter.
+/// @param[in] start  Time at which the pass started.
+void refragment_throttle(FDBRefragmenter *rf, const struct timespec *start);
+
+/// Re-fragmenting thread function.
+///
+/// @param[in] arg  Handle for the FDBRefragmenter object.
+void *refragment_thread_func(void *arg);
+
+//==============================================================================
+// Functions
+//==============================================================================
+
+int fdb_refragment_event_range(uint64_t first_id, uint64_t last_id,
+                               uint32_t fragment_length,
+                               uint64_t max_bytes_per_sec,
+                               FDBRefragmentStats *stats) {
+  FDBRefragmenter rf;
+
+  if (refragment_init(&rf, first_id, last_id, fragment_length,
+                      max_bytes_per_sec))
+    return -1;
+
+  rf.result = refragment_run(&rf);
+  if (stats)
+    *stats = rf.stats;
+
+  return rf.result;
+}
+
+int fdb_refragmenter_start(FDBRefragmenter *rf, uint64_t first_id,
+                           uint64_t last_id, uint32_t fragment_length,
+                           uint64_t max_bytes_per_sec) {
+  if (refragment_init(rf, first_id, last_id, fragment_length,
+                      max_bytes_per_sec))
+    return -1;
+
+  if (pthread_create(&rf->thread, NULL, refragment_thread_func, rf))
+    return -1;
+
+  // Success
+  return 0;
+}
+
+int fdb_refragmenter_stop(FDBRefragmenter *rf, FDBRefragmentStats *stats) {
+  atomic_store(&rf->stopping, true);
+  if (pthread_join(rf->thread, NULL))
+    return -1;
+
+  if (stats)
+    *stats = rf->stats;
+
+  return rf->result;
+}
+
+int refragment_init(FDBRefragmenter *rf, uint64_t first_id, uint64_t last_id,
+                    uint32_t fragment_length, uint64_t max_bytes_per_sec) {
+  if (!fragment_length || (fragment_length > MAX_VALUE_SIZE))
+    return -1;
+
+  rf->first_id = first_id;
+  rf->next_id = first_id;
+  rf->last_id = last_id;
+  rf->fragment_length = fragment_length;
+  rf->max_bytes_per_sec = max_bytes_per_sec;
+  rf->bucket = 0;
+  atomic_init(&rf->stopping, false);
+  rf->result = 0;
+  rf->stats = (FDBRefragmentStats){0, 0, 0, 0};
+
+  return 0;
+}
+
+int refragment_run(FDBRefragmenter *rf) {
+  FDBTransaction *tx;
+  FDBRetry retry;
+  fdb_error_t err;
+  struct timespec start;
+
+  timespec_get(&start, TIME_UTC);
+
+  while ((rf->bucket < fdb_key_buckets) && !atomic_load(&rf->stopping)) {
+    FDBRefragmentStats chunk;
+    uint64_t next_id;
+
+    // Move on to the next key bucket once this one is done
+    if (rf->next_id >= rf->last_id) {
+      ++rf->bucket;
+      rf->next_id = rf->first_id;
+      continue;
+    }
+
+    if (fdb_check_error(fdb_setup_transaction(&tx)))
+      return -1;
+
+    // Read and rewrite the chunk, reading it again for every retry
+    fdb_retry_init(&retry);
+    do {
+      if (refragment_chunk(tx, rf, &next_id, &chunk, &err))
+        goto tx_fail;
+      if (!err)
+        err = commit_transaction(tx);
+    } while (err && !fdb_retry_on_error(tx, err, &retry));
+
+    if (err)
+      goto tx_fail;
+
+    fdb_transaction_destroy(tx);
+
+    rf->next_id = next_id;
+    rf->stats.events_scanned += chunk.events_scanned;
+    rf->stats.events_rewritten += chunk.events_rewritten;
+    rf->stats.events_skipped += chunk.events_skipped;
+    rf->stats.bytes_rewritten += chunk.bytes_rewritten;
+
+    refragment_throttle(rf, &start);
+  }
+
+  // Success
+  return 0;
+
+// Failure
+tx_fail:
+  fdb_transaction_destroy(tx);
+  return -1;
+}
+
+int refragment_chunk(FDBTransaction *tx, const FDBRefragmenter *rf,
+                     uint64_t *next_id, FDBRefragmentStats *chunk,
+                     fdb_error_t *err) {
+  EventAssembler as;
+  FDBFuture *future;
+  const FDBKeyValue *out_kv;
+  fdb_bool_t out_more;
+  int out_count;
+  uint32_t batch_bytes = 0;
+  uint32_t num_fragments = 0;
+  bool full = false;
+  uint8_t range_start_key[FDB_KEY_MAX_LENGTH];
+  uint8_t range_end_key[FDB_KEY_MAX_LENGTH];
+  int range_start_length, range_end_length;
+
+  *next_id = rf->next_id;
+  *chunk = (FDBRefragmentStats){0, 0, 0, 0};
+  init_assembler(&as, rf->next_id, rf->last_id);
+
+  // Read about as much as the transaction may write back
+  range_start_length =
+      build_bucket_key(range_start_key, rf->bucket, rf->next_id, 0);
+  range_end_length = build_bucket_key(range_end_key, rf->bucket, rf->last_id, 0);
+  future = fdb_transaction_get_range(
+      tx, FDB_KEYSEL_FIRST_GREATER_OR_EQUAL(range_start_key, range_start_length),
+      FDB_KEYSEL_FIRST_GREATER_OR_EQUAL(range_end_key, range_end_length),
+      0, (int)fdb_batch_bytes, FDB_STREAMING_MODE_WANT_ALL, 1, 0, 0);
+  if (!(*err = fdb_future_block_until_ready(future)))
+    *err = fdb_future_get_error(future);
+  if (!*err)
+    *err = fdb_future_get_keyvalue_array(future, &out_kv, &out_count,
+                                         &out_more);
+  if (*err) {
+    fdb_future_destroy(future);
+    return 0;
+  }
+
+  for (int i = 0; (i < out_count) && !full; ++i) {
+    FragmentedEventSource f_event;
+    Event event;
+    uint64_t event_bytes;
+    uint32_t event_fragments;
+
+    switch (assemble_fragment(&as, &out_kv[i], NULL, &event)) {
+    case 2:
+      // The next event of a packed block comes from the same key-value pair
+      --i;
+      // Fall through
+    case 1:
+      break;
+    case 0:
+      continue;
+    default:
+      goto chunk_fail;
+    }
+
+    if (!refragment_needed(&as, &event, rf->fragment_length)) {
+      ++chunk->events_scanned;
+      *next_id = event.id + 1;
+      free_event(&event);
+      continue;
+    }
+
+    // The source takes over the event data
+    init_fragmented_event_source(&f_event, &event, rf->fragment_length);
+    event_bytes = event_set_bytes(&f_event.src);
+    event_fragments = es_num_fragments(&f_event.src);
+
+    if ((event_bytes > fdb_batch_bytes) ||
+        (event_fragments > batch_fragment_limit())) {
+      // Too large for any one transaction
+      ++chunk->events_scanned;
+      ++chunk->events_skipped;
+      *next_id = event.id + 1;
+    } else if (((batch_bytes + event_bytes) > fdb_batch_bytes) ||
+               ((num_fragments + event_fragments) > batch_fragment_limit())) {
+      // Too large for this transaction; the next chunk starts with it
+      full = true;
+    } else {
+      // Writing the first fragment clears the old ones
+      add_event_set_transactions(tx, &f_event.src, 0, UINT32_MAX,
+                                 &batch_bytes);
+      num_fragments += event_fragments;
+
+      ++chunk->events_scanned;
+      ++chunk->events_rewritten;
+      chunk->bytes_rewritten += event.data_length;
+      *next_id = event.id + 1;
+    }
+
+    es_free(&f_event.src);
+  }
+
+  if (!full) {
+    if (!out_more) {
+      // The chunk reached the end of the range
+      *next_id = rf->last_id;
+    } else if (as.event.data) {
+      // An event cut off by the end of the chunk is read whole by the next
+      // one, unless it alone fills a chunk
+      if (as.event.id > rf->next_id) {
+        *next_id = as.event.id;
+      } else {
+        ++chunk->events_scanned;
+        ++chunk->events_skipped;
+        *next_id = as.event.id + 1;
+      }
+    } else if (out_count) {
+      // Fragments of events that were never published are passed over
+      uint64_t id;
+      uint32_t fragment;
+
+      if (read_event_key(out_kv[out_count - 1].key,
+                         out_kv[out_count - 1].key_length, &id, &fragment) &&
+          (id >= *next_id))
+        *next_id = id + 1;
+    }
+  }
+
+  free_event(&as.event);
+  fdb_future_destroy(future);
+
+  // Success
+  return 0;
+
+// Failure
+chunk_fail:
+  free_event(&as.event);
+  fdb_future_destroy(future);
+  return -1;
+}
+
+bool refragment_needed(const EventAssembler *as, const Event *event,
+                       uint32_t fragment_length) {
+  uint64_t num_fragments = (event->data_length + fragment_length - 1) /
+                           fragment_length;
+
+  // Packed events have no fragments of their own, and compressed events are
+  // read back decompressed, so neither is rewritten
+  if (as->num_packed || as->compression)
+    return false;
+
+  // A single fragment is the same at any fragment length it fits in
+  if (!num_fragments)
+    num_fragments = 1;
+  if (num_fragments != as->num_fragments)
+    return true;
+
+  return ((num_fragments > 1) && (as->fragment_length != fragment_length));
+}
+
+void refragment_throttle(FDBRefragmenter *rf, const struct timespec *start) {
+  struct timespec now;
+  uint64_t elapsed_us;
+  uint64_t allowed_us;
+
+  if (!rf->max_bytes_per_sec)
+    return;
+
+  // Time the bytes rewritten so far are allowed to take
+  allowed_us = (uint64_t)(((double)rf->stats.bytes_rewritten * 1000000) /
+                          (double)rf->max_bytes_per_sec);
+
+  for (;;) {
+    uint64_t delay_us;
+
+    timespec_get(&now, TIME_UTC);
+    elapsed_us = ((uint64_t)(now.tv_sec - start->tv_sec) * 1000000) +
+                 ((now.tv_nsec - start->tv_nsec) / 1000);
+    if ((elapsed_us >= allowed_us) || atomic_load(&rf->stopping))
+      return;
+
+    // Sleep in slices, so that a stop request is not kept waiting
+    delay_us = allowed_us - elapsed_us;
+    if (delay_us > 100000)
+      delay_us = 100000;
+    thrd_sleep(&(struct timespec){.tv_sec = 0,
+                                  .tv_nsec = (long)(delay_us * 1000)},
+               NULL);
+  }
+}
+
+void *refragment_thread_func(void *arg) {
+  FDBRefragmenter *rf = (FDBRefragmenter *)arg;
+
+  rf->result = refragment_run(rf);
+  return NULL;
+}
@@ -0,0 +1,95 @@
+/// @file fdb_refragment.h
+///
+/// Declarations for rewriting events of the FoundationDB event log to a new
+/// fragment length, so that the fragment length can be retuned without
+/// leaving old events behind. Events are readable at any fragment length, so
+/// the rewrite is never urgent: it runs under a rate limit, in the background.
+
+#pragma once
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+//==============================================================================
+// Types
+//==============================================================================
+
+/// Counters of a re-fragmenting pass.
+typedef struct fdb_refragment_stats_t {
+  uint64_t events_scanned;   // Events read.
+  uint64_t events_rewritten; // Events rewritten to the new fragment length.
+  uint64_t events_skipped;   // Events too large to rewrite in one transaction.
+  uint64_t bytes_rewritten;  // Event data bytes rewritten.
+} FDBRefragmentStats;
+
+/// Background re-fragmenter: a thread rewriting a range of events.
+typedef struct fdb_refragmenter_t {
+  uint64_t first_id;          // Id of the first event in the range.
+  uint64_t next_id;           // Id of the next event to read.
+  uint64_t last_id;           // Id after the last event to read.
+  uint32_t fragment_length;   // Fragment length to rewrite events to.
+  uint64_t max_bytes_per_sec; // Rate limit on rewritten bytes (0 for none).
+  uint32_t bucket;            // Key bucket being rewritten.
+  atomic_bool stopping;       // Set when shutdown was requested.
+  pthread_t thread;           // Re-fragmenting thread.
+  int result;                 // 0 on success, -1 on failure.
+  FDBRefragmentStats stats;   // Counters of the pass so far.
+} FDBRefragmenter;
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Rewrite every event with an id in [first_id, last_id) whose fragments are
+/// not fragment_length bytes long. Events are read and rewritten a chunk at a
+/// time, each chunk in a single transaction within the write byte budget (see
+/// fdb_set_batch_bytes()), so a concurrent write or clear of an event in the
+/// chunk makes the chunk start over rather than be overwritten. Events too
+/// large for one transaction, packed events and compressed events are left as
+/// they are.
+///
+/// @param[in] first_id           Id of the first event in the range.
+/// @param[in] last_id            Id after the last event in the range.
+/// @param[in] fragment_length    Fragment length to rewrite events to
+///                               (between 1 and MAX_VALUE_SIZE).
+/// @param[in] max_bytes_per_sec  Rate limit on rewritten event data, in bytes
+///                               per second (0 for none).
+/// @param[in] stats              Address to write the counters of the pass
+///                               into, or NULL.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int fdb_refragment_event_range(uint64_t first_id, uint64_t last_id,
+                               uint32_t fragment_length,
+                               uint64_t max_bytes_per_sec,
+                               FDBRefragmentStats *stats);
+
+/// Start rewriting a range of events, as fdb_refragment_event_range() does,
+/// on a background thread.
+///
+/// @param[in] rf                 Handle for the re-fragmenter.
+/// @param[in] first_id           Id of the first event in the range.
+/// @param[in] last_id            Id after the last event in the range.
+/// @param[in] fragment_length    Fragment length to rewrite events to
+///                               (between 1 and MAX_VALUE_SIZE).
+/// @param[in] max_bytes_per_sec  Rate limit on rewritten event data, in bytes
+///                               per second (0 for none).
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int fdb_refragmenter_start(FDBRefragmenter *rf, uint64_t first_id,
+                           uint64_t last_id, uint32_t fragment_length,
+                           uint64_t max_bytes_per_sec);
+
+/// Stop a re-fragmenter once its current chunk is done, or wait for it to
+/// finish if it already has, then collect its counters. Events it did not get
+/// to are left as they are; with a single key bucket, a later pass may resume
+/// from rf->next_id.
+///
+/// @param[in] rf     Handle for the re-fragmenter.
+/// @param[in] stats  Address to write the counters of the pass into, or NULL.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int fdb_refragmenter_stop(FDBRefragmenter *rf, FDBRefragmentStats *stats);
@@ -24,18 +24,9 @@ typedef struct fdb_timer_t {
   clock_t t_min;
   clock_t t_max;
   double t_total;
+  uint32_t num_batches;
 } FDBTimer;
 
-typedef struct fdb_callback_data_t {
-  clock_t *start_t;
-  FDBTransaction *tx;
-  uint32_t *txs_processing;
-  FDBTimer *timer;
-  uint32_t num_events;
-  uint32_t num_frags;
-  uint32_t batch_size;
-} FDBCallbackData;
-
 //==============================================================================
 // Prototypes
 //==============================================================================
@@ -94,17 +85,23 @@ int fdb_clear_timed_database_async(uint32_t num_events, uint32_t num_fragments);
 // External Prototypes
 //==============================================================================
 
-/// Add a limited number of write operations for the fragments of an event to a
-/// FoundationDB transaction.
+/// Add write operations for the next batch of fragments from an array of
+/// events to a FoundationDB transaction. The batch ends at the byte budget, at
+/// the fragment cap, or at the end of the array.
 ///
-/// @param[in] tx         FDBTransaction handle.
-/// @param[in] event      FragmentedEvent handle.
-/// @param[in] start_pos  Starting position in event fragments array.
-/// @param[in] limit      Absolute limit on the number of fragments to write.
+/// @param[in]     tx          FDBTransaction handle.
+/// @param[in]     f_events    Array of event sources.
+/// @param[in]     num_events  Number of events in the array.
+/// @param[in,out] event_pos   Position of the next event to write.
+/// @param[in,out] frag_pos    Position of the next fragment to write in that
+///                            event.
 ///
 /// @return   Number of event fragments added to transaction.
-uint32_t add_event_set_transactions(FDBTransaction *tx, const Source *event,
-                                    uint32_t start_pos, uint32_t limit);
+uint32_t add_event_array_set_transactions(FDBTransaction *tx,
+                                          const FragmentedEventSource f_events[],
+                                          uint32_t num_events,
+                                          uint32_t *event_pos,
+                                          uint32_t *frag_pos);
 
 /// Check if a FoundationDB API command returned an error. If so, print the
 /// error description and exit.
@@ -0,0 +1,357 @@
+/// @file lmdb.c
+///
+/// Bulk importer for existing LMDB event logs.
+///
+/// The LMDB environment is memory-mapped and walked with a read-only cursor.
+/// Events are wrapped in borrowed sources that point straight into the map, so
+/// no payload is copied, and written in chunks by the parallel pipelined
+/// writer. After each chunk is durable, the id of its last event is saved to a
+/// checkpoint file, from which an interrupted import resumes.
+///
+/// Documentation links:
+///   http://www.lmdb.tech/doc/group__mdb.html
+///   https://www.gnu.org/software/libc/manual/html_node/Using-Getopt.html
+
+// Needed for getopt(), fileno() and fsync() in strict C11 mode
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <inttypes.h>
+#include <lmdb.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../constants.h"
+#include "../event.h"
+#include "../fdb.h"
+#include "../fdb_parallel.h"
+
+// Name of the LMDB database holding events, keyed by native-endian 64-bit
+// event number
+#define LMDB_EVENTS_DB "EVENTS"
+
+// Default number of event bytes written between checkpoints
+#define DEFAULT_CHUNK_MB 256
+
+// Default number of worker threads writing each chunk
+#define DEFAULT_NUM_WORKERS 4
+
+//==============================================================================
+// Types
+//==============================================================================
+
+typedef struct import_config_t {
+  const char *lmdb_path;       // Directory of the LMDB environment.
+  const char *checkpoint_path; // Checkpoint file, or NULL for none.
+  uint64_t chunk_bytes;        // Event bytes written between checkpoints.
+  uint32_t num_workers;        // Worker threads writing each chunk.
+} ImportConfig;
+
+//==============================================================================
+// Prototypes
+//==============================================================================
+
+/// Import every event after the checkpoint from an LMDB event log.
+///
+/// @param[in] config  Configuration of the import.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int import_lmdb(const ImportConfig *config);
+
+/// Read the id of the last imported event from a checkpoint file.
+///
+/// @param[in]  path     Path of the checkpoint file.
+/// @param[out] last_id  Id of the last imported event (0 if none).
+/// @param[out] resumed  Whether any event was imported before.
+///
+/// @return  0  Success, including when there is no checkpoint yet.
+/// @return -1  Failure.
+int read_checkpoint(const char *path, uint64_t *last_id, bool *resumed);
+
+/// Durably replace a checkpoint file with the id of the last imported event.
+///
+/// @param[in] path     Path of the checkpoint file.
+/// @param[in] last_id  Id of the last imported event.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int write_checkpoint(const char *path, uint64_t last_id);
+
+/// Seconds elapsed since a starting time.
+///
+/// @param[in] start  Starting time.
+///
+/// @return  Elapsed time in seconds.
+double seconds_since(const struct timespec *start);
+
+/// Print usage instructions.
+///
+/// @param[in] name  Name of the executable.
+void print_usage(const char *name);
+
+//==============================================================================
+// Functions
+//==============================================================================
+
+/// Execute the LMDB event log importer.
+///
+/// @param[in] argc  Number of command-line options provided.
+/// @param[in] argv  Array of command-line options provided.
+///
+/// @return  0  Success.
+/// @return -1  Failure.
+int main(int argc, char **argv) {
+  ImportConfig config = {NULL, NULL, (uint64_t)DEFAULT_CHUNK_MB << 20,
+                         DEFAULT_NUM_WORKERS};
+  int opt;
+  int err;
+
+  while ((opt = getopt(argc, argv, "c:m:w:h")) != -1) {
+    switch (opt) {
+    case 'c':
+      config.checkpoint_path = optarg;
+      break;
+    case 'm':
+      config.chunk_bytes = strtoull(optarg, NULL, 10) << 20;
+      break;
+    case 'w':
+      config.num_workers = (uint32_t)strtoul(optarg, NULL, 10);
+      break;
+    default:
+      print_usage(argv[0]);
+      return -1;
+    }
+  }
+
+  if ((optind != (argc - 1)) || !config.chunk_bytes || !config.num_workers) {
+    print_usage(argv[0]);
+    return -1;
+  }
+  config.lmdb_path = argv[optind];
+
+  // Initialize FoundationDB database
+  fdb_init_database();
+  fdb_init_network_thread();
+
+  err = import_lmdb(&config);
+
+  // Clean up FoundationDB database
+  fdb_shutdown_network_thread();
+  fdb_shutdown_database();
+
+  return err;
+}
+
+int import_lmdb(const ImportConfig *config) {
+  MDB_env *env;
+  MDB_txn *txn;
+  MDB_dbi dbi;
+  MDB_cursor *cursor;
+  MDB_val key, value;
+  FragmentedEventSource *f_events = NULL;
+  uint32_t capacity = 0;
+  uint64_t last_id = 0;
+  uint64_t total_events = 0;
+  uint64_t total_bytes = 0;
+  struct timespec start;
+  MDB_cursor_op op;
+  bool resumed = false;
+  int rc;
+
+  if (config->checkpoint_path &&
+      read_checkpoint(config->checkpoint_path, &last_id, &resumed))
+    return -1;
+
+  // Map the environment read-only. A single read transaction pins a snapshot
+  // of the log, and every value read from it stays valid until it ends.
+  if ((rc = mdb_env_create(&env)))
+    goto env_fail;
+  if ((rc = mdb_env_set_maxdbs(env, 2)) ||
+      (rc = mdb_env_open(env, config->lmdb_path, MDB_RDONLY | MDB_NOTLS, 0)))
+    goto open_fail;
+  if ((rc = mdb_txn_begin(env, NULL, MDB_RDONLY, &txn)))
+    goto open_fail;
+  if ((rc = mdb_dbi_open(txn, LMDB_EVENTS_DB, MDB_INTEGERKEY, &dbi)) ||
+      (rc = mdb_cursor_open(txn, dbi, &cursor)))
+    goto txn_fail;
+
+  if (resumed)
+    printf("resuming after event %" PRIu64 "\n", last_id);
+
+  // Start right after the checkpoint, or at the first event of the log
+  key.mv_size = sizeof(last_id);
+  key.mv_data = &(uint64_t){resumed ? (last_id + 1) : 0};
+  op = MDB_SET_RANGE;
+
+  timespec_get(&start, TIME_UTC);
+  for (;;) {
+    uint64_t chunk_bytes = 0;
+    uint32_t num_events = 0;
+
+    // Gather a chunk of events without copying their payloads
+    while (chunk_bytes < config->chunk_bytes) {
+      Event event;
+
+      if ((rc = mdb_cursor_get(cursor, &key, &value, op)))
+        break;
+      op = MDB_NEXT;
+
+      if ((key.mv_size != sizeof(uint64_t)) || !value.mv_size) {
+        fprintf(stderr, "malformed event in LMDB event log\n");
+        goto import_fail;
+      }
+
+      if (num_events == capacity) {
+        FragmentedEventSource *grown;
+
+        capacity = capacity ? (capacity * 2) : 4096;
+        grown = realloc(f_events, sizeof(FragmentedEventSource) * capacity);
+        if (!grown)
+          goto import_fail;
+        f_events = grown;
+      }
+
+      memcpy(&event.id, key.mv_data, sizeof(event.id));
+      event.data_length = value.mv_size;
+      event.data = (uint8_t *)value.mv_data;
+      init_borrowed_event_source(&f_events[num_events++], &event,
+                                 OPTIMAL_VALUE_SIZE);
+      chunk_bytes += value.mv_size;
+    }
+
+    if (rc && (rc != MDB_NOTFOUND))
+      goto lmdb_fail;
+    if (!num_events)
+      break;
+
+    // Write the chunk, then record that it is durable
+    if (fdb_write_fragmented_event_array_parallel(f_events, num_events,
+                                                  config->num_workers, NULL))
+      goto import_fail;
+
+    last_id = f_events[num_events - 1].src.event.id;
+    if (config->checkpoint_path &&
+        write_checkpoint(config->checkpoint_path, last_id))
+      goto import_fail;
+
+    total_events += num_events;
+    total_bytes += chunk_bytes;
+    printf("imported %" PRIu64 " events (%" PRIu64 " MB) through event %" PRIu64
+           ", %.1f MB/s\n",
+           total_events, (total_bytes >> 20), last_id,
+           (total_bytes / 1048576.0) / seconds_since(&start));
+
+    if (rc == MDB_NOTFOUND)
+      break;
+  }
+
+  printf("import complete: %" PRIu64 " events in %.1f s\n", total_events,
+         seconds_since(&start));
+
+  free(f_events);
+  mdb_cursor_close(cursor);
+  mdb_txn_abort(txn);
+  mdb_env_close(env);
+
+  // Success
+  return 0;
+
+// Failure
+lmdb_fail:
+  fprintf(stderr, "lmdb error: (%d) %s\n", rc, mdb_strerror(rc));
+import_fail:
+  free(f_events);
+  mdb_cursor_close(cursor);
+  mdb_txn_abort(txn);
+  mdb_env_close(env);
+  return -1;
+
+txn_fail:
+  mdb_txn_abort(txn);
+open_fail:
+  mdb_env_close(env);
+env_fail:
+  fprintf(stderr, "lmdb error: (%d) %s\n", rc, mdb_strerror(rc));
+  return -1;
+}
+
+int read_checkpoint(const char *path, uint64_t *last_id, bool *resumed) {
+  FILE *file = fopen(path, "r");
+
+  *last_id = 0;
+  *resumed = false;
+
+  // No checkpoint yet: start from the beginning
+  if (!file)
+    return (errno == ENOENT) ? 0 : -1;
+
+  if (fscanf(file, "%" SCNu64, last_id) != 1) {
+    fprintf(stderr, "unreadable checkpoint file %s\n", path);
+    fclose(file);
+    return -1;
+  }
+
+  *resumed = true;
+  fclose(file);
+  return 0;
+}
+
+int write_checkpoint(const char *path, uint64_t last_id) {
+  size_t path_length = strlen(path);
+  char *tmp_path = malloc(path_length + 5);
+  FILE *file;
+
+  if (!tmp_path)
+    return -1;
+  memcpy(tmp_path, path, path_length);
+  memcpy(tmp_path + path_length, ".tmp", 5);
+
+  // Write a new file and rename it over the old one, so that a crash leaves
+  // either the old or the new checkpoint
+  if (!(file = fopen(tmp_path, "w")))
+    goto checkpoint_fail;
+
+  if ((fprintf(file, "%" PRIu64 "\n", last_id) < 0) || fflush(file) ||
+      fsync(fileno(file))) {
+    fclose(file);
+    goto checkpoint_fail;
+  }
+
+  if (fclose(file) || rename(tmp_path, path))
+    goto checkpoint_fail;
+
+  free(tmp_path);
+
+  // Success
+  return 0;
+
+// Failure
+checkpoint_fail:
+  fprintf(stderr, "could not write checkpoint file %s: %s\n", path,
+          strerror(errno));
+  free(tmp_path);
+  return -1;
+}
+
+double seconds_since(const struct timespec *start) {
+  struct timespec now;
+
+  timespec_get(&now, TIME_UTC);
+  return (now.tv_sec - start->tv_sec) + ((now.tv_nsec - start->tv_nsec) / 1e9);
+}
+
+void print_usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s [-c checkpoint] [-m chunk MB] [-w workers] <lmdb dir>\n"
+          "\n"
+          "  -c  file recording the last imported event, to resume from\n"
+          "  -m  event megabytes written between checkpoints (default %d)\n"
+          "  -w  worker threads writing each chunk (default %d)\n",
+          name, DEFAULT_CHUNK_MB, DEFAULT_NUM_WORKERS);
+}
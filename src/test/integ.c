@@ -5,6 +5,7 @@
 #include <assert.h>
 #include <limits.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,7 +13,14 @@
 
 #include "../constants.h"
 #include "../event.h"
+#include "../event_cache.h"
+#include "../event_compress.h"
 #include "../fdb.h"
+#include "../fdb_async.h"
+#include "../fdb_cursor.h"
+#include "../fdb_group_commit.h"
+#include "../fdb_parallel.h"
+#include "../fdb_refragment.h"
 
 //==============================================================================
 // Prototypes
@@ -51,9 +59,94 @@ void test_write_event_array(void);
 /// their entirety.
 void test_write_fragmented_event_array(void);
 
+/// Test that an array of events can be written to a FoundationDB cluster in
+/// their entirety when transactions are limited by bytes rather than by
+/// fragments.
+void test_write_fragmented_event_array_byte_budget(void);
+
+/// Test that an array of events can be written to a FoundationDB cluster in
+/// their entirety with several batches committing concurrently.
+void test_write_fragmented_event_array_pipelined(void);
+
+/// Test that an array of events can be written to a FoundationDB cluster in
+/// their entirety from several worker threads, with progress reported.
+void test_write_fragmented_event_array_parallel(void);
+
+/// Test that events written concurrently through a group committer all reach
+/// a FoundationDB cluster, sharing commits.
+void test_group_commit_write(void);
+
 /// Test that an event can be read from a FoundationDB cluster in its entirety.
 void test_read_event(void);
 
+/// Test that an event too large for a single range read can be read from a
+/// FoundationDB cluster in its entirety.
+void test_read_event_multiple_ranges(void);
+
+/// Test that a range of events can be read back with a single range read.
+void test_read_event_range(void);
+
+/// Test that single-fragment events of a range can be read without copying
+/// them.
+void test_read_event_batch(void);
+
+/// Test that a cursor replays a range of events in order.
+void test_cursor(void);
+
+/// Test that events can be read into an event arena, and that an arena too
+/// small for an event reports the length it needs.
+void test_read_event_into(void);
+
+/// Test that a range of events can be scanned in parallel, in order or not.
+void test_scan_event_range_parallel(void);
+
+/// Test that many events and ranges can be read at once without blocking.
+void test_read_event_async(void);
+
+/// Test that retryable errors are retried within the retry budget, and that
+/// other errors are not.
+void test_retry_on_error(void);
+
+/// Test that reads through the read version cache see the writes made before
+/// them.
+void test_read_version_cache(void);
+
+/// Test that written events are served from the event cache, and that cleared
+/// events are not.
+void test_event_cache(void);
+
+/// Test that an event split across several buffers can be written and read
+/// back in its entirety.
+void test_write_scatter_gather_event(void);
+
+/// Test that an event pulled from a callback can be written without holding
+/// all of its data in memory.
+void test_write_stream_event(void);
+
+/// Test that an event larger than one transaction only becomes visible once
+/// it is written in its entirety.
+void test_write_event_staged(void);
+
+/// Test that events can be rewritten to a new fragment length and read back,
+/// in the foreground or the background.
+void test_refragment_event_range(void);
+
+/// Test that events spread over several key buckets read back in id order
+/// through every kind of read.
+void test_key_buckets(void);
+
+/// Test that events written with compact keys read back in id order, with
+/// and without key buckets.
+void test_key_format(void);
+
+/// Test packing runs of small events into shared key-value pairs, and reading
+/// them back through every reader.
+void test_pack_events(void);
+
+/// Test writing events compressed with each built-in compression algorithm,
+/// and reading them back through every reader.
+void test_compressed_events(void);
+
 /// Generate random, fake data for simulating events.
 ///
 /// @param[in] size   Number of bytes of data to generate.
@@ -61,6 +154,15 @@ void test_read_event(void);
 /// @return   Handle to array of generated data.
 uint8_t *generate_dummy_data(uint64_t size);
 
+/// Set up events with consecutive ids and random data of mixed sizes: from a
+/// single byte to three fragments of OPTIMAL_VALUE_SIZE.
+///
+/// @param[in] f_events    Array of event sources to initialize.
+/// @param[in] num_events  Number of events in the array.
+/// @param[in] first_id    Id of the first event.
+void load_mixed_events(FragmentedEventSource f_events[], uint32_t num_events,
+                       uint64_t first_id);
+
 /// Count the number of keys stored in the FoundationDB cluster referenced by a
 /// FDBTransaction.
 ///
@@ -78,6 +180,48 @@ uint32_t count_keys_in_database(FDBTransaction *tx);
 uint32_t count_event_fragments_in_database(FDBTransaction *tx,
                                            uint64_t event_id);
 
+/// Producer thread for the group commit test: submits a range of events, then
+/// waits for all of them.
+///
+/// @param[in] arg  Handle for the GroupCommitProducer object.
+void *group_commit_producer_func(void *arg);
+
+/// Pull callback for the streaming write test: copy the next bytes of a buffer.
+///
+/// @param[in] ctx     Handle for the StreamTestReader object.
+/// @param[in] buf     Buffer to fill.
+/// @param[in] length  Number of bytes to copy.
+///
+/// @return  0  Success.
+int stream_test_pull(void *ctx, uint8_t *buf, uint32_t length);
+
+/// Scan callback for the parallel scan test: check an event against the
+/// events written, and count it.
+///
+/// @param[in] param      Handle for the ScanTestState object.
+/// @param[in] partition  Partition the event was read from.
+/// @param[in] event      Handle for the event.
+///
+/// @return  0  The event was expected.
+/// @return -1  The scan should stop.
+int scan_test_callback(void *param, uint32_t partition, Event *event);
+
+/// Event callback for the asynchronous read tests: check an event against the
+/// events written, count it, and release it.
+///
+/// @param[in] param  Handle for the AsyncTestState object.
+/// @param[in] event  Handle for the event.
+///
+/// @return  0  Success.
+int async_test_event_callback(void *param, Event *event);
+
+/// Completion callback for the asynchronous read tests: count a finished read,
+/// and whether it failed, then wake the waiting test.
+///
+/// @param[in] param   Handle for the AsyncTestState object.
+/// @param[in] result  Result of the read: 0 on success, -1 on failure.
+void async_test_done_callback(void *param, int result);
+
 /// Gracefully fail a test by cleaning up before exiting.
 void fail_test(void);
 
@@ -111,7 +255,29 @@ int main(int argc, char **argv) {
   test_write_fragmented_event();
   test_write_event_array();
   test_write_fragmented_event_array();
+  test_write_fragmented_event_array_byte_budget();
+  test_write_fragmented_event_array_pipelined();
+  test_write_fragmented_event_array_parallel();
+  test_group_commit_write();
   test_read_event();
+  test_read_event_multiple_ranges();
+  test_read_event_range();
+  test_read_event_batch();
+  test_cursor();
+  test_read_event_into();
+  test_scan_event_range_parallel();
+  test_read_event_async();
+  test_retry_on_error();
+  test_read_version_cache();
+  test_event_cache();
+  test_write_scatter_gather_event();
+  test_write_stream_event();
+  test_write_event_staged();
+  test_refragment_event_range();
+  test_key_buckets();
+  test_key_format();
+  test_pack_events();
+  test_compressed_events();
 
   // Success
   printf("\nIntegration tests completed successfully.\n");
@@ -693,6 +859,45 @@ void test_write_fragmented_event_array(void) {
     assert(db_fragments == es_num_fragments(&mock_f_events[i].src));
   }
 
+  fdb_transaction_destroy(tx);
+
+  // Overwrite the events at new lengths: the first fragment of each now goes
+  // under a key with another header, and the longer events lose fragments
+  for (uint8_t i = 0; i < num_events; ++i) {
+    uint32_t data_size = ((mock_f_events[i].src.event.data_length / 2) + 1);
+
+    es_free(&mock_f_events[i].src);
+
+    mock_events[i].id = i;
+    mock_events[i].data_length = data_size;
+    mock_events[i].data = generate_dummy_data(data_size);
+
+    init_fragmented_event_source(&mock_f_events[i], &mock_events[i], OPTIMAL_VALUE_SIZE);
+  }
+
+  fdb_write_fragmented_event_array(mock_f_events, num_events);
+
+  if (fdb_check_error(fdb_setup_transaction(&tx)))
+    fail_test();
+
+  // Verify that only the new fragments are left, and read back as the new
+  // events
+  for (uint8_t i = 0; i < num_events; ++i) {
+    Event return_event = {.id = i};
+    uint32_t db_fragments = count_event_fragments_in_database(tx, mock_f_events[i].src.event.id);
+
+    assert(db_fragments == es_num_fragments(&mock_f_events[i].src));
+
+    if (fdb_read_event(&return_event))
+      fail_test();
+
+    assert(return_event.data_length == mock_f_events[i].src.event.data_length);
+    assert(!memcmp(return_event.data, mock_f_events[i].src.event.data,
+                   return_event.data_length));
+
+    free_event(&return_event);
+  }
+
   // Release the dummy data memory
   for (uint8_t i = 0; i < num_events; ++i) {
     free_event(&mock_events[i]);
@@ -711,26 +916,37 @@ void test_write_fragmented_event_array(void) {
   printf("fdb_write_fragmented_event_array() test PASSED\n");
 }
 
-void test_read_event(void) {
+void test_write_fragmented_event_array_byte_budget(void) {
   FDBTransaction *tx;
-  Event mock_event, return_event;
-  FragmentedEventSource mock_f_event;
-  uint64_t event_id = 42;
-  uint32_t data_size = (3 * OPTIMAL_VALUE_SIZE);
+  Event *mock_events;
+  FragmentedEventSource *mock_f_events;
+  uint8_t dead_marker_key[FDB_KEY_TOTAL_LENGTH] = {0x01, 0, 0, 0, 0, 0, 0, 0, 42, 0, 0, 0, 1};
+  uint32_t num_events = 20;
+  uint32_t total_num_fragments = 0;
 
-  printf("\nStarting fdb_read_event() test...\n");
+  printf("\nStarting fdb_set_batch_bytes() test...\n");
 
-  // Setup FoundationDB batch settings
-  fdb_set_batch_size(10);
+  // Setup FoundationDB batch settings: no fragment cap, and a budget smaller
+  // than a full fragment, so every full fragment must get its own transaction
+  fdb_set_batch_size(0);
+  assert(fdb_set_batch_bytes(0) == -1);
+  assert(fdb_set_batch_bytes(MAX_BATCH_BYTES + 1) == -1);
+  assert(fdb_set_batch_bytes(OPTIMAL_VALUE_SIZE / 2) == 0);
 
-  // Setup event
-  mock_event.id = event_id;
-  mock_event.data_length = data_size;
-  mock_event.data = generate_dummy_data(data_size);
+  // Setup events
+  mock_events = malloc(sizeof(Event) * num_events);
+  mock_f_events = malloc(sizeof(FragmentedEventSource) * num_events);
 
-  init_fragmented_event_source(&mock_f_event, &mock_event, OPTIMAL_VALUE_SIZE);
+  for (uint8_t i = 0; i < num_events; ++i) {
+    // Mix small events, which share transactions, with multiple fragment ones
+    uint32_t data_size = (i % 5) ? (100 * i) : (2 * OPTIMAL_VALUE_SIZE) + i;
 
-  return_event.id = event_id;
+    mock_events[i].id = i;
+    mock_events[i].data_length = data_size;
+    mock_events[i].data = generate_dummy_data(data_size);
+
+    init_fragmented_event_source(&mock_f_events[i], &mock_events[i], OPTIMAL_VALUE_SIZE);
+  }
 
   // Setup transaction handle
   if (fdb_check_error(fdb_setup_transaction(&tx)))
@@ -739,45 +955,2029 @@ void test_read_event(void) {
   // Verify that database is empty before test
   assert(count_keys_in_database(tx) == 0);
 
-  // fdb_write_fragmented_event() uses its own transaction, so we need to
+  // fdb_write_fragmented_event_array() uses its own transaction, so we need to
   // discard ours
   fdb_transaction_destroy(tx);
 
-  // Write event to FoundationDB cluster
-  fdb_write_event(&mock_f_event.src);
+  // Attempt to write events to FoundationDB cluster
+  if (fdb_write_fragmented_event_array(mock_f_events, num_events))
+    fail_test();
 
-  // Attempt to read event back from FoundationDB cluster
-  fdb_read_event(&return_event);
+  // Need a new transaction handle to read from the database
+  if (fdb_check_error(fdb_setup_transaction(&tx)))
+    fail_test();
 
-  // Verify that output data matches input data
-  assert(mock_event.data_length == return_event.data_length);
-  assert(!memcmp(mock_f_event.src.event.data, return_event.data, data_size));
+  // Verify that the events are in the database
+  for (uint8_t i = 0; i < num_events; ++i) {
+    uint32_t db_fragments = count_event_fragments_in_database(tx, mock_f_events[i].src.event.id);
+    assert(db_fragments == es_num_fragments(&mock_f_events[i].src));
+  }
+
+  // The completed write left no idempotency markers behind; those of a write
+  // that died midway are removed without touching the events
+  for (uint8_t i = 0; i < num_events; ++i)
+    total_num_fragments += es_num_fragments(&mock_f_events[i].src);
+  assert(count_keys_in_database(tx) == total_num_fragments);
+  fdb_transaction_set(tx, dead_marker_key, sizeof(dead_marker_key),
+                      dead_marker_key, sizeof(dead_marker_key));
+  if (fdb_send_transaction(tx))
+    fail_test();
+  assert(count_keys_in_database(tx) == (total_num_fragments + 1));
+  fdb_transaction_reset(tx);
+  if (fdb_clear_write_markers())
+    fail_test();
+  assert(count_keys_in_database(tx) == total_num_fragments);
 
   // Release the dummy data memory
-  es_free(&mock_f_event.src);
-  free_event(&mock_event);
-  free_event(&return_event);
+  for (uint8_t i = 0; i < num_events; ++i) {
+    free_event(&mock_events[i]);
+    es_free(&mock_f_events[i].src);
+  }
+  free((void *)mock_f_events);
+  free((void *)mock_events);
+
+  // Release the transaction handle
+  fdb_transaction_destroy(tx);
+
+  // Restore the default budget
+  fdb_set_batch_bytes(DEFAULT_BATCH_BYTES);
 
   // Clear the database
   fdb_clear_database();
 
   // Success
-  printf("fdb_read_event() test PASSED\n");
+  printf("fdb_set_batch_bytes() test PASSED\n");
 }
 
-uint8_t *generate_dummy_data(uint64_t size) {
-  uint8_t *result = malloc(sizeof(uint8_t) * size);
+void test_write_fragmented_event_array_pipelined(void) {
+  FDBTransaction *tx;
+  Event *mock_events;
+  FragmentedEventSource *mock_f_events;
+  uint32_t num_events = 50;
+  uint32_t total_num_fragments = 0;
 
-  // Seed the random number generator
-  srand(clock());
+  printf("\nStarting fdb_write_fragmented_event_array_pipelined() test...\n");
 
-  // Generate random byte data
-  for (uint64_t i = 0; i < size; ++i) {
-    result[i] = rand() % 256;
+  // Setup FoundationDB batch settings: a window smaller than the number of
+  // batches forces slots to be reused
+  fdb_set_batch_size(3);
+  fdb_set_window_size(4);
+
+  // Setup events
+  mock_events = malloc(sizeof(Event) * num_events);
+  mock_f_events = malloc(sizeof(FragmentedEventSource) * num_events);
+
+  for (uint8_t i = 0; i < num_events; ++i) {
+    // Mix single and multiple fragment events, so batches split events
+    uint32_t data_size = ((i % 4) * OPTIMAL_VALUE_SIZE) + 1;
+
+    mock_events[i].id = i;
+    mock_events[i].data_length = data_size;
+    mock_events[i].data = generate_dummy_data(data_size);
+
+    init_fragmented_event_source(&mock_f_events[i], &mock_events[i], OPTIMAL_VALUE_SIZE);
+    total_num_fragments += es_num_fragments(&mock_f_events[i].src);
+  }
+
+  // Setup transaction handle
+  if (fdb_check_error(fdb_setup_transaction(&tx)))
+    fail_test();
+
+  // Verify that database is empty before test
+  assert(count_keys_in_database(tx) == 0);
+
+  // fdb_write_fragmented_event_array_pipelined() uses its own transactions, so
+  // we need to discard ours
+  fdb_transaction_destroy(tx);
+
+  // Attempt to write events to FoundationDB cluster
+  if (fdb_write_fragmented_event_array_pipelined(mock_f_events, num_events))
+    fail_test();
+
+  // Need a new transaction handle to read from the database
+  if (fdb_check_error(fdb_setup_transaction(&tx)))
+    fail_test();
+
+  // Verify that the events are in the database
+  assert(count_keys_in_database(tx) == total_num_fragments);
+  for (uint8_t i = 0; i < num_events; ++i) {
+    uint32_t db_fragments = count_event_fragments_in_database(tx, mock_f_events[i].src.event.id);
+    assert(db_fragments == es_num_fragments(&mock_f_events[i].src));
+  }
+
+  // Release the dummy data memory
+  for (uint8_t i = 0; i < num_events; ++i) {
+    free_event(&mock_events[i]);
+    es_free(&mock_f_events[i].src);
   }
+  free((void *)mock_f_events);
+  free((void *)mock_events);
+
+  // Release the transaction handle
+  fdb_transaction_destroy(tx);
+
+  // Clear the database
+  fdb_clear_database();
 
   // Success
-  return result;
+  printf("fdb_write_fragmented_event_array_pipelined() test PASSED\n");
+}
+
+void test_write_fragmented_event_array_parallel(void) {
+  FDBTransaction *tx;
+  FDBWriteProgress progress;
+  Event *mock_events;
+  FragmentedEventSource *mock_f_events;
+  uint32_t num_events = 60;
+  uint32_t total_num_fragments = 0;
+
+  printf("\nStarting fdb_write_fragmented_event_array_parallel() test...\n");
+
+  // Setup FoundationDB batch settings
+  fdb_set_batch_size(4);
+  fdb_set_window_size(2);
+
+  // Setup events
+  mock_events = malloc(sizeof(Event) * num_events);
+  mock_f_events = malloc(sizeof(FragmentedEventSource) * num_events);
+
+  for (uint32_t i = 0; i < num_events; ++i) {
+    uint32_t data_size = ((i % 5) * OPTIMAL_VALUE_SIZE) + 1;
+
+    mock_events[i].id = i;
+    mock_events[i].data_length = data_size;
+    mock_events[i].data = generate_dummy_data(data_size);
+
+    init_fragmented_event_source(&mock_f_events[i], &mock_events[i], OPTIMAL_VALUE_SIZE);
+    total_num_fragments += es_num_fragments(&mock_f_events[i].src);
+  }
+
+  // Setup transaction handle
+  if (fdb_check_error(fdb_setup_transaction(&tx)))
+    fail_test();
+
+  // Verify that database is empty before test
+  assert(count_keys_in_database(tx) == 0);
+
+  // fdb_write_fragmented_event_array_parallel() uses its own transactions, so
+  // we need to discard ours
+  fdb_transaction_destroy(tx);
+
+  // A pool without workers is rejected
+  assert(fdb_write_fragmented_event_array_parallel(mock_f_events, num_events, 0, NULL) == -1);
+
+  // Attempt to write events to FoundationDB cluster
+  fdb_write_progress_init(&progress);
+  if (fdb_write_fragmented_event_array_parallel(mock_f_events, num_events, 4, &progress))
+    fail_test();
+
+  // Verify that progress covers every event
+  assert(atomic_load(&progress.events) == num_events);
+  assert(atomic_load(&progress.fragments) == total_num_fragments);
+  assert(atomic_load(&progress.commits) >= (total_num_fragments / 4));
+
+  // Need a new transaction handle to read from the database
+  if (fdb_check_error(fdb_setup_transaction(&tx)))
+    fail_test();
+
+  // Verify that the events are in the database
+  assert(count_keys_in_database(tx) == total_num_fragments);
+  for (uint32_t i = 0; i < num_events; ++i) {
+    uint32_t db_fragments = count_event_fragments_in_database(tx, mock_f_events[i].src.event.id);
+    assert(db_fragments == es_num_fragments(&mock_f_events[i].src));
+  }
+
+  // Release the dummy data memory
+  for (uint32_t i = 0; i < num_events; ++i) {
+    free_event(&mock_events[i]);
+    es_free(&mock_f_events[i].src);
+  }
+
+  free((void *)mock_f_events);
+  free((void *)mock_events);
+
+  // Release the transaction handle
+  fdb_transaction_destroy(tx);
+
+  // Clear the database
+  fdb_clear_database();
+
+  // Success
+  printf("fdb_write_fragmented_event_array_parallel() test PASSED\n");
+}
+
+typedef struct group_commit_producer_t {
+  FDBGroupCommit *gc;
+  FragmentedEventSource *f_events;
+  uint32_t num_events;
+  int result;
+} GroupCommitProducer;
+
+void *group_commit_producer_func(void *arg) {
+  GroupCommitProducer *producer = (GroupCommitProducer *)arg;
+  FDBWriteFuture *futures = malloc(sizeof(FDBWriteFuture) * producer->num_events);
+
+  producer->result = 0;
+  for (uint32_t i = 0; i < producer->num_events; ++i)
+    fdb_group_commit_submit(producer->gc, &producer->f_events[i].src, &futures[i]);
+
+  for (uint32_t i = 0; i < producer->num_events; ++i)
+    if (fdb_group_commit_wait(producer->gc, &futures[i]))
+      producer->result = -1;
+
+  free(futures);
+  return NULL;
+}
+
+void test_group_commit_write(void) {
+  FDBTransaction *tx;
+  FDBGroupCommit gc;
+  Event *mock_events;
+  FragmentedEventSource *mock_f_events;
+  pthread_t threads[4];
+  GroupCommitProducer producers[4];
+  uint32_t num_producers = 4;
+  uint32_t events_per_producer = 25;
+  uint32_t num_events = num_producers * events_per_producer;
+  uint32_t total_num_fragments = 0;
+
+  printf("\nStarting fdb_group_commit_write() test...\n");
+
+  // Setup a small byte budget, so that batches fill up and one event is too
+  // large to share a transaction
+  fdb_set_batch_size(0);
+  fdb_set_batch_bytes(8 * OPTIMAL_VALUE_SIZE);
+
+  // Setup events
+  mock_events = malloc(sizeof(Event) * num_events);
+  mock_f_events = malloc(sizeof(FragmentedEventSource) * num_events);
+
+  for (uint32_t i = 0; i < num_events; ++i) {
+    uint32_t data_size = ((i % 4) * OPTIMAL_VALUE_SIZE) + 1;
+    if (i == (num_events / 2))
+      data_size = 10 * OPTIMAL_VALUE_SIZE;
+
+    mock_events[i].id = i;
+    mock_events[i].data_length = data_size;
+    mock_events[i].data = generate_dummy_data(data_size);
+
+    init_fragmented_event_source(&mock_f_events[i], &mock_events[i], OPTIMAL_VALUE_SIZE);
+    total_num_fragments += es_num_fragments(&mock_f_events[i].src);
+  }
+
+  // Setup transaction handle
+  if (fdb_check_error(fdb_setup_transaction(&tx)))
+    fail_test();
+
+  // Verify that database is empty before test
+  assert(count_keys_in_database(tx) == 0);
+
+  // The group committer uses its own transactions, so we need to discard ours
+  fdb_transaction_destroy(tx);
+
+  // Attempt to write events from several producers at once
+  if (fdb_group_commit_init(&gc, 1000))
+    fail_test();
+
+  for (uint32_t i = 0; i < num_producers; ++i) {
+    producers[i].gc = &gc;
+    producers[i].f_events = mock_f_events + (i * events_per_producer);
+    producers[i].num_events = events_per_producer;
+    pthread_create(&threads[i], NULL, group_commit_producer_func, &producers[i]);
+  }
+
+  for (uint32_t i = 0; i < num_producers; ++i) {
+    pthread_join(threads[i], NULL);
+    assert(producers[i].result == 0);
+  }
+
+  // A single synchronous write after the producers are done
+  Event last_event = {.id = num_events, .data_length = 1, .data = generate_dummy_data(1)};
+  FragmentedEventSource last_f_event;
+  init_fragmented_event_source(&last_f_event, &last_event, OPTIMAL_VALUE_SIZE);
+  if (fdb_group_commit_write(&gc, &last_f_event.src))
+    fail_test();
+
+  if (fdb_group_commit_shutdown(&gc))
+    fail_test();
+
+  // Need a new transaction handle to read from the database
+  if (fdb_check_error(fdb_setup_transaction(&tx)))
+    fail_test();
+
+  // Verify that every event was written, and that events shared commits
+  assert(gc.num_events == (num_events + 1));
+  assert(gc.num_commits < gc.num_events);
+  assert(count_keys_in_database(tx) == (total_num_fragments + 1));
+  for (uint32_t i = 0; i < num_events; ++i) {
+    uint32_t db_fragments = count_event_fragments_in_database(tx, mock_f_events[i].src.event.id);
+    assert(db_fragments == es_num_fragments(&mock_f_events[i].src));
+  }
+
+  // Release the dummy data memory
+  for (uint32_t i = 0; i < num_events; ++i) {
+    free_event(&mock_events[i]);
+    es_free(&mock_f_events[i].src);
+  }
+  es_free(&last_f_event.src);
+
+  free((void *)mock_f_events);
+  free((void *)mock_events);
+
+  // Release the transaction handle
+  fdb_transaction_destroy(tx);
+
+  // Restore the default byte budget
+  fdb_set_batch_bytes(DEFAULT_BATCH_BYTES);
+
+  // Clear the database
+  fdb_clear_database();
+
+  // Success
+  printf("fdb_group_commit_write() test PASSED\n");
+}
+
+void test_read_event(void) {
+  FDBTransaction *tx;
+  Event mock_event, return_event;
+  FragmentedEventSource mock_f_event;
+  uint64_t event_id = 42;
+  uint32_t data_size = (3 * OPTIMAL_VALUE_SIZE);
+
+  printf("\nStarting fdb_read_event() test...\n");
+
+  // Setup FoundationDB batch settings
+  fdb_set_batch_size(10);
+
+  // Setup event
+  mock_event.id = event_id;
+  mock_event.data_length = data_size;
+  mock_event.data = generate_dummy_data(data_size);
+
+  init_fragmented_event_source(&mock_f_event, &mock_event, OPTIMAL_VALUE_SIZE);
+
+  return_event.id = event_id;
+
+  // Setup transaction handle
+  if (fdb_check_error(fdb_setup_transaction(&tx)))
+    fail_test();
+
+  // Verify that database is empty before test
+  assert(count_keys_in_database(tx) == 0);
+
+  // fdb_write_fragmented_event() uses its own transaction, so we need to
+  // discard ours
+  fdb_transaction_destroy(tx);
+
+  // Write event to FoundationDB cluster
+  fdb_write_event(&mock_f_event.src);
+
+  // Attempt to read event back from FoundationDB cluster
+  fdb_read_event(&return_event);
+
+  // Verify that output data matches input data
+  assert(mock_event.data_length == return_event.data_length);
+  assert(!memcmp(mock_f_event.src.event.data, return_event.data, data_size));
+
+  // Release the dummy data memory
+  es_free(&mock_f_event.src);
+  free_event(&mock_event);
+  free_event(&return_event);
+
+  // Clear the database
+  fdb_clear_database();
+
+  // Success
+  printf("fdb_read_event() test PASSED\n");
+}
+
+void test_read_event_multiple_ranges(void) {
+  FDBTransaction *tx;
+  Event mock_event, return_event;
+  FragmentedEventSource mock_f_event;
+  uint64_t event_id = 42;
+  uint32_t data_size = (40 * OPTIMAL_VALUE_SIZE) + 1;
+
+  printf("\nStarting fdb_read_event() multiple ranges test...\n");
+
+  // Setup FoundationDB batch settings
+  fdb_set_batch_size(10);
+
+  // Setup event with a short prefix, so fragments are not aligned to ranges
+  mock_event.id = event_id;
+  mock_event.data_length = data_size;
+  mock_event.data = generate_dummy_data(data_size);
+
+  init_fragmented_event_source(&mock_f_event, &mock_event, OPTIMAL_VALUE_SIZE);
+
+  return_event.id = event_id;
+
+  // Setup transaction handle
+  if (fdb_check_error(fdb_setup_transaction(&tx)))
+    fail_test();
+
+  // Verify that database is empty before test
+  assert(count_keys_in_database(tx) == 0);
+
+  // fdb_write_fragmented_event() uses its own transaction, so we need to
+  // discard ours
+  fdb_transaction_destroy(tx);
+
+  // Write event to FoundationDB cluster
+  if (fdb_write_event(&mock_f_event.src))
+    fail_test();
+
+  // Attempt to read event back from FoundationDB cluster
+  if (fdb_read_event(&return_event))
+    fail_test();
+
+  // Verify that output data matches input data
+  assert(mock_f_event.src.event.data_length == return_event.data_length);
+  assert(!memcmp(mock_f_event.src.event.data, return_event.data, data_size));
+
+  // Release the dummy data memory
+  es_free(&mock_f_event.src);
+  free_event(&mock_event);
+  free_event(&return_event);
+
+  // Clear the database
+  fdb_clear_database();
+
+  // Success
+  printf("fdb_read_event() multiple ranges test PASSED\n");
+}
+
+void test_read_event_range(void) {
+  FragmentedEventSource mock_f_events[20];
+  FragmentedEventSource mock_staged;
+  Event mock_event;
+  Event *return_events;
+  Event array_events[5];
+  uint32_t num_returned;
+  uint64_t first_id = 100;
+  uint64_t missing_id = 105;
+  uint32_t num_events = 19;
+  uint32_t pos = 1;
+
+  printf("\nStarting fdb_read_event_range() test...\n");
+
+  // Setup FoundationDB batch settings
+  fdb_set_batch_size(0);
+
+  // Setup events of mixed sizes, leaving out one id
+  load_mixed_events(mock_f_events, 5, first_id);
+  load_mixed_events(&mock_f_events[5], 14, missing_id + 1);
+
+  if (fdb_write_fragmented_event_array(mock_f_events, num_events))
+    fail_test();
+
+  // Stage, but never publish, the missing event
+  mock_event.id = missing_id;
+  mock_event.data_length = 3 * OPTIMAL_VALUE_SIZE;
+  mock_event.data = generate_dummy_data(mock_event.data_length);
+  init_fragmented_event_source(&mock_staged, &mock_event, OPTIMAL_VALUE_SIZE);
+  if (fdb_write_batch(&mock_staged.src, &pos))
+    fail_test();
+
+  // Attempt to read the range back from FoundationDB cluster
+  if (fdb_read_event_range(first_id, first_id + 20, &return_events,
+                           &num_returned))
+    fail_test();
+
+  // Verify that every published event came back, in order
+  assert(num_returned == num_events);
+  for (uint32_t i = 0; i < num_events; ++i) {
+    const Event *expected = &mock_f_events[i].src.event;
+
+    assert(return_events[i].id == expected->id);
+    assert(return_events[i].data_length == expected->data_length);
+    assert(!memcmp(return_events[i].data, expected->data,
+                   expected->data_length));
+    free_event(&return_events[i]);
+  }
+  free(return_events);
+
+  // An empty range has no events
+  assert(fdb_read_event_range(first_id, first_id, &return_events,
+                              &num_returned) == 0);
+  assert(num_returned == 0);
+
+  // Consecutive events are read as a range, which must hold all of them
+  for (uint32_t i = 0; i < 5; ++i)
+    array_events[i].id = first_id + i;
+  if (fdb_read_event_array(array_events, 5))
+    fail_test();
+  for (uint32_t i = 0; i < 5; ++i) {
+    assert(array_events[i].data_length == mock_f_events[i].src.event.data_length);
+    free_event(&array_events[i]);
+  }
+
+  for (uint32_t i = 0; i < 5; ++i)
+    array_events[i].id = missing_id - 2 + i;
+  assert(fdb_read_event_array(array_events, 5) == -1);
+
+  // Release the dummy data memory
+  for (uint32_t i = 0; i < num_events; ++i)
+    es_free(&mock_f_events[i].src);
+  es_free(&mock_staged.src);
+
+  // Clear the database
+  fdb_clear_database();
+
+  // Success
+  printf("fdb_read_event_range() test PASSED\n");
+}
+
+void test_read_event_batch(void) {
+  FragmentedEventSource mock_f_events[150];
+  FragmentedEventSource mock_staged;
+  Event mock_event;
+  FDBEventBatch batch;
+  uint64_t first_id = 500;
+  uint32_t num_events = 150;
+  uint32_t num_large = 0;
+  uint32_t pos = 1;
+
+  printf("\nStarting fdb_read_event_batch() test...\n");
+
+  // Setup FoundationDB batch settings
+  fdb_set_batch_size(0);
+
+  // Setup mostly single-fragment events, with a larger one every so often
+  for (uint32_t i = 0; i < num_events; ++i) {
+    uint32_t data_size = (i % 10) ? (i + 1) : ((2 * OPTIMAL_VALUE_SIZE) + i);
+
+    num_large += !(i % 10);
+    mock_event.id = first_id + i;
+    mock_event.data_length = data_size;
+    mock_event.data = generate_dummy_data(data_size);
+    init_fragmented_event_source(&mock_f_events[i], &mock_event,
+                                 OPTIMAL_VALUE_SIZE);
+  }
+
+  if (fdb_write_fragmented_event_array(mock_f_events, num_events))
+    fail_test();
+
+  // Stage, but never publish, an event past the end of the others
+  mock_event.id = first_id + num_events;
+  mock_event.data_length = 3 * OPTIMAL_VALUE_SIZE;
+  mock_event.data = generate_dummy_data(mock_event.data_length);
+  init_fragmented_event_source(&mock_staged, &mock_event, OPTIMAL_VALUE_SIZE);
+  if (fdb_write_batch(&mock_staged.src, &pos))
+    fail_test();
+
+  // Attempt to read the range back from FoundationDB cluster
+  if (fdb_read_event_batch(first_id, first_id + num_events + 1, &batch))
+    fail_test();
+
+  // Every event came back, and only the large ones were copied
+  assert(batch.num_events == num_events);
+  assert(batch.num_copies == num_large);
+  assert(batch.num_futures > 0);
+  for (uint32_t i = 0; i < num_events; ++i) {
+    const Event *expected = &mock_f_events[i].src.event;
+    bool copied = false;
+
+    assert(batch.events[i].id == expected->id);
+    assert(batch.events[i].data_length == expected->data_length);
+    assert(!memcmp(batch.events[i].data, expected->data,
+                   expected->data_length));
+
+    for (uint32_t j = 0; j < batch.num_copies; ++j)
+      copied |= (batch.copies[j] == batch.events[i].data);
+    assert(copied == !(i % 10));
+  }
+
+  fdb_release_event_batch(&batch);
+  assert(!batch.events && !batch.num_events);
+
+  // An empty range has no events
+  assert(fdb_read_event_batch(first_id, first_id, &batch) == 0);
+  assert(batch.num_events == 0);
+  fdb_release_event_batch(&batch);
+
+  // Release the dummy data memory
+  for (uint32_t i = 0; i < num_events; ++i)
+    es_free(&mock_f_events[i].src);
+  es_free(&mock_staged.src);
+
+  // Clear the database
+  fdb_clear_database();
+
+  // Success
+  printf("fdb_read_event_batch() test PASSED\n");
+}
+
+void test_cursor(void) {
+  FragmentedEventSource mock_f_events[30];
+  Event return_event;
+  FDBCursor cursor;
+  uint64_t first_id = 1000;
+  uint32_t num_events = 30;
+  uint32_t num_returned = 0;
+  int rc;
+
+  printf("\nStarting fdb_cursor_next() test...\n");
+
+  // Setup FoundationDB batch settings
+  fdb_set_batch_size(0);
+
+  // Setup events of mixed sizes
+  load_mixed_events(mock_f_events, num_events, first_id);
+
+  if (fdb_write_fragmented_event_array(mock_f_events, num_events))
+    fail_test();
+
+  // Replay everything but the first and last events
+  if (fdb_cursor_open(&cursor, first_id + 1, first_id + num_events - 1))
+    fail_test();
+
+  while ((rc = fdb_cursor_next(&cursor, &return_event)) == 1) {
+    const Event *expected = &mock_f_events[++num_returned].src.event;
+
+    assert(return_event.id == expected->id);
+    assert(return_event.data_length == expected->data_length);
+    assert(!memcmp(return_event.data, expected->data, expected->data_length));
+    free_event(&return_event);
+  }
+
+  assert(rc == 0);
+  assert(num_returned == (num_events - 2));
+
+  // A finished cursor stays finished
+  assert(fdb_cursor_next(&cursor, &return_event) == 0);
+  fdb_cursor_close(&cursor);
+
+  // A cursor can be closed with a read in flight
+  if (fdb_cursor_open(&cursor, first_id, first_id + num_events))
+    fail_test();
+  assert(fdb_cursor_next(&cursor, &return_event) == 1);
+  free_event(&return_event);
+  fdb_cursor_close(&cursor);
+
+  // Release the dummy data memory
+  for (uint32_t i = 0; i < num_events; ++i)
+    es_free(&mock_f_events[i].src);
+
+  // Clear the database
+  fdb_clear_database();
+
+  // Success
+  printf("fdb_cursor_next() test PASSED\n");
+}
+
+void test_read_event_into(void) {
+  FragmentedEventSource mock_f_events[10];
+  Event return_event;
+  FDBCursor cursor;
+  EventArena arena;
+  uint64_t first_id = 2000;
+  uint32_t num_events = 10;
+  uint32_t num_returned = 0;
+  uint32_t num_resets = 0;
+  uint64_t arena_length = (2 * OPTIMAL_VALUE_SIZE) + 100;
+  uint8_t *arena_data = malloc(arena_length);
+  int rc;
+
+  printf("\nStarting fdb_read_event_into() test...\n");
+
+  // Setup FoundationDB batch settings
+  fdb_set_batch_size(0);
+
+  // Setup events of mixed sizes, each small enough for the arena
+  load_mixed_events(mock_f_events, num_events, first_id);
+
+  if (fdb_write_fragmented_event_array(mock_f_events, num_events))
+    fail_test();
+
+  // An arena too small for the event reports the length it needs
+  init_event_arena(&arena, arena_data, OPTIMAL_VALUE_SIZE);
+  return_event.id = first_id + 2;
+  assert(fdb_read_event_into(&return_event, &arena) == FDB_READ_ARENA_FULL);
+  assert(return_event.data_length == mock_f_events[2].src.event.data_length);
+  assert(arena.used == 0);
+
+  // With enough room, the event is read into the arena
+  init_event_arena(&arena, arena_data, arena_length);
+  return_event.id = first_id + 2;
+  if (fdb_read_event_into(&return_event, &arena))
+    fail_test();
+  assert(return_event.data == arena_data);
+  assert(arena.used == return_event.data_length);
+  assert(!memcmp(return_event.data, mock_f_events[2].src.event.data,
+                 return_event.data_length));
+
+  // Replay the whole range through the arena, resetting it whenever it fills
+  reset_event_arena(&arena);
+  if (fdb_cursor_open(&cursor, first_id, first_id + num_events))
+    fail_test();
+
+  while ((rc = fdb_cursor_next_into(&cursor, &return_event, &arena)) != 0) {
+    const Event *expected;
+
+    if (rc == FDB_READ_ARENA_FULL) {
+      assert(arena.used);
+      reset_event_arena(&arena);
+      ++num_resets;
+      continue;
+    }
+
+    assert(rc == 1);
+    expected = &mock_f_events[num_returned++].src.event;
+    assert(return_event.id == expected->id);
+    assert(return_event.data_length == expected->data_length);
+    assert((return_event.data >= arena_data) &&
+           ((return_event.data + return_event.data_length) <=
+            (arena_data + arena_length)));
+    assert(!memcmp(return_event.data, expected->data, expected->data_length));
+  }
+
+  assert(num_returned == num_events);
+  assert(num_resets > 0);
+  fdb_cursor_close(&cursor);
+
+  // Release the dummy data memory
+  for (uint32_t i = 0; i < num_events; ++i)
+    es_free(&mock_f_events[i].src);
+  free(arena_data);
+
+  // Clear the database
+  fdb_clear_database();
+
+  // Success
+  printf("fdb_read_event_into() test PASSED\n");
+}
+
+typedef struct scan_test_state_t {
+  pthread_mutex_t lock;
+  const FragmentedEventSource *f_events;
+  uint64_t first_id;
+  uint32_t num_seen;
+  uint8_t *seen;
+  uint64_t last_id_seen;
+  int in_order;
+  uint32_t stop_after;
+} ScanTestState;
+
+int scan_test_callback(void *param, uint32_t partition, Event *event) {
+  ScanTestState *state = (ScanTestState *)param;
+  const Event *expected = &state->f_events[event->id - state->first_id].src.event;
+  int rc = 0;
+
+  assert(event->data_length == expected->data_length);
+  assert(!memcmp(event->data, expected->data, expected->data_length));
+
+  pthread_mutex_lock(&state->lock);
+  assert(!state->seen[event->id - state->first_id]);
+  state->seen[event->id - state->first_id] = 1;
+  if (state->num_seen && (event->id <= state->last_id_seen))
+    state->in_order = 0;
+  state->last_id_seen = event->id;
+  if (++state->num_seen == state->stop_after)
+    rc = -1;
+  pthread_mutex_unlock(&state->lock);
+
+  free_event(event);
+  return rc;
+}
+
+void test_scan_event_range_parallel(void) {
+  FragmentedEventSource mock_f_events[60];
+  ScanTestState state;
+  uint8_t seen[60];
+  uint64_t first_id = 5000;
+  uint32_t num_events = 60;
+
+  printf("\nStarting fdb_scan_event_range_parallel() test...\n");
+
+  // Setup FoundationDB batch settings
+  fdb_set_batch_size(0);
+
+  // Setup events of mixed sizes
+  load_mixed_events(mock_f_events, num_events, first_id);
+
+  if (fdb_write_fragmented_event_array(mock_f_events, num_events))
+    fail_test();
+
+  // Use partitions small enough to cut through multi-fragment events
+  assert(fdb_set_scan_partition_bytes(0) == -1);
+  fdb_set_scan_partition_bytes(3 * OPTIMAL_VALUE_SIZE);
+
+  pthread_mutex_init(&state.lock, NULL);
+  state.f_events = mock_f_events;
+  state.first_id = first_id;
+  state.seen = seen;
+
+  // Ordered: every event exactly once, in id order
+  memset(seen, 0, sizeof(seen));
+  state.num_seen = 0;
+  state.in_order = 1;
+  state.stop_after = 0;
+  if (fdb_scan_event_range_parallel(first_id, first_id + num_events, 4, true,
+                                    scan_test_callback, &state))
+    fail_test();
+  assert(state.num_seen == num_events);
+  assert(state.in_order);
+
+  // Unordered: every event exactly once
+  memset(seen, 0, sizeof(seen));
+  state.num_seen = 0;
+  if (fdb_scan_event_range_parallel(first_id, first_id + num_events, 4, false,
+                                    scan_test_callback, &state))
+    fail_test();
+  assert(state.num_seen == num_events);
+
+  // A callback can stop the scan, which then fails
+  memset(seen, 0, sizeof(seen));
+  state.num_seen = 0;
+  state.stop_after = 10;
+  assert(fdb_scan_event_range_parallel(first_id, first_id + num_events, 4, true,
+                                       scan_test_callback, &state) == -1);
+  assert(state.num_seen == 10);
+
+  assert(fdb_scan_event_range_parallel(first_id, first_id + num_events, 0, true,
+                                       scan_test_callback, &state) == -1);
+
+  // Restore the default scan settings
+  fdb_set_scan_partition_bytes(DEFAULT_SCAN_PARTITION_BYTES);
+  pthread_mutex_destroy(&state.lock);
+
+  // Release the dummy data memory
+  for (uint32_t i = 0; i < num_events; ++i)
+    es_free(&mock_f_events[i].src);
+
+  // Clear the database
+  fdb_clear_database();
+
+  // Success
+  printf("fdb_scan_event_range_parallel() test PASSED\n");
+}
+
+typedef struct async_test_state_t {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  const FragmentedEventSource *f_events;
+  uint64_t first_id;
+  uint32_t num_events;
+  uint32_t num_done;
+  uint32_t num_failed;
+} AsyncTestState;
+
+int async_test_event_callback(void *param, Event *event) {
+  AsyncTestState *state = (AsyncTestState *)param;
+  const Event *expected = &state->f_events[event->id - state->first_id].src.event;
+
+  assert(event->data_length == expected->data_length);
+  assert(!memcmp(event->data, expected->data, expected->data_length));
+
+  pthread_mutex_lock(&state->lock);
+  ++state->num_events;
+  pthread_mutex_unlock(&state->lock);
+
+  free_event(event);
+  return 0;
+}
+
+void async_test_done_callback(void *param, int result) {
+  AsyncTestState *state = (AsyncTestState *)param;
+
+  pthread_mutex_lock(&state->lock);
+  ++state->num_done;
+  state->num_failed += (result != 0);
+  pthread_cond_signal(&state->cond);
+  pthread_mutex_unlock(&state->lock);
+}
+
+void test_read_event_async(void) {
+  FragmentedEventSource mock_f_events[100];
+  FDBAsyncRead reads[102];
+  AsyncTestState state;
+  uint64_t first_id = 3000;
+  uint32_t num_events = 100;
+
+  printf("\nStarting fdb_read_event_async() test...\n");
+
+  // Setup FoundationDB batch settings
+  fdb_set_batch_size(0);
+
+  // Setup events of mixed sizes
+  load_mixed_events(mock_f_events, num_events, first_id);
+
+  if (fdb_write_fragmented_event_array(mock_f_events, num_events))
+    fail_test();
+
+  pthread_mutex_init(&state.lock, NULL);
+  pthread_cond_init(&state.cond, NULL);
+  state.f_events = mock_f_events;
+  state.first_id = first_id;
+  state.num_events = 0;
+  state.num_done = 0;
+  state.num_failed = 0;
+
+  // Read every event on its own, the whole range, and a missing event, all at
+  // once from this thread
+  for (uint32_t i = 0; i < num_events; ++i) {
+    if (fdb_read_event_async(&reads[i], first_id + i, async_test_event_callback,
+                             async_test_done_callback, &state))
+      fail_test();
+  }
+  if (fdb_read_event_range_async(&reads[num_events], first_id,
+                                 first_id + num_events,
+                                 async_test_event_callback,
+                                 async_test_done_callback, &state))
+    fail_test();
+  if (fdb_read_event_async(&reads[num_events + 1], first_id + num_events,
+                           async_test_event_callback, async_test_done_callback,
+                           &state))
+    fail_test();
+
+  // Wait for every read to finish
+  pthread_mutex_lock(&state.lock);
+  while (state.num_done < (num_events + 2))
+    pthread_cond_wait(&state.cond, &state.lock);
+  pthread_mutex_unlock(&state.lock);
+
+  assert(state.num_events == (2 * num_events));
+  assert(state.num_failed == 1);
+
+  pthread_cond_destroy(&state.cond);
+  pthread_mutex_destroy(&state.lock);
+
+  // Release the dummy data memory
+  for (uint32_t i = 0; i < num_events; ++i)
+    es_free(&mock_f_events[i].src);
+
+  // Clear the database
+  fdb_clear_database();
+
+  // Success
+  printf("fdb_read_event_async() test PASSED\n");
+}
+
+void test_retry_on_error(void) {
+  FDBTransaction *tx;
+  FDBRetry retry;
+
+  printf("\nStarting fdb_retry_on_error() test...\n");
+
+  // Setup transaction handle
+  if (fdb_check_error(fdb_setup_transaction(&tx)))
+    fail_test();
+
+  // A conflict (not_committed) is retried
+  fdb_retry_init(&retry);
+  assert(fdb_retry_on_error(tx, 1020, &retry) == 0);
+  assert(retry.attempts == 1);
+
+  // An error that a retry cannot fix (transaction_too_large) is not
+  fdb_retry_init(&retry);
+  assert(fdb_retry_on_error(tx, 2101, &retry) == -1);
+  assert(retry.attempts == 0);
+
+  // Nothing is retried once the retry limit is reached
+  fdb_set_retry_limit(1);
+  fdb_retry_init(&retry);
+  assert(fdb_retry_on_error(tx, 1020, &retry) == 0);
+  assert(fdb_retry_on_error(tx, 1020, &retry) == -1);
+  fdb_set_retry_limit(DEFAULT_RETRY_LIMIT);
+
+  // A time budget of zero is rejected
+  assert(fdb_set_retry_timeout(0) == -1);
+
+  // Release the transaction handle
+  fdb_transaction_destroy(tx);
+
+  // Success
+  printf("fdb_retry_on_error() test PASSED\n");
+}
+
+void test_read_version_cache(void) {
+  FragmentedEventSource mock_f_event;
+  Event mock_event, return_event;
+  uint64_t id = 4000;
+
+  printf("\nStarting fdb_set_read_version_cache() test...\n");
+
+  // The staleness bound must leave reads most of a transaction lifetime
+  assert(fdb_set_read_version_cache(READ_TX_MAX_AGE_MS) == -1);
+  if (fdb_set_read_version_cache(1000))
+    fail_test();
+
+  // Warm the cache, then read back each event right after writing it
+  return_event.id = id;
+  assert(fdb_read_event(&return_event) == -1);
+
+  for (uint32_t i = 0; i < 20; ++i) {
+    uint32_t data_size = ((i % 3) * OPTIMAL_VALUE_SIZE) + i + 1;
+
+    mock_event.id = id + i;
+    mock_event.data_length = data_size;
+    mock_event.data = generate_dummy_data(data_size);
+    init_fragmented_event_source(&mock_f_event, &mock_event,
+                                 OPTIMAL_VALUE_SIZE);
+
+    if (fdb_write_event(&mock_f_event.src))
+      fail_test();
+
+    return_event.id = id + i;
+    if (fdb_read_event(&return_event))
+      fail_test();
+    assert(return_event.data_length == mock_f_event.src.event.data_length);
+    assert(!memcmp(return_event.data, mock_f_event.src.event.data,
+                   return_event.data_length));
+
+    free_event(&return_event);
+    es_free(&mock_f_event.src);
+  }
+
+  // Disable the cache again
+  if (fdb_set_read_version_cache(0))
+    fail_test();
+
+  // Clear the database
+  fdb_clear_database();
+
+  // Success
+  printf("fdb_set_read_version_cache() test PASSED\n");
+}
+
+void test_event_cache(void) {
+  FragmentedEventSource mock_f_events[10];
+  Event return_event;
+  EventCacheStats stats;
+  uint64_t first_id = 5000;
+  uint32_t num_events = 10;
+
+  printf("\nStarting event cache test...\n");
+
+  if (event_cache_init(10 * 1000000))
+    fail_test();
+
+  // Setup events of mixed sizes
+  load_mixed_events(mock_f_events, num_events, first_id);
+
+  // Writing fills the cache, so every read is a hit
+  if (fdb_write_fragmented_event_array(mock_f_events, num_events))
+    fail_test();
+
+  for (uint32_t i = 0; i < num_events; ++i) {
+    return_event.id = first_id + i;
+    if (fdb_read_event(&return_event))
+      fail_test();
+    assert(return_event.data_length == mock_f_events[i].src.event.data_length);
+    assert(!memcmp(return_event.data, mock_f_events[i].src.event.data,
+                   return_event.data_length));
+    free_event(&return_event);
+  }
+
+  event_cache_stats(&stats);
+  assert((stats.hits == num_events) && (stats.misses == 0));
+  assert(stats.events == num_events);
+
+  // A cleared event misses, and is no longer found in the database either
+  if (fdb_clear_event(&mock_f_events[0]))
+    fail_test();
+  return_event.id = first_id;
+  assert(fdb_read_event(&return_event) == -1);
+
+  // An event read from the database is cached on the way
+  event_cache_clear();
+  return_event.id = first_id + 1;
+  if (fdb_read_event(&return_event))
+    fail_test();
+  free_event(&return_event);
+  if (fdb_read_event(&return_event))
+    fail_test();
+  free_event(&return_event);
+
+  event_cache_stats(&stats);
+  assert((stats.hits == (num_events + 1)) && (stats.misses == 2));
+
+  event_cache_destroy();
+
+  // Release the dummy data memory
+  for (uint32_t i = 0; i < num_events; ++i)
+    es_free(&mock_f_events[i].src);
+
+  // Clear the database
+  fdb_clear_database();
+
+  // Success
+  printf("event cache test PASSED\n");
+}
+
+void test_write_scatter_gather_event(void) {
+  Event return_event;
+  ScatterGatherEventSource mock_sg_event;
+  uint64_t event_id = 42;
+  uint32_t data_size = (5 * OPTIMAL_VALUE_SIZE) + 3;
+  uint8_t *data = generate_dummy_data(data_size);
+  EventSegment segments[] = {
+    {data, OPTIMAL_VALUE_SIZE / 2},
+    {data + (OPTIMAL_VALUE_SIZE / 2), 3 * OPTIMAL_VALUE_SIZE},
+    {data + (7 * OPTIMAL_VALUE_SIZE / 2), (3 * OPTIMAL_VALUE_SIZE / 2) + 3},
+  };
+
+  printf("\nStarting scatter-gather event write test...\n");
+
+  // Setup FoundationDB batch settings
+  fdb_set_batch_size(1);
+
+  if (init_scatter_gather_event_source(&mock_sg_event, event_id, segments, 3,
+                                       OPTIMAL_VALUE_SIZE))
+    fail_test();
+
+  return_event.id = event_id;
+
+  // Write event to FoundationDB cluster from its segments
+  if (fdb_write_event(&mock_sg_event.src))
+    fail_test();
+
+  // Attempt to read event back from FoundationDB cluster
+  if (fdb_read_event(&return_event))
+    fail_test();
+
+  // Verify that output data matches the concatenated segments
+  assert(return_event.data_length == data_size);
+  assert(!memcmp(data, return_event.data, data_size));
+
+  // Release the source, then the segments it pointed into
+  es_free(&mock_sg_event.src);
+  free(data);
+  free_event(&return_event);
+
+  // Clear the database
+  fdb_clear_database();
+
+  // Success
+  printf("scatter-gather event write test PASSED\n");
+}
+
+typedef struct stream_test_reader_t {
+  const uint8_t *data;
+  uint64_t pos;
+} StreamTestReader;
+
+int stream_test_pull(void *ctx, uint8_t *buf, uint32_t length) {
+  StreamTestReader *reader = (StreamTestReader *)ctx;
+
+  memcpy(buf, reader->data + reader->pos, length);
+  reader->pos += length;
+  return 0;
+}
+
+void test_write_stream_event(void) {
+  Event return_event;
+  StreamEventSource mock_stream_event;
+  uint64_t event_id = 42;
+  uint32_t data_size = (20 * OPTIMAL_VALUE_SIZE) + 9;
+  uint8_t *data = generate_dummy_data(data_size);
+  StreamTestReader reader = {data, 0};
+
+  printf("\nStarting fdb_write_stream_event() test...\n");
+
+  // Keep few, small transactions in flight, so the event is many times larger
+  // than what is buffered
+  fdb_set_batch_size(0);
+  fdb_set_batch_bytes(4 * OPTIMAL_VALUE_SIZE);
+  fdb_set_window_size(2);
+
+  if (init_stream_event_source(&mock_stream_event, event_id, data_size,
+                               stream_test_pull, &reader, OPTIMAL_VALUE_SIZE))
+    fail_test();
+
+  return_event.id = event_id;
+
+  // Write event to FoundationDB cluster as it is pulled
+  if (fdb_write_stream_event(&mock_stream_event))
+    fail_test();
+
+  // Every byte was pulled exactly once, through a bounded ring
+  assert(reader.pos == data_size);
+  assert(mock_stream_event.ring_fragments < es_num_fragments(&mock_stream_event.src));
+
+  // A streaming source cannot be written twice
+  assert(fdb_write_stream_event(&mock_stream_event) == -1);
+
+  // Attempt to read event back from FoundationDB cluster
+  if (fdb_read_event(&return_event))
+    fail_test();
+
+  // Verify that output data matches the pulled data
+  assert(return_event.data_length == data_size);
+  assert(!memcmp(data, return_event.data, data_size));
+
+  // Release the source and the test data
+  es_free(&mock_stream_event.src);
+  free(data);
+  free_event(&return_event);
+
+  // Restore the default write settings
+  fdb_set_batch_bytes(DEFAULT_BATCH_BYTES);
+
+  // Clear the database
+  fdb_clear_database();
+
+  // Success
+  printf("fdb_write_stream_event() test PASSED\n");
+}
+
+void test_write_event_staged(void) {
+  FDBTransaction *tx;
+  Event mock_event, return_event;
+  FragmentedEventSource mock_f_event, smaller_f_events[2];
+  uint64_t event_id = 42;
+  uint32_t num_fragments = 12;
+  uint32_t data_size = ((num_fragments - 1) * OPTIMAL_VALUE_SIZE) + 3;
+  uint32_t smaller_fragments[2] = {6, 2};
+  uint32_t pos = 1;
+
+  printf("\nStarting staged fdb_write_event() test...\n");
+
+  // Setup FoundationDB batch settings, so the event spans several transactions
+  fdb_set_batch_size(0);
+  fdb_set_batch_bytes(4 * OPTIMAL_VALUE_SIZE);
+  fdb_set_window_size(2);
+
+  // Setup event
+  mock_event.id = event_id;
+  mock_event.data_length = data_size;
+  mock_event.data = generate_dummy_data(data_size);
+
+  init_fragmented_event_source(&mock_f_event, &mock_event, OPTIMAL_VALUE_SIZE);
+
+  return_event.id = event_id;
+
+  // Simulate a write that died after staging some fragments
+  if (fdb_write_batch(&mock_f_event.src, &pos))
+    fail_test();
+  assert(pos > 1);
+
+  // Without its first fragment, the event does not exist yet
+  assert(fdb_read_event(&return_event) == -1);
+
+  // Attempt to write the whole event
+  if (fdb_write_event(&mock_f_event.src))
+    fail_test();
+
+  // Need a new transaction handle to read from the database
+  if (fdb_check_error(fdb_setup_transaction(&tx)))
+    fail_test();
+
+  // Verify that the event is in the database exactly once
+  assert(count_event_fragments_in_database(tx, event_id) == num_fragments);
+  fdb_transaction_destroy(tx);
+
+  if (fdb_read_event(&return_event))
+    fail_test();
+
+  // Verify that output data matches input data
+  assert(return_event.data_length == data_size);
+  assert(!memcmp(mock_f_event.src.event.data, return_event.data, data_size));
+  free_event(&return_event);
+
+  // A smaller event written over fragments staged by a failed write of a
+  // larger one, staged itself or in a single transaction, removes them
+  for (uint32_t i = 0; i < 2; ++i) {
+    uint32_t smaller_size = ((smaller_fragments[i] - 1) * OPTIMAL_VALUE_SIZE) + 5;
+
+    if (fdb_clear_event(&mock_f_event))
+      fail_test();
+    for (pos = 1; pos < num_fragments;)
+      if (fdb_write_batch(&mock_f_event.src, &pos))
+        fail_test();
+
+    mock_event.id = event_id;
+    mock_event.data_length = smaller_size;
+    mock_event.data = generate_dummy_data(smaller_size);
+    init_fragmented_event_source(&smaller_f_events[i], &mock_event,
+                                 OPTIMAL_VALUE_SIZE);
+    if (fdb_write_event(&smaller_f_events[i].src))
+      fail_test();
+
+    if (fdb_check_error(fdb_setup_transaction(&tx)))
+      fail_test();
+    assert(count_event_fragments_in_database(tx, event_id) ==
+           smaller_fragments[i]);
+    fdb_transaction_destroy(tx);
+
+    return_event.id = event_id;
+    if (fdb_read_event(&return_event))
+      fail_test();
+    assert(return_event.data_length == smaller_size);
+    assert(!memcmp(smaller_f_events[i].src.event.data, return_event.data,
+                   smaller_size));
+    free_event(&return_event);
+  }
+
+  // Clearing an event also removes fragments staged past it
+  for (pos = 1; pos < num_fragments;)
+    if (fdb_write_batch(&mock_f_event.src, &pos))
+      fail_test();
+  if (fdb_clear_event(&smaller_f_events[1]))
+    fail_test();
+  if (fdb_check_error(fdb_setup_transaction(&tx)))
+    fail_test();
+  assert(count_event_fragments_in_database(tx, event_id) == 0);
+  fdb_transaction_destroy(tx);
+
+  // Release the dummy data memory
+  es_free(&mock_f_event.src);
+  es_free(&smaller_f_events[0].src);
+  es_free(&smaller_f_events[1].src);
+
+  // Restore the default write settings
+  fdb_set_batch_bytes(DEFAULT_BATCH_BYTES);
+  fdb_set_window_size(DEFAULT_WINDOW_SIZE);
+
+  // Clear the database
+  fdb_clear_database();
+
+  // Success
+  printf("staged fdb_write_event() test PASSED\n");
+}
+
+void test_refragment_event_range(void) {
+  FragmentedEventSource mock_f_events[61];
+  Event mock_event;
+  FDBRefragmenter rf;
+  FDBRefragmentStats stats;
+  FDBTransaction *tx;
+  uint64_t first_id = 900;
+  uint32_t num_events = 61;
+  uint32_t fragment_length = 3000;
+
+  printf("\nStarting fdb_refragment_event_range() test...\n");
+
+  // Setup FoundationDB batch settings
+  fdb_set_batch_size(0);
+  assert(fdb_set_fragment_size(0) == -1);
+  assert(fdb_set_fragment_size(MAX_VALUE_SIZE + 1) == -1);
+  assert(fdb_set_fragment_size(OPTIMAL_VALUE_SIZE) == 0);
+
+  // Setup tiny, single-fragment and multi-fragment events, and one event too
+  // large for a transaction
+  for (uint32_t i = 0; i < num_events; ++i) {
+    uint32_t data_size = (i == (num_events - 1)) ? 60000
+                         : (i % 3 == 0)          ? (i + 1)
+                         : (i % 3 == 1)          ? ((2 * OPTIMAL_VALUE_SIZE) + i)
+                                                 : ((OPTIMAL_VALUE_SIZE / 2) + i);
+
+    mock_event.id = first_id + i;
+    mock_event.data_length = data_size;
+    mock_event.data = generate_dummy_data(data_size);
+    init_fragmented_event_source(&mock_f_events[i], &mock_event,
+                                 OPTIMAL_VALUE_SIZE);
+  }
+
+  if (fdb_write_fragmented_event_array(mock_f_events, num_events))
+    fail_test();
+
+  // Rewrite in transactions too small for the last event
+  fdb_set_batch_bytes(50000);
+
+  // An invalid fragment length is rejected
+  assert(fdb_refragment_event_range(first_id, first_id + num_events, 0, 0,
+                                    NULL) == -1);
+
+  // Rewrite every event that does not fit, or spans fragments of another
+  // length
+  if (fdb_refragment_event_range(first_id, first_id + num_events,
+                                 fragment_length, 0, &stats))
+    fail_test();
+  assert(stats.events_scanned == num_events);
+  assert(stats.events_rewritten == 40);
+  assert(stats.events_skipped == 1);
+
+  // Need a new transaction handle to read from the database
+  if (fdb_check_error(fdb_setup_transaction(&tx)))
+    fail_test();
+  assert(count_event_fragments_in_database(tx, first_id) == 1);
+  assert(count_event_fragments_in_database(tx, first_id + 1) == 7);
+  assert(count_event_fragments_in_database(tx, first_id + 2) == 2);
+  assert(count_event_fragments_in_database(tx, first_id + num_events - 1) == 6);
+  fdb_transaction_destroy(tx);
+
+  // Every event reads back the same
+  for (uint32_t i = 0; i < num_events; ++i) {
+    const Event *expected = &mock_f_events[i].src.event;
+    Event return_event = {expected->id, 0, NULL};
+
+    if (fdb_read_event(&return_event))
+      fail_test();
+    assert(return_event.data_length == expected->data_length);
+    assert(!memcmp(return_event.data, expected->data,
+                   return_event.data_length));
+    free_event(&return_event);
+  }
+
+  // A second pass finds nothing left to do
+  if (fdb_refragment_event_range(first_id, first_id + num_events,
+                                 fragment_length, 0, &stats))
+    fail_test();
+  assert(stats.events_scanned == num_events);
+  assert(stats.events_rewritten == 0);
+
+  // Start going back in the background, stop wherever it got to, and resume
+  // from there under a rate limit
+  if (fdb_refragmenter_start(&rf, first_id, first_id + num_events,
+                             OPTIMAL_VALUE_SIZE, 0))
+    fail_test();
+  if (fdb_refragmenter_stop(&rf, &stats))
+    fail_test();
+  assert(stats.events_rewritten <= 40);
+
+  if (fdb_refragment_event_range(rf.next_id, first_id + num_events,
+                                 OPTIMAL_VALUE_SIZE, 10000000, &stats))
+    fail_test();
+  assert((rf.stats.events_rewritten + stats.events_rewritten) == 40);
+
+  if (fdb_check_error(fdb_setup_transaction(&tx)))
+    fail_test();
+  assert(count_event_fragments_in_database(tx, first_id + 1) == 3);
+  assert(count_event_fragments_in_database(tx, first_id + 2) == 1);
+  fdb_transaction_destroy(tx);
+
+  for (uint32_t i = 0; i < num_events; ++i) {
+    const Event *expected = &mock_f_events[i].src.event;
+    Event return_event = {expected->id, 0, NULL};
+
+    if (fdb_read_event(&return_event))
+      fail_test();
+    assert(return_event.data_length == expected->data_length);
+    assert(!memcmp(return_event.data, expected->data,
+                   return_event.data_length));
+    free_event(&return_event);
+  }
+
+  // Release the dummy data memory
+  for (uint32_t i = 0; i < num_events; ++i)
+    es_free(&mock_f_events[i].src);
+
+  // Restore the default write settings
+  fdb_set_batch_bytes(DEFAULT_BATCH_BYTES);
+
+  // Clear the database
+  fdb_clear_database();
+
+  // Success
+  printf("fdb_refragment_event_range() test PASSED\n");
+}
+
+void test_key_buckets(void) {
+  FragmentedEventSource mock_f_events[40];
+  Event return_event;
+  Event *return_events;
+  FDBEventBatch batch;
+  FDBCursor cursor;
+  FDBTransaction *tx;
+  FDBRefragmentStats stats;
+  ScanTestState state;
+  uint8_t seen[40];
+  uint64_t first_id = 7000;
+  uint32_t num_events = 40;
+  uint32_t num_returned = 0;
+  int rc;
+
+  printf("\nStarting fdb_set_key_buckets() test...\n");
+
+  // Setup FoundationDB batch settings
+  fdb_set_batch_size(0);
+  assert(fdb_set_key_buckets(0) == -1);
+  assert(fdb_set_key_buckets(MAX_KEY_BUCKETS + 1) == -1);
+  assert(fdb_set_key_buckets(4) == 0);
+
+  // Setup events of mixed sizes
+  load_mixed_events(mock_f_events, num_events, first_id);
+
+  if (fdb_write_fragmented_event_array(mock_f_events, num_events))
+    fail_test();
+
+  // Every event is stored whole within its bucket
+  if (fdb_check_error(fdb_setup_transaction(&tx)))
+    fail_test();
+  for (uint32_t i = 0; i < num_events; ++i)
+    assert(count_event_fragments_in_database(tx, first_id + i) ==
+           es_num_fragments(&mock_f_events[i].src));
+  fdb_transaction_destroy(tx);
+
+  // Single events
+  for (uint32_t i = 0; i < num_events; ++i) {
+    const Event *expected = &mock_f_events[i].src.event;
+
+    return_event.id = expected->id;
+    return_event.data = NULL;
+    if (fdb_read_event(&return_event))
+      fail_test();
+    assert(return_event.data_length == expected->data_length);
+    assert(!memcmp(return_event.data, expected->data, expected->data_length));
+    free_event(&return_event);
+  }
+
+  // A range comes back merged into id order
+  if (fdb_read_event_range(first_id + 1, first_id + num_events, &return_events,
+                           &num_returned))
+    fail_test();
+  assert(num_returned == (num_events - 1));
+  for (uint32_t i = 0; i < num_returned; ++i) {
+    const Event *expected = &mock_f_events[i + 1].src.event;
+
+    assert(return_events[i].id == expected->id);
+    assert(return_events[i].data_length == expected->data_length);
+    assert(!memcmp(return_events[i].data, expected->data,
+                   expected->data_length));
+    free_event(&return_events[i]);
+  }
+  free(return_events);
+
+  if (fdb_read_event_batch(first_id, first_id + num_events, &batch))
+    fail_test();
+  assert(batch.num_events == num_events);
+  for (uint32_t i = 0; i < num_events; ++i)
+    assert(batch.events[i].id == (first_id + i));
+  fdb_release_event_batch(&batch);
+
+  // So does a cursor
+  num_returned = 0;
+  if (fdb_cursor_open(&cursor, first_id, first_id + num_events))
+    fail_test();
+  while ((rc = fdb_cursor_next(&cursor, &return_event)) == 1) {
+    const Event *expected = &mock_f_events[num_returned++].src.event;
+
+    assert(return_event.id == expected->id);
+    assert(!memcmp(return_event.data, expected->data, expected->data_length));
+    free_event(&return_event);
+  }
+  assert(rc == 0);
+  assert(num_returned == num_events);
+  fdb_cursor_close(&cursor);
+
+  // And an ordered parallel scan
+  fdb_set_scan_partition_bytes(8 * OPTIMAL_VALUE_SIZE);
+  pthread_mutex_init(&state.lock, NULL);
+  state.f_events = mock_f_events;
+  state.first_id = first_id;
+  state.seen = seen;
+  memset(seen, 0, sizeof(seen));
+  state.num_seen = 0;
+  state.in_order = 1;
+  state.stop_after = 0;
+  if (fdb_scan_event_range_parallel(first_id, first_id + num_events, 4, true,
+                                    scan_test_callback, &state))
+    fail_test();
+  assert(state.num_seen == num_events);
+  assert(state.in_order);
+  pthread_mutex_destroy(&state.lock);
+  fdb_set_scan_partition_bytes(DEFAULT_SCAN_PARTITION_BYTES);
+
+  // The re-fragmenter visits every bucket
+  if (fdb_refragment_event_range(first_id, first_id + num_events,
+                                 OPTIMAL_VALUE_SIZE, 0, &stats))
+    fail_test();
+  assert(stats.events_scanned == num_events);
+
+  // Release the dummy data memory
+  for (uint32_t i = 0; i < num_events; ++i)
+    es_free(&mock_f_events[i].src);
+
+  // Clear the database, and restore the default key layout
+  fdb_clear_database();
+  fdb_set_key_buckets(1);
+
+  // Success
+  printf("fdb_set_key_buckets() test PASSED\n");
+}
+
+void test_key_format(void) {
+  FragmentedEventSource mock_f_events[30];
+  Event return_event;
+  Event *return_events;
+  FDBCursor cursor;
+  FDBTransaction *tx;
+  uint64_t first_id = 100000;
+  uint32_t num_events = 30;
+  uint32_t num_returned;
+  int rc;
+
+  printf("\nStarting fdb_set_key_format() test...\n");
+
+  // Setup FoundationDB batch settings
+  fdb_set_batch_size(0);
+  assert(fdb_set_key_format(2) == -1);
+
+  // Setup events of mixed sizes, with ids past the three byte varints
+  load_mixed_events(mock_f_events, num_events, first_id);
+
+  // Once unbucketed, once bucketed
+  for (uint32_t num_buckets = 1; num_buckets <= 3; num_buckets += 2) {
+    assert(fdb_set_key_format(FDB_KEY_FORMAT_COMPACT) == 0);
+    fdb_set_key_buckets(num_buckets);
+
+    if (fdb_write_fragmented_event_array(mock_f_events, num_events))
+      fail_test();
+
+    if (fdb_check_error(fdb_setup_transaction(&tx)))
+      fail_test();
+    for (uint32_t i = 0; i < num_events; ++i)
+      assert(count_event_fragments_in_database(tx, first_id + i) ==
+             es_num_fragments(&mock_f_events[i].src));
+    fdb_transaction_destroy(tx);
+
+    // Single events
+    for (uint32_t i = 0; i < num_events; ++i) {
+      const Event *expected = &mock_f_events[i].src.event;
+
+      return_event.id = expected->id;
+      return_event.data = NULL;
+      if (fdb_read_event(&return_event))
+        fail_test();
+      assert(return_event.data_length == expected->data_length);
+      assert(!memcmp(return_event.data, expected->data, expected->data_length));
+      free_event(&return_event);
+    }
+
+    // A range
+    if (fdb_read_event_range(first_id, first_id + num_events, &return_events,
+                             &num_returned))
+      fail_test();
+    assert(num_returned == num_events);
+    for (uint32_t i = 0; i < num_returned; ++i) {
+      const Event *expected = &mock_f_events[i].src.event;
+
+      assert(return_events[i].id == expected->id);
+      assert(return_events[i].data_length == expected->data_length);
+      assert(!memcmp(return_events[i].data, expected->data,
+                     expected->data_length));
+      free_event(&return_events[i]);
+    }
+    free(return_events);
+
+    // A cursor over all but the first event
+    num_returned = 0;
+    if (fdb_cursor_open(&cursor, first_id + 1, first_id + num_events))
+      fail_test();
+    while ((rc = fdb_cursor_next(&cursor, &return_event)) == 1) {
+      const Event *expected = &mock_f_events[++num_returned].src.event;
+
+      assert(return_event.id == expected->id);
+      assert(!memcmp(return_event.data, expected->data, expected->data_length));
+      free_event(&return_event);
+    }
+    assert(rc == 0);
+    assert(num_returned == (num_events - 1));
+    fdb_cursor_close(&cursor);
+
+    // Nothing was written under the fixed key format
+    assert(fdb_set_key_format(FDB_KEY_FORMAT_FIXED) == 0);
+    if (fdb_read_event_range(first_id, first_id + num_events, &return_events,
+                             &num_returned))
+      fail_test();
+    assert(!num_returned);
+    free(return_events);
+
+    // Clear the database
+    fdb_clear_database();
+  }
+
+  // Restore the default key layout
+  fdb_set_key_buckets(1);
+
+  // Release the dummy data memory
+  for (uint32_t i = 0; i < num_events; ++i)
+    es_free(&mock_f_events[i].src);
+
+  // Success
+  printf("fdb_set_key_format() test PASSED\n");
+}
+
+void test_pack_events(void) {
+  FragmentedEventSource mock_f_events[60];
+  FDBAsyncRead reads[2];
+  FDBEventBatch batch;
+  Event mock_event, return_event;
+  Event *return_events;
+  AsyncTestState async_state;
+  ScanTestState scan_state;
+  FDBCursor cursor;
+  FDBTransaction *tx;
+  uint8_t seen[60];
+  uint64_t first_id = 7000;
+  uint32_t num_events = 60;
+  uint32_t num_returned;
+  int rc;
+
+  printf("\nStarting fdb_set_pack_bytes() test...\n");
+
+  // Setup FoundationDB batch settings
+  fdb_set_batch_size(0);
+  assert(fdb_set_pack_bytes(OPTIMAL_VALUE_SIZE + 1) == -1);
+  assert(fdb_set_pack_bytes(2000) == 0);
+
+  // Setup runs of nine small events, each after a large event
+  for (uint32_t i = 0; i < num_events; ++i) {
+    uint32_t data_size =
+        (i % 10) ? ((3 * i) + 1) : ((2 * OPTIMAL_VALUE_SIZE) + i + 1);
+
+    mock_event.id = first_id + i;
+    mock_event.data_length = data_size;
+    mock_event.data = generate_dummy_data(data_size);
+    init_fragmented_event_source(&mock_f_events[i], &mock_event,
+                                 OPTIMAL_VALUE_SIZE);
+  }
+
+  if (fdb_write_fragmented_event_array(mock_f_events, num_events))
+    fail_test();
+
+  // Each run takes one key, each large event three
+  if (fdb_check_error(fdb_setup_transaction(&tx)))
+    fail_test();
+  assert(count_keys_in_database(tx) == (6 + (6 * 3)));
+  fdb_transaction_destroy(tx);
+
+  // Single events
+  for (uint32_t i = 0; i < num_events; ++i) {
+    const Event *expected = &mock_f_events[i].src.event;
+
+    return_event.id = expected->id;
+    return_event.data = NULL;
+    if (fdb_read_event(&return_event))
+      fail_test();
+    assert(return_event.data_length == expected->data_length);
+    assert(!memcmp(return_event.data, expected->data, expected->data_length));
+    free_event(&return_event);
+  }
+
+  // A range starting and ending inside runs
+  if (fdb_read_event_range(first_id + 5, first_id + 25, &return_events,
+                           &num_returned))
+    fail_test();
+  assert(num_returned == 20);
+  for (uint32_t i = 0; i < num_returned; ++i) {
+    const Event *expected = &mock_f_events[i + 5].src.event;
+
+    assert(return_events[i].id == expected->id);
+    assert(return_events[i].data_length == expected->data_length);
+    assert(!memcmp(return_events[i].data, expected->data,
+                   expected->data_length));
+    free_event(&return_events[i]);
+  }
+  free(return_events);
+
+  // A batch, which copies packed events rather than borrow them
+  if (fdb_read_event_batch(first_id + 3, first_id + num_events, &batch))
+    fail_test();
+  assert(batch.num_events == (num_events - 3));
+  for (uint32_t i = 0; i < batch.num_events; ++i) {
+    const Event *expected = &mock_f_events[i + 3].src.event;
+
+    assert(batch.events[i].id == expected->id);
+    assert(!memcmp(batch.events[i].data, expected->data,
+                   expected->data_length));
+  }
+  fdb_release_event_batch(&batch);
+
+  // A cursor starting inside a run
+  num_returned = 0;
+  if (fdb_cursor_open(&cursor, first_id + 12, first_id + num_events))
+    fail_test();
+  while ((rc = fdb_cursor_next(&cursor, &return_event)) == 1) {
+    const Event *expected = &mock_f_events[12 + num_returned++].src.event;
+
+    assert(return_event.id == expected->id);
+    assert(!memcmp(return_event.data, expected->data, expected->data_length));
+    free_event(&return_event);
+  }
+  assert(rc == 0);
+  assert(num_returned == (num_events - 12));
+  fdb_cursor_close(&cursor);
+
+  // Asynchronous reads of a packed event and of a range inside a run
+  pthread_mutex_init(&async_state.lock, NULL);
+  pthread_cond_init(&async_state.cond, NULL);
+  async_state.f_events = mock_f_events;
+  async_state.first_id = first_id;
+  async_state.num_events = 0;
+  async_state.num_done = 0;
+  async_state.num_failed = 0;
+  if (fdb_read_event_async(&reads[0], first_id + 44, async_test_event_callback,
+                           async_test_done_callback, &async_state) ||
+      fdb_read_event_range_async(&reads[1], first_id + 42, first_id + 48,
+                                 async_test_event_callback,
+                                 async_test_done_callback, &async_state))
+    fail_test();
+
+  pthread_mutex_lock(&async_state.lock);
+  while (async_state.num_done < 2)
+    pthread_cond_wait(&async_state.cond, &async_state.lock);
+  pthread_mutex_unlock(&async_state.lock);
+  assert(async_state.num_events == 7);
+  assert(!async_state.num_failed);
+  pthread_cond_destroy(&async_state.cond);
+  pthread_mutex_destroy(&async_state.lock);
+
+  // A parallel scan
+  pthread_mutex_init(&scan_state.lock, NULL);
+  scan_state.f_events = mock_f_events;
+  scan_state.first_id = first_id;
+  scan_state.seen = seen;
+  memset(seen, 0, sizeof(seen));
+  scan_state.num_seen = 0;
+  scan_state.in_order = 1;
+  scan_state.stop_after = 0;
+  if (fdb_scan_event_range_parallel(first_id, first_id + num_events, 4, true,
+                                    scan_test_callback, &scan_state))
+    fail_test();
+  assert(scan_state.num_seen == num_events);
+  assert(scan_state.in_order);
+  pthread_mutex_destroy(&scan_state.lock);
+
+  // Clearing the first event of a run clears the run, clearing any other
+  // is refused
+  assert(fdb_clear_event(&mock_f_events[2]) == -1);
+  assert(fdb_clear_event_array(&mock_f_events[12], 3) == -1);
+  return_event.id = first_id + 2;
+  if (fdb_read_event(&return_event))
+    fail_test();
+  free_event(&return_event);
+  if (fdb_clear_event(&mock_f_events[1]))
+    fail_test();
+  for (uint32_t i = 1; i < 10; ++i) {
+    return_event.id = first_id + i;
+    assert(fdb_read_event(&return_event) == -1);
+  }
+
+  // A whole run at once, along with the events around it
+  if (fdb_clear_event_array(&mock_f_events[10], 11))
+    fail_test();
+  for (uint32_t i = 10; i < 21; ++i) {
+    return_event.id = first_id + i;
+    assert(fdb_read_event(&return_event) == -1);
+  }
+
+  // Restore the default settings
+  fdb_set_pack_bytes(0);
+
+  // Release the dummy data memory
+  for (uint32_t i = 0; i < num_events; ++i)
+    es_free(&mock_f_events[i].src);
+
+  // Clear the database
+  fdb_clear_database();
+
+  // Success
+  printf("fdb_set_pack_bytes() test PASSED\n");
+}
+
+void test_compressed_events(void) {
+  FragmentedEventSource mock_f_events[20];
+  FDBEventBatch batch;
+  Event mock_event, return_event;
+  Event *return_events;
+  FDBCursor cursor;
+  EventArena arena;
+  uint8_t *raw_data[20];
+  uint64_t first_id = 8000;
+  uint32_t num_events = 20;
+  uint32_t data_size = 25000;
+  uint32_t num_returned;
+  uint8_t *arena_data = malloc(data_size);
+  int rc;
+
+  printf("\nStarting compressed event test...\n");
+
+  // Setup FoundationDB batch settings
+  fdb_set_batch_size(0);
+
+  for (uint8_t algorithm = 1; algorithm <= MAX_COMPRESSION; ++algorithm) {
+    if (!compression_available(algorithm))
+      continue;
+
+    // Setup redundant events, which shrink, between random ones, which do
+    // not, on small fragments so that compressed events span several
+    for (uint32_t i = 0; i < num_events; ++i) {
+      raw_data[i] = generate_dummy_data(data_size);
+      if (i % 2)
+        for (uint32_t j = 0; j < data_size; ++j)
+          if (j % 64)
+            raw_data[i][j] = (uint8_t)(j % 13);
+
+      mock_event.id = first_id + i;
+      mock_event.data_length = data_size;
+      mock_event.data = malloc(data_size);
+      memcpy(mock_event.data, raw_data[i], data_size);
+      if (init_compressed_event_source(&mock_f_events[i], &mock_event, 100,
+                                       algorithm, 0))
+        fail_test();
+      assert((es_header(&mock_f_events[i].src)[0] == HEADER_COMPRESSED) ==
+             (i % 2));
+    }
+
+    if (fdb_write_fragmented_event_array(mock_f_events, num_events))
+      fail_test();
+
+    // Single events
+    for (uint32_t i = 0; i < num_events; ++i) {
+      return_event.id = first_id + i;
+      return_event.data = NULL;
+      if (fdb_read_event(&return_event))
+        fail_test();
+      assert(return_event.data_length == data_size);
+      assert(!memcmp(return_event.data, raw_data[i], data_size));
+      free_event(&return_event);
+    }
+
+    // An arena needs room for the decompressed event
+    init_event_arena(&arena, arena_data, data_size - 1);
+    return_event.id = first_id + 1;
+    assert(fdb_read_event_into(&return_event, &arena) == FDB_READ_ARENA_FULL);
+    assert(return_event.data_length == data_size);
+    init_event_arena(&arena, arena_data, data_size);
+    return_event.id = first_id + 1;
+    if (fdb_read_event_into(&return_event, &arena))
+      fail_test();
+    assert(return_event.data == arena_data);
+    assert(!memcmp(return_event.data, raw_data[1], data_size));
+
+    // A range
+    if (fdb_read_event_range(first_id, first_id + num_events, &return_events,
+                             &num_returned))
+      fail_test();
+    assert(num_returned == num_events);
+    for (uint32_t i = 0; i < num_returned; ++i) {
+      assert(return_events[i].id == (first_id + i));
+      assert(return_events[i].data_length == data_size);
+      assert(!memcmp(return_events[i].data, raw_data[i], data_size));
+      free_event(&return_events[i]);
+    }
+    free(return_events);
+
+    // A batch
+    if (fdb_read_event_batch(first_id + 1, first_id + num_events, &batch))
+      fail_test();
+    assert(batch.num_events == (num_events - 1));
+    for (uint32_t i = 0; i < batch.num_events; ++i) {
+      assert(batch.events[i].id == (first_id + i + 1));
+      assert(batch.events[i].data_length == data_size);
+      assert(!memcmp(batch.events[i].data, raw_data[i + 1], data_size));
+    }
+    fdb_release_event_batch(&batch);
+
+    // A cursor
+    num_returned = 0;
+    if (fdb_cursor_open(&cursor, first_id, first_id + num_events))
+      fail_test();
+    while ((rc = fdb_cursor_next(&cursor, &return_event)) == 1) {
+      assert(return_event.id == (first_id + num_returned));
+      assert(!memcmp(return_event.data, raw_data[num_returned++], data_size));
+      free_event(&return_event);
+    }
+    assert(rc == 0);
+    assert(num_returned == num_events);
+    fdb_cursor_close(&cursor);
+
+    // Release the dummy data memory
+    for (uint32_t i = 0; i < num_events; ++i) {
+      es_free(&mock_f_events[i].src);
+      free(raw_data[i]);
+    }
+
+    // Clear the database
+    fdb_clear_database();
+  }
+
+  free(arena_data);
+
+  // Success
+  printf("compressed event test PASSED\n");
+}
+
+uint8_t *generate_dummy_data(uint64_t size) {
+  uint8_t *result = malloc(sizeof(uint8_t) * size);
+
+  // Seed the random number generator
+  srand(clock());
+
+  // Generate random byte data
+  for (uint64_t i = 0; i < size; ++i) {
+    result[i] = rand() % 256;
+  }
+
+  // Success
+  return result;
+}
+
+void load_mixed_events(FragmentedEventSource f_events[], uint32_t num_events,
+                       uint64_t first_id) {
+  Event event;
+
+  for (uint32_t i = 0; i < num_events; ++i) {
+    uint32_t data_size = ((i % 3) * OPTIMAL_VALUE_SIZE) + i + 1;
+
+    event.id = first_id + i;
+    event.data_length = data_size;
+    event.data = generate_dummy_data(data_size);
+    init_fragmented_event_source(&f_events[i], &event, OPTIMAL_VALUE_SIZE);
+  }
 }
 
 /*
@@ -843,18 +3043,20 @@ uint32_t count_event_fragments_in_database(FDBTransaction *tx,
   fdb_bool_t out_more;
   uint32_t out_total = 0;
   int32_t out_count;
-  uint8_t range_start_key[FDB_KEY_TOTAL_LENGTH];
-  uint8_t range_end_key[FDB_KEY_TOTAL_LENGTH];
+  uint8_t range_start_key[FDB_KEY_MAX_LENGTH];
+  uint8_t range_end_key[FDB_KEY_MAX_LENGTH];
+  uint8_t range_start_length, range_end_length;
 
-  fdb_build_event_key(range_start_key, event_id, 0);
-  fdb_build_event_key(range_end_key, (event_id + 1), 0);
+  range_start_length = fdb_build_event_key(range_start_key, event_id, 0);
+  range_end_length = fdb_build_event_key(range_end_key, event_id, UINT32_MAX);
 
   // Loop until FoundationDB says there is no more data
   do {
     out_more = 0;
     future = fdb_transaction_get_range(
-        tx, range_start_key, FDB_KEY_TOTAL_LENGTH, 0, (out_total + 1), range_end_key,
-        FDB_KEY_TOTAL_LENGTH, 0, 1, 0, 0, FDB_STREAMING_MODE_WANT_ALL, 0, 0, 0);
+        tx, range_start_key, range_start_length, 0, (out_total + 1),
+        range_end_key, range_end_length, 0, 1, 0, 0, FDB_STREAMING_MODE_WANT_ALL,
+        0, 0, 0);
 
     if (fdb_check_error(fdb_future_block_until_ready(future)))
       fail_test();
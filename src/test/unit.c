@@ -6,9 +6,14 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "../constants.h"
 #include "../event.h"
+#include "../event_cache.h"
+#include "../event_compress.h"
+#include "../fdb.h"
+#include "../fdb_internal.h"
 
 //==============================================================================
 // Prototypes
@@ -27,6 +32,12 @@ void test_fragment_event_small(void);
 /// leftover payload.
 void test_fragment_event_large(void);
 
+/// Test fragmentation for an event whose data is borrowed rather than owned.
+void test_fragment_event_borrowed(void);
+
+/// Test fragmentation of an event split across several buffers.
+void test_fragment_event_scatter_gather(void);
+
 /// Test building/reading headers.
 void test_headers(void);
 
@@ -36,6 +47,34 @@ void test_build_header(void);
 /// Test reading information from event headers.
 void test_read_header(void);
 
+/// Test taking and giving back space in an event arena.
+void test_event_arena(void);
+
+/// Test lookups, replacement, eviction and counters of the event cache.
+void test_event_cache(void);
+
+/// Test that event keys sort by id, then fragment, in every key format.
+void test_event_keys(void);
+
+/// Test packing small events into a single value, and finding them again.
+void test_packed_events(void);
+
+/// Test compressed event headers, and compressing event sources with each
+/// built-in compression algorithm.
+void test_compression(void);
+
+/// Compare two keys the way FoundationDB orders them.
+///
+/// @param[in] a         The first key.
+/// @param[in] a_length  Length of the first key in bytes.
+/// @param[in] b         The second key.
+/// @param[in] b_length  Length of the second key in bytes.
+///
+/// @return  Negative, zero or positive as the first key sorts before, with or
+///          after the second.
+int compare_keys(const uint8_t *a, uint8_t a_length, const uint8_t *b,
+                 uint8_t b_length);
+
 //==============================================================================
 // Functions
 //=============================================================================
@@ -53,6 +92,11 @@ int main(int argc, char **argv) {
   // Run tests
   test_fragment_event();
   test_headers();
+  test_event_arena();
+  test_event_cache();
+  test_event_keys();
+  test_packed_events();
+  test_compression();
 
   // Success
   printf("\nUnit tests completed successfully.\n");
@@ -65,6 +109,8 @@ void test_fragment_event(void) {
   test_fragment_event_trivial();
   test_fragment_event_small();
   test_fragment_event_large();
+  test_fragment_event_borrowed();
+  test_fragment_event_scatter_gather();
 
   printf("Completed event fragmentation tests.\n");
 }
@@ -147,8 +193,9 @@ void test_fragment_event_large(void) {
 
   assert(f_event.src.event.id == id);
   assert(es_num_fragments(&f_event.src) == num_fragments);
-  assert(es_header(&f_event.src)[0] == (num_fragments - 1));
-  assert(es_header_length(&f_event.src) == 1);
+  assert(es_header(&f_event.src)[0] == HEADER_V2);
+  assert(es_header(&f_event.src)[1] == (num_fragments - 1));
+  assert(es_header_length(&f_event.src) == 7);
   assert(es_prefix_length(&f_event.src) == 1);
 
   const uint8_t *prefix = es_fragment_data(&f_event.src, 0);
@@ -160,6 +207,96 @@ void test_fragment_event_large(void) {
   printf(" PASSED\n");
 }
 
+void test_fragment_event_borrowed(void) {
+  FragmentedEventSource f_event;
+
+  // Setup event
+  const uint64_t id = 1011;
+  const uint32_t data_length = (2 * OPTIMAL_VALUE_SIZE) + 5;
+  uint8_t *data = calloc(data_length, sizeof(uint8_t));
+  Event event = {id, data_length, data};
+
+  // Fragment event
+  init_borrowed_event_source(&f_event, &event, OPTIMAL_VALUE_SIZE);
+
+  // Confirm correct state
+  printf("\tborrowed event data... ");
+
+  assert(f_event.src.event.id == id);
+  assert(es_num_fragments(&f_event.src) == 3);
+  assert(es_prefix_length(&f_event.src) == 5);
+  assert(es_fragment_data(&f_event.src, 0) == data);
+  assert(es_fragment_data(&f_event.src, 2) == (data + 5 + OPTIMAL_VALUE_SIZE));
+
+  // Releasing the source must leave the data to its owner
+  es_free(&f_event.src);
+  free(data);
+
+  printf(" PASSED\n");
+}
+
+void test_fragment_event_scatter_gather(void) {
+  ScatterGatherEventSource sg_event;
+
+  // Setup event: one contiguous buffer, split at odd offsets (including an
+  // empty segment and one spanning several fragment boundaries)
+  const uint64_t id = 1213;
+  const uint32_t data_length = (4 * OPTIMAL_VALUE_SIZE) + 7;
+  uint8_t *data = malloc(data_length);
+  for (uint32_t i = 0; i < data_length; ++i)
+    data[i] = (uint8_t)(i * 31);
+
+  EventSegment segments[] = {
+    {data, 3},
+    {data + 3, 0},
+    {data + 3, OPTIMAL_VALUE_SIZE + 4},
+    {data + OPTIMAL_VALUE_SIZE + 7, 2 * OPTIMAL_VALUE_SIZE + 1},
+    {data + (3 * OPTIMAL_VALUE_SIZE) + 8, OPTIMAL_VALUE_SIZE - 1},
+  };
+  const uint32_t num_segments = sizeof(segments) / sizeof(segments[0]);
+
+  // Compare against the same event fragmented from a single buffer
+  FragmentedEventSource f_event;
+  Event event = {id, data_length, data};
+  init_borrowed_event_source(&f_event, &event, OPTIMAL_VALUE_SIZE);
+
+  printf("	scatter-gather event data... ");
+
+  assert(init_scatter_gather_event_source(&sg_event, id, segments,
+                                          num_segments,
+                                          OPTIMAL_VALUE_SIZE) == 0);
+  assert(sg_event.src.event.id == id);
+  assert(es_length(&sg_event.src) == data_length);
+  assert(es_num_fragments(&sg_event.src) == es_num_fragments(&f_event.src));
+  assert(es_prefix_length(&sg_event.src) == 7);
+  assert(es_header_length(&sg_event.src) == es_header_length(&f_event.src));
+  assert(memcmp(es_header(&sg_event.src), es_header(&f_event.src),
+                es_header_length(&f_event.src)) == 0);
+  assert(sg_event.num_bounced < num_segments);
+
+  for (uint32_t i = 0; i < es_num_fragments(&f_event.src); ++i) {
+    assert(es_fragment_length(&sg_event.src, i) ==
+           es_fragment_length(&f_event.src, i));
+    assert(memcmp(es_fragment_data(&sg_event.src, i),
+                  es_fragment_data(&f_event.src, i),
+                  es_fragment_length(&f_event.src, i)) == 0);
+  }
+
+  // Fragments within a single segment are not copied
+  assert(es_fragment_data(&sg_event.src, 2) == es_fragment_data(&f_event.src, 2));
+  assert(sg_event.num_bounced == 2);
+  es_free(&sg_event.src);
+
+  // An empty event cannot be fragmented
+  assert(init_scatter_gather_event_source(&sg_event, id, segments + 1, 1,
+                                          OPTIMAL_VALUE_SIZE) == -1);
+
+  es_free(&f_event.src);
+  free(data);
+
+  printf(" PASSED\n");
+}
+
 void test_headers(void) {
   printf("\nStarting event header tests...\n");
 
@@ -175,129 +312,481 @@ void test_build_header(void) {
 
   printf("\tbuilding headers... ");
 
-  // 0
-  header_length = build_header(header, 0);
+  // Single fragment
+  header_length = build_header(header, 0, 1, OPTIMAL_VALUE_SIZE);
   assert(header_length == 1);
   assert(header[0] == 0);
 
-  // 127
-  header_length = build_header(header, 127);
-  assert(header_length == 1);
-  assert(header[0] == 127);
+  // 1 additional fragment, 10001 bytes
+  header_length = build_header(header, 1, 10001, OPTIMAL_VALUE_SIZE);
+  assert(header_length == 6);
+  assert(header[0] == HEADER_V2);
+  assert(header[1] == 1);
+  assert(header[2] == (0x80 | (10001 & 0x7F)));
+  assert(header[3] == (10001 >> 7));
+  assert(header[4] == (0x80 | (OPTIMAL_VALUE_SIZE & 0x7F)));
+  assert(header[5] == (OPTIMAL_VALUE_SIZE >> 7));
+
+  // 128 additional fragments of 100 bytes, 12801 bytes
+  header_length = build_header(header, 128, 12801, 100);
+  assert(header_length == 6);
+  assert(header[0] == HEADER_V2);
+  assert(header[1] == 0x80);
+  assert(header[2] == 1);
+  assert(header[5] == 100);
+
+  // 2^24 additional fragments <-- beyond the range of v1 headers
+  header_length = build_header(header, 16777216,
+                               ((uint64_t)16777216 * OPTIMAL_VALUE_SIZE) + 1,
+                               OPTIMAL_VALUE_SIZE);
+  assert(header_length == 13);
+  assert(header[0] == HEADER_V2);
+  assert(header[1] == 0x80);
+  assert(header[2] == 0x80);
+  assert(header[3] == 0x80);
+  assert(header[4] == 0x08);
+
+  // Largest event
+  header_length = build_header(header, (UINT32_MAX - 1), UINT64_MAX, UINT32_MAX);
+  assert(header_length == 21);
 
-  // 128
-  header_length = build_header(header, 128);
-  assert(header_length == 2);
-  assert(header[0] == (EXTENDED_HEADER | 1));
-  assert(header[1] == 128);
+  printf(" PASSED\n");
+}
 
-  // 255
-  header_length = build_header(header, 255);
-  assert(header_length == 2);
-  assert(header[0] == (EXTENDED_HEADER | 1));
-  assert(header[1] == 255);
+void test_read_header(void) {
+  uint8_t header[MAX_HEADER_SIZE] = {0};
+  uint8_t header_length = 0;
+  EventHeader layout;
 
-  // 256
-  header_length = build_header(header, 256);
-  assert(header_length == 3);
-  assert(header[0] == (EXTENDED_HEADER | 2));
-  assert(header[1] == 0);
-  assert(header[2] == 1);
+  printf("\treading headers... ");
 
-  // 65535
-  header_length = build_header(header, 65535);
-  assert(header_length == 3);
-  assert(header[0] == (EXTENDED_HEADER | 2));
-  assert(header[1] == 255);
-  assert(header[2] == 255);
+  // Single fragment
+  build_header(header, 0, 1, OPTIMAL_VALUE_SIZE);
+  header_length = read_header(header, MAX_HEADER_SIZE, &layout);
+  assert(header_length == 1);
+  assert(layout.num_fragments == 0);
+
+  // v2
+  build_header(header, 3, 30001, OPTIMAL_VALUE_SIZE);
+  header_length = read_header(header, MAX_HEADER_SIZE, &layout);
+  assert(header_length == 7);
+  assert(layout.num_fragments == 3);
+  assert(layout.data_length == 30001);
+  assert(layout.fragment_length == OPTIMAL_VALUE_SIZE);
+
+  build_header(header, 16777216, ((uint64_t)16777216 * 512) + 512, 512);
+  header_length = read_header(header, MAX_HEADER_SIZE, &layout);
+  assert(header_length == 12);
+  assert(layout.num_fragments == 16777216);
+  assert(layout.data_length == (((uint64_t)16777216 * 512) + 512));
+  assert(layout.fragment_length == 512);
+
+  // v2, truncated
+  build_header(header, 3, 30001, OPTIMAL_VALUE_SIZE);
+  assert(read_header(header, 5, &layout) == 0);
+
+  // v2, with a first fragment that is empty or longer than the others
+  build_header(header, 3, 30000, OPTIMAL_VALUE_SIZE);
+  assert(read_header(header, MAX_HEADER_SIZE, &layout) == 0);
+  build_header(header, 3, 40001, OPTIMAL_VALUE_SIZE);
+  assert(read_header(header, MAX_HEADER_SIZE, &layout) == 0);
+
+  // v1, one byte
+  header[0] = 127;
+  header_length = read_header(header, 1, &layout);
+  assert(header_length == 1);
+  assert(layout.num_fragments == 127);
+  assert(layout.data_length == 0);
+  assert(layout.fragment_length == OPTIMAL_VALUE_SIZE);
+
+  // v1, extended
+  header[0] = (EXTENDED_HEADER | 1);
+  header[1] = 128;
+  header_length = read_header(header, 2, &layout);
+  assert(header_length == 2);
+  assert(layout.num_fragments == 128);
 
-  // 65536
-  header_length = build_header(header, 65536);
+  header[0] = (EXTENDED_HEADER | 3);
+  header[1] = 0;
+  header[2] = 0;
+  header[3] = 1;
+  header_length = read_header(header, 4, &layout);
   assert(header_length == 4);
-  assert(header[0] == (EXTENDED_HEADER | 3));
-  assert(header[1] == 0);
-  assert(header[2] == 0);
-  assert(header[3] == 1);
+  assert(layout.num_fragments == 65536);
+  assert(layout.fragment_length == OPTIMAL_VALUE_SIZE);
 
-  // 16777215
-  header_length = build_header(header, 16777215);
-  assert(header_length == 4);
-  assert(header[0] == (EXTENDED_HEADER | 3));
-  assert(header[1] == 255);
-  assert(header[2] == 255);
-  assert(header[3] == 255);
+  // v1, extended and truncated
+  assert(read_header(header, 3, &layout) == 0);
 
-  // 16777216 <-- beyond current range of num fragments
-  header_length = build_header(header, 16777216);
-  assert(header_length == 4);
-  assert(header[0] == (EXTENDED_HEADER | 3));
-  assert(header[1] == 0);
-  assert(header[2] == 0);
-  assert(header[3] == 0);
+  printf(" PASSED\n");
+}
+
+void test_event_arena(void) {
+  uint8_t memory[64];
+  EventArena arena;
+  uint8_t *first, *second;
+
+  printf("\nStarting event arena test...");
+
+  init_event_arena(&arena, memory, sizeof(memory));
+
+  // Space is handed out front to back
+  first = event_arena_alloc(&arena, 40);
+  assert(first == memory);
+  second = event_arena_alloc(&arena, 24);
+  assert(second == (memory + 40));
+  assert(arena.used == sizeof(memory));
+
+  // A full arena hands out nothing more, not even past its end
+  assert(!event_arena_alloc(&arena, 1));
+  assert(!event_arena_alloc(&arena, UINT64_MAX));
+  assert(event_arena_alloc(&arena, 0) == (memory + sizeof(memory)));
+
+  // A reset gives everything back at once
+  reset_event_arena(&arena);
+  assert(arena.used == 0);
+  assert(event_arena_alloc(&arena, sizeof(memory)) == memory);
 
   printf(" PASSED\n");
 }
 
-void test_read_header(void) {
-  uint8_t header[MAX_HEADER_SIZE] = {0};
-  uint8_t header_length = 0;
-  uint32_t num_fragments;
+void test_event_cache(void) {
+  uint8_t data[1000];
+  uint8_t memory[100];
+  EventArena arena;
+  EventCacheStats stats;
+  Event event;
 
-  printf("\treading headers... ");
+  printf("\nStarting event cache test...");
 
-  // 0
-  build_header(header, 0);
-  header_length = read_header(header, &num_fragments);
-  assert(header_length == 1);
-  assert(num_fragments == 0);
+  for (uint32_t i = 0; i < sizeof(data); ++i)
+    data[i] = (uint8_t)i;
 
-  // 127
-  build_header(header, 127);
-  header_length = read_header(header, &num_fragments);
-  assert(header_length == 1);
-  assert(num_fragments == 127);
+  // A disabled cache answers nothing
+  event.id = 1;
+  assert(event_cache_get(&event, NULL) == 0);
+  assert(event_cache_init(0) == -1);
 
-  // 128
-  build_header(header, 128);
-  header_length = read_header(header, &num_fragments);
-  assert(header_length == 2);
-  assert(num_fragments == 128);
+  // Room for a handful of 1000-byte events per shard
+  assert(event_cache_init(EVENT_CACHE_SHARDS * 5000) == 0);
 
-  // 255
-  build_header(header, 255);
-  header_length = read_header(header, &num_fragments);
-  assert(header_length == 2);
-  assert(num_fragments == 255);
+  for (uint64_t id = 1; id <= 1000; ++id) {
+    event.id = id;
+    event.data_length = sizeof(data);
+    event.data = data;
+    event_cache_put_event(&event);
+  }
 
-  // 256
-  build_header(header, 256);
-  header_length = read_header(header, &num_fragments);
-  assert(header_length == 3);
-  assert(num_fragments == 256);
+  // The most recent events are cached, the oldest were evicted
+  event_cache_stats(&stats);
+  assert(stats.events && (stats.events < 1000));
+  assert(stats.evictions == (1000 - stats.events));
+  assert(stats.bytes <= (EVENT_CACHE_SHARDS * 5000));
+
+  event.id = 1000;
+  assert(event_cache_get(&event, NULL) == 1);
+  assert(event.data_length == sizeof(data));
+  assert(!memcmp(event.data, data, sizeof(data)));
+  free_event(&event);
+
+  event.id = 1;
+  assert(event_cache_get(&event, NULL) == 0);
+
+  // A hit too large for an arena reports the length it needs
+  init_event_arena(&arena, memory, sizeof(memory));
+  event.id = 999;
+  assert(event_cache_get(&event, &arena) == -2);
+  assert(event.data_length == sizeof(data));
+
+  // A newer copy replaces the old one
+  event.id = 1000;
+  event.data_length = 10;
+  event.data = data + 10;
+  event_cache_put_event(&event);
+  assert(event_cache_get(&event, &arena) == 1);
+  assert((event.data_length == 10) && (event.data == memory));
+  assert(!memcmp(event.data, data + 10, 10));
+
+  // Removed events are gone, and clearing keeps the counters
+  event_cache_remove(1000);
+  event.id = 1000;
+  assert(event_cache_get(&event, NULL) == 0);
+
+  event_cache_clear();
+  event_cache_stats(&stats);
+  assert((stats.events == 0) && (stats.bytes == 0));
+  assert((stats.hits == 2) && (stats.misses == 2));
+
+  event_cache_destroy();
+
+  printf(" PASSED\n");
+}
+
+void test_event_keys(void) {
+  const uint64_t ids[] = {0,        1,        240,      241,
+                          2287,     2288,     67823,    67824,
+                          16777215, 16777216, 1ULL << 32, UINT64_MAX - 1};
+  const uint32_t fragments[] = {0, 1, 240, 241, 70000, UINT32_MAX};
+  const uint32_t num_ids = sizeof(ids) / sizeof(ids[0]);
+  const uint32_t num_fragments = sizeof(fragments) / sizeof(fragments[0]);
+
+  printf("\nStarting event key test...");
+
+  assert(fdb_set_key_format(2) == -1);
+
+  for (uint8_t format = FDB_KEY_FORMAT_FIXED; format <= FDB_KEY_FORMAT_COMPACT;
+       ++format) {
+    uint8_t last_key[FDB_KEY_MAX_LENGTH];
+    uint8_t last_length = 0;
+
+    assert(fdb_set_key_format(format) == 0);
+
+    // Every key sorts after the one before it, and reads back the same
+    for (uint32_t i = 0; i < num_ids; ++i) {
+      for (uint32_t j = 0; j < num_fragments; ++j) {
+        uint8_t key[FDB_KEY_MAX_LENGTH];
+        uint8_t length = fdb_build_event_key(key, ids[i], fragments[j]);
+        uint64_t id;
+        uint32_t fragment;
+
+        assert(length <= FDB_KEY_MAX_LENGTH);
+        if (format == FDB_KEY_FORMAT_FIXED)
+          assert(length == FDB_KEY_TOTAL_LENGTH);
+        if (last_length)
+          assert(compare_keys(last_key, last_length, key, length) < 0);
+        assert(read_event_key(key, length, &id, &fragment) == length);
+        assert((id == ids[i]) && (fragment == fragments[j]));
+
+        memcpy(last_key, key, length);
+        last_length = length;
+      }
+    }
+  }
 
-  // 65535
-  build_header(header, 65535);
-  header_length = read_header(header, &num_fragments);
+  // Small ids and fragment numbers take a byte each, the largest take
+  // FDB_KEY_MAX_LENGTH in all
+  {
+    uint8_t key[FDB_KEY_MAX_LENGTH];
+
+    assert(fdb_build_event_key(key, 240, 0) == 3);
+    assert(fdb_build_event_key(key, 2288, 1) == 5);
+    assert(fdb_build_event_key(key, 1000000, 0) == 6);
+    assert(fdb_build_event_key(key, UINT64_MAX, UINT32_MAX) ==
+           FDB_KEY_MAX_LENGTH);
+  }
+
+  // Only the shortest form of a value is read: 2288 has a 3-byte form, so
+  // the 2-byte form past 2287 is no key
+  {
+    uint8_t key[FDB_KEY_MAX_LENGTH];
+    uint8_t length = fdb_build_event_key(key, 2287, 0);
+    uint64_t id;
+    uint32_t fragment;
+
+    assert((length == 4) && (key[1] == 248) && (key[2] == 0xFE));
+    key[2] = 0xFF;
+    assert(read_event_key(key, length, &id, &fragment) == 0);
+  }
+
+  // Restore the default key format
+  fdb_set_key_format(FDB_KEY_FORMAT_FIXED);
+
+  printf(" PASSED\n");
+}
+
+void test_packed_events(void) {
+  FragmentedEventSource f_events[3];
+  uint8_t data[3][100];
+  uint32_t data_lengths[3] = {1, 100, 37};
+  uint8_t header[MAX_HEADER_SIZE] = {0};
+  uint8_t value[(3 * PACKED_OFFSET_SIZE) + 138];
+  uint8_t header_length;
+  uint32_t value_length;
+  const uint8_t *unpacked;
+  uint32_t unpacked_length;
+  EventHeader layout;
+
+  printf("\nStarting packed event tests...\n");
+  printf("\tpacking events... ");
+
+  // Packed headers hold the number of events, and nothing else
+  header_length = build_packed_header(header, MAX_PACKED_EVENTS);
   assert(header_length == 3);
-  assert(num_fragments == 65535);
+  assert(header[0] == HEADER_PACKED);
+  assert(read_header(header, MAX_HEADER_SIZE, &layout) == header_length);
+  assert(layout.num_events == MAX_PACKED_EVENTS);
+  assert(layout.num_fragments == 0);
+
+  // Fewer than two events or more than MAX_PACKED_EVENTS is no block
+  build_packed_header(header, 1);
+  assert(read_header(header, MAX_HEADER_SIZE, &layout) == 0);
+  build_packed_header(header, MAX_PACKED_EVENTS + 1);
+  assert(read_header(header, MAX_HEADER_SIZE, &layout) == 0);
+  build_packed_header(header, 3);
+  assert(read_header(header, 1, &layout) == 0);
+
+  // Event headers are not packed headers
+  build_header(header, 3, 30001, OPTIMAL_VALUE_SIZE);
+  assert(read_header(header, MAX_HEADER_SIZE, &layout) == 7);
+  assert(layout.num_events == 0);
+
+  // Pack events of a byte, of 100 bytes, and in between
+  for (uint32_t i = 0; i < 3; ++i) {
+    Event event = {i + 10, data_lengths[i], data[i]};
+
+    memset(data[i], (int)(i + 1), sizeof(data[i]));
+    init_borrowed_event_source(&f_events[i], &event, OPTIMAL_VALUE_SIZE);
+  }
+  value_length = pack_events(value, f_events, 3);
+  assert(value_length == sizeof(value));
+
+  for (uint32_t i = 0; i < 3; ++i) {
+    assert(unpack_event(value, value_length, 3, i, &unpacked,
+                        &unpacked_length) == 0);
+    assert(unpacked_length == data_lengths[i]);
+    assert(!memcmp(unpacked, data[i], unpacked_length));
+  }
 
-  // 65536
-  build_header(header, 65536);
-  header_length = read_header(header, &num_fragments);
-  assert(header_length == 4);
-  assert(num_fragments == 65536);
+  // Malformed blocks: truncated, out of range, or with offsets going back
+  assert(unpack_event(value, value_length - 1, 3, 2, &unpacked,
+                      &unpacked_length) == -1);
+  assert(unpack_event(value, value_length, 3, 3, &unpacked,
+                      &unpacked_length) == -1);
+  assert(unpack_event(value, 5, 3, 0, &unpacked, &unpacked_length) == -1);
+  value[2] = 0;
+  value[3] = 0;
+  assert(unpack_event(value, value_length, 3, 1, &unpacked,
+                      &unpacked_length) == -1);
 
-  // 16777215
-  build_header(header, 16777215);
-  header_length = read_header(header, &num_fragments);
-  assert(header_length == 4);
-  assert(num_fragments == 16777215);
+  printf(" PASSED\n");
+  printf("Completed packed event tests.\n");
+}
 
-  // 16777216 <-- beyond current range of num fragments
-  build_header(header, 16777216);
-  header_length = read_header(header, &num_fragments);
-  assert(header_length == 4);
-  assert(num_fragments == 0);
+void test_compression(void) {
+  FragmentedEventSource f_event;
+  uint8_t header[MAX_HEADER_SIZE] = {0};
+  uint8_t header_length;
+  uint32_t data_length = 30000;
+  uint8_t *data;
+  uint8_t *decompressed = malloc(data_length);
+  EventHeader layout;
+  Event event;
+
+  printf("\nStarting compression tests...\n");
+  printf("\tcompressed headers... ");
+
+  // Three fragments of compressed data, with the algorithm and level
+  header_length = build_compressed_header(header, 2, 250, 100,
+                                          COMPRESSION_ZSTD, 3, 1000);
+  assert(header_length == 9);
+  assert(header[0] == HEADER_COMPRESSED);
+  assert(read_header(header, MAX_HEADER_SIZE, &layout) == header_length);
+  assert(layout.num_fragments == 2);
+  assert(layout.data_length == 250);
+  assert(layout.fragment_length == 100);
+  assert(layout.compression == COMPRESSION_ZSTD);
+  assert(layout.compression_level == 3);
+  assert(layout.raw_length == 1000);
+
+  // A single fragment, unlike in v2
+  header_length = build_compressed_header(header, 0, 50, OPTIMAL_VALUE_SIZE,
+                                          COMPRESSION_LZ4, 0, 200);
+  assert(read_header(header, MAX_HEADER_SIZE, &layout) == header_length);
+  assert(layout.num_fragments == 0);
+  assert(layout.data_length == 50);
+  assert(layout.raw_length == 200);
+
+  // Truncated, of an unknown algorithm, or not smaller than the event
+  assert(read_header(header, header_length - 1, &layout) == 0);
+  header[1] = MAX_COMPRESSION + 1;
+  assert(read_header(header, MAX_HEADER_SIZE, &layout) == 0);
+  build_compressed_header(header, 0, 50, OPTIMAL_VALUE_SIZE, COMPRESSION_LZ4,
+                          0, 50);
+  assert(read_header(header, MAX_HEADER_SIZE, &layout) == 0);
+
+  // Uncompressed events say so
+  build_header(header, 3, 30001, OPTIMAL_VALUE_SIZE);
+  assert(read_header(header, MAX_HEADER_SIZE, &layout) == 7);
+  assert(layout.compression == COMPRESSION_NONE);
+  assert(layout.raw_length == 0);
+
+  // Largest header
+  header_length = build_compressed_header(header, (UINT32_MAX - 1),
+                                          (UINT64_MAX - 1), UINT32_MAX,
+                                          COMPRESSION_ZSTD, 22, UINT64_MAX);
+  assert(header_length == MAX_HEADER_SIZE);
 
   printf(" PASSED\n");
+  printf("\tcompressing event sources... ");
+
+  // Algorithms that are not built in are refused, and the event left alone
+  data = malloc(data_length);
+  event = (Event){1, data_length, data};
+  assert(init_compressed_event_source(&f_event, &event, 1000,
+                                      MAX_COMPRESSION + 1, 0) == -1);
+  assert(event.data == data);
+
+  // Without compression, the source is a plain one
+  assert(init_compressed_event_source(&f_event, &event, 1000,
+                                      COMPRESSION_NONE, 0) == 0);
+  assert(es_header(&f_event.src)[0] == HEADER_V2);
+  assert(es_length(&f_event.src) == data_length);
+  es_free(&f_event.src);
+
+  for (uint8_t algorithm = 1; algorithm <= MAX_COMPRESSION; ++algorithm) {
+    if (!compression_available(algorithm))
+      continue;
+
+    // Redundant data shrinks, into fewer fragments
+    data = malloc(data_length);
+    for (uint32_t i = 0; i < data_length; ++i)
+      data[i] = (uint8_t)((i % 64) ? (i % 13) : (uint32_t)rand());
+    memcpy(decompressed, data, data_length);
+    event = (Event){2, data_length, data};
+    assert(init_compressed_event_source(&f_event, &event, 1000, algorithm,
+                                        0) == 0);
+    assert(es_header(&f_event.src)[0] == HEADER_COMPRESSED);
+    assert(es_length(&f_event.src) < data_length);
+    assert(es_num_fragments(&f_event.src) < (data_length / 1000));
+    assert(read_header(es_header(&f_event.src),
+                       es_header_length(&f_event.src),
+                       &layout) == es_header_length(&f_event.src));
+    assert(layout.compression == algorithm);
+    assert(layout.raw_length == data_length);
+
+    // The fragments hold the compressed data back to back
+    data = malloc(data_length);
+    assert(decompress_data(algorithm, es_fragment_data(&f_event.src, 0),
+                           es_length(&f_event.src), data, data_length) == 0);
+    assert(!memcmp(data, decompressed, data_length));
+    assert(decompress_data(algorithm, es_fragment_data(&f_event.src, 0),
+                           es_length(&f_event.src) - 1, data,
+                           data_length) == -1);
+    free(data);
+    es_free(&f_event.src);
+
+    // Random data does not shrink, so it is left as it is
+    data = malloc(data_length);
+    for (uint32_t i = 0; i < data_length; ++i)
+      data[i] = (uint8_t)rand();
+    event = (Event){3, data_length, data};
+    assert(init_compressed_event_source(&f_event, &event, 1000, algorithm,
+                                        0) == 0);
+    assert(es_header(&f_event.src)[0] == HEADER_V2);
+    assert(es_length(&f_event.src) == data_length);
+    assert(es_fragment_data(&f_event.src, 0) == data);
+    es_free(&f_event.src);
+  }
+
+  free(decompressed);
+
+  printf(" PASSED\n");
+  printf("Completed compression tests.\n");
+}
+
+int compare_keys(const uint8_t *a, uint8_t a_length, const uint8_t *b,
+                 uint8_t b_length) {
+  int rc = memcmp(a, b, (a_length < b_length) ? a_length : b_length);
+
+  return rc ? rc : (a_length - b_length);
 }